@@ -1,7 +1,10 @@
+#include <algorithm>
 #include <cstring>
 #include <cstdlib>
 
 #include "appendix.h"
+#include "bucket-kernels.h"
+#include "util.h"
 
 static int
 compare_uint64(const void *a, const void *b)
@@ -9,18 +12,165 @@ compare_uint64(const void *a, const void *b)
     return *(uint64_t*)a >= *(uint64_t*)b;
 }
 
+static int
+compare_uint32(const void *a, const void *b)
+{
+    return *(uint32_t*)a >= *(uint32_t*)b;
+}
+
+appendix::appendix()
+: spill(nullptr),
+  spill_bytes(0),
+  spilled(0),
+  encoding(RAW),
+  shift(0)
+{}
+
+void
+appendix::set_encoding(int encoding)
+{
+    /* DELTA appendices always end with the padding */
+    if (this->encoding != DELTA && encoding == DELTA) {
+        data.resize(data.size() + PADDING, 0);
+    } else if (this->encoding == DELTA && encoding != DELTA) {
+        data.resize(data.size() - PADDING);
+    }
+    this->encoding = encoding;
+}
+
+int
+appendix::get_encoding() const
+{
+    return encoding;
+}
+
+void
+appendix::set_shift(int shift)
+{
+    this->shift = shift;
+}
+
+int
+appendix::get_shift() const
+{
+    return shift;
+}
+
+int
+appendix::get_min_shift(size_t value_num, size_t value_size)
+{
+    size_t list_num;
+    size_t bytes;
+    int shift;
+
+    /* At most a list per two values. Each list adds a count (32-bit) or
+     * block headers (DELTA) of under 8 bytes, and up to a unit of padding
+     * before it. */
+    list_num = value_num / 2;
+    bytes = value_num * value_size + list_num * 8;
+    for (shift=0; shift<32; ++shift) {
+        if (bytes + list_num * ((1UL << shift) - 1) <=
+            (uint64_t)INLINE_BASE << shift) {
+            break;
+        }
+    }
+    return shift;
+}
+
+void
+appendix::set_spill(FILE *fp, size_t bytes)
+{
+    spill = fp;
+    spill_bytes = bytes;
+}
+
+void
+appendix::flush()
+{
+    const size_t padding = encoding == DELTA ? PADDING : 0;
+    size_t bytes;
+
+    /* The DELTA padding stays, as the next list overwrites it */
+    if (!spill || data.size() <= spill_bytes + padding) {
+        return;
+    }
+    bytes = data.size() - padding;
+    xfwrite(&data[0], bytes, spill);
+    data.erase(data.begin(), data.begin() + bytes);
+    spilled += bytes;
+}
+
+uint64_t
+appendix::align()
+{
+    uint64_t offset;
+
+    offset = DIV_ROUND_UP(spilled + data.size(), 1UL << shift);
+    data.resize((offset << shift) - spilled, 0);
+    assert(offset < INLINE_BASE);
+    return offset;
+}
+
+template <typename T>
+void
+appendix::push_deltas(const std::vector<T> &vals)
+{
+    uint64_t packed[BLOCK_SIZE + 1];
+    uint64_t delta;
+    size_t bit;
+    int width;
+    int k;
+
+    push(vals[0]);
+
+    for (size_t i=1; i<vals.size(); i+=BLOCK_SIZE) {
+        k = std::min(vals.size() - i, (size_t)BLOCK_SIZE);
+        width = 0;
+        for (int j=0; j<k; ++j) {
+            delta = vals[i+j] - vals[i+j-1];
+            width = std::max(width, delta ? 64 - __builtin_clzll(delta) : 0);
+        }
+
+        /* BLOCK_SIZE deltas of "width" bits take "width" bytes */
+        memset(packed, 0, sizeof(packed));
+        for (int j=0; j<k; ++j) {
+            delta = vals[i+j] - vals[i+j-1];
+            bit = j * width;
+            packed[bit / 64] |= delta << (bit % 64);
+            if (bit % 64 && bit % 64 + width > 64) {
+                packed[bit / 64 + 1] |= delta >> (64 - bit % 64);
+            }
+        }
+        push((uint8_t)width);
+        data.insert(data.end(), (char*)packed, (char*)packed + width);
+    }
+}
+
 uint64_t
 appendix::add_element64(std::vector<uint64_t> &vals)
 {
     uint64_t out;
 
+    /* Deltas require an exact order. The list overwrites the padding. */
+    if (encoding == DELTA) {
+        std::sort(vals.begin(), vals.end());
+        data.resize(data.size() - PADDING);
+        out = (align() << 32) | (uint32_t)vals.size();
+        push_deltas(vals);
+        data.resize(data.size() + PADDING, 0);
+        flush();
+        return out;
+    }
+
+    out = (align() << 32) | (uint32_t)vals.size();
+
     /* Sort elements in "vals" */
     qsort(&vals[0], vals.size(), sizeof(uint64_t), compare_uint64);
 
-    out = ((uint64_t)data.size() << 32) | (uint32_t)vals.size();
     for (uint64_t e : vals) {
         push(e);
     }
+    flush();
     return out;
 }
 
@@ -31,26 +181,138 @@ appendix::add_element32(std::vector<uint32_t> &vals)
     uint32_t size;
 
     size = vals.size();
+
+    /* Deltas require an exact order. The list overwrites the padding. */
+    if (encoding == DELTA) {
+        std::sort(vals.begin(), vals.end());
+        data.resize(data.size() - PADDING);
+        out = align();
+        push(size);
+        push_deltas(vals);
+        data.resize(data.size() + PADDING, 0);
+        flush();
+        return out;
+    }
+
+    out = align();
     push(size);
 
     /* Sort elements in "vals" */
-    qsort(&vals[0], vals.size(), sizeof(uint32_t), compare_uint64);
+    qsort(&vals[0], vals.size(), sizeof(uint32_t), compare_uint32);
 
-    out = (uint32_t)data.size();
-    for (uint64_t e : vals) {
+    for (uint32_t e : vals) {
         push(e);
     }
+    flush();
     return out;
 }
 
+uint64_t
+appendix::append(const appendix &other)
+{
+    const size_t padding = encoding == DELTA ? PADDING : 0;
+    uint64_t base;
+
+    assert(other.encoding == encoding && other.shift == shift);
+    assert(!other.spilled);
+
+    /* The first list of "other" is at its offset 0 */
+    if (other.data.size() == padding) {
+        return 0;
+    }
+    data.resize(data.size() - padding);
+    base = align();
+    data.insert(data.end(), other.data.begin(), other.data.end());
+    flush();
+    return base;
+}
+
 uint64_t
 appendix::get_size() const
 {
-    return data.size();
+    return spilled + data.size();
 }
 
 const char *
 appendix::get_data() const
 {
+    assert(!spilled);
     return &data[0];
 }
+
+void
+appendix::write(binstream &s) const
+{
+    std::vector<char> chunk(std::min(spilled, (uint64_t)1 << 20));
+    uint64_t bytes;
+
+    /* Spilled lists are copied a chunk at a time */
+    for (uint64_t offset=0; offset<spilled; offset+=bytes) {
+        bytes = std::min(spilled - offset, (uint64_t)chunk.size());
+        xpread(spill, &chunk[0], bytes, offset);
+        s.write(&chunk[0], bytes);
+    }
+    if (!data.empty()) {
+        s.write(&data[0], data.size());
+    }
+}
+
+void
+appendix::move_data(char *out)
+{
+    if (spilled) {
+        xpread(spill, out, spilled, 0);
+    }
+    if (!data.empty()) {
+        memcpy(out + spilled, &data[0], data.size());
+    }
+    std::vector<char>().swap(data);
+    spilled = 0;
+}
+
+void
+appendix::decode64(int encoding,
+                   const char *ptr,
+                   size_t num,
+                   uint64_t *out,
+                   int width)
+{
+    if (encoding == RAW && width < (int)sizeof(uint64_t)) {
+        bucket_kernels_get()->widen_values((const uint8_t*)ptr,
+                                           width,
+                                           out,
+                                           num);
+        return;
+    } else if (encoding == RAW) {
+        memcpy(out, ptr, num * sizeof(uint64_t));
+        return;
+    }
+    out[0] = *(const uint64_t*)ptr;
+    unpack((const uint8_t*)ptr + sizeof(uint64_t), out[0], out + 1, num - 1);
+}
+
+void
+appendix::decode32(int encoding,
+                   const char *ptr,
+                   size_t num,
+                   uint32_t *out)
+{
+    if (encoding == RAW) {
+        memcpy(out, ptr, num * sizeof(uint32_t));
+        return;
+    }
+    out[0] = *(const uint32_t*)ptr;
+    unpack((const uint8_t*)ptr + sizeof(uint32_t), out[0], out + 1, num - 1);
+}
+
+const uint8_t *
+appendix::unpack(const uint8_t *in, uint64_t base, uint64_t *out, size_t n)
+{
+    return bucket_kernels_get()->unpack_deltas64(in, base, out, n);
+}
+
+const uint8_t *
+appendix::unpack(const uint8_t *in, uint32_t base, uint32_t *out, size_t n)
+{
+    return bucket_kernels_get()->unpack_deltas32(in, base, out, n);
+}
@@ -1,12 +1,34 @@
 #ifndef APPENDIX_H
 #define APPENDIX_H
 
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <map>
 #include <vector>
+#include "binstream.h"
 
+/* Value lists of keys with more than one value. Each list is sorted, and
+ * stored either as raw values (RAW), or as its first value followed by the
+ * deltas between consecutive values (DELTA). Buckets address lists with 32
+ * bits, in units of 2^shift bytes, so with a shift the appendix may exceed
+ * 4GB; each list then starts at a multiple of the unit. The deltas are
+ * bit-packed in blocks of BLOCK_SIZE: a byte with the bit width of the
+ * largest delta in the block, then BLOCK_SIZE deltas of that width (i.e.,
+ * "width" bytes).
+ * Sorted positions have small deltas, so DELTA lists are a fraction of the
+ * size of RAW ones.
+ * The appendix may exceed memory: with a spill file, the lists are moved to
+ * the file once they take more memory than allowed, and "data" holds only
+ * the bytes from offset "spilled" on. */
 class appendix {
 
     std::vector<char> data;
+    FILE *spill;
+    size_t spill_bytes;
+    uint64_t spilled;
+    int encoding;
+    int shift;
 
     template <typename T>
     void push(const T &elem)
@@ -17,19 +39,182 @@ class appendix {
         }
     }
 
+    /* Push the DELTA encoding of the sorted "vals" */
+    template <typename T>
+    void push_deltas(const std::vector<T> &vals);
+
+    /* Pad the data to the next list start. Returns the offset of the next
+     * list in units. */
+    uint64_t align();
+
+    /* Move the lists in memory to the spill file, if they take more than
+     * "spill_bytes" */
+    void flush();
+
 public:
 
-    appendix() = default;
+    /* List encodings */
+    enum { RAW, DELTA, ENCODING_NUM };
+
+    /* Deltas per block of the DELTA encoding */
+    static constexpr int BLOCK_SIZE = 8;
+
+    /* Bytes past the end of a DELTA list that its decoders may read. DELTA
+     * appendices end with this many zero bytes. */
+    static constexpr int PADDING = 8;
+
+    /* Offsets from INLINE_BASE units up are not in the appendix. Buckets
+     * use them for raw lists inlined in their spare value lanes (see
+     * "bucket_geometry"), with the first lane of the list in bits 6-11 and
+     * its count in bits 0-5. */
+    static constexpr uint32_t INLINE_BASE = 0xFFFFF000;
+
+    appendix();
     appendix(const appendix&) = delete;
 
-    /* Adds "vals" into the appendix. Returns value to save in bucket. */
+    /* Set the encoding of lists that are added afterwards */
+    void set_encoding(int encoding);
+
+    /* Returns the list encoding of this */
+    int get_encoding() const;
+
+    /* Address lists added afterwards in units of 2^shift bytes */
+    void set_shift(int shift);
+
+    /* Returns the offset unit of this, in bits */
+    int get_shift() const;
+
+    /* Returns the smallest shift that addresses the appendix of
+     * "value_num" values of "value_size" bytes in any list split */
+    static int get_min_shift(size_t value_num, size_t value_size);
+
+    /* Adds "vals" into the appendix. Returns value to save in bucket: in
+     * 64-bit, the list offset in units (upper 32 bits) and the value count;
+     * in 32-bit, the offset in units of the value count, which precedes
+     * the list. */
     uint64_t add_element64(std::vector<uint64_t> &vals);
     uint32_t add_element32(std::vector<uint32_t> &vals);
 
+    /* Appends the lists of "other", which must have the encoding and shift
+     * of this, after the lists of this. Returns the offset in units that
+     * the bucket values of "other" must be rebased by (see
+     * "bucket_geometry::rebase_value"). The result is the same as adding
+     * the lists of "other" to this in order. */
+    uint64_t append(const appendix &other);
+
+    /* Keep at most about "bytes" of the lists in memory, and move the rest
+     * to "fp", which the caller closes after this. nullptr (default) keeps
+     * all lists in memory. */
+    void set_spill(FILE *fp, size_t bytes);
+
     /* Returns the size of this, in bytes */
     uint64_t get_size() const;
 
+    /* Returns the lists of this. Not available once lists are spilled
+     * (see "write"). */
     const char *get_data() const;
+
+    /* Write the lists of this to "s", including the spilled ones */
+    void write(binstream &s) const;
+
+    /* Move the lists of this to "out", which has room for "get_size"
+     * bytes. This is then left without lists. */
+    void move_data(char *out);
+
+    /* Write the "num" values of the list at "ptr" (as pointed by the
+     * bucket value) in "encoding" to "out". RAW 64-bit values may take
+     * only their low "width" bytes, as in narrow buckets. */
+    static void decode64(int encoding,
+                         const char *ptr,
+                         size_t num,
+                         uint64_t *out,
+                         int width = sizeof(uint64_t));
+    static void decode32(int encoding,
+                         const char *ptr,
+                         size_t num,
+                         uint32_t *out);
+
+    /* Decode "n" deltas from the blocks at "in". Sets out[i] to "base" plus
+     * the first i+1 deltas. Returns the end of the last block. */
+    static const uint8_t *unpack(const uint8_t *in,
+                                 uint64_t base,
+                                 uint64_t *out,
+                                 size_t n);
+    static const uint8_t *unpack(const uint8_t *in,
+                                 uint32_t base,
+                                 uint32_t *out,
+                                 size_t n);
+
+    /* Iterates the values of a list with T-sized values, decoding a block
+     * at a time. Use when only a part of a long list is needed, or there
+     * is no room for all of it. RAW values take "width" bytes, as in
+     * "decode64". */
+    template <typename T>
+    class iterator {
+        const uint8_t *ptr;
+        size_t remaining;
+        int encoding;
+        int width;
+        bool started;
+        int cursor;
+        int filled;
+        T last;
+        T buffer[BLOCK_SIZE];
+
+    public:
+
+        iterator(int encoding,
+                 const char *ptr,
+                 size_t num,
+                 int width = sizeof(T))
+        : ptr((const uint8_t*)ptr),
+          remaining(num),
+          encoding(encoding),
+          width(width),
+          started(false),
+          cursor(0),
+          filled(0),
+          last(0)
+        {}
+
+        /* Set "value" to the next value. Returns false at the end. */
+        bool next(T &value)
+        {
+            if (cursor < filled) {
+                value = buffer[cursor++];
+                return true;
+            }
+            if (!remaining) {
+                return false;
+            }
+
+            /* Raw values, and the first value of DELTA lists */
+            if (encoding == RAW) {
+                value = 0;
+                memcpy(&value, ptr, width);
+                ptr += width;
+                remaining--;
+                return true;
+            }
+            if (!started) {
+                value = *(const T*)ptr;
+                ptr += sizeof(T);
+                remaining--;
+                started = true;
+                last = value;
+                return true;
+            }
+
+            /* The next block, relative to the last value */
+            filled = remaining < BLOCK_SIZE ? remaining : BLOCK_SIZE;
+            ptr = unpack(ptr, last, buffer, filled);
+            last = buffer[filled-1];
+            remaining -= filled;
+            cursor = 0;
+            value = buffer[cursor++];
+            return true;
+        }
+    };
 };
 
 
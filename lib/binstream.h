@@ -1,8 +1,10 @@
 #ifndef BINSTREAM_H
 #define BINSTREAM_H
 
+#include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <stdexcept>
 #include <vector>
 #include <iostream>
 #include <zlib.h>
@@ -128,6 +130,45 @@ public:
         this->data->cursor += size;
     }
 
+    /* Returns the number of bytes read so far */
+    size_t
+    get_cursor() const
+    {
+        return data->cursor;
+    }
+
+    /* Append "size" bytes to this, to be written in place. Returns them. */
+    char*
+    extend(size_t size)
+    {
+        char *out;
+        if (data->size + size > data->reserved) {
+            data->reserved = data->size + size;
+            data->ptr = (char*)realloc((void*)data->ptr, data->reserved);
+        }
+        out = data->ptr + data->size;
+        data->size += size;
+        return out;
+    }
+
+    /* Returns the data written to this, for in-place updates */
+    char*
+    get_data()
+    {
+        return data->ptr;
+    }
+
+    /* Drop the data from "size" bytes on, and release its memory */
+    void
+    truncate(size_t size)
+    {
+        if (size < data->size) {
+            data->size = size;
+            data->reserved = size ? size : 32;
+            data->ptr = (char*)realloc((void*)data->ptr, data->reserved);
+        }
+    }
+
     /* Detached data from all copies of this */
     void*
     detach_data(size_t *out_size)
@@ -335,4 +376,38 @@ public:
     }
 };
 
+/* Read and write a stdio file, at its position. Does not close the file. */
+class file_binstream : public base_binstream {
+    FILE *fp;
+
+public:
+
+    file_binstream(FILE *fp)
+        : fp(fp)
+    {}
+
+    void
+    write(const void *data, size_t size)
+    {
+        if (fwrite(data, 1, size, fp) != size) {
+            throw std::runtime_error("Cannot write: I/O error");
+        }
+    }
+
+    void
+    read(void *data, size_t size)
+    {
+        if (fread(data, 1, size, fp) != size) {
+            throw std::runtime_error("Cannot read: unexpected end of file");
+        }
+    }
+
+    base_binstream&
+    clone() const
+    {
+        file_binstream *b = new file_binstream(*this);
+        return *b;
+    }
+};
+
 #endif
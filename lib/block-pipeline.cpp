@@ -0,0 +1,319 @@
+#include <algorithm>
+#include <cassert>
+#include "block-pipeline.h"
+#include "perf.h"
+
+block_ring::block_ring(size_t block_size, int depth)
+: memory(block_size * depth),
+  lengths(depth),
+  free(depth),
+  full(depth),
+  closed(false),
+  block_size(block_size)
+{
+    assert(block_size > 0 && depth > 0);
+    for (int i=0; i<depth; ++i) {
+        free.try_push(i);
+    }
+}
+
+template <typename F>
+void
+block_ring::wait(waiters &w, F ready)
+{
+    for (int i=0; i<SPIN; ++i) {
+        if (ready()) {
+            return;
+        }
+        std::this_thread::yield();
+    }
+
+    /* Either "ready" sees the push of the other side, or the other side
+     * sees this sleeper and notifies it under the lock */
+    std::unique_lock<std::mutex> lock(w.lock);
+    w.num.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!ready()) {
+        w.cond.wait(lock);
+    }
+    w.num.fetch_sub(1);
+}
+
+void
+block_ring::wake(waiters &w)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (w.num.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(w.lock);
+        w.cond.notify_all();
+    }
+}
+
+size_t
+block_ring::get_block_size() const
+{
+    return block_size;
+}
+
+char*
+block_ring::get_block(int id)
+{
+    return &memory[id * block_size];
+}
+
+bool
+block_ring::acquire(int &id, uint64_t &wait_ns)
+{
+    uint64_t start;
+    bool popped;
+
+    if (free.try_pop(id)) {
+        return !closed.load(std::memory_order_acquire);
+    }
+    start = get_time_ns();
+    wait(free_waiters, [&]() {
+        popped = free.try_pop(id);
+        return popped || closed.load(std::memory_order_acquire);
+    });
+    wait_ns += get_time_ns() - start;
+    return popped && !closed.load(std::memory_order_acquire);
+}
+
+void
+block_ring::submit(int id, size_t length)
+{
+    bool pushed;
+
+    lengths[id] = length;
+    /* The ring has "depth" blocks, so there is room */
+    pushed = full.try_push(id);
+    assert(pushed);
+    (void)pushed;
+    wake(full_waiters);
+}
+
+bool
+block_ring::receive(int &id, size_t &length, uint64_t &wait_ns)
+{
+    uint64_t start;
+    bool popped;
+
+    start = get_time_ns();
+    wait(full_waiters, [&]() {
+        popped = full.try_pop(id);
+        return popped || closed.load(std::memory_order_acquire);
+    });
+    /* Blocks that were submitted before closing are received */
+    if (!popped) {
+        popped = full.try_pop(id);
+    }
+    wait_ns += get_time_ns() - start;
+    if (!popped) {
+        return false;
+    }
+    length = lengths[id];
+    return true;
+}
+
+void
+block_ring::release(int id)
+{
+    bool pushed;
+
+    pushed = free.try_push(id);
+    assert(pushed);
+    (void)pushed;
+    wake(free_waiters);
+}
+
+void
+block_ring::close()
+{
+    closed.store(true, std::memory_order_release);
+    for (waiters *w : { &free_waiters, &full_waiters }) {
+        std::lock_guard<std::mutex> lock(w->lock);
+        w->cond.notify_all();
+    }
+}
+
+gz_block_reader::gz_block_reader(gzFile fp, size_t block_size, int depth)
+: ring(block_size, depth),
+  stats(),
+  wait_ns(0),
+  block(nullptr),
+  cursor(0),
+  length(0),
+  id(-1),
+  error(0)
+{
+    thread = std::thread(&gz_block_reader::run, this, fp);
+}
+
+gz_block_reader::~gz_block_reader()
+{
+    /* Stop the thread, if the file was not read to its end */
+    ring.close();
+    thread.join();
+}
+
+void
+gz_block_reader::run(gzFile fp)
+{
+    uint64_t start;
+    int size;
+    int id;
+
+    while (ring.acquire(id, stats.wait_ns)) {
+        start = get_time_ns();
+        size = gzread(fp, ring.get_block(id), ring.get_block_size());
+        stats.busy_ns += get_time_ns() - start;
+        if (size <= 0) {
+            error = size < 0;
+            break;
+        }
+        stats.bytes += size;
+        ring.submit(id, size);
+    }
+    ring.close();
+}
+
+bool
+gz_block_reader::next_block()
+{
+    if (id >= 0) {
+        ring.release(id);
+    }
+    if (!ring.receive(id, length, wait_ns)) {
+        id = -1;
+        block = nullptr;
+        cursor = length = 0;
+        return false;
+    }
+    block = ring.get_block(id);
+    cursor = 0;
+    return true;
+}
+
+size_t
+gz_block_reader::read_blocks(char *data, size_t size)
+{
+    size_t done;
+    size_t n;
+
+    done = 0;
+    while (done < size) {
+        if (cursor == length && !next_block()) {
+            break;
+        }
+        n = std::min(size - done, length - cursor);
+        memcpy(data + done, block + cursor, n);
+        cursor += n;
+        done += n;
+    }
+    return done;
+}
+
+int
+gz_block_reader::get_error() const
+{
+    return error;
+}
+
+const stage_stats&
+gz_block_reader::get_stats() const
+{
+    return stats;
+}
+
+uint64_t
+gz_block_reader::get_wait_ns() const
+{
+    return wait_ns;
+}
+
+gz_block_writer::gz_block_writer(gzFile fp, size_t block_size, int depth)
+: ring(block_size, depth),
+  stats(),
+  wait_ns(0),
+  block(nullptr),
+  cursor(0),
+  id(-1),
+  error(0)
+{
+    thread = std::thread(&gz_block_writer::run, this, fp);
+}
+
+gz_block_writer::~gz_block_writer()
+{
+    finish();
+}
+
+void
+gz_block_writer::run(gzFile fp)
+{
+    uint64_t start;
+    size_t length;
+    int id;
+
+    while (ring.receive(id, length, stats.wait_ns)) {
+        /* After an error, only recycle the blocks */
+        if (!error) {
+            start = get_time_ns();
+            error = gzwrite(fp, ring.get_block(id), length) != (int)length;
+            stats.busy_ns += get_time_ns() - start;
+            stats.bytes += length;
+        }
+        ring.release(id);
+    }
+}
+
+void
+gz_block_writer::write(const void *data, size_t size)
+{
+    const char *ptr = (const char*)data;
+    size_t n;
+
+    while (size) {
+        if (!block) {
+            ring.acquire(id, wait_ns);
+            block = ring.get_block(id);
+            cursor = 0;
+        }
+        n = std::min(size, ring.get_block_size() - cursor);
+        memcpy(block + cursor, ptr, n);
+        cursor += n;
+        ptr += n;
+        size -= n;
+        if (cursor == ring.get_block_size()) {
+            ring.submit(id, cursor);
+            block = nullptr;
+        }
+    }
+}
+
+int
+gz_block_writer::finish()
+{
+    if (!thread.joinable()) {
+        return error;
+    }
+    if (block) {
+        ring.submit(id, cursor);
+        block = nullptr;
+    }
+    ring.close();
+    thread.join();
+    return error;
+}
+
+const stage_stats&
+gz_block_writer::get_stats() const
+{
+    return stats;
+}
+
+uint64_t
+gz_block_writer::get_wait_ns() const
+{
+    return wait_ns;
+}
@@ -0,0 +1,273 @@
+#ifndef BLOCK_PIPELINE_H
+#define BLOCK_PIPELINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+#include "binstream.h"
+
+/* A bounded lock-free queue of one producer thread and one consumer
+ * thread. Holds up to "capacity" elements, rounded up to a power of two. */
+template <typename T>
+class spsc_queue {
+
+    /* Keep the cursors of the two threads on different cache lines */
+    static constexpr int LINE = 64;
+
+    std::vector<T> slots;
+    size_t mask;
+    char pad0[LINE];
+    std::atomic<size_t> head;
+    char pad1[LINE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail;
+    char pad2[LINE - sizeof(std::atomic<size_t>)];
+
+public:
+
+    spsc_queue(size_t capacity)
+    : mask(1),
+      head(0),
+      tail(0)
+    {
+        while (mask < capacity) {
+            mask <<= 1;
+        }
+        slots.resize(mask);
+        mask--;
+    }
+
+    spsc_queue(const spsc_queue&) = delete;
+
+    /* Push "elem" by the producer. Returns false if the queue is full. */
+    bool try_push(const T &elem)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) > mask) {
+            return false;
+        }
+        slots[t & mask] = elem;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Pop to "elem" by the consumer. Returns false if the queue is
+     * empty. */
+    bool try_pop(T &elem)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        elem = slots[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+/* Throughput of a pipeline stage: the bytes it passed on, the time it
+ * spent working on them, and the time it waited for the other stages */
+struct stage_stats {
+    uint64_t bytes;
+    uint64_t busy_ns;
+    uint64_t wait_ns;
+};
+
+/* "depth" blocks of "block_size" bytes that circulate between a producer
+ * and a consumer thread: the producer fills free blocks and submits them,
+ * the consumer receives them in order and releases them back. Bounds the
+ * memory of a pipeline stage, and lets either side stop the other. */
+class block_ring {
+
+    /* A side that waits on a queue spins this many times, and then sleeps
+     * until the other side pushes to the queue or closes the ring */
+    static constexpr int SPIN = 64;
+
+    /* The sleepers on a queue */
+    struct waiters {
+        std::mutex lock;
+        std::condition_variable cond;
+        std::atomic<int> num;
+
+        waiters()
+        : num(0)
+        {}
+    };
+
+    std::vector<char> memory;
+    std::vector<size_t> lengths;
+    spsc_queue<int> free;
+    spsc_queue<int> full;
+    waiters free_waiters;
+    waiters full_waiters;
+    std::atomic<bool> closed;
+    size_t block_size;
+
+    /* Wait until "ready" returns true, spinning and then sleeping on "w" */
+    template <typename F>
+    static void wait(waiters &w, F ready);
+
+    /* Wake the sleepers on "w", after a push to its queue */
+    static void wake(waiters &w);
+
+public:
+
+    block_ring(size_t block_size, int depth);
+    block_ring(const block_ring&) = delete;
+
+    /* Returns the size of the blocks, in bytes */
+    size_t get_block_size() const;
+
+    /* Returns block "id" */
+    char *get_block(int id);
+
+    /* Set "id" to a free block, waiting for one. Adds the wait time to
+     * "wait_ns". Returns false once this is closed. */
+    bool acquire(int &id, uint64_t &wait_ns);
+
+    /* Pass the first "length" bytes of block "id" to the consumer */
+    void submit(int id, size_t length);
+
+    /* Set "id" and "length" to the next submitted block, waiting for one.
+     * Adds the wait time to "wait_ns". Returns false once this is closed
+     * and all blocks were received. */
+    bool receive(int &id, size_t &length, uint64_t &wait_ns);
+
+    /* Return block "id" to the producer */
+    void release(int id);
+
+    /* No more blocks are submitted, or the consumer stops receiving */
+    void close();
+};
+
+/* Reads a gzip file with a thread that decompresses it a block at a time
+ * ahead of the reader, up to "depth" blocks. The reading thread then only
+ * copies the data. */
+class gz_block_reader {
+
+    block_ring ring;
+    std::thread thread;
+    stage_stats stats;
+    uint64_t wait_ns;
+    char *block;
+    size_t cursor;
+    size_t length;
+    int id;
+    int error;
+
+    /* Decompress "fp" to the ring, on the thread */
+    void run(gzFile fp);
+
+    /* Move to the next block. Returns false at the end of the file. */
+    bool next_block();
+
+public:
+
+    /* Start reading "fp" from its current position. The caller closes
+     * "fp", after this is destroyed. */
+    gz_block_reader(gzFile fp, size_t block_size, int depth);
+    gz_block_reader(const gz_block_reader&) = delete;
+    ~gz_block_reader();
+
+    /* Read "size" bytes to "data". Returns the number of bytes read, which
+     * is less than "size" only at the end of the file. */
+    size_t read(void *data, size_t size)
+    {
+        if (size <= length - cursor) {
+            memcpy(data, block + cursor, size);
+            cursor += size;
+            return size;
+        }
+        return read_blocks((char*)data, size);
+    }
+
+    /* "read" across blocks */
+    size_t read_blocks(char *data, size_t size);
+
+    /* Returns nonzero if decompression failed */
+    int get_error() const;
+
+    /* Returns the throughput of the decompressing thread. Call after the
+     * end of the file. */
+    const stage_stats& get_stats() const;
+
+    /* Returns the time the reader waited for decompressed blocks */
+    uint64_t get_wait_ns() const;
+};
+
+/* Writes a gzip file with a thread that compresses and writes it a block
+ * at a time behind the writer, up to "depth" blocks. The writing thread
+ * then only copies the data. */
+class gz_block_writer {
+
+    block_ring ring;
+    std::thread thread;
+    stage_stats stats;
+    uint64_t wait_ns;
+    char *block;
+    size_t cursor;
+    int id;
+    int error;
+
+    /* Compress the blocks of the ring to "fp", on the thread */
+    void run(gzFile fp);
+
+public:
+
+    /* Start writing to "fp" at its current position. The caller closes
+     * "fp", after "finish". */
+    gz_block_writer(gzFile fp, size_t block_size, int depth);
+    gz_block_writer(const gz_block_writer&) = delete;
+    ~gz_block_writer();
+
+    /* Write the "size" bytes at "data" */
+    void write(const void *data, size_t size);
+
+    /* Write the last block and wait for the thread. Returns 0 on success,
+     * or nonzero if any write failed. */
+    int finish();
+
+    /* Returns the throughput of the compressing thread. Call after
+     * "finish". */
+    const stage_stats& get_stats() const;
+
+    /* Returns the time the writer waited for free blocks */
+    uint64_t get_wait_ns() const;
+
+    /* A binstream base that writes to a "gz_block_writer" */
+    class stream : public base_binstream {
+        gz_block_writer *writer;
+
+    public:
+
+        stream(gz_block_writer &writer)
+            : writer(&writer)
+        {}
+
+        void
+        write(const void *data, size_t size)
+        {
+            writer->write(data, size);
+        }
+
+        void
+        read(void *data, size_t size)
+        {
+            throw std::runtime_error("Cannot read: write-only stream");
+        }
+
+        base_binstream&
+        clone() const
+        {
+            stream *b = new stream(*this);
+            return *b;
+        }
+    };
+};
+
+#endif
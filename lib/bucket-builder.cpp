@@ -8,187 +8,491 @@
 #include "hash-methods.h"
 #include "simd.h"
 
-#define MAX_KEYS_IN_PAGE 32
+static inline size_t
+round_to_lines(size_t bytes)
+{
+    return (bytes + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+}
 
-bucket_builder::attr::attr()
-: count(0),
-  hash(0),
-  saved_val64(0),
-  saved_val32(0)
+bucket_geometry::bucket_geometry(bool use_64bit,
+                                 int verify_bits,
+                                 int keys,
+                                 int slot_bits,
+                                 int hash_seeds,
+                                 int inline_values,
+                                 int value_bytes)
+: keys(keys),
+  slot_bits(slot_bits),
+  verify_bits(verify_bits),
+  hash_seeds(hash_seeds),
+  inline_values(inline_values),
+  value_bytes(value_bytes),
+  use_64bit(use_64bit)
 { }
 
-bucket_builder::bucket_builder(bool use_64bit)
-: use_64bit(use_64bit),
-  smallest_key(0)
-{ }
+bool
+bucket_geometry::is_valid() const
+{
+    return (keys == 16 || keys == 32 || keys == 64) &&
+           (slot_bits == 8 || slot_bits == 16) &&
+           verify_bits >= 0 && verify_bits <= 16 &&
+           hash_seeds >= 0 && hash_seeds <= MAX_HASH_SEEDS &&
+           inline_values >= 0 && inline_values <= MAX_INLINE_VALUES &&
+           (value_bytes == 0 ||
+            (use_64bit && (value_bytes == 5 || value_bytes == 6)));
+}
 
-bucket_builder::~bucket_builder()
+int
+bucket_geometry::get_capacity() const
 {
-    for (auto &it : keys) {
-        delete it.second;
-    }
+    return hash_seeds ? keys - 1 : keys;
+}
+
+size_t
+bucket_geometry::get_size_bytes() const
+{
+    const size_t full = use_64bit ? sizeof(uint64_t) : sizeof(uint32_t);
+
+    /* Narrow values are read with full-width loads, so the last one is
+     * followed by padding */
+    return get_values_offset() +
+           round_to_lines(keys * get_value_bytes() +
+                          full - get_value_bytes());
+}
+
+size_t
+bucket_geometry::get_verify_offset() const
+{
+    return round_to_lines(keys * slot_bits / 8);
+}
+
+size_t
+bucket_geometry::get_values_offset() const
+{
+    /* The verification lanes follow the hash lanes, so both are fetched
+     * together by the adjacent-line prefetcher */
+    return get_verify_offset() +
+           (verify_bits ? round_to_lines(keys * sizeof(uint16_t)) : 0);
+}
+
+int
+bucket_geometry::get_value_bytes() const
+{
+    return value_bytes ? value_bytes :
+           use_64bit ? sizeof(uint64_t) : sizeof(uint32_t);
 }
 
 void
-bucket_builder::clear()
+bucket_geometry::narrow_bucket(const char *in, char *out) const
 {
-    smallest_key = 0;
-    for (auto &it : keys) {
-        delete it.second;
+    const uint64_t *values;
+    uint64_t value;
+    bool list;
+
+    values = (const uint64_t*)(in + get_values_offset());
+    memcpy(out, in, get_values_offset());
+    memset(out + get_values_offset(),
+           0,
+           get_size_bytes() - get_values_offset());
+
+    /* Lists are flagged in the hash slots of keys. With hash seeds, the
+     * last slot holds the seed, and its lane a value of an inlined list. */
+    for (int i=0; i<keys; ++i) {
+        value = values[i];
+        list = false;
+        if (i < get_capacity()) {
+            list = slot_bits == 8 ? ((const uint8_t*)in)[i] & 1 :
+                                    ((const uint16_t*)in)[i] & 1;
+        }
+        if (list) {
+            value = (value >> 32) | (value << 32);
+        }
+        memcpy(out + get_values_offset() + i * value_bytes,
+               &value,
+               value_bytes);
     }
-    keys.clear();
 }
 
-bucket_builder::attr *
-bucket_builder::get_key_attr(uint64_t key)
+void
+bucket_geometry::rebase_value(char *val, uint64_t base) const
 {
-    struct attr *key_attr;
-    auto it = keys.find(key);
-    if ((it == keys.end()) && (keys.size() >= MAX_KEYS_IN_PAGE)) {
-        return nullptr;
-    } else if (it == keys.end()) {
-        key_attr = new attr();
-        keys[key] = key_attr;
-        return key_attr;
+    uint64_t value64;
+    uint32_t value32;
+
+    if (use_64bit) {
+        memcpy(&value64, val, sizeof(value64));
+        if ((value64 >> 32) < appendix::INLINE_BASE) {
+            value64 += base << 32;
+        }
+        memcpy(val, &value64, sizeof(value64));
     } else {
-        return it->second;
+        memcpy(&value32, val, sizeof(value32));
+        if (value32 < appendix::INLINE_BASE) {
+            value32 += base;
+        }
+        memcpy(val, &value32, sizeof(value32));
     }
 }
 
-int
-bucket_builder::populate_record(struct record *m, struct attr *key_attr)
+void
+bucket_geometry::rebase_bucket(char *ptr, uint64_t base) const
 {
-    uint16_t hash;
+    const size_t size = use_64bit ? sizeof(uint64_t) : sizeof(uint32_t);
+    bool list;
 
-    /* Issues may arise only for new keys: must check for hash collision */
-    if (!key_attr->count) {
-        hash = hash_15bit_key(m->key, smallest_key);
+    assert(!value_bytes);
 
-        for (auto &it : keys) {
-            if ((it.second != key_attr) &&
-                (hash_15bit_read(&it.second->hash) == hash)) {
-                return 1;
-            }
+    /* As in "narrow_bucket", lists are flagged in the hash slots of keys */
+    for (int i=0; i<get_capacity(); ++i) {
+        list = slot_bits == 8 ? ((const uint8_t*)ptr)[i] & 1 :
+                                ((const uint16_t*)ptr)[i] & 1;
+        if (list) {
+            rebase_value(ptr + get_values_offset() + i * size, base);
         }
-        key_attr->hash = hash;
     }
+}
 
-    key_attr->count++;
-    if (use_64bit) {
-        key_attr->values64.push_back(m->value);
-        key_attr->saved_val64 = key_attr->values64[0];
-    } else {
-        key_attr->values32.push_back((uint32_t)m->value);
-        key_attr->saved_val32 = key_attr->values32[0];
-    }
-    return 0;
+uint16_t
+bucket_geometry::get_verify_mask() const
+{
+    return (uint16_t)((1U << verify_bits) - 1);
 }
 
-int
-bucket_builder::try_insert(struct record *m)
+/* The bucket value of the list "vals" */
+static inline uint64_t
+add_element(appendix &a, std::vector<uint64_t> &vals)
+{
+    return a.add_element64(vals);
+}
+
+static inline uint32_t
+add_element(appendix &a, std::vector<uint32_t> &vals)
 {
-    struct attr *key_attr;
+    return a.add_element32(vals);
+}
 
-    key_attr = get_key_attr(m->key);
+/* The bucket value of a list of "count" values inlined from "lane" */
+static inline void
+set_inline_value(uint64_t &val, int lane, int count)
+{
+    val = (uint64_t)(appendix::INLINE_BASE | lane << 6 | count) << 32 |
+          count;
+}
 
-    /* Can't put in more than maximum */
-    if (key_attr == nullptr) {
-        return 1;
+static inline void
+set_inline_value(uint32_t &val, int lane, int count)
+{
+    val = appendix::INLINE_BASE | lane << 6 | count;
+}
+
+/* Returns a bit per lane of the hash line at "line" that matches "hash" */
+static inline uint64_t
+probe_line(const struct bucket_kernels *kernels, char *line, uint16_t hash)
+{
+    uint32_t mask;
+    kernels->probe_batch(&line, &hash, &mask, 1);
+    return mask;
+}
+
+static inline uint64_t
+probe_line(const struct bucket_kernels *kernels, char *line, uint8_t hash)
+{
+    uint64_t mask;
+    kernels->probe8_batch(&line, &hash, &mask, 1);
+    return mask;
+}
+
+/* The hash of "key" minus "base_range" with hash basis "basis" */
+static inline uint32_t
+hash_key(const struct bucket_kernels *kernels,
+         uint64_t key,
+         uint64_t base_range,
+         uint32_t basis)
+{
+    uint32_t hash;
+    kernels->hash_batch(&key, &base_range, &basis, &hash, 1);
+    return hash;
+}
+
+template <int KEYS, typename slot_t, typename value_t>
+bucket_builder<KEYS, slot_t, value_t>::bucket_builder(
+    const bucket_geometry &g)
+: geometry(g),
+  kernels(bucket_kernels_get()),
+  smallest_key(0),
+  seed(0),
+  num(0),
+  stash_room(0)
+{
+    assert(g.keys == KEYS && g.slot_bits == 8 * sizeof(slot_t) &&
+           g.use_64bit == (sizeof(value_t) == sizeof(uint64_t)));
+    memset(hashes, 0, sizeof(hashes));
+}
+
+template <int KEYS, typename slot_t, typename value_t>
+void
+bucket_builder<KEYS, slot_t, value_t>::clear()
+{
+    /* Only the hashes are read past "num" */
+    smallest_key = 0;
+    seed = 0;
+    memset(hashes, 0, num * sizeof(slot_t));
+    num = 0;
+    values.clear();
+    stashed.clear();
+    blocked.clear();
+}
+
+template <int KEYS, typename slot_t, typename value_t>
+void
+bucket_builder<KEYS, slot_t, value_t>::set_stash_room(size_t num)
+{
+    stash_room = num;
+}
+
+template <int KEYS, typename slot_t, typename value_t>
+int
+bucket_builder<KEYS, slot_t, value_t>::find_hash(slot_t hash) const
+{
+    constexpr int LANES = CACHE_LINE_SIZE / sizeof(slot_t);
+    uint64_t mask;
+    int valid;
+
+    for (int l=0; l<HASH_LINES; ++l) {
+        valid = num - l * LANES;
+        if (valid <= 0) {
+            break;
+        }
+        mask = probe_line(kernels,
+                          (char*)hashes + l * CACHE_LINE_SIZE,
+                          hash);
+
+        /* The lanes past the keys are zero, and may match */
+        if (valid < LANES) {
+            mask &= (1ULL << valid) - 1;
+        }
+        if (mask) {
+            return l * LANES + __builtin_ctzll(mask);
+        }
     }
+    return -1;
+}
 
-    /* Returns success if there exists a valid hash function */
-    if (!populate_record(m, key_attr)) {
-        return 0;
+template <int KEYS, typename slot_t, typename value_t>
+void
+bucket_builder<KEYS, slot_t, value_t>::add_value(entry &e, uint64_t value)
+{
+    /* Keys are pushed in order, so only the last run grows */
+    assert(e.first + e.count == values.size());
+    if (!e.count) {
+        e.saved_val = (value_t)value;
     }
+    values.push_back((value_t)value);
+    e.count++;
+}
 
-    /* Delete key attributes */
-    delete key_attr;
-    keys.erase(m->key);
-    return 1;
+template <int KEYS, typename slot_t, typename value_t>
+void
+bucket_builder<KEYS, slot_t, value_t>::remove(int idx)
+{
+    for (int i=idx+1; i<num; ++i) {
+        entries[i-1] = entries[i];
+        hashes[i-1] = hashes[i];
+    }
+    num--;
+    hashes[num] = 0;
 }
 
+template <int KEYS, typename slot_t, typename value_t>
 int
-bucket_builder::key_sort(const void *pa, const void *pb, void *pargs)
+bucket_builder<KEYS, slot_t, value_t>::reseed(uint64_t key)
 {
-    const uint64_t a = *(uint64_t*)pa;
-    const uint64_t b = *(uint64_t*)pb;
-    sortargs *args = (sortargs*)pargs;
+    std::array<uint64_t, KEYS> keys;
+    std::array<uint64_t, KEYS> base_ranges;
+    std::array<uint32_t, KEYS> bases;
+    std::array<uint32_t, KEYS> full;
+    std::array<slot_t, KEYS> trial;
+
+    keys[0] = key;
+    for (int i=0; i<num; ++i) {
+        keys[i+1] = entries[i].key;
+    }
+    base_ranges.fill(smallest_key);
+
+    for (int s=0; s<geometry.hash_seeds; ++s) {
+        if (s == seed) {
+            continue;
+        }
 
-    /* Singletons come before appendix */
-    if (args->keys->at(a)->count < args->keys->at(b)->count) {
-        return true;
+        bases.fill(hash_seed_basis(s));
+        kernels->hash_batch(keys.data(),
+                            base_ranges.data(),
+                            bases.data(),
+                            full.data(),
+                            num + 1);
+        for (int i=0; i<=num; ++i) {
+            trial[i] = hash_slot_of<slot_t>(full[i]);
+        }
+        std::sort(trial.begin(), trial.begin() + num + 1);
+        if (std::adjacent_find(trial.begin(), trial.begin() + num + 1) !=
+            trial.begin() + num + 1) {
+            continue;
+        }
+
+        /* Flags are only set by "populate_appendix", after the last push */
+        seed = s;
+        for (int i=0; i<num; ++i) {
+            hashes[i] = hash_slot_of<slot_t>(full[i+1]);
+        }
+        return 0;
     }
-    /* Singletons are sorted by their values */
-    return args->use_64bit ?
-           (args->keys->at(a)->values64[0] < args->keys->at(b)->values64[0]) :
-           (args->keys->at(a)->values32[0] < args->keys->at(b)->values32[0]);
+    return 1;
 }
 
-std::vector<uint64_t>
-bucket_builder::get_key_order()
+template <int KEYS, typename slot_t, typename value_t>
+int
+bucket_builder<KEYS, slot_t, value_t>::stash(struct record *m, slot_t hash)
 {
-    sortargs args;
-    std::vector<uint64_t> out;
+    int other = find_hash(hash);
+    entry e;
 
-    args.keys = &keys;
-    args.use_64bit = use_64bit;
+    if (stashed.size() + (other >= 0 ? 2 : 1) > stash_room) {
+        return 1;
+    }
 
-    out.reserve(keys.size());
-    for (auto & it : keys) {
-        out.push_back(it.first);
+    if (other >= 0) {
+        stashed.push_back(entries[other]);
+        remove(other);
+        blocked.push_back(hash);
     }
-    qsort_r(&out[0], out.size(), sizeof(uint64_t), key_sort, &args);
-    return out;
+
+    /* The new key is last, so its next values find it */
+    e.key = m->key;
+    e.first = values.size();
+    e.count = 0;
+    e.fp = 0;
+    e.lane = -1;
+    stashed.push_back(e);
+    add_value(stashed.back(), m->value);
+    return 0;
 }
 
-size_t
-bucket_builder::get_size_bytes(bool use_64bit)
+template <int KEYS, typename slot_t, typename value_t>
+int
+bucket_builder<KEYS, slot_t, value_t>::push(struct record *m)
 {
-    return use_64bit ?
-           320 : /* 64B index + 4 * 64B = 256B */
-           192 ; /* 64B index + 2 * 64B = 128B */
+    slot_t hash;
+    entry *e;
+
+    if (!num && stashed.empty()) {
+        smallest_key = m->key;
+    }
+
+    /* More values of the last key, in the bucket or in the stash */
+    if (num && entries[num-1].key == m->key) {
+        add_value(entries[num-1], m->value);
+        return 0;
+    }
+    if (!stashed.empty() && stashed.back().key == m->key) {
+        add_value(stashed.back(), m->value);
+        return 0;
+    }
+
+    /* Can't put in more than maximum */
+    if (num >= geometry.get_capacity()) {
+        return 1;
+    }
+
+    /* A hash of stashed keys would match them in the bucket */
+    hash = hash_slot_of<slot_t>(hash_key(kernels,
+                                         m->key,
+                                         smallest_key,
+                                         hash_seed_basis(seed)));
+    if (std::find(blocked.begin(), blocked.end(), hash) != blocked.end()) {
+        return stash(m, hash);
+    }
+
+    if (find_hash(hash) >= 0) {
+        /* Another seed may separate all keys. Blocked hashes are of the
+         * current seed, so it is kept once keys are stashed. */
+        if (!stashed.empty() || reseed(m->key)) {
+            return stash(m, hash);
+        }
+        hash = hash_slot_of<slot_t>(hash_key(kernels,
+                                             m->key,
+                                             smallest_key,
+                                             hash_seed_basis(seed)));
+    }
+
+    e = &entries[num];
+    e->key = m->key;
+    e->first = values.size();
+    e->count = 0;
+    e->fp = hash_verify_of(hash_key(kernels,
+                                    m->key,
+                                    smallest_key,
+                                    HASH_VERIFY_BASIS),
+                           geometry.get_verify_mask());
+    e->lane = -1;
+    hashes[num] = hash;
+    num++;
+    add_value(*e, m->value);
+    return 0;
 }
 
-size_t
-bucket_builder::get_distinct_key_num() const
+template <int KEYS, typename slot_t, typename value_t>
+int
+bucket_builder<KEYS, slot_t, value_t>::get_key_order(
+    std::array<int, KEYS> &order) const
 {
-    return keys.size();
+    for (int i=0; i<num; ++i) {
+        order[i] = i;
+    }
+
+    /* Singletons come before lists, and are sorted by their values */
+    std::sort(order.begin(), order.begin() + num,
+              [this](int a, int b) {
+                  const entry &ea = entries[a];
+                  const entry &eb = entries[b];
+                  if ((ea.count == 1) != (eb.count == 1)) {
+                      return ea.count == 1;
+                  }
+                  if (values[ea.first] != values[eb.first]) {
+                      return values[ea.first] < values[eb.first];
+                  }
+                  return a < b;
+              });
+    return num;
 }
 
+template <int KEYS, typename slot_t, typename value_t>
 size_t
-bucket_builder::get_total_key_num() const
+bucket_builder<KEYS, slot_t, value_t>::get_distinct_key_num() const
 {
-    size_t count = 0;
-    for (auto &it : keys) {
-        count += it.second->count;
-    }
-    return count;
+    return num + stashed.size();
 }
 
-int
-bucket_builder::push(struct record *m)
+template <int KEYS, typename slot_t, typename value_t>
+size_t
+bucket_builder<KEYS, slot_t, value_t>::get_total_key_num() const
 {
-    if (!keys.size()) {
-        smallest_key = m->key;
-    }
-    return try_insert(m);
+    /* Every value belongs to a key, in the bucket or in the stash */
+    return values.size();
 }
 
+template <int KEYS, typename slot_t, typename value_t>
 uint64_t
-bucket_builder::get_smallest_key() const
+bucket_builder<KEYS, slot_t, value_t>::get_smallest_key() const
 {
     return smallest_key;
 }
 
+template <int KEYS, typename slot_t, typename value_t>
 uint8_t
-bucket_builder::get_common_prefix_bits() const
+bucket_builder<KEYS, slot_t, value_t>::get_common_prefix_bits() const
 {
-    uint64_t largest_key = smallest_key;
-    for (auto it : keys) {
-        if (it.first > largest_key) {
-            largest_key = it.first;
-        }
-    }
+    /* Keys are in order */
+    uint64_t largest_key = num ? entries[num-1].key : smallest_key;
 
     uint64_t diff = largest_key - smallest_key;
     if (diff == 0) {
@@ -201,91 +505,206 @@ bucket_builder::get_common_prefix_bits() const
     return 63 - result;
 }
 
-const std::vector<uint64_t>*
-bucket_builder::get_key_values64(uint64_t key) const
+template <int KEYS, typename slot_t, typename value_t>
+const value_t*
+bucket_builder<KEYS, slot_t, value_t>::get_key_values(uint64_t key,
+                                                      size_t &count) const
 {
-    auto it = keys.find(key);
-    if (it == keys.end()) {
-        return nullptr;
+    for (int i=0; i<num; ++i) {
+        if (entries[i].key == key) {
+            count = entries[i].count;
+            return &values[entries[i].first];
+        }
+    }
+    for (const entry &e : stashed) {
+        if (e.key == key) {
+            count = e.count;
+            return &values[e.first];
+        }
     }
-    return &it->second->values64;
+    return nullptr;
 }
 
-const std::vector<uint32_t>*
-bucket_builder::get_key_values32(uint64_t key) const
+template <int KEYS, typename slot_t, typename value_t>
+size_t
+bucket_builder<KEYS, slot_t, value_t>::get_used_bytes() const
 {
-    auto it = keys.find(key);
-    if (it == keys.end()) {
-        return nullptr;
-    }
-    return &it->second->values32;
+    return num * (sizeof(slot_t) +
+                  (geometry.verify_bits ? sizeof(uint16_t) : 0)) +
+           get_used_lanes() * sizeof(value_t);
 }
 
+template <int KEYS, typename slot_t, typename value_t>
 size_t
-bucket_builder::get_used_bytes() const
+bucket_builder<KEYS, slot_t, value_t>::get_used_lanes() const
 {
-    size_t num = keys.size();
-    return num * 10; /* 320B max */
+    size_t out = num;
+    for (int i=0; i<num; ++i) {
+        if (entries[i].lane >= 0) {
+            out += entries[i].count;
+        }
+    }
+    return out;
 }
 
-bool
-bucket_builder::get_use_64bit() const
+template <int KEYS, typename slot_t, typename value_t>
+const bucket_geometry&
+bucket_builder<KEYS, slot_t, value_t>::get_geometry() const
 {
-    return use_64bit;
+    return geometry;
 }
 
+template <int KEYS, typename slot_t, typename value_t>
 size_t
-bucket_builder::get_singleton_num() const
+bucket_builder<KEYS, slot_t, value_t>::get_singleton_num() const
 {
     size_t count = 0;
-    for (auto &it : keys) {
-        count += (it.second->count == 1);
+    for (int i=0; i<num; ++i) {
+        count += (entries[i].count == 1);
+    }
+    for (const entry &e : stashed) {
+        count += (e.count == 1);
     }
     return count;
 }
 
+template <int KEYS, typename slot_t, typename value_t>
+size_t
+bucket_builder<KEYS, slot_t, value_t>::get_stashed_key_num() const
+{
+    return stashed.size();
+}
+
+template <int KEYS, typename slot_t, typename value_t>
+value_t
+bucket_builder<KEYS, slot_t, value_t>::add_list(appendix &a, const entry &e)
+{
+    list.assign(values.begin() + e.first,
+                values.begin() + e.first + e.count);
+    return add_element(a, list);
+}
+
+template <int KEYS, typename slot_t, typename value_t>
 void
-bucket_builder::populate_appendix(appendix &a)
+bucket_builder<KEYS, slot_t, value_t>::populate_appendix(appendix &a)
 {
+    std::array<int, KEYS> lists;
+    int list_num;
+    int lane;
+
+    /* Keys take the first lanes. The shortest lists are inlined first, so
+     * that most fit in the rest. */
+    if (geometry.inline_values) {
+        list_num = 0;
+        for (int i=0; i<num; ++i) {
+            if (entries[i].count > 1 &&
+                entries[i].count <= (uint32_t)geometry.inline_values) {
+                lists[list_num++] = i;
+            }
+        }
+        std::stable_sort(lists.begin(), lists.begin() + list_num,
+                         [this](int a, int b) {
+                             return entries[a].count < entries[b].count;
+                         });
+        lane = num;
+        for (int i=0; i<list_num; ++i) {
+            entry &e = entries[lists[i]];
+            if (lane + e.count > KEYS) {
+                break;
+            }
+            std::sort(values.begin() + e.first,
+                      values.begin() + e.first + e.count);
+            e.lane = lane;
+            set_inline_value(e.saved_val, lane, e.count);
+            hashes[lists[i]] |= 1;
+            lane += e.count;
+        }
+    }
+
     /* Add large records to the appendix */
-    for (auto &it : keys) {
-        if (it.second->count<=1) {
+    for (int i=0; i<num; ++i) {
+        if (entries[i].count <= 1 || entries[i].lane >= 0) {
             continue;
         }
-        if (use_64bit) {
-            it.second->saved_val64 = a.add_element64(it.second->values64);
-        } else {
-            it.second->saved_val32 = a.add_element32(it.second->values32);
+        entries[i].saved_val = add_list(a, entries[i]);
+        hashes[i] |= 1; /* LSBit means value is pointer */
+    }
+    for (entry &e : stashed) {
+        if (e.count > 1) {
+            e.saved_val = add_list(a, e);
         }
-        it.second->hash |= 1; /* LSBit means value is pointer */
     }
 }
 
+template <int KEYS, typename slot_t, typename value_t>
 void
-bucket_builder::pack(char *ptr)
-{
-    std::vector<uint64_t> order;
-    uint16_t  *hash_cursor;
-    uint64_t *val64_cursor;
-    uint32_t *val32_cursor;
-
-    memset(ptr, 0, get_size_bytes(use_64bit));
-
-    hash_cursor = (uint16_t*)ptr;
-    val64_cursor = (uint64_t*)(ptr + CACHE_LINE_SIZE);
-    val32_cursor = (uint32_t*)(ptr + CACHE_LINE_SIZE);
-    order = get_key_order();
-
-    /* Put hashes and values */
-    for (uint64_t k : order) {
-        *hash_cursor = keys[k]->hash;
-        if (use_64bit) {
-            *val64_cursor = keys[k]->saved_val64;
-            val64_cursor++;
-        } else {
-            *val32_cursor = keys[k]->saved_val32;
-            val32_cursor++;
+bucket_builder<KEYS, slot_t, value_t>::populate_stash(key_stash &s)
+{
+    /* A key is stashed after the key it collides with, which may be
+     * smaller than keys stashed before */
+    std::sort(stashed.begin(), stashed.end(),
+              [](const entry &a, const entry &b) {
+                  return a.key < b.key;
+              });
+    for (const entry &e : stashed) {
+        s.add(e.key, e.count, &e.saved_val);
+    }
+}
+
+template <int KEYS, typename slot_t, typename value_t>
+void
+bucket_builder<KEYS, slot_t, value_t>::pack(char *ptr) const
+{
+    std::array<int, KEYS> order;
+    slot_t *hash_cursor;
+    uint16_t *fp_cursor;
+    value_t *val_cursor;
+    int n;
+
+    memset(ptr, 0, geometry.get_size_bytes());
+
+    hash_cursor = (slot_t*)ptr;
+    fp_cursor = (uint16_t*)(ptr + geometry.get_verify_offset());
+    val_cursor = (value_t*)(ptr + geometry.get_values_offset());
+    n = get_key_order(order);
+
+    /* Put hashes, verification bits and values */
+    for (int i=0; i<n; ++i) {
+        const entry &e = entries[order[i]];
+        *hash_cursor = hashes[order[i]];
+        if (geometry.verify_bits) {
+            *fp_cursor = e.fp;
+            fp_cursor++;
         }
+        *val_cursor = e.saved_val;
+        val_cursor++;
         hash_cursor++;
+
+        /* Inlined lists are in the lanes that follow the keys */
+        if (e.lane >= 0) {
+            memcpy(ptr + geometry.get_values_offset() +
+                   e.lane * sizeof(value_t),
+                   &values[e.first],
+                   e.count * sizeof(value_t));
+        }
+    }
+
+    /* The seed index takes the last hash slot */
+    if (geometry.hash_seeds) {
+        ((slot_t*)ptr)[KEYS-1] = seed;
     }
 }
+
+/* All geometries of "bucket_geometry" */
+template class bucket_builder<16, uint8_t, uint32_t>;
+template class bucket_builder<16, uint8_t, uint64_t>;
+template class bucket_builder<16, uint16_t, uint32_t>;
+template class bucket_builder<16, uint16_t, uint64_t>;
+template class bucket_builder<32, uint8_t, uint32_t>;
+template class bucket_builder<32, uint8_t, uint64_t>;
+template class bucket_builder<32, uint16_t, uint32_t>;
+template class bucket_builder<32, uint16_t, uint64_t>;
+template class bucket_builder<64, uint8_t, uint32_t>;
+template class bucket_builder<64, uint8_t, uint64_t>;
+template class bucket_builder<64, uint16_t, uint32_t>;
+template class bucket_builder<64, uint16_t, uint64_t>;
@@ -3,55 +3,213 @@
 
 #include <array>
 #include <vector>
-#include <map>
 
 #include "appendix.h"
+#include "bucket-kernels.h"
+#include "key-stash.h"
 #include "record.h"
+#include "simd.h"
 
+/* The layout of the buckets of a db, stored in its header. A bucket has
+ * "keys" slots (16, 32 or 64). Each slot holds a key hash of "slot_bits"
+ * bits (8 or 16), whose LSbit is 1 iff the value is an appendix pointer,
+ * "verify_bits" verification bits in a 16-bit lane (none if 0), and a 32 or
+ * 64 bit value. Hash, verification and value lanes are in separate arrays,
+ * each starting at a cache line. Fewer, narrower slots make smaller
+ * buckets that hold fewer keys (so there are more ranges to search) and
+ * collide more often.
+ * With "hash_seeds" > 0, the keys of each bucket are hashed with one of
+ * that many hash seeds, the first that has no collisions, and the last
+ * hash slot holds the index of the seed instead of a key.
+ * With "inline_values" > 0, lists of up to that many values are stored in
+ * the value lanes that no key uses, when they fit, instead of in the
+ * appendix. Their bucket value addresses the lanes (see "appendix").
+ * With "value_bytes" (5 or 6, 64-bit values only), the value lanes keep
+ * only the low "value_bytes" bytes of each value. The bucket value of a
+ * list then holds its appendix offset in the low 32 bits, and its count
+ * above them. Buckets are built with full values and narrowed by
+ * "narrow_bucket". */
+struct bucket_geometry {
+    int keys;
+    int slot_bits;
+    int verify_bits;
+    int hash_seeds;
+    int inline_values;
+    int value_bytes;   /* 0 for the size of the values */
+    bool use_64bit;
+
+    /* Seed indices fit in the smallest hash slot */
+    static constexpr int MAX_HASH_SEEDS = 256;
+
+    /* Inlined list counts fit in 6 bits */
+    static constexpr int MAX_INLINE_VALUES = 63;
+
+    bucket_geometry(bool use_64bit = true,
+                    int verify_bits = 0,
+                    int keys = 32,
+                    int slot_bits = 16,
+                    int hash_seeds = 0,
+                    int inline_values = 0,
+                    int value_bytes = 0);
+
+    /* Returns true iff the buckets of this are supported */
+    bool is_valid() const;
+
+    /* Returns the maximal number of keys in a bucket */
+    int get_capacity() const;
+
+    /* Returns the number of bytes in the bucket */
+    size_t get_size_bytes() const;
+
+    /* Returns the offset of the verification lanes within the bucket */
+    size_t get_verify_offset() const;
+
+    /* Returns the offset of the values within the bucket */
+    size_t get_values_offset() const;
+
+    /* Returns the number of bytes in a value lane */
+    int get_value_bytes() const;
+
+    /* Copies the bucket at "in" to "out" in the value width of this. The
+     * bucket at "in" must have the geometry of this with full values. */
+    void narrow_bucket(const char *in, char *out) const;
+
+    /* Adds "base" units to the appendix offset of the bucket value at
+     * "val", unless it addresses an inlined list. The value must be of a
+     * list, in full width. */
+    void rebase_value(char *val, uint64_t base) const;
+
+    /* Rebases the values of all appendix lists in the bucket at "ptr", as
+     * "rebase_value". The bucket must have full values. */
+    void rebase_bucket(char *ptr, uint64_t base) const;
+
+    /* Returns the mask of the verification bits */
+    uint16_t get_verify_mask() const;
+};
+
+/* Calls f.template run<KEYS, slot_t, value_t>() with the bucket parameters
+ * of "g" as types, and returns its result. Returns -1 if "g" is not
+ * supported. */
+template <int KEYS, typename slot_t, class F>
+static inline int
+bucket_geometry_dispatch_values(const bucket_geometry &g, F &f)
+{
+    return g.use_64bit ? f.template run<KEYS, slot_t, uint64_t>() :
+                         f.template run<KEYS, slot_t, uint32_t>();
+}
+
+template <int KEYS, class F>
+static inline int
+bucket_geometry_dispatch_slots(const bucket_geometry &g, F &f)
+{
+    switch (g.slot_bits) {
+    case 8:
+        return bucket_geometry_dispatch_values<KEYS, uint8_t>(g, f);
+    case 16:
+        return bucket_geometry_dispatch_values<KEYS, uint16_t>(g, f);
+    default:
+        return -1;
+    }
+}
+
+template <class F>
+static inline int
+bucket_geometry_dispatch(const bucket_geometry &g, F &f)
+{
+    if (!g.is_valid()) {
+        return -1;
+    }
+    switch (g.keys) {
+    case 16:
+        return bucket_geometry_dispatch_slots<16>(g, f);
+    case 32:
+        return bucket_geometry_dispatch_slots<32>(g, f);
+    case 64:
+        return bucket_geometry_dispatch_slots<64>(g, f);
+    default:
+        return -1;
+    }
+}
+
+/* Builds a bucket of up to KEYS keys with "slot_t" hash slots and "value_t"
+ * values (see "bucket_geometry"). Keys live in fixed arrays and their
+ * values in an arena, both of which are reused by the next bucket, so
+ * building allocates nothing once the arena has grown. */
+template <int KEYS, typename slot_t, typename value_t>
 class bucket_builder {
 
-    struct attr {
-        int count;
-        uint16_t hash; /* LSbit is 1 iff saved_val is apdx pointer */
-        uint64_t saved_val64;
-        uint32_t saved_val32;
-        std::vector<uint64_t> values64;
-        std::vector<uint32_t> values32;
-        attr();
+    struct entry {
+        uint64_t key;
+        size_t first;  /* Index of the first value in "values" */
+        uint32_t count;
+        uint16_t fp;   /* Verification bits */
+        int lane;      /* First lane of an inlined list, or -1 */
+        value_t saved_val;
     };
 
-    bool use_64bit;
+    /* Lines of hash slots */
+    static constexpr int HASH_LINES =
+        (KEYS * sizeof(slot_t) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE;
+
+    bucket_geometry geometry;
+    const struct bucket_kernels *kernels;
     uint64_t smallest_key;
-    std::map<uint64_t, struct attr*> keys;
+    int seed;
 
-    struct sortargs {
-        std::map<uint64_t, struct attr*> *keys;
-        bool use_64bit;
-    };
+    /* Keys in push (key) order. The hashes are laid out as hash lines,
+     * so collisions are found by the probe kernels. LSbit of a hash is 1
+     * iff the saved value is a list. */
+    int num;
+    std::array<entry, KEYS> entries;
+    slot_t hashes[HASH_LINES * CACHE_LINE_SIZE / sizeof(slot_t)];
+
+    /* The values of all keys, each key's in a run */
+    std::vector<value_t> values;
+
+    /* Keys diverted to the stash, and the hashes they collided on */
+    std::vector<entry> stashed;
+    std::vector<slot_t> blocked;
+    size_t stash_room;
+
+    /* A list on its way to the appendix */
+    std::vector<value_t> list;
 
 public:
 
-    bucket_builder(bool use_64bit);
+    /* "g" must match the template parameters */
+    bucket_builder(const bucket_geometry &g);
     bucket_builder(const bucket_builder &other) = delete;
-    ~bucket_builder();
 
     /* Pushes a record "m" into this, returns 0 if it can be inserted
-     * into the bucket w/o breaking the collision constraint. */
+     * into the bucket w/o breaking the collision constraint. Records
+     * must be pushed in key order. */
     int push(struct record *m);
 
     /* Clear all records from this */
     void clear();
 
+    /* Let this divert up to "num" colliding keys to the stash instead of
+     * rejecting them. Kept by "clear". */
+    void set_stash_room(size_t num);
+
     /* Populate the bucket at "ptr". The bucket must have at least
-     * "get_bucket_size" bytes allocated. */
-    void pack(char *ptr);
+     * "get_size_bytes" bytes of the geometry allocated. */
+    void pack(char *ptr) const;
 
-    /* Populates the appendix with a new appendix bucket */
+    /* Inlines the short lists of this that fit in the bucket, and
+     * populates the appendix with the rest. Call after the last push. */
     void populate_appendix(appendix &a);
 
+    /* Adds the stashed keys of this to "s". Call after
+     * "populate_appendix". */
+    void populate_stash(key_stash &s);
+
     /* Returns how many bytes are used by this */
     size_t get_used_bytes() const;
 
+    /* Returns how many value lanes are used by this */
+    size_t get_used_lanes() const;
+
     /* Returns the smallest key in this */
     uint64_t get_smallest_key() const;
 
@@ -67,32 +225,43 @@ public:
     /* Return number of singletons */
     size_t get_singleton_num() const;
 
-    /* Returns true iff this uses 64bit values */
-    bool get_use_64bit() const;
+    /* Returns the number of distinct keys diverted to the stash */
+    size_t get_stashed_key_num() const;
 
-    /* Returns the list of values accosiated with a key */
-    const std::vector<uint64_t>* get_key_values64(uint64_t key) const;
-    const std::vector<uint32_t>* get_key_values32(uint64_t key) const;
+    /* Returns the values accosiated with a key, and sets "count" to their
+     * number. Returns nullptr if the key is not in this. */
+    const value_t *get_key_values(uint64_t key, size_t &count) const;
 
-    /* Returns the number of bytes in the bucket */
-    static size_t get_size_bytes(bool use_64bit);
+    /* Returns the bucket geometry of this */
+    const bucket_geometry& get_geometry() const;
 
 private:
 
-    /* Returns the attributes of the given key. Initializes attributes for
-     * new keys. Returns NULL if this has reached maximum capacity */
-    attr * get_key_attr(uint64_t key);
+    /* Returns the index of the key whose hash is "hash", or -1 */
+    int find_hash(slot_t hash) const;
+
+    /* Appends "value" to the values of "e" */
+    void add_value(entry &e, uint64_t value);
+
+    /* Removes the key at "idx" from the keys of this */
+    void remove(int idx);
 
-    /* Populate the record within this. Returns 0 on success */
-    int populate_record(struct record *m, struct attr *key_attr);
+    /* Switch to the first hash seed with no collisions between the keys of
+     * this and "key", and rehash the keys. Returns 0 on success, or 1 if
+     * there is no such seed. */
+    int reseed(uint64_t key);
 
-    /* Try insert "m" into this. Returns 0 on success. */
-    int try_insert(struct record *m);
+    /* Divert the new key of record "m", and the key it collides with on
+     * "hash" (if any), to the stash. Returns 0 on success, or 1 if there is
+     * no room. */
+    int stash(struct record *m, slot_t hash);
 
-    /* Returns the key order in bucket */
-    std::vector<uint64_t> get_key_order();
+    /* Adds the values of "e" to the appendix, returns its bucket value */
+    value_t add_list(appendix &a, const entry &e);
 
-    static int key_sort(const void *pa, const void *pb, void *args);
+    /* Sets "order" to the key indices in bucket order, returns their
+     * number */
+    int get_key_order(std::array<int, KEYS> &order) const;
 };
 
 
@@ -0,0 +1,892 @@
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <immintrin.h>
+
+#include "appendix.h"
+#include "bucket-kernels.h"
+#include "hash-methods.h"
+#include "pgm-engine.h"
+#include "simd.h"
+
+/* Number of 16-bit lanes in a hash line */
+static constexpr int LANES = CACHE_LINE_SIZE / sizeof(uint16_t);
+
+/* Number of 8-bit lanes in a hash line */
+static constexpr int LANES8 = CACHE_LINE_SIZE;
+
+/* Used to switch off the LSbit in hash */
+static constexpr uint16_t HASH_MASK = 0xFFFE;
+static constexpr uint8_t HASH_MASK8 = 0xFE;
+
+static inline int
+key_num_from_mask(uint32_t nonzero)
+{
+    /* Keys are packed from the first lane onward */
+    return nonzero ? 32 - __builtin_clz(nonzero) : 0;
+}
+
+/* Scalar kernels */
+
+static void
+probe_batch_scalar(char *const *buckets,
+                   const uint16_t *hashes,
+                   uint32_t *masks,
+                   int n)
+{
+    const uint16_t *lanes;
+    uint32_t mask;
+
+    for (int i=0; i<n; ++i) {
+        lanes = (const uint16_t*)buckets[i];
+        mask = 0;
+        for (int l=0; l<LANES; ++l) {
+            mask |= (uint32_t)((lanes[l] & HASH_MASK) == hashes[i]) << l;
+        }
+        masks[i] = mask;
+    }
+}
+
+static void
+probe8_batch_scalar(char *const *buckets,
+                    const uint8_t *hashes,
+                    uint64_t *masks,
+                    int n)
+{
+    const uint8_t *lanes;
+    uint64_t mask;
+
+    for (int i=0; i<n; ++i) {
+        lanes = (const uint8_t*)buckets[i];
+        mask = 0;
+        for (int l=0; l<LANES8; ++l) {
+            mask |= (uint64_t)((lanes[l] & HASH_MASK8) == hashes[i]) << l;
+        }
+        masks[i] = mask;
+    }
+}
+
+static void
+verify_batch_scalar(char *const *lines,
+                    const uint16_t *fps,
+                    uint32_t *masks,
+                    int n)
+{
+    const uint16_t *lanes;
+    uint32_t mask;
+
+    for (int i=0; i<n; ++i) {
+        lanes = (const uint16_t*)lines[i];
+        mask = 0;
+        for (int l=0; l<LANES; ++l) {
+            mask |= (uint32_t)(lanes[l] == fps[i]) << l;
+        }
+        masks[i] &= mask;
+    }
+}
+
+static int
+key_num_scalar(const char *ptr)
+{
+    const uint16_t *lanes = (const uint16_t*)ptr;
+    uint32_t nonzero = 0;
+    for (int l=0; l<LANES; ++l) {
+        nonzero |= (uint32_t)(lanes[l] != 0) << l;
+    }
+    return key_num_from_mask(nonzero);
+}
+
+/* Nodes this many levels below the current one share a cache line, and
+ * are prefetched while the current level is searched */
+static constexpr int PREFETCH_LEVELS = 3;
+
+static void
+descend_batch_scalar(const uint64_t *tree,
+                     int depth,
+                     const uint64_t *keys,
+                     uint64_t *nodes,
+                     int n)
+{
+    for (int i=0; i<n; ++i) {
+        nodes[i] = 1;
+    }
+
+    /* All keys descend together, so their memory accesses overlap */
+    for (int d=0; d<depth; ++d) {
+        for (int i=0; i<n; ++i) {
+            if (d + PREFETCH_LEVELS < depth) {
+                __builtin_prefetch(tree + (nodes[i] << PREFETCH_LEVELS));
+            }
+            nodes[i] = 2*nodes[i] + (tree[nodes[i]] <= keys[i]);
+        }
+    }
+}
+
+static void
+predict_batch_scalar(const struct pgm_segment *segs,
+                     const uint32_t *idx,
+                     const uint64_t *keys,
+                     uint32_t *pos,
+                     int n)
+{
+    const struct pgm_segment *seg;
+    uint64_t x;
+    float y;
+
+    for (int i=0; i<n; ++i) {
+        seg = &segs[idx[i]];
+        x = (keys[i] - seg->key) >> seg->shift;
+        x = x > INT32_MAX ? INT32_MAX : x;
+        /* Same operations as the SIMD variants, so the results are equal */
+        y = (float)(int32_t)x * seg->slope;
+        y = y > 0 ? y : 0;
+        y = y < (float)seg->last ? y : (float)seg->last;
+        pos[i] = seg->start + (uint32_t)(int32_t)y;
+    }
+}
+
+/* Returns delta "lane" of the block of "width"-bit deltas at "in" */
+static inline uint64_t
+unpack_lane(const uint8_t *in, int width, int lane)
+{
+    const uint8_t *ptr;
+    uint64_t value;
+    int shift;
+
+    ptr = in + (lane * width) / 8;
+    shift = (lane * width) % 8;
+    memcpy(&value, ptr, sizeof(value));
+    value >>= shift;
+    if (shift + width > 64) {
+        value |= (uint64_t)ptr[8] << (64 - shift);
+    }
+    return width == 64 ? value : value & ((1ULL << width) - 1);
+}
+
+template <typename T>
+static const uint8_t *
+unpack_deltas_scalar(const uint8_t *in, T base, T *out, size_t n)
+{
+    const int B = appendix::BLOCK_SIZE;
+    int width;
+    int k;
+
+    for (size_t i=0; i<n; i+=B) {
+        width = *in++;
+        k = n - i < (size_t)B ? n - i : B;
+        for (int j=0; j<k; ++j) {
+            base += unpack_lane(in, width, j);
+            out[i+j] = base;
+        }
+        in += width;
+    }
+    return in;
+}
+
+static const uint8_t *
+unpack_deltas64_scalar(const uint8_t *in,
+                       uint64_t base,
+                       uint64_t *out,
+                       size_t n)
+{
+    return unpack_deltas_scalar(in, base, out, n);
+}
+
+static const uint8_t *
+unpack_deltas32_scalar(const uint8_t *in,
+                       uint32_t base,
+                       uint32_t *out,
+                       size_t n)
+{
+    return unpack_deltas_scalar(in, base, out, n);
+}
+
+static void
+widen_values_scalar(const uint8_t *in, int width, uint64_t *out, size_t n)
+{
+    for (size_t i=0; i<n; ++i) {
+        out[i] = 0;
+        memcpy(&out[i], in + i * width, width);
+    }
+}
+
+/* CRC32C (Castagnoli), a byte at a time */
+static uint64_t
+crc32_u64_scalar(uint64_t crc, uint64_t data)
+{
+    static const struct crc32c_table {
+        uint32_t entries[256];
+
+        crc32c_table()
+        {
+            uint32_t c;
+            for (uint32_t i=0; i<256; ++i) {
+                c = i;
+                for (int j=0; j<8; ++j) {
+                    c = (c >> 1) ^ (0x82F63B78 & -(c & 1));
+                }
+                entries[i] = c;
+            }
+        }
+    } table;
+    uint32_t c = crc;
+
+    for (int i=0; i<8; ++i) {
+        c = table.entries[(c ^ data) & 0xFF] ^ (c >> 8);
+        data >>= 8;
+    }
+    return c;
+}
+
+static void
+hash_batch_scalar(const uint64_t *keys,
+                  const uint64_t *base_ranges,
+                  const uint32_t *bases,
+                  uint32_t *out,
+                  int n)
+{
+    for (int i=0; i<n; ++i) {
+        out[i] = hash_finish_crc(crc32_u64_scalar(
+                     hash_add64(bases[i], keys[i] - base_ranges[i]), 8));
+    }
+}
+
+static int
+popcount_batch_scalar(const uint64_t *words, int n)
+{
+    int out = 0;
+    for (int i=0; i<n; ++i) {
+        out += __builtin_popcountll(words[i]);
+    }
+    return out;
+}
+
+/* SSE4.2 kernels: four 16-byte iterations per hash line. The AVX kernels
+ * use their CRC and POPCNT. */
+
+__attribute__((target("sse4.2")))
+static uint64_t
+crc32_u64_sse42(uint64_t crc, uint64_t data)
+{
+    return _mm_crc32_u64(crc, data);
+}
+
+__attribute__((target("sse4.2")))
+static void
+hash_batch_sse42(const uint64_t *keys,
+                 const uint64_t *base_ranges,
+                 const uint32_t *bases,
+                 uint32_t *out,
+                 int n)
+{
+    for (int i=0; i<n; ++i) {
+        out[i] = hash_finish_crc(_mm_crc32_u64(
+                     hash_add64(bases[i], keys[i] - base_ranges[i]), 8));
+    }
+}
+
+__attribute__((target("sse4.2,popcnt")))
+static int
+popcount_batch_sse42(const uint64_t *words, int n)
+{
+    int out = 0;
+    for (int i=0; i<n; ++i) {
+        out += __builtin_popcountll(words[i]);
+    }
+    return out;
+}
+
+/* One bit per 16-bit lane of "line" that equals "value" after "andmask" */
+__attribute__((target("sse4.2")))
+static inline uint32_t
+sse42_eq_mask(const char *line, __m128i value, __m128i andmask)
+{
+    __m128i lo, hi;
+    uint32_t mask = 0;
+
+    for (int ofst=0; ofst<CACHE_LINE_SIZE; ofst+=32) {
+        lo = _mm_loadu_si128((const __m128i*)(line + ofst));
+        hi = _mm_loadu_si128((const __m128i*)(line + ofst + 16));
+        lo = _mm_cmpeq_epi16(_mm_and_si128(lo, andmask), value);
+        hi = _mm_cmpeq_epi16(_mm_and_si128(hi, andmask), value);
+        /* One byte per lane, then one bit per lane */
+        mask |= (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(lo, hi))
+                << (ofst / sizeof(uint16_t));
+    }
+    return mask;
+}
+
+__attribute__((target("sse4.2")))
+static void
+probe_batch_sse42(char *const *buckets,
+                  const uint16_t *hashes,
+                  uint32_t *masks,
+                  int n)
+{
+    const __m128i hashmask = _mm_set1_epi16((short)HASH_MASK);
+    for (int i=0; i<n; ++i) {
+        masks[i] = sse42_eq_mask(buckets[i],
+                                 _mm_set1_epi16((short)hashes[i]),
+                                 hashmask);
+    }
+}
+
+__attribute__((target("sse4.2")))
+static void
+probe8_batch_sse42(char *const *buckets,
+                   const uint8_t *hashes,
+                   uint64_t *masks,
+                   int n)
+{
+    const __m128i hashmask = _mm_set1_epi8((char)HASH_MASK8);
+    __m128i value, lanes;
+    uint64_t mask;
+
+    for (int i=0; i<n; ++i) {
+        value = _mm_set1_epi8((char)hashes[i]);
+        mask = 0;
+        for (int ofst=0; ofst<CACHE_LINE_SIZE; ofst+=16) {
+            lanes = _mm_loadu_si128((const __m128i*)(buckets[i] + ofst));
+            lanes = _mm_cmpeq_epi8(_mm_and_si128(lanes, hashmask), value);
+            mask |= (uint64_t)(uint32_t)_mm_movemask_epi8(lanes) << ofst;
+        }
+        masks[i] = mask;
+    }
+}
+
+__attribute__((target("sse4.2")))
+static void
+verify_batch_sse42(char *const *lines,
+                   const uint16_t *fps,
+                   uint32_t *masks,
+                   int n)
+{
+    const __m128i ones = _mm_set1_epi16(-1);
+    for (int i=0; i<n; ++i) {
+        masks[i] &= sse42_eq_mask(lines[i],
+                                  _mm_set1_epi16((short)fps[i]),
+                                  ones);
+    }
+}
+
+__attribute__((target("sse4.2")))
+static int
+key_num_sse42(const char *ptr)
+{
+    const __m128i zeros = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(-1);
+    return key_num_from_mask(~sse42_eq_mask(ptr, zeros, ones));
+}
+
+/* Shuffles the first two "width"-byte values of a 16-byte load into two
+ * 64-bit lanes */
+__attribute__((target("sse4.2")))
+static inline __m128i
+widen_shuffle(int width)
+{
+    uint8_t idx[16];
+    for (int j=0; j<8; ++j) {
+        idx[j] = j < width ? j : 0x80;
+        idx[8+j] = j < width ? width + j : 0x80;
+    }
+    return _mm_loadu_si128((const __m128i*)idx);
+}
+
+__attribute__((target("sse4.2")))
+static void
+widen_values_sse42(const uint8_t *in, int width, uint64_t *out, size_t n)
+{
+    const __m128i shuffle = widen_shuffle(width);
+    size_t i;
+
+    /* Two values per load, while the load ends within the values */
+    for (i=0; i + 2 <= n && (n - i) * width >= 16; i+=2) {
+        _mm_storeu_si128((__m128i*)(out + i),
+            _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i*width)),
+                             shuffle));
+    }
+    widen_values_scalar(in + i * width, width, out + i, n - i);
+}
+
+/* AVX2 kernels: two 32-byte iterations per hash line */
+
+__attribute__((target("avx2")))
+static inline uint32_t
+avx2_lane_mask(__m256i lo, __m256i hi)
+{
+    /* "packs" interleaves the 128-bit halves of its inputs; restore the
+     * lane order before extracting one bit per lane */
+    __m256i packed = _mm256_packs_epi16(lo, hi);
+    packed = _mm256_permute4x64_epi64(packed, 0xD8);
+    return (uint32_t)_mm256_movemask_epi8(packed);
+}
+
+/* One bit per 16-bit lane of "line" that equals "value" after "andmask" */
+__attribute__((target("avx2")))
+static inline uint32_t
+avx2_eq_mask(const char *line, __m256i value, __m256i andmask)
+{
+    __m256i lo, hi;
+    lo = _mm256_loadu_si256((const __m256i*)line);
+    hi = _mm256_loadu_si256((const __m256i*)(line + 32));
+    lo = _mm256_cmpeq_epi16(_mm256_and_si256(lo, andmask), value);
+    hi = _mm256_cmpeq_epi16(_mm256_and_si256(hi, andmask), value);
+    return avx2_lane_mask(lo, hi);
+}
+
+__attribute__((target("avx2")))
+static void
+probe_batch_avx2(char *const *buckets,
+                 const uint16_t *hashes,
+                 uint32_t *masks,
+                 int n)
+{
+    const __m256i hashmask = _mm256_set1_epi16((short)HASH_MASK);
+    for (int i=0; i<n; ++i) {
+        masks[i] = avx2_eq_mask(buckets[i],
+                                _mm256_set1_epi16((short)hashes[i]),
+                                hashmask);
+    }
+}
+
+__attribute__((target("avx2")))
+static void
+probe8_batch_avx2(char *const *buckets,
+                  const uint8_t *hashes,
+                  uint64_t *masks,
+                  int n)
+{
+    const __m256i hashmask = _mm256_set1_epi8((char)HASH_MASK8);
+    __m256i value, lo, hi;
+
+    for (int i=0; i<n; ++i) {
+        value = _mm256_set1_epi8((char)hashes[i]);
+        lo = _mm256_loadu_si256((const __m256i*)buckets[i]);
+        hi = _mm256_loadu_si256((const __m256i*)(buckets[i] + 32));
+        lo = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hashmask), value);
+        hi = _mm256_cmpeq_epi8(_mm256_and_si256(hi, hashmask), value);
+        masks[i] = (uint64_t)(uint32_t)_mm256_movemask_epi8(lo) |
+                   (uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32;
+    }
+}
+
+__attribute__((target("avx2")))
+static void
+verify_batch_avx2(char *const *lines,
+                  const uint16_t *fps,
+                  uint32_t *masks,
+                  int n)
+{
+    const __m256i ones = _mm256_set1_epi16(-1);
+    for (int i=0; i<n; ++i) {
+        masks[i] &= avx2_eq_mask(lines[i],
+                                 _mm256_set1_epi16((short)fps[i]),
+                                 ones);
+    }
+}
+
+__attribute__((target("avx2")))
+static int
+key_num_avx2(const char *ptr)
+{
+    const __m256i zeros = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(-1);
+    return key_num_from_mask(~avx2_eq_mask(ptr, zeros, ones));
+}
+
+/* Four keys per iteration: the nodes of all keys are gathered at once */
+__attribute__((target("avx2")))
+static void
+descend_batch_avx2(const uint64_t *tree,
+                   int depth,
+                   const uint64_t *keys,
+                   uint64_t *nodes,
+                   int n)
+{
+    /* There is no unsigned 64-bit compare; flip the sign bits instead */
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i one = _mm256_set1_epi64x(1);
+    alignas(32) uint64_t next[4];
+    __m256i key, node, k;
+    int i;
+
+    for (i=0; i+4<=n; i+=4) {
+        key = _mm256_loadu_si256((const __m256i*)(keys + i));
+        key = _mm256_xor_si256(key, sign);
+        k = one;
+        for (int d=0; d<depth; ++d) {
+            if (d + PREFETCH_LEVELS < depth) {
+                _mm256_store_si256((__m256i*)next, k);
+                for (int j=0; j<4; ++j) {
+                    __builtin_prefetch(tree + (next[j] << PREFETCH_LEVELS));
+                }
+            }
+            node = _mm256_i64gather_epi64((const long long*)tree, k, 8);
+            /* -1 where the node is greater than the key, otherwise 0 */
+            node = _mm256_cmpgt_epi64(_mm256_xor_si256(node, sign), key);
+            k = _mm256_add_epi64(_mm256_add_epi64(k, k),
+                                 _mm256_add_epi64(node, one));
+        }
+        _mm256_storeu_si256((__m256i*)(nodes + i), k);
+    }
+    descend_batch_scalar(tree, depth, keys + i, nodes + i, n - i);
+}
+
+/* Four keys per iteration: the segment fields of all keys are gathered at
+ * once, and the model is evaluated in float32 lanes */
+__attribute__((target("avx2")))
+static void
+predict_batch_avx2(const struct pgm_segment *segs,
+                   const uint32_t *idx,
+                   const uint64_t *keys,
+                   uint32_t *pos,
+                   int n)
+{
+    /* Field offsets in 32-bit and 64-bit words */
+    const int *words = (const int*)segs;
+    const long long *qwords = (const long long*)segs;
+    constexpr int WORDS = sizeof(struct pgm_segment) / sizeof(int);
+    constexpr int QWORDS = sizeof(struct pgm_segment) / sizeof(long long);
+    const __m256i even = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+    const __m256i limit = _mm256_set1_epi64x(INT32_MAX);
+    __m256i seg, key, x, small;
+    __m128i start, last, shift, p;
+    __m128 y;
+    int i;
+
+    for (i=0; i+4<=n; i+=4) {
+        seg = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)(idx+i)));
+        key = _mm256_i64gather_epi64(qwords,
+                                     _mm256_mul_epu32(seg,
+                                     _mm256_set1_epi64x(QWORDS)),
+                                     8);
+        seg = _mm256_mul_epu32(seg, _mm256_set1_epi64x(WORDS));
+        start = _mm256_i64gather_epi32(words + 2, seg, 4);
+        last = _mm256_i64gather_epi32(words + 3, seg, 4);
+        shift = _mm256_i64gather_epi32(words + 4, seg, 4);
+        y = _mm256_i64gather_ps((const float*)words + 5, seg, 4);
+
+        /* Input to the model, saturated to 31 bits */
+        x = _mm256_loadu_si256((const __m256i*)(keys + i));
+        x = _mm256_srlv_epi64(_mm256_sub_epi64(x, key),
+                              _mm256_cvtepu32_epi64(shift));
+        small = _mm256_cmpeq_epi64(_mm256_srli_epi64(x, 31),
+                                   _mm256_setzero_si256());
+        x = _mm256_blendv_epi8(limit, x, small);
+        x = _mm256_permutevar8x32_epi32(x, even);
+
+        y = _mm_mul_ps(_mm_cvtepi32_ps(_mm256_castsi256_si128(x)), y);
+        y = _mm_max_ps(y, _mm_setzero_ps());
+        y = _mm_min_ps(y, _mm_cvtepi32_ps(last));
+        p = _mm_add_epi32(start, _mm_cvttps_epi32(y));
+        _mm_storeu_si128((__m128i*)(pos + i), p);
+    }
+    predict_batch_scalar(segs, idx + i, keys + i, pos + i, n - i);
+}
+
+/* Widest deltas whose lanes a single 8-byte gather covers */
+static constexpr int GATHER_WIDTH = 57;
+
+/* Decode the block of "width"-bit deltas at "in" into the prefix sums
+ * "lo" (deltas 0-3) and "hi" (deltas 4-7) on top of "base", and set "base"
+ * to the sum of all deltas */
+__attribute__((target("avx2")))
+static inline void
+unpack_block_avx2(const uint8_t *in,
+                  int width,
+                  __m256i &base,
+                  __m256i &lo,
+                  __m256i &hi)
+{
+    const __m256i lanes = _mm256_setr_epi64x(0, 1, 2, 3);
+    const __m256i seven = _mm256_set1_epi64x(7);
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t deltas[appendix::BLOCK_SIZE];
+    __m256i bits_lo, bits_hi, mask;
+
+    if (width <= GATHER_WIDTH) {
+        /* Bit offset of each lane; gather the 8 bytes that hold it */
+        bits_lo = _mm256_mul_epu32(lanes, _mm256_set1_epi64x(width));
+        bits_hi = _mm256_add_epi64(bits_lo, _mm256_set1_epi64x(4 * width));
+        lo = _mm256_i64gather_epi64((const long long*)in,
+                                    _mm256_srli_epi64(bits_lo, 3), 1);
+        hi = _mm256_i64gather_epi64((const long long*)in,
+                                    _mm256_srli_epi64(bits_hi, 3), 1);
+        lo = _mm256_srlv_epi64(lo, _mm256_and_si256(bits_lo, seven));
+        hi = _mm256_srlv_epi64(hi, _mm256_and_si256(bits_hi, seven));
+        mask = _mm256_set1_epi64x((1ULL << width) - 1);
+        lo = _mm256_and_si256(lo, mask);
+        hi = _mm256_and_si256(hi, mask);
+    } else {
+        for (int j=0; j<appendix::BLOCK_SIZE; ++j) {
+            deltas[j] = unpack_lane(in, width, j);
+        }
+        lo = _mm256_loadu_si256((const __m256i*)deltas);
+        hi = _mm256_loadu_si256((const __m256i*)(deltas + 4));
+    }
+
+    /* Prefix sums within 128-bit lanes, then across them */
+    lo = _mm256_add_epi64(lo, _mm256_slli_si256(lo, 8));
+    hi = _mm256_add_epi64(hi, _mm256_slli_si256(hi, 8));
+    lo = _mm256_add_epi64(lo, _mm256_blend_epi32(zero,
+             _mm256_permute4x64_epi64(lo, _MM_SHUFFLE(1, 1, 1, 1)), 0xF0));
+    hi = _mm256_add_epi64(hi, _mm256_blend_epi32(zero,
+             _mm256_permute4x64_epi64(hi, _MM_SHUFFLE(1, 1, 1, 1)), 0xF0));
+
+    /* Then across the two halves, on top of "base" */
+    lo = _mm256_add_epi64(lo, base);
+    hi = _mm256_add_epi64(hi,
+             _mm256_permute4x64_epi64(lo, _MM_SHUFFLE(3, 3, 3, 3)));
+    base = _mm256_permute4x64_epi64(hi, _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *
+unpack_deltas64_avx2(const uint8_t *in,
+                     uint64_t base,
+                     uint64_t *out,
+                     size_t n)
+{
+    const int B = appendix::BLOCK_SIZE;
+    __m256i vbase = _mm256_set1_epi64x(base);
+    uint64_t tail[B];
+    __m256i lo, hi;
+    int width;
+
+    for (size_t i=0; i<n; i+=B) {
+        width = *in++;
+        unpack_block_avx2(in, width, vbase, lo, hi);
+        in += width;
+        if (n - i >= (size_t)B) {
+            _mm256_storeu_si256((__m256i*)(out + i), lo);
+            _mm256_storeu_si256((__m256i*)(out + i + 4), hi);
+        } else {
+            _mm256_storeu_si256((__m256i*)tail, lo);
+            _mm256_storeu_si256((__m256i*)(tail + 4), hi);
+            memcpy(out + i, tail, (n - i) * sizeof(uint64_t));
+        }
+    }
+    return in;
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *
+unpack_deltas32_avx2(const uint8_t *in,
+                     uint32_t base,
+                     uint32_t *out,
+                     size_t n)
+{
+    const int B = appendix::BLOCK_SIZE;
+    /* The low 32 bits of each 64-bit lane to the low 128 bits */
+    const __m256i narrow = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    __m256i vbase = _mm256_set1_epi64x(base);
+    __m256i lo, hi, values;
+    uint32_t tail[B];
+    int width;
+
+    /* The sums wrap around in 64 bits, so their low 32 bits are exact */
+    for (size_t i=0; i<n; i+=B) {
+        width = *in++;
+        unpack_block_avx2(in, width, vbase, lo, hi);
+        in += width;
+        values = _mm256_permute2x128_si256(
+            _mm256_permutevar8x32_epi32(lo, narrow),
+            _mm256_permutevar8x32_epi32(hi, narrow),
+            0x20);
+        if (n - i >= (size_t)B) {
+            _mm256_storeu_si256((__m256i*)(out + i), values);
+        } else {
+            _mm256_storeu_si256((__m256i*)tail, values);
+            memcpy(out + i, tail, (n - i) * sizeof(uint32_t));
+        }
+    }
+    return in;
+}
+
+__attribute__((target("avx2")))
+static void
+widen_values_avx2(const uint8_t *in, int width, uint64_t *out, size_t n)
+{
+    const __m128i half = widen_shuffle(width);
+    const __m256i shuffle = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(half), half, 1);
+    __m256i values;
+    size_t i;
+
+    /* Four values per two loads, while the loads end within the values */
+    for (i=0; i + 4 <= n && (n - i - 2) * width >= 16; i+=4) {
+        values = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(
+                _mm_loadu_si128((const __m128i*)(in + i * width))),
+            _mm_loadu_si128((const __m128i*)(in + (i + 2) * width)),
+            1);
+        _mm256_storeu_si256((__m256i*)(out + i),
+                            _mm256_shuffle_epi8(values, shuffle));
+    }
+    widen_values_sse42(in + i * width, width, out + i, n - i);
+}
+
+/* AVX-512BW kernels: a single compare per hash line */
+
+__attribute__((target("avx512bw")))
+static void
+probe_batch_avx512bw(char *const *buckets,
+                     const uint16_t *hashes,
+                     uint32_t *masks,
+                     int n)
+{
+    const __m512i hashmask = _mm512_set1_epi16((short)HASH_MASK);
+    __m512i line;
+
+    for (int i=0; i<n; ++i) {
+        line = _mm512_and_si512(_mm512_loadu_si512(buckets[i]), hashmask);
+        masks[i] = _mm512_cmpeq_epi16_mask(line,
+                                           _mm512_set1_epi16(hashes[i]));
+    }
+}
+
+__attribute__((target("avx512bw")))
+static void
+probe8_batch_avx512bw(char *const *buckets,
+                      const uint8_t *hashes,
+                      uint64_t *masks,
+                      int n)
+{
+    const __m512i hashmask = _mm512_set1_epi8((char)HASH_MASK8);
+    __m512i line;
+
+    for (int i=0; i<n; ++i) {
+        line = _mm512_and_si512(_mm512_loadu_si512(buckets[i]), hashmask);
+        masks[i] = _mm512_cmpeq_epi8_mask(line,
+                                          _mm512_set1_epi8(hashes[i]));
+    }
+}
+
+__attribute__((target("avx512bw")))
+static void
+verify_batch_avx512bw(char *const *lines,
+                      const uint16_t *fps,
+                      uint32_t *masks,
+                      int n)
+{
+    for (int i=0; i<n; ++i) {
+        /* Only lanes that are already set in masks[i] are compared */
+        masks[i] = _mm512_mask_cmpeq_epi16_mask(masks[i],
+                                                _mm512_loadu_si512(lines[i]),
+                                                _mm512_set1_epi16(fps[i]));
+    }
+}
+
+__attribute__((target("avx512bw")))
+static int
+key_num_avx512bw(const char *ptr)
+{
+    __m512i line = _mm512_loadu_si512(ptr);
+    return key_num_from_mask(_mm512_test_epi16_mask(line, line));
+}
+
+/* Best first */
+static const struct bucket_kernels all_kernels[] = {
+    /* A query batch is too small for wider tree descent and inference
+     * than AVX2 */
+    { "avx512bw", probe_batch_avx512bw, probe8_batch_avx512bw,
+                  verify_batch_avx512bw, key_num_avx512bw,
+                  descend_batch_avx2, predict_batch_avx2,
+                  unpack_deltas64_avx2, unpack_deltas32_avx2,
+                  widen_values_avx2, crc32_u64_sse42,
+                  hash_batch_sse42, popcount_batch_sse42 },
+    { "avx2",     probe_batch_avx2, probe8_batch_avx2,
+                  verify_batch_avx2, key_num_avx2,
+                  descend_batch_avx2, predict_batch_avx2,
+                  unpack_deltas64_avx2, unpack_deltas32_avx2,
+                  widen_values_avx2, crc32_u64_sse42,
+                  hash_batch_sse42, popcount_batch_sse42 },
+    /* SSE has no gather */
+    { "sse4.2",   probe_batch_sse42, probe8_batch_sse42,
+                  verify_batch_sse42, key_num_sse42,
+                  descend_batch_scalar, predict_batch_scalar,
+                  unpack_deltas64_scalar, unpack_deltas32_scalar,
+                  widen_values_sse42, crc32_u64_sse42,
+                  hash_batch_sse42, popcount_batch_sse42 },
+    { "scalar",   probe_batch_scalar, probe8_batch_scalar,
+                  verify_batch_scalar, key_num_scalar,
+                  descend_batch_scalar, predict_batch_scalar,
+                  unpack_deltas64_scalar, unpack_deltas32_scalar,
+                  widen_values_scalar, crc32_u64_scalar,
+                  hash_batch_scalar, popcount_batch_scalar },
+};
+
+static bool
+is_supported(const struct bucket_kernels *k)
+{
+    /* "__builtin_cpu_supports" requires literal strings */
+    __builtin_cpu_init();
+    if (strcmp(k->name, "scalar") && !__builtin_cpu_supports("popcnt")) {
+        return false;
+    } else if (!strcmp(k->name, "avx512bw")) {
+        return __builtin_cpu_supports("avx512bw");
+    } else if (!strcmp(k->name, "avx2")) {
+        return __builtin_cpu_supports("avx2");
+    } else if (!strcmp(k->name, "sse4.2")) {
+        return __builtin_cpu_supports("sse4.2");
+    }
+    return true;
+}
+
+static const struct bucket_kernels *
+find_best()
+{
+    for (const struct bucket_kernels &k : all_kernels) {
+        if (is_supported(&k)) {
+            return &k;
+        }
+    }
+    return &all_kernels[sizeof(all_kernels)/sizeof(*all_kernels)-1];
+}
+
+/* Kernels chosen by "bucket_kernels_select", if any */
+static std::atomic<const struct bucket_kernels*> selected(nullptr);
+
+const struct bucket_kernels *
+bucket_kernels_get()
+{
+    /* Initialized once, by the first thread to get here */
+    static const struct bucket_kernels *best = find_best();
+    const struct bucket_kernels *k;
+
+    k = selected.load(std::memory_order_acquire);
+    return k ? k : best;
+}
+
+int
+bucket_kernels_select(const char *name)
+{
+    for (const struct bucket_kernels &k : all_kernels) {
+        if (!strcmp(k.name, name) && is_supported(&k)) {
+            selected.store(&k, std::memory_order_release);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static std::string
+available_names()
+{
+    std::string names;
+    for (const struct bucket_kernels &k : all_kernels) {
+        if (!is_supported(&k)) {
+            continue;
+        }
+        names += names.empty() ? "" : " ";
+        names += k.name;
+    }
+    return names;
+}
+
+const char *
+bucket_kernels_available()
+{
+    static const std::string names = available_names();
+    return names.c_str();
+}
@@ -0,0 +1,111 @@
+#ifndef BUCKET_KERNELS_H
+#define BUCKET_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+struct pgm_segment;
+
+/* SIMD kernels of the lookup path: scanning the hash line of buckets,
+ * descending the Eytzinger search tree, learned model inference, and
+ * decoding appendix value lists. Several variants are compiled into the
+ * library, and one is selected at runtime according to the CPU, so a
+ * single build runs at the best available speed. */
+struct bucket_kernels {
+    const char *name;
+
+    /* For i in [0,n): set masks[i] to hold a bit per 16-bit lane in the hash
+     * line at buckets[i] that matches hashes[i] (the LSbit of each lane is
+     * ignored). */
+    void (*probe_batch)(char *const *buckets,
+                        const uint16_t *hashes,
+                        uint32_t *masks,
+                        int n);
+
+    /* As "probe_batch", with a bit per 8-bit lane of the hash line */
+    void (*probe8_batch)(char *const *buckets,
+                         const uint8_t *hashes,
+                         uint64_t *masks,
+                         int n);
+
+    /* For i in [0,n): clear the bits in masks[i] whose 16-bit lane in the
+     * verification line at lines[i] does not equal fps[i] */
+    void (*verify_batch)(char *const *lines,
+                         const uint16_t *fps,
+                         uint32_t *masks,
+                         int n);
+
+    /* Returns the number of keys in the bucket at "ptr" */
+    int (*key_num)(const char *ptr);
+
+    /* For i in [0,n): descend "depth" levels of the 1-based Eytzinger
+     * "tree" with keys[i], going right iff the node is not greater than the
+     * key, and set nodes[i] to the final node index */
+    void (*descend_batch)(const uint64_t *tree,
+                          int depth,
+                          const uint64_t *keys,
+                          uint64_t *nodes,
+                          int n);
+
+    /* For i in [0,n): set pos[i] to the position that segs[idx[i]]
+     * predicts for keys[i] (see "pgm_segment"). keys[i] must not be
+     * smaller than the key of its segment. All variants return the same
+     * results. */
+    void (*predict_batch)(const struct pgm_segment *segs,
+                          const uint32_t *idx,
+                          const uint64_t *keys,
+                          uint32_t *pos,
+                          int n);
+
+    /* Decode "n" deltas of the DELTA appendix encoding from the blocks at
+     * "in" (see "appendix"), and set out[i] to "base" plus the first i+1
+     * deltas. Returns the end of the last block. May read up to
+     * "appendix::PADDING" bytes past it. */
+    const uint8_t *(*unpack_deltas64)(const uint8_t *in,
+                                      uint64_t base,
+                                      uint64_t *out,
+                                      size_t n);
+    const uint8_t *(*unpack_deltas32)(const uint8_t *in,
+                                      uint32_t base,
+                                      uint32_t *out,
+                                      size_t n);
+
+    /* For i in [0,n): set out[i] to the little-endian value of "width"
+     * bytes (in [5,8]) at in + i * width. Reads no bytes past the last
+     * value. */
+    void (*widen_values)(const uint8_t *in,
+                         int width,
+                         uint64_t *out,
+                         size_t n);
+
+    /* Returns the CRC32C of "crc" (its low 32 bits) and the 8 bytes of
+     * "data", as "_mm_crc32_u64". All variants return the same results. */
+    uint64_t (*crc32_u64)(uint64_t crc, uint64_t data);
+
+    /* For i in [0,n): set out[i] to "hash_uint64_basis" of keys[i] -
+     * base_ranges[i] with basis bases[i]. All variants return the same
+     * results. */
+    void (*hash_batch)(const uint64_t *keys,
+                       const uint64_t *base_ranges,
+                       const uint32_t *bases,
+                       uint32_t *out,
+                       int n);
+
+    /* Returns the number of set bits in the "n" words at "words" */
+    int (*popcount_batch)(const uint64_t *words, int n);
+};
+
+/* Returns the kernels in use. The first call selects the best variant the
+ * CPU supports. Thread safe. */
+const struct bucket_kernels *bucket_kernels_get();
+
+/* Use the kernels named "name" (e.g., "avx2"). Returns 0 on success, or 1 if
+ * there are no such kernels or the CPU does not support them. Affects
+ * bucket readers that are created afterwards. */
+int bucket_kernels_select(const char *name);
+
+/* Returns the names of all kernels supported by the CPU, best first,
+ * separated by spaces */
+const char *bucket_kernels_available();
+
+#endif
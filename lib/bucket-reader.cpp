@@ -1,172 +1,426 @@
+#include <algorithm>
+#include <cstring>
 #include <sstream>
+#include <type_traits>
 #include "bucket-reader.h"
 #include "hash-methods.h"
 #include "simd.h"
 #include "perf.h"
 #include "record.h"
 
-const int ITERATION_BYTES = SIMD_WIDTH*sizeof(int);
+static constexpr int N = bucket_reader::N;
 
-bucket_reader::bucket_reader(bool use_64bit)
-:
-  use_64bit(use_64bit),
-  data(nullptr),
-  apdx(nullptr)
-{}
-
-bucket_reader::bucket_reader(char *data, char *apdx, bool use_64bit)
-:
-  use_64bit(use_64bit),
-  data(data),
-  apdx(apdx)
-{}
+/* Lines of a bucket that "prefetch_batch" brings in */
+static constexpr size_t PREFETCH_LINES = 4;
 
 static inline char *
-get_bucket_ptr(char *data, uint64_t bucket_index, bool use_64bit)
+get_bucket_ptr(char *data, uint64_t bucket_index, size_t bucket_size)
 {
-    return data + (bucket_index * bucket_builder::get_size_bytes(use_64bit));
+    return data + (bucket_index * bucket_size);
 }
 
-size_t
-bucket_reader::get_redundant_bytes(uint64_t idx) const
+/* Set masks[i] to the slots of the bucket at buckets[i] that match
+ * hashes[i]. A single line of 16-bit slots matches into 32-bit masks. */
+static inline void
+probe_slots(const struct bucket_kernels *kernels,
+            char *const *buckets,
+            const uint16_t *hashes,
+            uint32_t *masks,
+            int lines)
 {
-    const int total_bytes = bucket_builder::get_size_bytes(use_64bit);
-    uint64_t value64;
-    uint32_t value32;
-    size_t out;
-    int bit;
-    int stride;
+    kernels->probe_batch(buckets, hashes, masks, N);
+}
 
-    out = 0;
-    stride = use_64bit ? sizeof(uint64_t) : sizeof(uint32_t);
-    for (int i=CACHE_LINE_SIZE; i<total_bytes; i+=stride) {
-        if (use_64bit) {
-            value64 = *(uint64_t*)(get_bucket_ptr(data, idx, true)+i);
-            BSR64(bit, value64);
-            bit >>= 4;
-            if (!value64 || !bit) out += 6;
-            else if (bit == 1) out += 4;
-            else if (bit == 2) out += 2;
-        } else {
-            value32 = *(uint32_t*)(get_bucket_ptr(data, idx, false)+i);
-            BSR32(bit, value32);
-            bit >>= 4;
-            if (!value32 || !bit) out += 2;
+static inline void
+probe_slots(const struct bucket_kernels *kernels,
+            char *const *buckets,
+            const uint16_t *hashes,
+            uint64_t *masks,
+            int lines)
+{
+    std::array<uint32_t, N> part;
+    std::array<char*, N> ptrs;
+
+    for (int i=0; i<N; ++i) {
+        masks[i] = 0;
+    }
+    for (int l=0; l<lines; ++l) {
+        for (int i=0; i<N; ++i) {
+            ptrs[i] = buckets[i] + l * CACHE_LINE_SIZE;
+        }
+        kernels->probe_batch(ptrs.data(), hashes, part.data(), N);
+        for (int i=0; i<N; ++i) {
+            masks[i] |= (uint64_t)part[i] << (32 * l);
         }
     }
+}
 
-    return out;
+static inline void
+probe_slots(const struct bucket_kernels *kernels,
+            char *const *buckets,
+            const uint8_t *hashes,
+            uint64_t *masks,
+            int lines)
+{
+    /* 64 8-bit slots fit in a line */
+    kernels->probe8_batch(buckets, hashes, masks, N);
+}
+
+/* Clear the bits in masks[i] whose verification lane at lines[i] does not
+ * equal fps[i] */
+static inline void
+verify_slots(const struct bucket_kernels *kernels,
+             char *const *lines,
+             const uint16_t *fps,
+             uint32_t *masks,
+             int line_num)
+{
+    kernels->verify_batch(lines, fps, masks, N);
 }
 
-static int
-get_bucket_key_num(char *ptr)
+static inline void
+verify_slots(const struct bucket_kernels *kernels,
+             char *const *lines,
+             const uint16_t *fps,
+             uint64_t *masks,
+             int line_num)
 {
-    EPU_REG bucket;
-    EPU_REG zeros = SIMD_SET1_EPI16(0);
-    EPU_REG ones = SIMD_SET1_EPI16(0xFFFF);
-    uint32_t result, tmp;
-    result = 0;
-
-    for (int ofst=0; ofst<CACHE_LINE_SIZE; ofst+=ITERATION_BYTES) {
-        bucket = SIMD_LOADU_SI(ptr + ofst);
-        SIMD_CMPEQ_EPI32(bucket, bucket, zeros);
-        bucket = SIMD_ANDNOT_SI(bucket, ones);
-        SIMD_MOVE_MASK_EPI8(tmp, bucket);
-        if (tmp) {
-            BSR32(tmp, tmp);
-            result += (tmp>>1);
+    std::array<uint32_t, N> part;
+    std::array<uint64_t, N> out;
+    std::array<char*, N> ptrs;
+
+    for (int i=0; i<N; ++i) {
+        out[i] = 0;
+    }
+    for (int l=0; l<line_num; ++l) {
+        for (int i=0; i<N; ++i) {
+            ptrs[i] = lines[i] + l * CACHE_LINE_SIZE;
+            part[i] = (uint32_t)(masks[i] >> (32 * l));
+        }
+        kernels->verify_batch(ptrs.data(), fps, part.data(), N);
+        for (int i=0; i<N; ++i) {
+            out[i] |= (uint64_t)part[i] << (32 * l);
         }
     }
+    for (int i=0; i<N; ++i) {
+        masks[i] = out[i];
+    }
+}
 
-    return result;
+/* Returns the appendix list of a bucket value, and sets "num" to its
+ * number of values. 64-bit values hold the offset and the count; 32-bit
+ * values point to the count, which precedes the list. */
+static inline char *
+get_list(char *apdx, int shift, const uint64_t *val, int &num)
+{
+    num = (uint32_t)*val;
+    return apdx + ((*val >> 32) << shift);
 }
 
-std::vector<bucket_reader::element>
-bucket_reader::get_bucket_contents64(char *ptr) const
+static inline char *
+get_list(char *apdx, int shift, const uint32_t *val, int &num)
 {
-    std::vector<element> out;
-    uint16_t *hash_cursor;
-    uint64_t *val_cursor;
-    element elem;
-    int max;
+    char *list = apdx + ((uint64_t)*val << shift);
+    num = *(uint32_t*)list;
+    return list + sizeof(uint32_t);
+}
 
-    hash_cursor = (uint16_t*)ptr;
-    val_cursor = (uint64_t*)(ptr + CACHE_LINE_SIZE);
-    max = get_bucket_key_num(ptr);
+/* Returns the appendix offset of a bucket value, in units */
+static inline uint32_t
+get_unit(uint64_t val)
+{
+    return val >> 32;
+}
 
-    for (int i=0; i<max; ++i) {
-        /* LSbit of the hash indicates whether the value is apdx pointer */
-        elem.hash = hash_15bit_read(hash_cursor);
-        if (*hash_cursor & 1) {
-            elem.count = (uint32_t)*val_cursor;
-            elem.vals64 = (uint64_t*)(apdx + (*val_cursor >> 32));
+static inline uint32_t
+get_unit(uint32_t val)
+{
+    return val;
+}
+
+static inline void
+decode_values(int encoding,
+              const char *ptr,
+              size_t num,
+              uint64_t *out,
+              int width)
+{
+    appendix::decode64(encoding, ptr, num, out, width);
+}
+
+static inline void
+decode_values(int encoding,
+              const char *ptr,
+              size_t num,
+              uint32_t *out,
+              int width)
+{
+    appendix::decode32(encoding, ptr, num, out);
+}
+
+/* A reader of buckets of KEYS "slot_t" hash slots and "value_t" values */
+template <int KEYS, typename slot_t, typename value_t>
+class bucket_reader_impl : public bucket_reader {
+
+    /* A bit per slot */
+    using mask_t = typename std::conditional<
+        KEYS <= 32 && sizeof(slot_t) == sizeof(uint16_t),
+        uint32_t,
+        uint64_t>::type;
+
+    /* Lines of hash slots, and of verification lanes */
+    static constexpr int HASH_LINES =
+        (KEYS * sizeof(slot_t) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE;
+    static constexpr int VERIFY_LINES =
+        (KEYS * sizeof(uint16_t) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE;
+
+    struct element {
+        value_t *vals;
+        uint32_t count;
+        slot_t hash;
+        uint16_t fp;
+    };
+
+    bucket_geometry geometry;
+    char *data;
+    char *apdx;
+    int apdx_encoding;
+    int apdx_shift;
+
+    /* Keys that collided in their buckets, checked on bucket misses */
+    key_stash stash;
+
+    /* Bucket layout. With hash seeds, the last hash slot holds the seed
+     * index, and "slot_mask" excludes it from matches. */
+    size_t bucket_size;
+    size_t verify_offset;
+    size_t values_offset;
+    uint16_t verify_mask;
+    int capacity;
+    bool seeded;
+    mask_t slot_mask;
+    bool inlined;
+
+    /* Value lanes, which are narrower than "value_t" if "narrow" */
+    int value_bytes;
+    bool narrow;
+    uint64_t narrow_mask;
+
+    /* SIMD kernels, selected at construction */
+    const struct bucket_kernels *kernels;
+
+public:
+
+    bucket_reader_impl(const bucket_geometry &g,
+                       char *data,
+                       char *apdx,
+                       const key_stash &stash,
+                       int apdx_encoding,
+                       int apdx_shift)
+    : geometry(g),
+      data(data),
+      apdx(apdx),
+      apdx_encoding(apdx_encoding),
+      apdx_shift(apdx_shift),
+      stash(stash),
+      bucket_size(g.get_size_bytes()),
+      verify_offset(g.get_verify_offset()),
+      values_offset(g.get_values_offset()),
+      verify_mask(g.get_verify_mask()),
+      capacity(g.get_capacity()),
+      seeded(g.hash_seeds > 0),
+      slot_mask(seeded ? ~((mask_t)1 << (KEYS - 1)) : ~(mask_t)0),
+      inlined(g.inline_values > 0),
+      value_bytes(g.get_value_bytes()),
+      narrow(value_bytes < (int)sizeof(value_t)),
+      narrow_mask(narrow ? (1ULL << (8 * value_bytes)) - 1 : ~0ULL),
+      kernels(bucket_kernels_get())
+    {}
+
+    const bucket_geometry& get_geometry() const;
+    uint16_t get_key_hash(uint64_t bucket_idx,
+                          uint64_t base_range,
+                          uint64_t key) const;
+    std::string get_bucket_string(uint64_t idx, uint64_t base_range) const;
+    std::string get_key_values(uint64_t bucket_idx,
+                               uint64_t base_range,
+                               uint64_t key) const;
+    size_t get_redundant_bytes(uint64_t idx) const;
+    int lookup_batch(const std::array<uint64_t, N> &keys,
+                     const std::array<int, N> &search_results,
+                     std::array<uint64_t, N> &base_ranges,
+                     std::array<int, N> &num,
+                     std::array<char*, N> &ptr,
+                     int lanes = N) const;
+    void prefetch_batch(const std::array<int, N> &search_results) const;
+    int probe_batch(const std::array<uint64_t, N> &keys,
+                    const std::array<int, N> &search_results,
+                    std::array<uint64_t, N> &base_ranges,
+                    std::array<int, N> &num,
+                    std::array<char*, N> &ptr,
+                    int lanes = N) const;
+    std::vector<uint32_t> get_occurence_list(uint64_t bucket_idx,
+                                             uint64_t base_range) const;
+
+private:
+
+    std::vector<element> get_bucket_contents(char *ptr) const;
+
+    /* Returns the hash seed of the bucket at "ptr" */
+    int get_seed(const char *ptr) const
+    {
+        return seeded ? ((const slot_t*)ptr)[KEYS-1] : 0;
+    }
+
+    /* Returns the list of the bucket value at "val" of the bucket at
+     * "ptr", and sets "num" to its number of values. The list is either
+     * inlined in the bucket, or in the appendix. */
+    char *get_bucket_list(char *ptr, const char *val, int &num) const
+    {
+        uint64_t narrow_val;
+        uint32_t unit;
+
+        /* Narrow values hold the offset below the count. The bucket is
+         * padded for the full-width load. */
+        if (narrow) {
+            memcpy(&narrow_val, val, sizeof(narrow_val));
+            narrow_val &= narrow_mask;
+            unit = (uint32_t)narrow_val;
+            num = narrow_val >> 32;
         } else {
-            elem.count = 1;
-            elem.vals64 = val_cursor;
+            unit = get_unit(*(const value_t*)val);
         }
-        val_cursor++;
-        hash_cursor++;
-        out.push_back(elem);
+        if (inlined && unit >= appendix::INLINE_BASE) {
+            num = unit & 63;
+            return ptr + values_offset + value_bytes * ((unit >> 6) & 63);
+        }
+        if (narrow) {
+            return apdx + ((uint64_t)unit << apdx_shift);
+        }
+        return get_list(apdx, apdx_shift, (const value_t*)val, num);
+    }
+
+    /* Returns the bytes per value of a list at "ptr" with "num" values */
+    int get_width(const char *ptr, int num) const
+    {
+        return num > 1 && ptr >= apdx ? sizeof(value_t) : value_bytes;
     }
+};
+
+template <int KEYS, typename slot_t, typename value_t>
+const bucket_geometry&
+bucket_reader_impl<KEYS, slot_t, value_t>::get_geometry() const
+{
+    return geometry;
+}
+
+template <int KEYS, typename slot_t, typename value_t>
+uint16_t
+bucket_reader_impl<KEYS, slot_t, value_t>::get_key_hash(
+    uint64_t bkt_idx,
+    uint64_t base_range,
+    uint64_t key) const
+{
+    uint32_t basis, hash;
+
+    basis = hash_seed_basis(get_seed(get_bucket_ptr(data,
+                                                    bkt_idx,
+                                                    bucket_size)));
+    kernels->hash_batch(&key, &base_range, &basis, &hash, 1);
+    return hash_slot_of<slot_t>(hash);
+}
+
+template <int KEYS, typename slot_t, typename value_t>
+size_t
+bucket_reader_impl<KEYS, slot_t, value_t>::get_redundant_bytes(
+    uint64_t idx) const
+{
+    const char *values;
+    uint64_t value;
+    size_t used;
+    size_t out;
+    int bit;
+
+    /* Values are counted in 16-bit units, the smallest that is used */
+    out = 0;
+    values = get_bucket_ptr(data, idx, bucket_size) + values_offset;
+    for (int i=0; i<KEYS; ++i) {
+        value = 0;
+        memcpy(&value, values + i * value_bytes, value_bytes);
+        bit = 0;
+        if (value) {
+            BSR64(bit, value);
+        }
+        used = sizeof(uint16_t) * ((bit >> 4) + 1);
+        out += value_bytes - std::min(used, (size_t)value_bytes);
+    }
+
     return out;
 }
 
-std::vector<bucket_reader::element>
-bucket_reader::get_bucket_contents32(char *ptr) const
+template <int KEYS, typename slot_t, typename value_t>
+std::vector<typename bucket_reader_impl<KEYS, slot_t, value_t>::element>
+bucket_reader_impl<KEYS, slot_t, value_t>::get_bucket_contents(
+    char *ptr) const
 {
     std::vector<element> out;
-    uint16_t *hash_cursor;
-    uint32_t *val_cursor;
+    slot_t *hash_cursor;
+    uint16_t *fp_cursor;
+    char *val_cursor;
     element elem;
-    int max;
+    int count;
 
-    hash_cursor = (uint16_t*)ptr;
-    val_cursor = (uint32_t*)(ptr + CACHE_LINE_SIZE);
-    max = get_bucket_key_num(ptr);
+    hash_cursor = (slot_t*)ptr;
+    fp_cursor = (uint16_t*)(ptr + verify_offset);
+    val_cursor = ptr + values_offset;
 
-    for (int i=0; i<max; ++i) {
+    /* Keys are packed from the first slot onward */
+    for (int i=0; i<capacity && hash_cursor[i]; ++i) {
         /* LSbit of the hash indicates whether the value is apdx pointer */
-        elem.hash = hash_15bit_read(hash_cursor);
-        if (*hash_cursor & 1) {
-            elem.count = *(uint32_t*)(apdx + *val_cursor);
-            elem.vals32 = ((uint32_t*)(apdx + *val_cursor) + 1);
+        elem.hash = hash_slot_read(&hash_cursor[i]);
+        elem.fp = verify_mask ? fp_cursor[i] : 0;
+        if (hash_cursor[i] & 1) {
+            elem.vals = (value_t*)get_bucket_list(
+                ptr,
+                val_cursor + i * value_bytes,
+                count);
+            elem.count = count;
         } else {
             elem.count = 1;
-            elem.vals32 = val_cursor;
+            elem.vals = (value_t*)(val_cursor + i * value_bytes);
         }
-        val_cursor++;
-        hash_cursor++;
         out.push_back(elem);
     }
     return out;
 }
 
+template <int KEYS, typename slot_t, typename value_t>
 std::string
-bucket_reader::get_bucket_string(uint64_t bkt_idx, uint64_t base_range) const
+bucket_reader_impl<KEYS, slot_t, value_t>::get_bucket_string(
+    uint64_t bkt_idx,
+    uint64_t base_range) const
 {
     std::vector<element> bcv;
     std::stringstream ss;
-    char *ptr;
-
-    ptr = get_bucket_ptr(data, bkt_idx, use_64bit);
-    bcv = use_64bit ? get_bucket_contents64(ptr) : get_bucket_contents32(ptr);
 
-    for (int i=0; i<get_bucket_key_num(ptr); i++) {
-        ss << bcv[i].hash << " (" << bcv[i].count << ") ";
+    bcv = get_bucket_contents(get_bucket_ptr(data, bkt_idx, bucket_size));
+    for (size_t i=0; i<bcv.size(); i++) {
+        ss << (int)bcv[i].hash << " (" << bcv[i].count << ") ";
     }
     ss << std::endl;
     return ss.str();
 }
 
+template <int KEYS, typename slot_t, typename value_t>
 std::vector<uint32_t>
-bucket_reader::get_occurence_list(uint64_t bkt_idx, uint64_t base_range) const
+bucket_reader_impl<KEYS, slot_t, value_t>::get_occurence_list(
+    uint64_t bkt_idx,
+    uint64_t base_range) const
 {
     std::vector<uint32_t> out;
     std::vector<element> bcv;
-    char *ptr;
 
-    ptr = get_bucket_ptr(data, bkt_idx, use_64bit);
-    bcv = use_64bit ? get_bucket_contents64(ptr) : get_bucket_contents32(ptr);
+    bcv = get_bucket_contents(get_bucket_ptr(data, bkt_idx, bucket_size));
     for (auto & it : bcv) {
         out.push_back(it.count);
     }
@@ -174,34 +428,42 @@ bucket_reader::get_occurence_list(uint64_t bkt_idx, uint64_t base_range) const
     return out;
 }
 
+template <int KEYS, typename slot_t, typename value_t>
 std::string
-bucket_reader::get_key_values(uint64_t bkt_idx,
-                              uint64_t base_range,
-                              uint64_t key) const
+bucket_reader_impl<KEYS, slot_t, value_t>::get_key_values(
+    uint64_t bkt_idx,
+    uint64_t base_range,
+    uint64_t key) const
 {
+    std::vector<value_t> vals;
     std::vector<element> bcv;
     std::stringstream ss;
-    uint16_t hash;
+    uint32_t verify;
+    slot_t hash;
+    uint16_t fp;
     bool found;
-    char *ptr;
 
-    hash = hash_15bit_key(key, base_range);
-    ptr = get_bucket_ptr(data, bkt_idx, use_64bit);
-    bcv = use_64bit ? get_bucket_contents64(ptr) : get_bucket_contents32(ptr);
+    hash = get_key_hash(bkt_idx, base_range, key);
+    kernels->hash_batch(&key, &base_range, &HASH_VERIFY_BASIS, &verify, 1);
+    fp = hash_verify_of(verify, verify_mask);
+    bcv = get_bucket_contents(get_bucket_ptr(data, bkt_idx, bucket_size));
     found = false;
 
     for (auto & it : bcv) {
-        if (it.hash != hash) {
+        if (it.hash != hash || it.fp != fp) {
             continue;
         }
         ss << "Found (" << it.count << "): ";
         found = true;
-        for (uint32_t j=0; j<it.count; ++j) {
-            if (use_64bit) {
-                ss << it.vals64[j] << " ";
-            } else {
-                ss << it.vals32[j] << " ";
-            }
+        vals.resize(it.count);
+        decode_values(it.count > 1 && (char*)it.vals >= apdx ?
+                      apdx_encoding : appendix::RAW,
+                      (char*)it.vals,
+                      it.count,
+                      &vals[0],
+                      get_width((char*)it.vals, it.count));
+        for (value_t v : vals) {
+            ss << v << " ";
         }
     }
 
@@ -212,83 +474,189 @@ bucket_reader::get_key_values(uint64_t bkt_idx,
     return ss.str();
 }
 
+template <int KEYS, typename slot_t, typename value_t>
+int
+bucket_reader_impl<KEYS, slot_t, value_t>::lookup_batch(
+    const std::array<uint64_t, N> &keys,
+    const std::array<int, N> &search_results,
+    std::array<uint64_t, N> &base_ranges,
+    std::array<int, N> &num,
+    std::array<char*, N> &ptr,
+    int lanes) const
+{
+    prefetch_batch(search_results);
+    return probe_batch(keys, search_results, base_ranges, num, ptr, lanes);
+}
+
+template <int KEYS, typename slot_t, typename value_t>
 void
-bucket_reader::lookup_batch(const std::array<uint64_t, N> &keys,
-                            const std::array<int, N> &search_results,
-                            std::array<uint64_t, N> &base_ranges,
-                            std::array<int, N> &num,
-                            std::array<char*, N> &ptr) const
+bucket_reader_impl<KEYS, slot_t, value_t>::prefetch_batch(
+    const std::array<int, N> &search_results) const
 {
-    EPU_REG result, hash_reg, phashes, hashmask;
-    uint16_t* hash_ptr;
-    uint64_t fullmask;
-    uint32_t mask;
-    uint16_t hash;
     char *bucket;
 
-    /* Used to switch off the LSbit in hash */
-    hashmask = SIMD_SET1_EPI16(0xFFFE);
-
     /* Prefetch into L2 */
     for (int i=0; i<N; ++i) {
-        bucket = get_bucket_ptr(data, search_results[i], use_64bit);
+        bucket = get_bucket_ptr(data, search_results[i], bucket_size);
         __builtin_prefetch(bucket, 0, 1);
-        __builtin_prefetch(bucket+CACHE_LINE_SIZE, 0, 0);
-        __builtin_prefetch(bucket+2*CACHE_LINE_SIZE, 0, 0);
-        __builtin_prefetch(bucket+3*CACHE_LINE_SIZE, 0, 0);
+        for (size_t l=1; l<PREFETCH_LINES; ++l) {
+            if (l * CACHE_LINE_SIZE < bucket_size) {
+                __builtin_prefetch(bucket + l * CACHE_LINE_SIZE, 0, 0);
+            }
+        }
     }
+}
 
-    /* Fill "locs" for each input. One cache line access per key */
+template <int KEYS, typename slot_t, typename value_t>
+int
+bucket_reader_impl<KEYS, slot_t, value_t>::probe_batch(
+    const std::array<uint64_t, N> &keys,
+    const std::array<int, N> &search_results,
+    std::array<uint64_t, N> &base_ranges,
+    std::array<int, N> &num,
+    std::array<char*, N> &ptr,
+    int lanes) const
+{
+    std::array<uint32_t, N> bases;
+    std::array<uint32_t, N> full;
+    std::array<slot_t, N> hashes;
+    std::array<uint16_t, N> fps;
+    std::array<mask_t, N> masks;
+    std::array<uint64_t, N> dropped;
+    std::array<char*, N> buckets;
+    std::array<char*, N> lines;
+    slot_t *hash_ptr;
+    int rejected;
+    int lane;
+    long idx;
+
+    /* The seed is in the hash line, which is probed anyway */
     for (int i=0; i<N; ++i) {
-        fullmask = 0;
-
-        bucket = get_bucket_ptr(data, search_results[i], use_64bit);
-
-        hash = hash_15bit_key(keys[i], base_ranges[i]);
-        hash_reg = SIMD_SET1_EPI16(hash);
-
-        /* Populate "fullmask" with 0b11 per match */
-        for (int ofst=0; ofst<CACHE_LINE_SIZE; ofst+=ITERATION_BYTES) {
-            /* Load bucket hashes from index at "cursor" */
-            phashes = SIMD_LOADU_SI(bucket+ofst);
-            phashes = SIMD_AND_SI(phashes, hashmask);
-            /* "results" holds 0xffff for matched locations */
-            SIMD_CMPEQ_EPI16(result, hash_reg, phashes);
-            /* Mask holds 0b11 for matched locations */
-            SIMD_MOVE_MASK_EPI8(mask, result);
-            fullmask |= ((uint64_t)mask<<ofst);
+        buckets[i] = get_bucket_ptr(data, search_results[i], bucket_size);
+        bases[i] = hash_seed_basis(get_seed(buckets[i]));
+    }
+    kernels->hash_batch(keys.data(),
+                        base_ranges.data(),
+                        bases.data(),
+                        full.data(),
+                        N);
+    for (int i=0; i<N; ++i) {
+        hashes[i] = hash_slot_of<slot_t>(full[i]);
+    }
+
+    /* One cache line access per key, unless there are 64 16-bit slots */
+    probe_slots(kernels,
+                buckets.data(),
+                hashes.data(),
+                masks.data(),
+                HASH_LINES);
+    if (seeded) {
+        for (int i=0; i<N; ++i) {
+            masks[i] &= slot_mask;
         }
+    }
 
-        /* No match */
-        if (!fullmask) {
-            num[i] = 0;
+    /* Matched keys are checked against the verification lanes, which are
+     * adjacent to the hash lines */
+    rejected = 0;
+    if (verify_mask) {
+        for (int i=0; i<N; ++i) {
+            lines[i] = buckets[i] + verify_offset;
+            bases[i] = HASH_VERIFY_BASIS;
+        }
+        kernels->hash_batch(keys.data(),
+                            base_ranges.data(),
+                            bases.data(),
+                            full.data(),
+                            N);
+        for (int i=0; i<N; ++i) {
+            fps[i] = masks[i] ? hash_verify_of(full[i], verify_mask) : 0;
+            dropped[i] = masks[i];
+        }
+        verify_slots(kernels,
+                     lines.data(),
+                     fps.data(),
+                     masks.data(),
+                     VERIFY_LINES);
+        for (int i=0; i<lanes; ++i) {
+            dropped[i] &= ~(uint64_t)masks[i];
+        }
+        rejected = kernels->popcount_batch(dropped.data(), lanes);
+    }
+
+    for (int i=0; i<N; ++i) {
+        /* No match, unless the key was stashed */
+        if (!masks[i]) {
+            idx = stash.find(keys[i]);
+            if (idx < 0) {
+                num[i] = 0;
+            } else if (stash.get_count(idx) == 1) {
+                ptr[i] = stash.get_value(idx);
+                num[i] = 1;
+            } else {
+                ptr[i] = get_list(apdx,
+                                  apdx_shift,
+                                  (value_t*)stash.get_value(idx),
+                                  num[i]);
+                __builtin_prefetch(ptr[i], 0, 1);
+            }
             continue;
         }
 
         /* Get first match (lowest to greatest, little endian) */
-        BSF64(fullmask, fullmask);
-        /* sizeof(uint32_t) * fullmask == sizeof(uint64_t) * fullmask / 2 */
-        ptr[i] = bucket + CACHE_LINE_SIZE + sizeof(uint32_t) * fullmask;
-        /* "fullmask" has twice the value than what's found, which is okay
-         * since we want uint16_t */
-        hash_ptr = (uint16_t*)(bucket + fullmask);
+        lane = __builtin_ctzll(masks[i]);
+        ptr[i] = buckets[i] + values_offset + value_bytes * lane;
+        hash_ptr = (slot_t*)buckets[i] + lane;
         /* Handle singletons */
         if (!(*hash_ptr & 1)) {
             num[i] = 1;
         }
-        /* Handle 64bit appendix */
-        else if (use_64bit) {
-            fullmask = *(uint64_t*)ptr[i];
-            num[i] = (uint32_t)fullmask;
-            ptr[i] = apdx + (fullmask >> 32);
-            __builtin_prefetch(ptr[i], 0, 1);
-        }
-        /* Handle 32bit appendix */
+        /* Handle lists, which are in the bucket lines if inlined */
         else {
-            fullmask = *(uint32_t*)ptr[i];
-            num[i] = *(uint32_t*)(apdx + fullmask);
-            ptr[i] = (char*)((uint32_t*)(apdx + fullmask) + 1);
+            ptr[i] = get_bucket_list(buckets[i], ptr[i], num[i]);
             __builtin_prefetch(ptr[i], 0, 1);
         }
     }
+
+    return rejected;
+}
+
+/* Creates the reader specialization of the geometry it dispatches */
+struct bucket_reader_factory {
+    const bucket_geometry &g;
+    char *data;
+    char *apdx;
+    const key_stash &stash;
+    int apdx_encoding;
+    int apdx_shift;
+    bucket_reader *out;
+
+    template <int KEYS, typename slot_t, typename value_t>
+    int run()
+    {
+        out = new bucket_reader_impl<KEYS, slot_t, value_t>(g,
+                                                            data,
+                                                            apdx,
+                                                            stash,
+                                                            apdx_encoding,
+                                                            apdx_shift);
+        return 0;
+    }
+};
+
+bucket_reader *
+bucket_reader::create(const bucket_geometry &g,
+                      char *data,
+                      char *apdx,
+                      const key_stash &stash,
+                      int apdx_encoding,
+                      int apdx_shift)
+{
+    bucket_reader_factory factory = {
+        g, data, apdx, stash, apdx_encoding, apdx_shift, nullptr
+    };
+    if (bucket_geometry_dispatch(g, factory)) {
+        return nullptr;
+    }
+    return factory.out;
 }
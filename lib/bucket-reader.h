@@ -7,58 +7,81 @@
 
 #include "hash-methods.h"
 #include "bucket-builder.h"
+#include "bucket-kernels.h"
 #include "libnuevomatchup.h"
 
+/* Reads the buckets of a db. The lookup code is specialized for each bucket
+ * geometry at compile time; "create" selects the specialization once, when
+ * the db is loaded. */
 class bucket_reader {
-
-    struct element {
-        uint64_t *vals64;
-        uint32_t *vals32;
-        uint32_t count;
-        uint16_t hash;
-    };
-
-    bool use_64bit;
-    char *data;
-    char *apdx;
-
 public:
 
     /* Query batch size */
     static constexpr int N = LNMU_BATCH_SIZE;
 
-    bucket_reader(bool use_64bit = true);
-    bucket_reader(char *data, char *apdx, bool use_64bit);
+    virtual ~bucket_reader() {}
+
+    /* Returns a reader of the buckets at "data" with geometry "g", whose
+     * appendix is at "apdx", and whose colliding keys are in "stash" (which
+     * is copied). Returns nullptr if "g" is not supported. */
+    static bucket_reader *create(const bucket_geometry &g,
+                                 char *data,
+                                 char *apdx,
+                                 const key_stash &stash,
+                                 int apdx_encoding = appendix::RAW,
+                                 int apdx_shift = 0);
+
+    /* Returns the bucket geometry of this */
+    virtual const bucket_geometry& get_geometry() const = 0;
+
+    /* Returns the slot hash of "key" in bucket "bucket_idx" */
+    virtual uint16_t get_key_hash(uint64_t bucket_idx,
+                                  uint64_t base_range,
+                                  uint64_t key) const = 0;
 
     /* Returns a textual representation of a bucket in this  */
-    std::string get_bucket_string(uint64_t idx, uint64_t base_range) const;
+    virtual std::string get_bucket_string(uint64_t idx,
+                                          uint64_t base_range) const = 0;
 
     /* Returns a textual representation of the values of a specific key, if
      * found */
-    std::string get_key_values(uint64_t bucket_idx,
-                               uint64_t base_range,
-                               uint64_t key) const;
+    virtual std::string get_key_values(uint64_t bucket_idx,
+                                       uint64_t base_range,
+                                       uint64_t key) const = 0;
 
     /* Returns the number of bytes that hold no data and can be spared */
-    size_t get_redundant_bytes(uint64_t idx) const;
+    virtual size_t get_redundant_bytes(uint64_t idx) const = 0;
 
     /* Performs a batch lookup of N keys in N buckets. Populates "num" to the
      * number of values per key (0 if not found), and sets "ptr" to point
-     * to the value of each key. */
-    void lookup_batch(const std::array<uint64_t, N> &keys,
-                      const std::array<int, N> &search_results,
-                      std::array<uint64_t, N> &base_ranges,
-                      std::array<int, N> &num,
-                      std::array<char*, N> &ptr) const;
+     * to the value of each key. Returns the number of hash matches of the
+     * first "lanes" keys that were rejected by the verification bits. */
+    virtual int lookup_batch(const std::array<uint64_t, N> &keys,
+                             const std::array<int, N> &search_results,
+                             std::array<uint64_t, N> &base_ranges,
+                             std::array<int, N> &num,
+                             std::array<char*, N> &ptr,
+                             int lanes = N) const = 0;
+
+    /* The two stages of "lookup_batch". "prefetch_batch" issues the memory
+     * requests for the N buckets, and "probe_batch" performs the lookup
+     * itself. Pipelined callers should leave enough work between the two
+     * for the bucket lines to arrive. "probe_batch" counts rejections of
+     * the first "lanes" keys only, so the keys that pad a partial batch
+     * are not counted. */
+    virtual void prefetch_batch(
+        const std::array<int, N> &search_results) const = 0;
+    virtual int probe_batch(const std::array<uint64_t, N> &keys,
+                            const std::array<int, N> &search_results,
+                            std::array<uint64_t, N> &base_ranges,
+                            std::array<int, N> &num,
+                            std::array<char*, N> &ptr,
+                            int lanes = N) const = 0;
 
     /* Returns a vector of all key occurrences in this */
-    std::vector<uint32_t> get_occurence_list(uint64_t bucket_idx,
-                                             uint64_t base_range) const;
-
-private:
-
-    std::vector<element> get_bucket_contents64(char *ptr) const;
-    std::vector<element> get_bucket_contents32(char *ptr) const;
+    virtual std::vector<uint32_t> get_occurence_list(
+        uint64_t bucket_idx,
+        uint64_t base_range) const = 0;
 };
 
 
@@ -1,29 +1,62 @@
+#include <algorithm>
+#include <cassert>
 #include <cmath>
+#include <cstring>
+#include <memory>
 #include <set>
+#include <thread>
 #include "db-builder.h"
 #include "hash-methods.h"
+#include "record-sort.h"
 #include "simd.h"
+#include "util.h"
+
+/* Bytes that spill files are read back in at a time */
+static constexpr size_t SPILL_CHUNK = 1 << 20;
 
 db_builder::db_builder(bool use_64bit)
-:rangearr(nullptr),
- rqrmi(nullptr),
+:engine(nullptr),
  mstream(new mem_binstream),
  bstream(new binstream(*mstream)),
+ bucket_file(nullptr),
+ apdx_file(nullptr),
+ filter_file(nullptr),
  compression(1),
+ verify_bits(0),
+ filter_bits(0),
+ engine_type(search_engine::NUEVOMATCHUP),
+ error_bound(search_engine::DEFAULT_ERROR_BOUND),
+ appendix_shift(-1),
+ bucket_keys(32),
+ slot_bits(16),
+ hash_seeds(0),
+ inline_values(0),
+ value_bytes(0),
+ build_threads(1),
+ stash_size(0),
+ sort_memory(0),
+ build_memory(0),
+ spilled_filter_keys(0),
  use_64bit(use_64bit),
+ narrow_values(false),
+ sort_records(false),
  distinct_key_num(0),
  bucket_num(0),
  used_bytes(0),
  singleton_num(0),
- total_key_num(0)
+ total_key_num(0),
+ used_lanes(0),
+ max_list(0),
+ max_key(0),
+ max_value(0)
 { }
 
 db_builder::~db_builder()
 {
     delete mstream;
     delete bstream;
-    lnmu_range_array_destroy(rangearr);
-    lnmu_rqrmi64_destroy(rqrmi);
+    delete engine;
+    close_spill_files();
 }
 
 void
@@ -36,20 +69,64 @@ db_builder::clear()
     distinct_key_num = 0;
     singleton_num = 0;
     total_key_num = 0;
-    lnmu_range_array_destroy(rangearr);
-    lnmu_rqrmi64_destroy(rqrmi);
-    rqrmi = nullptr;
-    rangearr = nullptr;
+    used_lanes = 0;
+    max_list = 0;
+    max_key = 0;
+    max_value = 0;
+    value_bytes = 0;
+    filter = key_filter();
+    filter_keys.clear();
+    spilled_filter_keys = 0;
+    stash.init(use_64bit ? sizeof(uint64_t) : sizeof(uint32_t));
+    delete engine;
+    engine = nullptr;
+
+    close_spill_files();
+    if (build_memory) {
+        apdx_file = xtmpfile(spill_dir.c_str());
+    }
+    if (build_memory && filter_bits) {
+        filter_file = xtmpfile(spill_dir.c_str());
+    }
+    apdx.set_spill(apdx_file, build_memory / 8);
+    open_bucket_stream();
+}
+
+void
+db_builder::open_bucket_stream()
+{
     delete mstream;
     delete bstream;
     mstream = new mem_binstream;
-    bstream = new binstream(*mstream);
+    if (bucket_file) {
+        fclose(bucket_file);
+        bucket_file = nullptr;
+    }
+    if (build_memory) {
+        bucket_file = xtmpfile(spill_dir.c_str());
+        file_binstream base(bucket_file);
+        bstream = new binstream(base);
+    } else {
+        bstream = new binstream(*mstream);
+    }
+}
+
+void
+db_builder::close_spill_files()
+{
+    for (FILE **fp : { &bucket_file, &apdx_file, &filter_file }) {
+        if (*fp) {
+            fclose(*fp);
+            *fp = nullptr;
+        }
+    }
+    apdx.set_spill(nullptr, 0);
 }
 
 size_t
 db_builder::get_db_size() const
 {
-    return bucket_num * bucket_builder::get_size_bytes(use_64bit);
+    return bucket_num * get_bucket_geometry().get_size_bytes();
 }
 
 void
@@ -58,6 +135,135 @@ db_builder::set_compression(int value)
     compression = value;
 }
 
+void
+db_builder::set_verify_bits(int bits)
+{
+    verify_bits = bits < 0 ? 0 : bits > 16 ? 16 : bits;
+}
+
+int
+db_builder::set_bucket_geometry(int keys, int slot_bits)
+{
+    if (!bucket_geometry(use_64bit, verify_bits, keys, slot_bits).is_valid()) {
+        return 1;
+    }
+    bucket_keys = keys;
+    this->slot_bits = slot_bits;
+    return 0;
+}
+
+void
+db_builder::set_hash_seeds(int num)
+{
+    hash_seeds = num < 0 ? 0 :
+                 num > bucket_geometry::MAX_HASH_SEEDS ?
+                 bucket_geometry::MAX_HASH_SEEDS : num;
+}
+
+void
+db_builder::set_inline_values(int num)
+{
+    inline_values = num < 0 ? 0 :
+                    num > bucket_geometry::MAX_INLINE_VALUES ?
+                    bucket_geometry::MAX_INLINE_VALUES : num;
+}
+
+void
+db_builder::set_narrow_values(bool enable)
+{
+    narrow_values = enable;
+}
+
+void
+db_builder::set_stash_size(size_t keys)
+{
+    stash_size = keys;
+}
+
+void
+db_builder::set_build_threads(int num)
+{
+    build_threads = num < 1 ? 1 : num;
+}
+
+void
+db_builder::set_sort_records(bool enable)
+{
+    sort_records = enable;
+}
+
+void
+db_builder::set_sort_memory(size_t bytes)
+{
+    sort_memory = bytes;
+}
+
+void
+db_builder::set_build_memory(size_t bytes)
+{
+    build_memory = bytes;
+}
+
+void
+db_builder::set_spill_dir(const char *dir)
+{
+    spill_dir = dir ? dir : "";
+}
+
+size_t
+db_builder::get_stashed_key_num() const
+{
+    return stash.get_key_num();
+}
+
+bucket_geometry
+db_builder::get_bucket_geometry() const
+{
+    return bucket_geometry(use_64bit,
+                           verify_bits,
+                           bucket_keys,
+                           slot_bits,
+                           hash_seeds,
+                           inline_values,
+                           value_bytes);
+}
+
+void
+db_builder::set_filter_bits(int bits)
+{
+    filter_bits = bits < 0 ? 0 : bits;
+}
+
+void
+db_builder::set_search_engine(int type)
+{
+    engine_type = type;
+}
+
+int
+db_builder::get_search_engine() const
+{
+    return engine_type;
+}
+
+void
+db_builder::set_error_bound(int error)
+{
+    error_bound = error;
+}
+
+void
+db_builder::set_appendix_encoding(int encoding)
+{
+    apdx.set_encoding(encoding);
+}
+
+void
+db_builder::set_appendix_shift(int shift)
+{
+    appendix_shift = shift;
+}
+
 int
 db_builder::get_compression() const
 {
@@ -86,7 +292,7 @@ db_builder::get_ranges() const
 double
 db_builder::get_singleton_percent() const
 {
-    return (double)singleton_num / distinct_key_num;
+    return distinct_key_num ? (double)singleton_num / distinct_key_num : 0;
 }
 
 size_t
@@ -95,56 +301,175 @@ db_builder::get_disctinct_key_num() const
     return distinct_key_num;
 }
 
+template <class B>
 void
-db_builder::add_bucket(bucket_builder *bucket_b, char *blob)
+db_builder::add_bucket(B *bucket_b, char *blob)
 {
     bucket_b->populate_appendix(apdx);
+    bucket_b->populate_stash(stash);
     ranges.push_back(bucket_b->get_smallest_key());
     bucket_b->pack(blob);
     bucket_num++;
 }
 
+template <class B>
 void
-db_builder::update_stats(bucket_builder *bucket_b)
+db_builder::update_stats(B *bucket_b)
 {
     used_bytes += bucket_b->get_used_bytes();
+    used_lanes += bucket_b->get_used_lanes();
     singleton_num += bucket_b->get_singleton_num();
     distinct_key_num += bucket_b->get_distinct_key_num();
     total_key_num += bucket_b->get_total_key_num();
     prefix_bits.push_back(bucket_b->get_common_prefix_bits());
 }
 
+/* Iterates the records that "build" read, as "next_record_func_t" */
+struct loaded_records {
+    const std::vector<struct record> *records;
+    size_t next;
+};
+
+static int
+next_loaded_record(struct record *m, void *args)
+{
+    loaded_records *loaded = (loaded_records*)args;
+    if (loaded->next >= loaded->records->size()) {
+        return 1;
+    }
+    *m = (*loaded->records)[loaded->next++];
+    return 0;
+}
+
+/* Runs "build_buckets" with the bucket builder of the geometry it
+ * dispatches */
+struct bucket_build_dispatch {
+    db_builder *db;
+    std::vector<struct record> *records;
+    size_t record_num;
+    next_record_func_t get_next;
+    void *args;
+
+    template <int KEYS, typename slot_t, typename value_t>
+    int run()
+    {
+        using B = bucket_builder<KEYS, slot_t, value_t>;
+        if (db->build_threads > 1 && !records->empty()) {
+            db->build_buckets_parallel<B>(*records);
+        } else {
+            db->build_buckets<B>(record_num, get_next, args);
+        }
+        return 0;
+    }
+};
+
 void
 db_builder::build(size_t record_num,
                   next_record_func_t get_next,
                   void *args)
 {
-    bucket_builder bucket_b(use_64bit);
+    std::vector<struct record> records;
+    bucket_build_dispatch dispatch = { this,
+                                       &records,
+                                       record_num,
+                                       get_next,
+                                       args };
+    loaded_records loaded = { &records, 0 };
+    std::unique_ptr<external_sort> sorter;
+    struct record m;
+    bool external;
+    int last;
+
+    clear();
+
+    /* Threads split the records, and sorting needs all of them, unless
+     * they exceed the memory budget. They are then sorted on disk, or
+     * streamed as they are, to buckets that are built on this thread. */
+    external = build_memory &&
+               record_num > build_memory / 2 / sizeof(struct record);
+    if (external && sort_records) {
+        sorter.reset(new external_sort(build_memory / 2,
+                                       build_threads,
+                                       spill_dir.c_str()));
+        last = -1;
+        for (size_t i=0; i<record_num; ++i) {
+            publish_progress(DB_LOAD, i, record_num, last);
+            if (get_next(&m, args)) {
+                break;
+            }
+            sorter->add(m);
+        }
+        sorter->finish();
+        dispatch.get_next = external_sort::read_next;
+        dispatch.args = sorter.get();
+    } else if (!external && (build_threads > 1 || sort_records)) {
+        read_records(record_num, get_next, args, records);
+        if (sort_records &&
+            !record_is_sorted(records.data(), records.size())) {
+            record_sort(records.data(),
+                        records.size(),
+                        build_threads,
+                        sort_memory);
+        }
+        dispatch.record_num = records.size();
+        dispatch.get_next = next_loaded_record;
+        dispatch.args = &loaded;
+    }
+
+    /* Offsets are fixed as lists are added, so the unit must fit the
+     * largest appendix the records can make */
+    apdx.set_shift(appendix_shift >= 0 ? appendix_shift :
+                   appendix::get_min_shift(record_num,
+                                           use_64bit ? sizeof(uint64_t) :
+                                                       sizeof(uint32_t)));
+
+    /* The geometry is checked by "set_bucket_geometry" */
+    bucket_geometry_dispatch(get_bucket_geometry(), dispatch);
+    if (narrow_values && use_64bit) {
+        narrow_buckets();
+    }
+
+    if (filter_bits) {
+        build_filter();
+    }
+
+    callback.msg.status = DB_BUILD;
+    callback.msg.build_percent = 100;
+    callback.publish(*this);
+}
+
+template <class B>
+void
+db_builder::build_buckets(size_t record_num,
+                          next_record_func_t get_next,
+                          void *args)
+{
+    B bucket_b(get_bucket_geometry());
+    const size_t bucket_size = bucket_b.get_geometry().get_size_bytes();
     struct record m;
     struct record m_last;
-    int percent, last;
+    int last;
     int retval;
+    size_t run;
     char *blob;
 
-    clear();
     last = -1;
-    blob = new char[bucket_builder::get_size_bytes(use_64bit)];
+    run = 0;
+    blob = new char[bucket_size];
+    bucket_b.set_stash_room(stash_size);
 
     for (size_t i=0; i<record_num; ++i) {
-        percent = 100*i/record_num;
-        if (percent > last) {
-            last = percent;
-            callback.msg.status = DB_BUILD;
-            callback.msg.build_percent = percent;
-            callback.publish(*this);
-        }
+        publish_progress(DB_BUILD, i, record_num, last);
 
         /* Get next record */
-        m_last = m;
+        if (i) {
+            m_last = m;
+        }
         retval = get_next(&m, args);
         if (retval) {
             break;
         }
+        scan_record(m, i ? &m_last : nullptr, run);
 
         /* Current record is successful pushed into the current bucket */
         if (!bucket_b.push(&m)) {
@@ -152,28 +477,395 @@ db_builder::build(size_t record_num,
         }
 
         add_bucket(&bucket_b, blob);
-        bstream->write(blob, bucket_builder::get_size_bytes(use_64bit));
+        bstream->write(blob, bucket_size);
         update_stats(&bucket_b);
         bucket_b.clear();
+        bucket_b.set_stash_room(stash_size - stash.get_key_num());
         bucket_b.push(&m);
     }
 
-    /* If last bucket is not empty */
-    if (bucket_b.get_used_bytes()) {
+    /* If last bucket is not empty (its keys may all be stashed) */
+    if (bucket_b.get_distinct_key_num()) {
         add_bucket(&bucket_b, blob);
-        bstream->write(blob, bucket_builder::get_size_bytes(use_64bit));
+        bstream->write(blob, bucket_size);
         update_stats(&bucket_b);
     }
 
     delete[] blob;
-    callback.msg.build_percent = 100;
-    callback.publish(*this);
+}
+
+void
+db_builder::read_records(size_t record_num,
+                         next_record_func_t get_next,
+                         void *args,
+                         std::vector<struct record> &records)
+{
+    struct record m;
+    int last;
+
+    last = -1;
+    records.reserve(record_num);
+    for (size_t i=0; i<record_num; ++i) {
+        publish_progress(DB_LOAD, i, record_num, last);
+        if (get_next(&m, args)) {
+            break;
+        }
+        records.push_back(m);
+    }
+}
+
+void
+db_builder::publish_progress(int status,
+                             size_t i,
+                             size_t record_num,
+                             int &last)
+{
+    int percent = 100*i/record_num;
+    if (percent > last) {
+        last = percent;
+        callback.msg.status = status;
+        callback.msg.build_percent = percent;
+        callback.publish(*this);
+    }
+}
+
+void
+db_builder::scan_record(const struct record &m,
+                        const struct record *last,
+                        size_t &run)
+{
+    /* Keys are sorted */
+    run = last && m.key == last->key ? run + 1 : 1;
+    max_list = std::max(max_list, run);
+    max_value = std::max(max_value, m.value);
+    max_key = m.key;
+    if (!filter_bits || run > 1) {
+        return;
+    }
+
+    /* With a spill file, the keys are moved to it a chunk at a time */
+    filter_keys.push_back(m.key);
+    if (filter_file &&
+        filter_keys.size() == SPILL_CHUNK / sizeof(uint64_t)) {
+        xfwrite(&filter_keys[0], SPILL_CHUNK, filter_file);
+        spilled_filter_keys += filter_keys.size();
+        filter_keys.clear();
+    }
+}
+
+void
+db_builder::build_filter()
+{
+    size_t num;
+
+    /* The filter is sized by the number of distinct keys */
+    filter.init(spilled_filter_keys + filter_keys.size(), filter_bits);
+    for (uint64_t key : filter_keys) {
+        filter.add(key);
+    }
+    for (size_t i=0; i<spilled_filter_keys; i+=num) {
+        num = std::min(spilled_filter_keys - i,
+                       SPILL_CHUNK / sizeof(uint64_t));
+        filter_keys.resize(num);
+        xpread(filter_file,
+               &filter_keys[0],
+               num * sizeof(uint64_t),
+               i * sizeof(uint64_t));
+        for (uint64_t key : filter_keys) {
+            filter.add(key);
+        }
+    }
+    std::vector<uint64_t>().swap(filter_keys);
+}
+
+/* Pushes records from "begin" to the cleared "b" with stash "room", until
+ * a push fails or "end". Returns the index of the first record that is not
+ * in "b", which starts the next bucket. */
+template <class B>
+static size_t
+fill_bucket(B &b,
+            struct record *records,
+            size_t begin,
+            size_t end,
+            size_t room)
+{
+    size_t i;
+
+    b.clear();
+    b.set_stash_room(room);
+    for (i=begin; i<end; ++i) {
+        if (b.push(&records[i])) {
+            break;
+        }
+    }
+    return i;
+}
+
+template <class B>
+void
+db_builder::build_buckets_parallel(std::vector<struct record> &records)
+{
+    const bucket_geometry geometry = get_bucket_geometry();
+    std::vector<std::vector<bucket_span>> trials;
+    std::vector<std::thread> threads;
+    std::vector<bucket_span> spans;
+    std::vector<size_t> chunks;
+    bucket_span span;
+    char *region;
+    size_t begin, room, pos, n, j;
+    size_t run;
+    int c;
+
+    run = 0;
+    for (size_t i=0; i<records.size(); ++i) {
+        scan_record(records[i], i ? &records[i-1] : nullptr, run);
+    }
+
+    n = records.size();
+    if (!n) {
+        return;
+    }
+
+    /* Key-disjoint chunks of about the same number of records. Buckets
+     * start at keys. */
+    for (int t=0; t<=build_threads; ++t) {
+        pos = n * t / build_threads;
+        while (pos > 0 && pos < n && records[pos].key == records[pos-1].key) {
+            pos++;
+        }
+        if (chunks.empty() || pos > chunks.back()) {
+            chunks.push_back(pos);
+        }
+    }
+
+    /* The buckets of each chunk, as if one started at its first record.
+     * They may extend past the chunk, into the records of the next. */
+    trials.resize(chunks.size() - 1);
+    for (c=0; c<(int)trials.size(); ++c) {
+        threads.push_back(std::thread([&, c]() {
+            B trial_b(geometry);
+            bucket_span trial;
+            trial.room = stash_size;
+            for (trial.begin = chunks[c];
+                 trial.begin < chunks[c+1];
+                 trial.begin = trial.end) {
+                trial.end = fill_bucket(trial_b,
+                                        &records[0],
+                                        trial.begin,
+                                        n,
+                                        trial.room);
+                trial.stashed = trial_b.get_stashed_key_num();
+                trials[c].push_back(trial);
+                trial.room -= trial.stashed;
+            }
+        }));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    threads.clear();
+
+    /* The buckets of a serial build. Those that start where a trial
+     * bucket did are the trial buckets, unless the stash room differs:
+     * with less room, a bucket is the same iff it stashed no more keys
+     * than the room. Others are refilled, typically only a few until the
+     * buckets meet the trial buckets of the chunk again. */
+    B b(geometry);
+    room = stash_size;
+    begin = 0;
+    c = 0;
+    j = 0;
+    while (begin < n) {
+        while (c + 1 < (int)trials.size() && chunks[c+1] <= begin) {
+            c++;
+            j = 0;
+        }
+        while (j < trials[c].size() && trials[c][j].begin < begin) {
+            j++;
+        }
+        if (j < trials[c].size() &&
+            trials[c][j].begin == begin &&
+            trials[c][j].stashed <= room &&
+            trials[c][j].room >= room) {
+            span = trials[c][j];
+        } else {
+            span.begin = begin;
+            span.end = fill_bucket(b, &records[0], begin, n, room);
+            span.stashed = b.get_stashed_key_num();
+        }
+        span.room = room;
+        room -= span.stashed;
+        begin = span.end;
+        spans.push_back(span);
+    }
+    std::vector<std::vector<bucket_span>>().swap(trials);
+
+    /* Build consecutive buckets in each thread, and concatenate them. The
+     * number of buckets is known, so in memory they are packed in place. */
+    std::vector<bucket_part> parts(chunks.size() - 1);
+    region = bucket_file ? nullptr :
+             mstream->extend(spans.size() * geometry.get_size_bytes());
+    for (c=0; c<(int)parts.size(); ++c) {
+        size_t first = spans.size() * c / parts.size();
+        size_t next = spans.size() * (c + 1) / parts.size();
+        if (region) {
+            parts[c].buckets = region + first * geometry.get_size_bytes();
+        } else {
+            parts[c].spilled.resize((next - first) *
+                                    geometry.get_size_bytes());
+            parts[c].buckets = parts[c].spilled.data();
+        }
+        threads.push_back(std::thread([&, c, first, next]() {
+            build_part<B>(parts[c], &records[0], &spans[first], next - first);
+        }));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    for (auto &part : parts) {
+        merge_part(part);
+    }
+}
+
+template <class B>
+void
+db_builder::build_part(bucket_part &part,
+                       struct record *records,
+                       const bucket_span *spans,
+                       size_t span_num)
+{
+    B b(get_bucket_geometry());
+    const size_t bucket_size = b.get_geometry().get_size_bytes();
+    size_t end;
+
+    /* Lists are added as to the appendix of this, from offset 0 */
+    part.apdx.set_shift(apdx.get_shift());
+    part.apdx.set_encoding(apdx.get_encoding());
+    part.stash.init(use_64bit ? sizeof(uint64_t) : sizeof(uint32_t));
+    part.bucket_num = span_num;
+    part.used_bytes = 0;
+    part.used_lanes = 0;
+    part.singleton_num = 0;
+    part.distinct_key_num = 0;
+    part.total_key_num = 0;
+
+    for (size_t i=0; i<span_num; ++i) {
+        end = fill_bucket(b,
+                          records,
+                          spans[i].begin,
+                          spans[i].end,
+                          spans[i].room);
+        assert(end == spans[i].end);
+        (void)end;
+
+        /* As "add_bucket" and "update_stats" */
+        b.populate_appendix(part.apdx);
+        b.populate_stash(part.stash);
+        part.ranges.push_back(b.get_smallest_key());
+        b.pack(&part.buckets[i * bucket_size]);
+        part.used_bytes += b.get_used_bytes();
+        part.used_lanes += b.get_used_lanes();
+        part.singleton_num += b.get_singleton_num();
+        part.distinct_key_num += b.get_distinct_key_num();
+        part.total_key_num += b.get_total_key_num();
+        part.prefix_bits.push_back(b.get_common_prefix_bits());
+    }
+}
+
+void
+db_builder::merge_part(bucket_part &part)
+{
+    const bucket_geometry geometry = get_bucket_geometry();
+    const size_t bucket_size = geometry.get_size_bytes();
+    uint64_t base;
+
+    /* Lists of the part were addressed from the start of its appendix */
+    base = apdx.append(part.apdx);
+    for (size_t i=0; base && i<part.bucket_num; ++i) {
+        geometry.rebase_bucket(&part.buckets[i * bucket_size], base);
+    }
+    if (!part.spilled.empty()) {
+        bstream->write(part.spilled.data(), part.spilled.size());
+    }
+    for (size_t i=0; i<part.stash.get_key_num(); ++i) {
+        if (part.stash.get_count(i) > 1) {
+            geometry.rebase_value(part.stash.get_value(i), base);
+        }
+        stash.add(part.stash.get_key(i),
+                  part.stash.get_count(i),
+                  part.stash.get_value(i));
+    }
+
+    ranges.insert(ranges.end(), part.ranges.begin(), part.ranges.end());
+    prefix_bits.insert(prefix_bits.end(),
+                       part.prefix_bits.begin(),
+                       part.prefix_bits.end());
+    bucket_num += part.bucket_num;
+    used_bytes += part.used_bytes;
+    used_lanes += part.used_lanes;
+    singleton_num += part.singleton_num;
+    distinct_key_num += part.distinct_key_num;
+    total_key_num += part.total_key_num;
+
+    /* Free the buckets of the part as it is merged */
+    std::vector<char>().swap(part.spilled);
+}
+
+void
+db_builder::narrow_buckets()
+{
+    bucket_geometry narrow = get_bucket_geometry();
+    const size_t full_size = narrow.get_size_bytes();
+    size_t narrow_size;
+    FILE *in_file;
+    char *blob;
+    char *out;
+    char *in;
+
+    for (int bytes=5; bytes<=6 && !narrow.value_bytes; ++bytes) {
+        if (!(max_value >> (8 * bytes)) && !(max_list >> (8 * bytes - 32))) {
+            narrow.value_bytes = bytes;
+        }
+    }
+    if (!narrow.value_bytes) {
+        return;
+    }
+    narrow_size = narrow.get_size_bytes();
+
+    in = new char[full_size];
+    if (bucket_file) {
+        /* Spilled buckets are narrowed to a new spill file */
+        in_file = bucket_file;
+        bucket_file = nullptr;
+        open_bucket_stream();
+        out = new char[narrow_size];
+        for (size_t i=0; i<bucket_num; ++i) {
+            xpread(in_file, in, full_size, i * full_size);
+            narrow.narrow_bucket(in, out);
+            bstream->write(out, narrow_size);
+        }
+        delete[] out;
+        fclose(in_file);
+    } else {
+        /* In place, so memory never holds both. A narrow bucket ends
+         * before the next full bucket starts. */
+        blob = mstream->get_data();
+        for (size_t i=0; i<bucket_num; ++i) {
+            memcpy(in, blob + i * full_size, full_size);
+            narrow.narrow_bucket(in, blob + i * narrow_size);
+        }
+        mstream->truncate(bucket_num * narrow_size);
+    }
+    delete[] in;
+
+    used_bytes -= used_lanes * (sizeof(uint64_t) - narrow.value_bytes);
+    value_bytes = narrow.value_bytes;
 }
 
 double
 db_builder::get_utilization() const
 {
-    return (double)used_bytes / get_db_size();
+    return bucket_num ? (double)used_bytes / get_db_size() : 0;
 }
 
 const appendix&
@@ -188,86 +880,66 @@ db_builder::set_model_size(std::vector<int> size)
     rqrmi_size = size;
 }
 
-static std::vector<int>
-model_size(size_t range_num)
-{
-    if (range_num < 1000) {
-        return {1};
-    } else if (range_num < 10000) {
-        return {1, 8};
-    } else if (range_num < 100000) {
-        return {1,8,55};
-    } else {
-        return {1,8,119};
-    }
-}
-
 int
 db_builder::build_model()
 {
-    struct lnmu_trainer_configuration pol;
-    std::vector<int> rqsize;
-    const uint64_t *values;
+    search_engine::options opts;
     int retval;
-    size_t size;
 
     /* Clean previous version */
-    lnmu_range_array_destroy(rangearr);
-    lnmu_rqrmi64_destroy(rqrmi);
-
-    /* Select RQRMI size according to the number of ranges */
-    rangearr = lnmu_range_array_init(&ranges[0],
-                                     ranges.size(),
-                                     compression,
-                                     false);
-    size = lnmu_range_array_get_size(rangearr);
-    values = lnmu_range_array_get_values(rangearr);
-
-    rqsize = rqrmi_size;
-    if (!rqsize.size()) {
-        rqsize = model_size(size);
+    delete engine;
+    engine = search_engine::create(engine_type);
+    if (!engine) {
+        return 1;
     }
 
-    pol.error_threshold = 64;
-    pol.allow_failure = false;
-    pol.use_hybrid = true;
-    pol.use_batching = true;
-    pol.samples = 16e3;
-    pol.max_sessions = 20;
+    opts.compression = compression;
+    opts.model_size = rqrmi_size;
+    opts.error_bound = error_bound;
 
     callback.msg.status = START_TRAINING;
     callback.publish(*this);
 
-    rqrmi = lnmu_rqrmi64_init(&pol, &rqsize[0], rqsize.size());
-    retval =  lnmu_rqrmi64_train(rqrmi, values, size);
+    retval = engine->build(&ranges[0], ranges.size(), opts);
 
     callback.msg.status = DONE_TRAINING;
-    callback.msg.model_errors = lnmu_rqrmi64_get_errors(rqrmi,
-                                &callback.msg.model_error_num);
+    callback.msg.model_errors =
+        engine->get_errors(&callback.msg.model_error_num);
     callback.publish(*this);
     return retval;
 }
 
-binstream&
-db_builder::write(binstream& s)
+void
+db_builder::write_info(binstream &s) const
 {
-    size_t apdx_size;
-    size_t size;
     double prefix_bits_mean;
     double prefix_bits_stddev;
     double value;
-    char *blob;
+    size_t apdx_size;
+    size_t size;
 
     /* Calculate total size */
     apdx_size = apdx.get_size();
     size = get_db_size() + apdx_size;
 
-    s.write_header("db", 1);
+    s.write_header("db", 11);
     s << size
       << use_64bit
       << apdx_size
       << bucket_num
-      << compression;
+      << compression
+      << verify_bits
+      << filter_bits
+      << max_key
+      << engine_type
+      << apdx.get_encoding()
+      << apdx.get_shift()
+      << bucket_keys
+      << slot_bits
+      << hash_seeds
+      << stash.get_key_num()
+      << inline_values
+      << value_bytes;
 
     /* Write statistics */
     s << total_key_num
@@ -290,23 +962,81 @@ db_builder::write(binstream& s)
 
     s << prefix_bits_mean
       << prefix_bits_stddev;
+}
 
-    /* Pack buckets */
-    s.write("blb", 4);
-    blob = (char*)mstream->detach_data(&size);
-    s.write(blob, size);
-    free(blob);
+void
+db_builder::write_search(binstream &s) const
+{
+    /* Pack ranges, search engine */
+    s << ranges;
+    engine->write(s);
 
-    /* Pack appendix */
-    s.write(apdx.get_data(), apdx_size);
+    /* Pack key filter */
+    if (filter_bits) {
+        filter.write(s);
+    }
 
-    /* Pack ranges, RQRMI model */
-    s << ranges;
+    /* Pack key stash */
+    if (stash.get_key_num()) {
+        stash.write(s);
+    }
+}
+
+void
+db_builder::move_data(char *out)
+{
+    const size_t size = get_db_size();
+    size_t bytes;
+    char *blob;
+
+    /* In memory, the buckets are moved from the last chunk, and each
+     * chunk is released once moved */
+    if (bucket_file) {
+        for (size_t offset=0; offset<size; offset+=bytes) {
+            bytes = std::min(size - offset, SPILL_CHUNK);
+            xpread(bucket_file, out + offset, bytes, offset);
+        }
+    } else {
+        blob = mstream->get_data();
+        for (size_t end=size; end>0; end-=bytes) {
+            bytes = std::min(end, SPILL_CHUNK);
+            memcpy(out + end - bytes, blob + end - bytes, bytes);
+            mstream->truncate(end - bytes);
+            blob = mstream->get_data();
+        }
+    }
+    open_bucket_stream();
+    apdx.move_data(out + size);
+}
 
-    lnmu_rqrmi64_store(rqrmi, (void**)&blob, &size);
-    s << size;
-    s.write(blob, size);
-    free(blob);
+binstream&
+db_builder::write(binstream& s)
+{
+    size_t bytes;
+    size_t size;
+    char *blob;
+
+    write_info(s);
+
+    /* Pack buckets. Spilled buckets are copied a chunk at a time. */
+    s.write("blb", 4);
+    if (bucket_file) {
+        std::vector<char> chunk(SPILL_CHUNK);
+        size = get_db_size();
+        for (size_t offset=0; offset<size; offset+=bytes) {
+            bytes = std::min(size - offset, SPILL_CHUNK);
+            xpread(bucket_file, &chunk[0], bytes, offset);
+            s.write(&chunk[0], bytes);
+        }
+    } else {
+        blob = (char*)mstream->detach_data(&size);
+        s.write(blob, size);
+        free(blob);
+    }
+
+    /* Pack appendix */
+    apdx.write(s);
 
+    write_search(s);
     return s;
 }
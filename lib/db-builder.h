@@ -4,17 +4,22 @@
 #include <vector>
 #include <list>
 #include <cstdio>
+#include <string>
 #include "appendix.h"
 #include "binstream.h"
 #include "callback-message.h"
-#include "libnuevomatchup.h"
 #include "record.h"
 #include "bucket-builder.h"
+#include "key-filter.h"
+#include "key-stash.h"
+#include "search-engine.h"
 
 class db_builder {
 public:
 
-    enum { DB_BUILD, START_TRAINING, DONE_TRAINING };
+    /* DB_LOAD is the progress of reading (and sorting) the records before
+     * any bucket is built, DB_BUILD that of building the buckets */
+    enum { DB_BUILD, START_TRAINING, DONE_TRAINING, DB_LOAD };
 
     /* Sent to callback method with statistics */
     struct status {
@@ -27,22 +32,49 @@ public:
     using callback_type = callback_message<db_builder, struct status>;
 
 private:
-    struct lnmu_rangearr *rangearr;
-    struct lnmu_rqrmi64 *rqrmi;
+    search_engine *engine;
     std::vector<uint64_t> ranges;
     std::vector<int> rqrmi_size;
     std::vector<uint8_t> prefix_bits;
     mem_binstream *mstream;
     binstream *bstream;
+    FILE *bucket_file;
+    FILE *apdx_file;
+    FILE *filter_file;
+    std::string spill_dir;
     callback_type callback;
     int compression;
+    int verify_bits;
+    int filter_bits;
+    int engine_type;
+    int error_bound;
+    int appendix_shift;
+    int bucket_keys;
+    int slot_bits;
+    int hash_seeds;
+    int inline_values;
+    int value_bytes;
+    int build_threads;
+    size_t stash_size;
+    size_t sort_memory;
+    size_t build_memory;
+    size_t spilled_filter_keys;
     bool use_64bit;
+    bool narrow_values;
+    bool sort_records;
     size_t distinct_key_num;
     size_t bucket_num;
     size_t used_bytes;
     size_t singleton_num;
     size_t total_key_num;
+    size_t used_lanes;
+    size_t max_list;
+    uint64_t max_key;
+    uint64_t max_value;
     appendix apdx;
+    key_filter filter;
+    key_stash stash;
+    std::vector<uint64_t> filter_keys;
 
 public:
 
@@ -55,22 +87,114 @@ public:
     /* Returns the DB size in bytes */
     size_t get_db_size() const;
 
-    /* Build database */
+    /* Build database. Records must be sorted by key, unless sorted by
+     * "set_sort_records". */
     void build(size_t record_num,
                next_record_func_t get_next,
                void *args);
 
     /* Returns a number in [0,1] on how the db is utilized.
-     * 1 stands for 100% utilization. */
+     * 1 stands for 100% utilization. 0 before any bucket is built. */
     double get_utilization() const;
 
     /* Set range compression value */
     void set_compression(int val);
 
+    /* Store "bits" (in [0,16]) additional key bits per slot, used by the
+     * reader to reject hash false positives. 0 disables verification. */
+    void set_verify_bits(int bits);
+
+    /* Store up to "keys" keys per bucket (16, 32 or 64), with hash slots
+     * of "slot_bits" bits (8 or 16), see "bucket_geometry". Call before
+     * "build". Returns 0 on success, or 1 if the geometry is not
+     * supported. */
+    int set_bucket_geometry(int keys, int slot_bits);
+
+    /* Try up to "num" hash seeds per bucket (at most 256) before closing
+     * it on a hash collision. With "num" > 0, a hash slot of each bucket
+     * holds the seed. 0 (default) disables seeds. */
+    void set_hash_seeds(int num);
+
+    /* Store value lists of up to "num" values (at most 63) in the spare
+     * value lanes of their bucket when they fit, so their lookup needs no
+     * appendix access. 0 (default) stores all lists in the appendix. */
+    void set_inline_values(int num);
+
+    /* Store 64-bit values in the fewest bytes (5, 6 or 8) that hold the
+     * largest value and the appendix offset and count of the longest
+     * list. Values in the buckets are then read by "db_reader::get_values"
+     * rather than directly. Disabled by default. */
+    void set_narrow_values(bool enable);
+
+    /* Divert up to "keys" keys that collide in their buckets to a global
+     * stash, searched by the reader only when the bucket misses, instead
+     * of closing the buckets early. 0 (default) disables the stash. */
+    void set_stash_size(size_t keys);
+
+    /* Build the buckets with up to "num" threads. The records are then
+     * read into memory first. The db is the same with any number of
+     * threads. 1 (default) builds on the calling thread. */
+    void set_build_threads(int num);
+
+    /* Accept records in any order: read them into memory and sort them by
+     * key and value with the build threads (see "record_sort"), unless
+     * they are sorted. The db is then the same for any order of the same
+     * records. Disabled by default. */
+    void set_sort_records(bool enable);
+
+    /* Sort the records with at most "bytes" of memory besides the records.
+     * 0 (default) for no limit, which sorts fastest. */
+    void set_sort_memory(size_t bytes);
+
+    /* Build within about "bytes" of memory, besides a range per bucket.
+     * The buckets, the appendix and the keys of the filter are then
+     * written to temporary files (see "set_spill_dir") as they are built,
+     * and are copied to the output by "write", so the db may exceed
+     * memory. Records that do not fit in half of "bytes" are streamed to
+     * the buckets rather than read into memory, so the buckets are built
+     * on the calling thread; sorting them (see "set_sort_records") spills
+     * sorted runs to disk and merges them (see "external_sort"). The db is
+     * the same with any budget. 0 (default) builds in memory. */
+    void set_build_memory(size_t bytes);
+
+    /* Write the temporary files of "set_build_memory" to "dir". Empty
+     * (default) for TMPDIR, or the system default. */
+    void set_spill_dir(const char *dir);
+
+    /* Returns the number of distinct keys in the stash of this */
+    size_t get_stashed_key_num() const;
+
+    /* Returns the bucket geometry of this */
+    bucket_geometry get_bucket_geometry() const;
+
+    /* Build a key filter with "bits" bits per distinct key, used by the
+     * reader to answer most absent keys before model inference. 0 disables
+     * the filter. */
+    void set_filter_bits(int bits);
+
+    /* Search the ranges with the engine of type "type" (see
+     * "search_engine"). Takes effect on "build_model". */
+    void set_search_engine(int type);
+
+    /* Returns the search engine type of this */
+    int get_search_engine() const;
+
+    /* Set the maximal position error of learned search engines (PGM) */
+    void set_error_bound(int error);
+
+    /* Encode the value lists of the appendix in "encoding" (see
+     * "appendix"). Call before "build". */
+    void set_appendix_encoding(int encoding);
+
+    /* Address the appendix in units of 2^shift bytes (see "appendix").
+     * -1 (default) selects the smallest shift that fits the records of
+     * "build", which is 0 unless the appendix may exceed 4GB. */
+    void set_appendix_shift(int shift);
+
     /* Set callback method for this */
     callback_type& on_update();
 
-    /* Custom model size */
+    /* Custom model size (NuevoMatchUp engine) */
     void set_model_size(std::vector<int> size);
 
     /* Returns the ranges of the DB */
@@ -79,7 +203,8 @@ public:
     /* Returns the appendix of this */
     const appendix& get_appendix() const;
 
-    /* Returns the singleton percent of this (in [0,1]) */
+    /* Returns the singleton percent of this (in [0,1]), 0 before any
+     * bucket is built */
     double get_singleton_percent() const;
 
     /* Returns the number of distinct keys in this */
@@ -97,10 +222,105 @@ public:
     /* Write this to file */
     binstream& write(binstream&);
 
+    /* The sections of "write": the header and statistics, the buckets
+     * and appendix ("move_data"), and the ranges, search engine, key
+     * filter and stash */
+    void write_info(binstream&) const;
+    void write_search(binstream&) const;
+
+    /* Move the buckets and then the appendix to "out", which has room for
+     * them, releasing their memory as they are moved. This is then left
+     * without them, so "write_info" must precede this. */
+    void move_data(char *out);
+
 private:
 
-    void add_bucket(bucket_builder *bucket_b, char *blob);
-    void update_stats(bucket_builder *bucket_b);
+    friend struct bucket_build_dispatch;
+
+    /* Consecutive buckets built by a thread of "build_buckets_parallel",
+     * as "build_buckets" would add them. The buckets are packed in place
+     * in the bucket stream, or in "spilled" if it is a spill file. */
+    struct bucket_part {
+        appendix apdx;
+        key_stash stash;
+        char *buckets;
+        std::vector<char> spilled;
+        std::vector<uint64_t> ranges;
+        std::vector<uint8_t> prefix_bits;
+        size_t bucket_num;
+        size_t used_bytes;
+        size_t used_lanes;
+        size_t singleton_num;
+        size_t distinct_key_num;
+        size_t total_key_num;
+    };
+
+    /* The records of a bucket, and the stash room it was filled with */
+    struct bucket_span {
+        size_t begin;
+        size_t end;
+        size_t room;
+        size_t stashed;
+    };
+
+    /* The bucket part of "build", with "B" buckets (a "bucket_builder") */
+    template <class B>
+    void build_buckets(size_t record_num,
+                       next_record_func_t get_next,
+                       void *args);
+
+    /* As "build_buckets" with "build_threads" threads, from "records" */
+    template <class B>
+    void build_buckets_parallel(std::vector<struct record> &records);
+
+    /* Build the buckets of "spans" into "part" */
+    template <class B>
+    void build_part(bucket_part &part,
+                    struct record *records,
+                    const bucket_span *spans,
+                    size_t span_num);
+
+    /* Add the buckets of "part" after the buckets of this */
+    void merge_part(bucket_part &part);
+
+    /* Read "record_num" records from "get_next" into "records" */
+    void read_records(size_t record_num,
+                      next_record_func_t get_next,
+                      void *args,
+                      std::vector<struct record> &records);
+
+    /* Account the record "m", which follows "last" (nullptr for the first
+     * record), in the statistics of this. "run" counts the records of the
+     * current key. */
+    void scan_record(const struct record &m,
+                     const struct record *last,
+                     size_t &run);
+
+    /* Publish the progress of reading the "i"th of "record_num" records
+     * with "status" (DB_LOAD or DB_BUILD), if its percent is greater than
+     * "last" */
+    void publish_progress(int status,
+                          size_t i,
+                          size_t record_num,
+                          int &last);
+
+    template <class B>
+    void add_bucket(B *bucket_b, char *blob);
+
+    template <class B>
+    void update_stats(B *bucket_b);
+
+    /* Repack the buckets in the narrowest value width, if any is enough */
+    void narrow_buckets();
+
+    /* Start a new bucket stream, in memory or in a new spill file */
+    void open_bucket_stream();
+
+    /* Close the spill files of this */
+    void close_spill_files();
+
+    /* Build the filter from the keys of "scan_record" */
+    void build_filter();
 };
 
 
@@ -1,7 +1,14 @@
 #include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstddef>
 #include <cstring>
 #include <sstream>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "bucket-builder.h"
 #include "db-reader.h"
 #include "util.h"
@@ -9,16 +16,199 @@
 
 static constexpr int N = db_reader::N;
 
+/* Sections of the mapped format, in file order */
+enum { SECTION_INFO, SECTION_BUCKETS, SECTION_APPENDIX, SECTION_SEARCH,
+       SECTION_NUM };
+
+/* Sections of the mapped format start at multiples of this. The buckets
+ * and appendix start at a huge page, so they can be mapped by huge pages. */
+static constexpr size_t MAPPED_ALIGNMENT = 4096;
+
+/* The next db generation. Zero is of no db. */
+static std::atomic<uint64_t> next_generation(1);
+
+static uint64_t
+new_generation()
+{
+    return next_generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+db_reader::context::context()
+: cache_mask(0),
+  cache_generation(0)
+{
+    clear();
+}
+
+void
+db_reader::context::clear()
+{
+    stats_inference = 0;
+    stats_search = 0;
+    stats_validate = 0;
+    stats_lookup = 0;
+    stats_counter = 0;
+    stats_rejected = 0;
+    stats_filtered = 0;
+    stats_keys = 0;
+    stats_cache_hits = 0;
+    stats_cache_misses = 0;
+}
+
+void
+db_reader::context::merge(const context &other)
+{
+    stats_inference += other.stats_inference;
+    stats_search += other.stats_search;
+    stats_validate += other.stats_validate;
+    stats_lookup += other.stats_lookup;
+    stats_counter += other.stats_counter;
+    stats_rejected += other.stats_rejected;
+    stats_filtered += other.stats_filtered;
+    stats_keys += other.stats_keys;
+    stats_cache_hits += other.stats_cache_hits;
+    stats_cache_misses += other.stats_cache_misses;
+}
+
+void
+db_reader::context::set_cache_size(size_t entries)
+{
+    int bits = 0;
+    while (entries >> (bits+1)) {
+        bits++;
+    }
+    cache.assign(entries ? (1ULL << bits) : 0, cache_entry{0, nullptr, -1});
+    cache_mask = (1ULL << bits) - 1;
+}
+
+size_t
+db_reader::context::get_cache_size() const
+{
+    return cache.size();
+}
+
+void
+db_reader::context::cache_bind(const db_reader *db)
+{
+    if (cache_generation == db->generation) {
+        return;
+    }
+    cache_generation = db->generation;
+    for (auto &entry : cache) {
+        entry.num = -1;
+    }
+}
+
+/* Fibonacci hashing */
+static inline size_t
+cache_index(uint64_t key, uint64_t mask)
+{
+    return ((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+inline bool
+db_reader::context::cache_find(uint64_t key, int &num, char *&ptr)
+{
+    cache_entry *entry;
+
+    if (cache.empty()) {
+        return false;
+    }
+
+    entry = &cache[cache_index(key, cache_mask)];
+    if (entry->num < 0 || entry->key != key) {
+        stats_cache_misses++;
+        return false;
+    }
+    num = entry->num;
+    ptr = entry->ptr;
+    stats_cache_hits++;
+    return true;
+}
+
+inline void
+db_reader::context::cache_insert(uint64_t key, int num, char *ptr)
+{
+    cache_entry *entry;
+
+    if (cache.empty()) {
+        return;
+    }
+
+    entry = &cache[cache_index(key, cache_mask)];
+    entry->key = key;
+    entry->num = num;
+    entry->ptr = ptr;
+}
+
+double
+db_reader::context::get_stats_inference_ns() const
+{
+    return stats_counter ? stats_inference/stats_counter/N : 0;
+}
+
+double
+db_reader::context::get_stats_search_ns() const
+{
+    return stats_counter ? stats_search/stats_counter/N : 0;
+}
+
+double
+db_reader::context::get_stats_validate_ns() const
+{
+    return stats_counter ? stats_validate/stats_counter/N : 0;
+}
+
+double
+db_reader::context::get_stats_lookup_ns() const
+{
+    return stats_counter ? stats_lookup/stats_counter/N : 0;
+}
+
+double
+db_reader::context::get_stats_rejected() const
+{
+    return stats_keys ? stats_rejected/stats_keys : 0;
+}
+
+double
+db_reader::context::get_stats_filtered() const
+{
+    return stats_keys ? stats_filtered/stats_keys : 0;
+}
+
+double
+db_reader::context::get_stats_cache_hits() const
+{
+    double total = stats_cache_hits + stats_cache_misses;
+    return total ? stats_cache_hits/total : 0;
+}
+
 db_reader::db_reader()
  : bucket_num(0),
    compression(1),
+   verify_bits(0),
+   filter_bits(0),
    use_64bit(true),
    data(NULL),
    apdx(NULL),
-   ranges(nullptr),
-   model(nullptr),
+   mapping(nullptr),
+   mapping_size(0),
+   engine(nullptr),
+   engine_override(-1),
+   huge_pages(HUGE_PAGES_NONE),
+   appendix_encoding(appendix::RAW),
+   appendix_shift(0),
+   bucket_keys(32),
+   slot_bits(16),
+   hash_seeds(0),
+   inline_values(0),
+   value_bytes(0),
+   stash_key_num(0),
+   preader(nullptr),
    min(0),
    max(0),
+   generation(new_generation()),
    total_bytes(0),
    appendix_bytes(0),
    distinct_key_num(0),
@@ -26,25 +216,38 @@ db_reader::db_reader()
    singleton_num(0),
    total_key_num(0),
    prefix_bits_mean(0),
-   prefix_bits_stddev(0),
-   stats_inference(0),
-   stats_search(0),
-   stats_validate(0),
-   stats_lookup(0),
-   stats_counter(0)
+   prefix_bits_stddev(0)
 {
 }
 
 db_reader::db_reader(db_reader &&other)
  : bucket_num(other.bucket_num),
    compression(other.compression),
+   verify_bits(other.verify_bits),
+   filter_bits(other.filter_bits),
    use_64bit(other.use_64bit),
    data(other.data),
    apdx(other.apdx),
-   ranges(other.ranges),
-   model(other.model),
+   mapping(other.mapping),
+   mapping_size(other.mapping_size),
+   engine(other.engine),
+   engine_override(other.engine_override),
+   huge_pages(other.huge_pages),
+   appendix_encoding(other.appendix_encoding),
+   appendix_shift(other.appendix_shift),
+   bucket_keys(other.bucket_keys),
+   slot_bits(other.slot_bits),
+   hash_seeds(other.hash_seeds),
+   inline_values(other.inline_values),
+   value_bytes(other.value_bytes),
+   stash_key_num(other.stash_key_num),
+   preader(other.preader),
    min(other.min),
    max(other.max),
+   filter(std::move(other.filter)),
+   generation(new_generation()),
+   info_section(std::move(other.info_section)),
+   search_section(std::move(other.search_section)),
    total_bytes(other.total_bytes),
    appendix_bytes(other.appendix_bytes),
    distinct_key_num(other.distinct_key_num),
@@ -52,29 +255,30 @@ db_reader::db_reader(db_reader &&other)
    singleton_num(other.singleton_num),
    total_key_num(other.total_key_num),
    prefix_bits_mean(other.prefix_bits_mean),
-   prefix_bits_stddev(other.prefix_bits_stddev),
-   stats_inference(0),
-   stats_search(0),
-   stats_validate(0),
-   stats_lookup(0),
-   stats_counter(0)
+   prefix_bits_stddev(other.prefix_bits_stddev)
 {
     other.data = nullptr;
-    other.model = nullptr;
-    other.ranges = nullptr;
+    other.mapping = nullptr;
+    other.engine = nullptr;
+    other.preader = nullptr;
+    other.generation = new_generation();
 }
 
 db_reader::~db_reader()
 {
-    free_cacheline(data);
-    lnmu_rqrmi64_destroy(model);
-    lnmu_range_array_destroy(ranges);
+    if (mapping) {
+        munmap(mapping, mapping_size);
+    } else {
+        free_cacheline(data);
+    }
+    delete engine;
+    delete preader;
 }
 
 size_t
 db_reader::get_range_num() const
 {
-    return lnmu_range_array_get_size(ranges);
+    return engine->get_range_num();
 }
 
 size_t
@@ -88,7 +292,7 @@ db_reader::get_redundant_bytes() const
 {
     size_t out = 0;
     for (size_t i=0; i<bucket_num; ++i) {
-        out += preader.get_redundant_bytes(i);
+        out += preader->get_redundant_bytes(i);
     }
     return out;
 }
@@ -108,7 +312,7 @@ db_reader::get_prefix_bits_stddev() const
 const uint64_t *
 db_reader::get_ranges() const
 {
-    return lnmu_range_array_get_values(ranges);
+    return engine->get_ranges();
 }
 
 size_t
@@ -147,40 +351,59 @@ db_reader::get_singleton_num() const
     return singleton_num;
 }
 
-double
-db_reader::get_stats_inference_ns() const
+bool
+db_reader::is_in_appendix(void *value) const
 {
-    return stats_counter ? stats_inference/stats_counter/N : 0;
+    return value >= (void*)apdx;
 }
 
-double
-db_reader::get_stats_search_ns() const
+bool
+db_reader::get_use_64bit() const
 {
-    return stats_counter ? stats_search/stats_counter/N : 0;
+    return use_64bit;
 }
 
-double
-db_reader::get_stats_validate_ns() const
+int
+db_reader::get_filter_bits() const
 {
-    return stats_counter ? stats_validate/stats_counter/N : 0;
+    return filter_bits;
 }
 
-double
-db_reader::get_stats_lookup_ns() const
+int
+db_reader::get_verify_bits() const
 {
-    return stats_counter ? stats_lookup/stats_counter/N : 0;
+    return verify_bits;
 }
 
-bool
-db_reader::is_in_appendix(void *value) const
+bucket_geometry
+db_reader::get_bucket_geometry() const
 {
-    return value > (void*)apdx;
+    return bucket_geometry(use_64bit,
+                           verify_bits,
+                           bucket_keys,
+                           slot_bits,
+                           hash_seeds,
+                           inline_values,
+                           value_bytes);
 }
 
-bool
-db_reader::get_use_64bit() const
+size_t
+db_reader::get_stashed_key_num() const
 {
-    return use_64bit;
+    return stash_key_num;
+}
+
+double
+db_reader::get_false_positive_rate() const
+{
+    /* Probability that a missing key passes the filter, and that any of
+     * the keys in its bucket shares its hash and verification bits */
+    if (!bucket_num) {
+        return 0;
+    }
+    return filter.get_false_positive_rate() *
+           std::ldexp((double)distinct_key_num / bucket_num,
+                      -(slot_bits - 1 + verify_bits));
 }
 
 std::vector<uint32_t>
@@ -188,34 +411,173 @@ db_reader::get_occurence_list() const
 {
     std::vector<uint32_t> vec;
     for (size_t i=0; i<bucket_num; i++) {
-        std::vector<uint32_t> current = preader.get_occurence_list(i, 0);
+        std::vector<uint32_t> current = preader->get_occurence_list(i, 0);
         vec.insert(vec.end(), current.begin(), current.end());
     }
     std::sort(vec.begin(), vec.end());
     return vec;
 }
 
+void
+db_reader::get_values(const char *ptr, int num, uint64_t *out) const
+{
+    appendix::decode64(get_encoding(ptr, num),
+                       ptr,
+                       num,
+                       out,
+                       get_width(ptr, num));
+}
+
+void
+db_reader::get_values(const char *ptr, int num, uint32_t *out) const
+{
+    appendix::decode32(get_encoding(ptr, num),
+                       ptr,
+                       num,
+                       out);
+}
+
+appendix::iterator<uint64_t>
+db_reader::iterate_values64(const char *ptr, int num) const
+{
+    return appendix::iterator<uint64_t>(
+        get_encoding(ptr, num), ptr, num, get_width(ptr, num));
+}
+
+appendix::iterator<uint32_t>
+db_reader::iterate_values32(const char *ptr, int num) const
+{
+    return appendix::iterator<uint32_t>(
+        get_encoding(ptr, num), ptr, num);
+}
+
 int
-db_reader::read(binstream &s)
+db_reader::get_appendix_encoding() const
+{
+    return appendix_encoding;
+}
+
+int
+db_reader::get_appendix_shift() const
+{
+    return appendix_shift;
+}
+
+void
+db_reader::set_huge_pages(int mode)
+{
+    huge_pages = mode;
+}
+
+size_t
+db_reader::get_huge_page_bytes() const
+{
+    /* Huge pages are counted per mapping; the buckets and appendix share
+     * one, and take nearly all of it */
+    if (!data) {
+        return 0;
+    }
+    return std::min(::get_huge_page_bytes(data,
+                                          apdx + appendix_bytes - data),
+                    total_bytes);
+}
+
+void
+db_reader::set_search_engine(int type)
+{
+    engine_override = type;
+}
+
+int
+db_reader::get_search_engine() const
+{
+    return engine->get_type();
+}
+
+int
+db_reader::read_info(binstream &s, int &engine_type)
 {
-    std::vector<uint64_t> rlst;
-    char blob[4];
-    char *buffer;
-    size_t size;
     int version;
 
+    /* A new db, which the caches of contexts have not seen */
+    generation = new_generation();
+
+    /* Version 2 adds verification bits, version 3 adds the key filter,
+     * version 4 adds the search engine, version 5 the appendix encoding,
+     * version 6 the appendix offset unit, version 7 the bucket geometry,
+     * version 8 the hash seeds, version 9 the key stash, version 10 the
+     * inlined lists, version 11 the value width */
     version = s.read_header("db");
-    if (version != 1) {
+    if (version < 1 || version > 11) {
         return 1;
     }
 
-    s >> size
+    s >> total_bytes
       >> use_64bit
       >> appendix_bytes
       >> bucket_num
       >> compression;
 
-    total_bytes = size;
+    verify_bits = 0;
+    if (version >= 2) {
+        s >> verify_bits;
+    }
+
+    /* Older versions do not store the largest key */
+    filter_bits = 0;
+    max = UINT64_MAX;
+    if (version >= 3) {
+        s >> filter_bits
+          >> max;
+    }
+
+    engine_type = search_engine::NUEVOMATCHUP;
+    if (version >= 4) {
+        s >> engine_type;
+    }
+
+    appendix_encoding = appendix::RAW;
+    if (version >= 5) {
+        s >> appendix_encoding;
+    }
+    if (appendix_encoding < 0 || appendix_encoding >= appendix::ENCODING_NUM) {
+        return 1;
+    }
+
+    appendix_shift = 0;
+    if (version >= 6) {
+        s >> appendix_shift;
+    }
+
+    bucket_keys = 32;
+    slot_bits = 16;
+    if (version >= 7) {
+        s >> bucket_keys
+          >> slot_bits;
+    }
+
+    hash_seeds = 0;
+    if (version >= 8) {
+        s >> hash_seeds;
+    }
+
+    stash_key_num = 0;
+    if (version >= 9) {
+        s >> stash_key_num;
+    }
+
+    inline_values = 0;
+    if (version >= 10) {
+        s >> inline_values;
+    }
+
+    value_bytes = 0;
+    if (version >= 11) {
+        s >> value_bytes;
+    }
+    if (!get_bucket_geometry().is_valid()) {
+        return 1;
+    }
 
     /* Read statistics */
     s >> total_key_num
@@ -225,101 +587,557 @@ db_reader::read(binstream &s)
       >> prefix_bits_mean
       >> prefix_bits_stddev;
 
-    data = (char*)xmalloc_cacheline(size);
-    apdx = data + bucket_builder::get_size_bytes(use_64bit) * bucket_num;
+    return 0;
+}
+
+int
+db_reader::read_search(binstream &s, int engine_type)
+{
+    search_engine::options opts;
+    std::vector<uint64_t> rlst;
+    search_engine *stored;
+    key_stash stash;
+
+    /* Read ranges, search engine */
+    s >> rlst;
+    min = rlst.front();
+    opts.compression = compression;
+
+    stored = search_engine::create(engine_type);
+    if (!stored || stored->read(s, &rlst[0], rlst.size(), opts)) {
+        delete stored;
+        return 1;
+    }
+
+    /* The stored engine is read anyway, to get past it in the stream */
+    delete engine;
+    engine = stored;
+    if (engine_override >= 0 && engine_override != engine_type) {
+        engine = search_engine::create(engine_override);
+        delete stored;
+        if (!engine || engine->build(&rlst[0], rlst.size(), opts)) {
+            return 1;
+        }
+    }
+
+    total_bytes += engine->get_size();
+    used_bytes += engine->get_size();
+    used_bytes += appendix_bytes;
+
+    /* Read key filter */
+    if (filter_bits) {
+        if (filter.read(s)) {
+            return 1;
+        }
+        total_bytes += filter.get_size();
+        used_bytes += filter.get_size();
+    }
+
+    /* Read key stash */
+    if (stash_key_num) {
+        if (stash.read(s) || stash.get_key_num() != stash_key_num) {
+            return 1;
+        }
+        total_bytes += stash.get_size();
+        used_bytes += stash.get_size();
+    }
+
+    /* The lookup code of the bucket geometry is selected once, here */
+    delete preader;
+    preader = bucket_reader::create(get_bucket_geometry(),
+                                    data,
+                                    apdx,
+                                    stash,
+                                    appendix_encoding,
+                                    appendix_shift);
+
+    return preader ? 0 : 1;
+}
+
+void
+db_reader::alloc_data()
+{
+    if (huge_pages != HUGE_PAGES_NONE) {
+        data = (char*)xmalloc_huge(total_bytes,
+                                   huge_pages == HUGE_PAGES_EXPLICIT,
+                                   &mapping_size);
+        mapping = data;
+    } else {
+        data = (char*)xmalloc_cacheline(total_bytes);
+    }
+    apdx = data + get_bucket_geometry().get_size_bytes() * bucket_num;
+}
+
+int
+db_reader::read(binstream &s)
+{
+    int engine_type;
+    char blob[4];
+
+    if (read_info(s, engine_type)) {
+        return 1;
+    }
+    alloc_data();
 
     /* Read data blob */
     s.read(blob, 4);
     if (strcmp(blob, "blb")) {
-        free_cacheline(data);
         return 1;
     }
-    s.read(data, size);
+    s.read(data, total_bytes);
 
-    /* Read ranges */
-    s >> rlst;
-    min = rlst.front();
-    max = rlst.back();
-    ranges = lnmu_range_array_init(&rlst[0], rlst.size(), compression, false);
+    return read_search(s, engine_type);
+}
 
-    total_bytes += rlst.size() * sizeof(uint64_t);
-    used_bytes += rlst.size() * sizeof(uint64_t);
-    used_bytes += appendix_bytes;
+int
+db_reader::read(db_builder &builder)
+{
+    mem_binstream info_mem;
+    mem_binstream search_mem;
+    binstream info(info_mem);
+    binstream search(search_mem);
+    int engine_type;
+    size_t size;
+    char *bytes;
 
-    /* Read RQRMI model */
-    model = lnmu_rqrmi64_init(NULL, NULL, 0);
-    s >> size;
-    buffer = new char[size];
-    s.read(buffer, size);
-    lnmu_rqrmi64_load(model, (void*)buffer, size);
-    delete[] buffer;
+    /* The small sections are serialized, and kept for "write" */
+    builder.write_info(info);
+    bytes = (char*)info_mem.detach_data(&size);
+    info_section.assign(bytes, bytes + size);
+    free(bytes);
+    builder.write_search(search);
+    bytes = (char*)search_mem.detach_data(&size);
+    search_section.assign(bytes, bytes + size);
+    free(bytes);
 
-    total_bytes += size;
-    used_bytes += size;
+    mem_binstream info_in(info_section.data(), info_section.size());
+    binstream info_reader(info_in);
+    if (read_info(info_reader, engine_type)) {
+        return 1;
+    }
+    alloc_data();
+    builder.move_data(data);
 
-    preader = bucket_reader(data, apdx, use_64bit);
+    mem_binstream search_in(search_section.data(), search_section.size());
+    binstream search_reader(search_in);
+    return read_search(search_reader, engine_type);
+}
 
+int
+db_reader::write(binstream &s) const
+{
+    if (info_section.empty()) {
+        return 1;
+    }
+    s.write(info_section.data(), info_section.size());
+    s.write("blb", 4);
+    s.write(data, apdx - data + appendix_bytes);
+    s.write(search_section.data(), search_section.size());
     return 0;
 }
 
+size_t
+db_reader::get_image_size() const
+{
+    if (info_section.empty()) {
+        return 0;
+    }
+    return info_section.size() + 4 + (apdx - data) + appendix_bytes +
+           search_section.size();
+}
+
+int
+db_reader::write_mapped(FILE *fp) const
+{
+    const char *section[SECTION_NUM];
+    size_t size[SECTION_NUM];
+
+    if (info_section.empty()) {
+        return 1;
+    }
+    section[SECTION_INFO] = info_section.data();
+    size[SECTION_INFO] = info_section.size();
+    section[SECTION_BUCKETS] = data;
+    size[SECTION_BUCKETS] = apdx - data;
+    section[SECTION_APPENDIX] = apdx;
+    size[SECTION_APPENDIX] = appendix_bytes;
+    section[SECTION_SEARCH] = search_section.data();
+    size[SECTION_SEARCH] = search_section.size();
+    return write_sections(section, size, fp);
+}
+
+int
+db_reader::open_mmap(const char *path)
+{
+    size_t offset[SECTION_NUM];
+    size_t size[SECTION_NUM];
+    struct stat st;
+    char *base;
+    int engine_type;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+    if (fstat(fd, &st)) {
+        close(fd);
+        return 1;
+    }
+    mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        mapping = nullptr;
+        return 1;
+    }
+    mapping_size = st.st_size;
+    base = (char*)mapping;
+
+    /* Section table */
+    mem_binstream header_mem(base, mapping_size);
+    binstream header(header_mem);
+    if (header.read_header("db-mapped") != 1) {
+        return 1;
+    }
+    for (int i=0; i<SECTION_NUM; ++i) {
+        header >> offset[i]
+               >> size[i];
+        if (offset[i] > mapping_size || size[i] > mapping_size - offset[i]) {
+            return 1;
+        }
+    }
+
+    mem_binstream info_mem(base + offset[SECTION_INFO], size[SECTION_INFO]);
+    binstream info(info_mem);
+    if (read_info(info, engine_type) ||
+        size[SECTION_BUCKETS] + size[SECTION_APPENDIX] != total_bytes ||
+        size[SECTION_APPENDIX] != appendix_bytes) {
+        return 1;
+    }
+
+    /* Buckets and appendix are used in place. Their accesses are random,
+     * so read-ahead only wastes page cache. */
+    data = base + offset[SECTION_BUCKETS];
+    apdx = base + offset[SECTION_APPENDIX];
+    madvise(data, size[SECTION_BUCKETS], MADV_RANDOM);
+    madvise(apdx, size[SECTION_APPENDIX], MADV_RANDOM);
+    if (huge_pages != HUGE_PAGES_NONE) {
+        madvise(data, size[SECTION_BUCKETS], MADV_HUGEPAGE);
+        madvise(apdx, size[SECTION_APPENDIX], MADV_HUGEPAGE);
+    }
+
+    mem_binstream search_mem(base + offset[SECTION_SEARCH],
+                             size[SECTION_SEARCH]);
+    binstream search(search_mem);
+    return read_search(search, engine_type);
+}
+
+int
+db_reader::write_mapped(const char *image, size_t image_size, FILE *fp)
+{
+    const char *section[SECTION_NUM];
+    size_t size[SECTION_NUM];
+    size_t blob_offset;
+    db_reader info;
+    int engine_type;
+    char blob[4];
+
+    /* Locate the sections in "image" */
+    mem_binstream image_mem((char*)image, image_size);
+    binstream s(image_mem);
+    if (info.read_info(s, engine_type)) {
+        return 1;
+    }
+    section[SECTION_INFO] = image;
+    size[SECTION_INFO] = image_mem.get_cursor();
+
+    s.read(blob, 4);
+    if (strcmp(blob, "blb")) {
+        return 1;
+    }
+    blob_offset = image_mem.get_cursor();
+    if (info.total_bytes > image_size - blob_offset) {
+        return 1;
+    }
+    section[SECTION_BUCKETS] = image + blob_offset;
+    size[SECTION_BUCKETS] = info.total_bytes - info.appendix_bytes;
+    section[SECTION_APPENDIX] = section[SECTION_BUCKETS] +
+                                size[SECTION_BUCKETS];
+    size[SECTION_APPENDIX] = info.appendix_bytes;
+    section[SECTION_SEARCH] = image + blob_offset + info.total_bytes;
+    size[SECTION_SEARCH] = image_size - blob_offset - info.total_bytes;
+    return write_sections(section, size, fp);
+}
+
+int
+db_reader::write_sections(const char *const *section,
+                          const size_t *size,
+                          FILE *fp)
+{
+    static const char zeros[MAPPED_ALIGNMENT] = {0};
+    size_t offset[SECTION_NUM];
+    size_t header_size;
+    size_t alignment;
+    size_t position;
+    size_t padding;
+    char *header_data;
+
+    /* The section table fits in the first page */
+    position = MAPPED_ALIGNMENT;
+    for (int i=0; i<SECTION_NUM; ++i) {
+        alignment = i == SECTION_BUCKETS || i == SECTION_APPENDIX ?
+                    HUGE_PAGE_SIZE : MAPPED_ALIGNMENT;
+        offset[i] = ROUND_UP(position, alignment);
+        position = offset[i] + size[i];
+    }
+
+    mem_binstream header_mem;
+    binstream header(header_mem);
+    header.write_header("db-mapped", 1);
+    for (int i=0; i<SECTION_NUM; ++i) {
+        header << offset[i]
+               << size[i];
+    }
+    header_data = (char*)header_mem.detach_data(&header_size);
+    fwrite(header_data, 1, header_size, fp);
+    free(header_data);
+
+    position = header_size;
+    for (int i=0; i<SECTION_NUM; ++i) {
+        while (position < offset[i]) {
+            padding = std::min(offset[i] - position, MAPPED_ALIGNMENT);
+            fwrite(zeros, 1, padding, fp);
+            position += padding;
+        }
+        fwrite(section[i], 1, size[i], fp);
+        position += size[i];
+    }
+
+    return ferror(fp) ? 1 : 0;
+}
+
 void
-db_reader::query(std::array<uint64_t, N> keys,
+db_reader::search_batch(std::array<uint64_t, N> &keys,
+                        std::array<uint64_t, N> &base_ranges,
+                        std::array<int, N> &buckets) const
+{
+    engine->search_batch(keys, base_ranges, buckets);
+}
+
+int
+db_reader::resolve_batch(context &ctx,
+                         std::array<uint64_t, N> &keys,
+                         std::array<int, N> &idx,
+                         std::array<int, N> &num,
+                         std::array<char*, N> &ptr) const
+{
+    int size = 0;
+
+    ctx.cache_bind(this);
+    for (int i=0; i<N; ++i) {
+        if (ctx.cache_find(keys[i], num[i], ptr[i])) {
+            continue;
+        } else if (is_absent(keys[i])) {
+            num[i] = 0;
+            ptr[i] = nullptr;
+            ctx.stats_filtered++;
+            continue;
+        }
+        keys[size] = keys[i];
+        idx[size] = i;
+        size++;
+    }
+
+    /* Pad with the last unresolved key, so the padding never touches
+     * buckets the unresolved keys do not already touch */
+    for (int i=size; size && i<N; ++i) {
+        keys[i] = keys[size-1];
+    }
+    return size;
+}
+
+void
+db_reader::finish_batch(context &ctx,
+                        const std::array<uint64_t, N> &keys,
+                        const std::array<int, N> &idx,
+                        int size,
+                        const std::array<int, N> &lane_num,
+                        const std::array<char*, N> &lane_ptr,
+                        std::array<int, N> &num,
+                        std::array<char*, N> &ptr) const
+{
+    for (int j=0; j<size; ++j) {
+        num[idx[j]] = lane_num[j];
+        ptr[idx[j]] = lane_ptr[j];
+        ctx.cache_insert(keys[j], lane_num[j], lane_ptr[j]);
+    }
+}
+
+void
+db_reader::query(context &ctx,
+                 std::array<uint64_t, N> keys,
                  std::array<int, N> &num,
-                 std::array<char*, N> &ptr)
+                 std::array<char*, N> &ptr) const
 {
     std::array<uint64_t, N> base_ranges;
-    std::array<double, N> model_out;
-    std::array<uint64_t, N> errors;
-    std::array<int, N> search_results;
     std::array<int, N> val_results;
+    std::array<int, N> idx;
+    std::array<int, N> lane_num;
+    std::array<char*, N> lane_ptr;
+    int size;
+
+    ctx.stats_keys += N;
+    size = resolve_batch(ctx, keys, idx, num, ptr);
+    if (!size) {
+        return;
+    }
+
+    search_batch(keys, base_ranges, val_results);
+    ctx.stats_rejected += preader->lookup_batch(keys,
+                                               val_results,
+                                               base_ranges,
+                                               lane_num,
+                                               lane_ptr,
+                                               size);
+    ctx.stats_counter++;
+    finish_batch(ctx, keys, idx, size, lane_num, lane_ptr, num, ptr);
+}
+
+int
+db_reader::load_group(context &ctx,
+                      context::stage &st,
+                      const uint64_t *keys,
+                      size_t n,
+                      size_t &cursor,
+                      int *num,
+                      char **ptr) const
+{
+    /* Keys ahead of "cursor" by this much have their filter block
+     * prefetched */
+    const size_t LOOKAHEAD = 4 * N;
+    int size = 0;
+
+    /* Cached and absent keys are answered here and never enter the
+     * pipeline */
+    while (cursor < n && size < N) {
+        if (cursor + LOOKAHEAD < n) {
+            filter.prefetch(keys[cursor + LOOKAHEAD]);
+        }
+        if (ctx.cache_find(keys[cursor], num[cursor], ptr[cursor])) {
+            /* Nothing to do */
+        } else if (is_absent(keys[cursor])) {
+            num[cursor] = 0;
+            ptr[cursor] = nullptr;
+            ctx.stats_filtered++;
+        } else {
+            st.keys[size] = keys[cursor];
+            st.idx[size] = cursor;
+            size++;
+        }
+        cursor++;
+    }
+
+    /* Pad with the last valid key, so the padding never touches buckets
+     * the real keys do not already touch */
+    for (int i=size; size && i<N; ++i) {
+        st.keys[i] = st.keys[size-1];
+    }
+    st.size = size;
+    return size;
+}
+
+void
+db_reader::query_many(context &ctx,
+                      const uint64_t *keys,
+                      size_t n,
+                      int *num,
+                      char **ptr) const
+{
+    /* Two groups are in flight: one in search, one waiting for its
+     * bucket lines */
+    context::stage *cur, *prev;
+    size_t cursor, groups;
+
+    cursor = 0;
+    groups = 0;
+    ctx.stages[1].size = 0;
+    ctx.cache_bind(this);
+
+    for (int s=0; ; s^=1) {
+        cur = &ctx.stages[s];
+        prev = &ctx.stages[s^1];
+
+        /* Next group: inference, search, validate, then issue the bucket
+         * prefetches */
+        if (load_group(ctx, *cur, keys, n, cursor, num, ptr)) {
+            search_batch(cur->keys, cur->base_ranges, cur->buckets);
+            preader->prefetch_batch(cur->buckets);
+            groups++;
+        }
 
-    lnmu_rqrmi64_inference_batch(model, &keys[0], &model_out[0], &errors[0]);
-    /* Access to secondary search array (should fit the cache) */
-    lnmu_range_array_search_batch(ranges, &keys[0], &model_out[0], &errors[0],
-                                  &base_ranges[0], &search_results[0]);
-    /* Access to validation array, 8*(compression-1) bytes per element */
-    lnmu_range_array_validate_batch(ranges, &keys[0], &search_results[0],
-                                    &base_ranges[0], &val_results[0]);
-    preader.lookup_batch(keys, val_results, base_ranges, num, ptr);
-    stats_counter++;
+        /* Previous group: its bucket lines were requested one stage ago */
+        if (prev->size) {
+            ctx.stats_rejected += preader->probe_batch(prev->keys,
+                                                      prev->buckets,
+                                                      prev->base_ranges,
+                                                      ctx.num_out,
+                                                      ctx.ptr_out,
+                                                      prev->size);
+            for (int i=0; i<prev->size; ++i) {
+                num[prev->idx[i]] = ctx.num_out[i];
+                ptr[prev->idx[i]] = ctx.ptr_out[i];
+                ctx.cache_insert(prev->keys[i],
+                                 ctx.num_out[i],
+                                 ctx.ptr_out[i]);
+            }
+        }
+
+        if (!cur->size) {
+            break;
+        }
+    }
+
+    ctx.stats_counter += groups;
+    ctx.stats_keys += n;
 }
 
 void
-db_reader::query_perf(std::array<uint64_t, N> keys,
+db_reader::query_perf(context &ctx,
+                      std::array<uint64_t, N> keys,
                       std::array<int, N> &num,
-                      std::array<char*, N> &ptr)
+                      std::array<char*, N> &ptr) const
 {
     std::array<uint64_t, N> base_ranges;
-    std::array<double, N> model_out;
-    std::array<uint64_t, N> errors;
-    std::array<int, N> search_results;
     std::array<int, N> val_results;
+    std::array<int, N> idx;
+    std::array<int, N> lane_num;
+    std::array<char*, N> lane_ptr;
+    search_engine::perf stats = {0, 0, 0};
+    int size;
 
-    PERF_START(inference);
-    lnmu_rqrmi64_inference_batch(model, &keys[0], &model_out[0], &errors[0]);
-    PERF_END(inference);
-
-    /* Access to secondary search array (should fit the cache) */
-    PERF_START(search);
-    lnmu_range_array_search_batch(ranges, &keys[0], &model_out[0], &errors[0],
-                                  &base_ranges[0], &search_results[0]);
-    PERF_END(search);
+    ctx.stats_keys += N;
+    size = resolve_batch(ctx, keys, idx, num, ptr);
+    if (!size) {
+        return;
+    }
 
-    /* Access to validation array, 8*(compression-1) bytes per element */
-    PERF_START(validate);
-    lnmu_range_array_validate_batch(ranges, &keys[0], &search_results[0],
-                                    &base_ranges[0], &val_results[0]);
-    PERF_END(validate);
+    engine->search_batch_perf(keys, base_ranges, val_results, stats);
 
     PERF_START(lookup);
-    preader.lookup_batch(keys, val_results, base_ranges, num, ptr);
+    ctx.stats_rejected += preader->lookup_batch(keys,
+                                               val_results,
+                                               base_ranges,
+                                               lane_num,
+                                               lane_ptr,
+                                               size);
     PERF_END(lookup);
+    finish_batch(ctx, keys, idx, size, lane_num, lane_ptr, num, ptr);
 
-    stats_inference += inference;
-    stats_search += search;
-    stats_validate += validate;
-    stats_lookup += lookup;
-    stats_counter++;
+    ctx.stats_inference += stats.inference;
+    ctx.stats_search += stats.search;
+    ctx.stats_validate += stats.validate;
+    ctx.stats_lookup += lookup;
+    ctx.stats_counter++;
 }
 
 std::string
@@ -327,33 +1145,30 @@ db_reader::debug(uint64_t key) const
 {
     std::array<uint64_t, N> keys;
     std::array<uint64_t, N> base_ranges;
-    std::array<double, N> model_out;
-    std::array<uint64_t, N> errors;
-    std::array<int, N> search_results;
     std::array<int, N> val_results;
     std::stringstream ss;
     uint16_t hash;
 
-    keys[0] = key;
-    lnmu_rqrmi64_inference_batch(model, &keys[0], &model_out[0], &errors[0]);
-    lnmu_range_array_search_batch(ranges, &keys[0], &model_out[0], &errors[0],
-                                  &base_ranges[0], &search_results[0]);
-    lnmu_range_array_validate_batch(ranges, &keys[0], &search_results[0],
-                                    &base_ranges[0], &val_results[0]);
-    hash = hash_15bit_key(key, base_ranges[0]);
-    ss << "Model search results:" << std::endl;
+    keys.fill(key);
+    engine->search_batch(keys, base_ranges, val_results);
+    hash = preader->get_key_hash(val_results[0], base_ranges[0], key);
+    ss << "Model search results ("
+       << search_engine::get_name(engine->get_type()) << "):" << std::endl;
     ss << "key: " << key
-       << " model-out: " << model_out[0]
-       << " error: " << errors[0]
+       << " " << engine->debug(key)
        << " base-range: " << base_ranges[0]
        << " bucket-index: " << val_results[0]
        << " hash: " << hash
+       << " verify: "
+       << hash_verify_key(key,
+                          base_ranges[0],
+                          get_bucket_geometry().get_verify_mask())
        << std::endl;
 
     ss << "Page contents:" << std::endl;
-    ss << preader.get_bucket_string(val_results[0], base_ranges[0]);
+    ss << preader->get_bucket_string(val_results[0], base_ranges[0]);
     ss << "Matched values:" << std::endl;
-    ss << preader.get_key_values(val_results[0], base_ranges[0], key);
+    ss << preader->get_key_values(val_results[0], base_ranges[0], key);
 
     return ss.str();
 }
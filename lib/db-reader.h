@@ -3,7 +3,9 @@
 
 #include <array>
 #include <cstdint>
+#include <cstdio>
 #include <string>
+#include <vector>
 
 #include "appendix.h"
 #include "binstream.h"
@@ -12,18 +14,45 @@
 #include "record.h"
 #include "bucket-builder.h"
 #include "bucket-reader.h"
+#include "key-filter.h"
+#include "key-stash.h"
+#include "search-engine.h"
 
 class db_reader {
 
     size_t bucket_num;
     int compression;
+    int verify_bits;
+    int filter_bits;
     bool use_64bit;
     char *data;
     char *apdx;
-    struct lnmu_rangearr *ranges;
-    struct lnmu_rqrmi64 *model;
-    bucket_reader preader;
+    void *mapping;
+    size_t mapping_size;
+    search_engine *engine;
+    int engine_override;
+    int huge_pages;
+    int appendix_encoding;
+    int appendix_shift;
+    int bucket_keys;
+    int slot_bits;
+    int hash_seeds;
+    int inline_values;
+    int value_bytes;
+    size_t stash_key_num;
+    bucket_reader *preader;
     uint64_t min, max;
+    key_filter filter;
+
+    /* Identifies the db that this holds, unique across all readers.
+     * Renewed whenever a db is read, so that the caches of contexts never
+     * mistake another db (possibly at a reused address) for it. */
+    uint64_t generation;
+
+    /* The header and search sections of a db that was read from a
+     * builder, to write it with its buckets and appendix */
+    std::vector<char> info_section;
+    std::vector<char> search_section;
 
     /* Stats */
     size_t total_bytes;
@@ -35,18 +64,106 @@ class db_reader {
     double prefix_bits_mean;
     double prefix_bits_stddev;
 
-    /* Perf stats */
-    double stats_inference;
-    double stats_search;
-    double stats_validate;
-    double stats_lookup;
-    double stats_counter;
-
 public:
 
     /* Query batch size */
     static constexpr int N = LNMU_BATCH_SIZE;
 
+    /* Page sizes for the buckets and appendix, see "set_huge_pages" */
+    enum {
+        HUGE_PAGES_NONE,
+        HUGE_PAGES_TRANSPARENT,
+        HUGE_PAGES_EXPLICIT,
+    };
+
+    /* Per-thread query state: performance counters and scratch arrays.
+     * Queries never modify the db_reader, so any number of threads may
+     * query it concurrently as long as each uses its own context. */
+    class context {
+        friend class db_reader;
+
+        /* Perf stats */
+        double stats_inference;
+        double stats_search;
+        double stats_validate;
+        double stats_lookup;
+        double stats_counter;
+        double stats_rejected;
+        double stats_filtered;
+        double stats_keys;
+        double stats_cache_hits;
+        double stats_cache_misses;
+
+        /* Direct-mapped cache of query results of the db of generation
+         * "cache_generation" (see "db_reader::generation"). Values point
+         * into its memory, so they stay valid as long as it does. */
+        struct cache_entry {
+            uint64_t key;
+            char *ptr;
+            int num; /* -1 for an empty entry */
+        };
+        std::vector<cache_entry> cache;
+        uint64_t cache_mask;
+        uint64_t cache_generation;
+
+        /* Pipeline stages of "query_many" */
+        struct stage {
+            std::array<uint64_t, N> keys;
+            std::array<uint64_t, N> base_ranges;
+            std::array<int, N> buckets;
+            std::array<size_t, N> idx;
+            int size;
+        };
+        stage stages[2];
+        std::array<int, N> num_out;
+        std::array<char*, N> ptr_out;
+
+        /* Empty the cache if it holds results of a db other than the
+         * current db of "db" */
+        void cache_bind(const db_reader *db);
+
+        /* Returns true and sets "num" and "ptr" iff "key" is cached */
+        bool cache_find(uint64_t key, int &num, char *&ptr);
+
+        /* Save the results of "key" */
+        void cache_insert(uint64_t key, int num, char *ptr);
+
+    public:
+
+        context();
+
+        /* Reset the perf stats of this */
+        void clear();
+
+        /* Add the perf stats of "other" to this */
+        void merge(const context &other);
+
+        /* Cache the results of up to "entries" keys (rounded down to a
+         * power of two) in this, so repeated keys skip the index. 0
+         * disables the cache. Empties the cache. */
+        void set_cache_size(size_t entries);
+
+        /* Returns the number of cache entries (0 if disabled) */
+        size_t get_cache_size() const;
+
+        /* Get average perf stats */
+        double get_stats_inference_ns() const;
+        double get_stats_search_ns() const;
+        double get_stats_validate_ns() const;
+        double get_stats_lookup_ns() const;
+
+        /* Returns the fraction of queried keys whose hash match was
+         * rejected by the verification bits */
+        double get_stats_rejected() const;
+
+        /* Returns the fraction of queried keys that were found absent by
+         * the key bounds and filter, without accessing the index */
+        double get_stats_filtered() const;
+
+        /* Returns the fraction of cache lookups that hit */
+        double get_stats_cache_hits() const;
+    };
+
     db_reader();
     db_reader(const db_reader&) = delete;
     db_reader(db_reader&&);
@@ -55,15 +172,97 @@ public:
     /* Read content from binstream. Returns 0 on success. */
     int read(binstream&);
 
+    /* Read the db of "builder", once its model is built, as "read" does
+     * from "db_builder::write", but without serializing the buckets and
+     * appendix: "db_builder::move_data" moves them to the memory of this,
+     * so they are never held twice. "builder" is then left without them.
+     * Returns 0 on success. */
+    int read(db_builder &builder);
+
+    /* Write the db, as "db_builder::write" did, or in the mapped format
+     * (see "write_mapped"). Only for dbs that were read from a builder.
+     * Returns 0 on success. */
+    int write(binstream &s) const;
+    int write_mapped(FILE *fp) const;
+
+    /* Returns the number of bytes "write" writes (0 if it cannot) */
+    size_t get_image_size() const;
+
+    /* Map the file "path" in the mapped format (see "write_mapped")
+     * read-only. The buckets and appendix are used in place, so loading
+     * copies only the small sections, and processes that map the same file
+     * share its page cache. Returns 0 on success. */
+    int open_mmap(const char *path);
+
+    /* Write the db "image" of "size" bytes (as written by
+     * "db_builder::write") to "fp" in the mapped format: a header, then the
+     * info, buckets, appendix and search sections, each aligned to a page.
+     * Returns 0 on success. */
+    static int write_mapped(const char *image, size_t size, FILE *fp);
+
+    /* Back the buckets and appendix with 2MB pages, so that random
+     * lookups across a large index miss the TLB less often. Call before
+     * "read" or "open_mmap". HUGE_PAGES_EXPLICIT uses the reserved huge
+     * pages of the system, and falls back to transparent huge pages if
+     * none are free. "open_mmap" can only advise the kernel to use
+     * transparent huge pages for the file (effective on tmpfs, or with
+     * read-only file THP support). See "get_huge_page_bytes". */
+    void set_huge_pages(int mode);
+
+    /* Returns the number of bucket and appendix bytes that are currently
+     * mapped by huge pages, approximately (0 if unknown) */
+    size_t get_huge_page_bytes() const;
+
+    /* Search with an engine of type "type" (see "search_engine") instead
+     * of the one stored in the db; it is built from the ranges by "read".
+     * -1 (default) uses the stored engine. */
+    void set_search_engine(int type);
+
+    /* Returns the type of the search engine in use */
+    int get_search_engine() const;
+
     /* For each i in [1..N]: Query keys[i], set num[i] to be the number of
-     * matched values, and ptr[i] to point to the data. */
-    void query(std::array<uint64_t, N> keys,
+     * matched values, and ptr[i] to point to the data. Keys outside the
+     * key bounds or the key filter are answered before model inference. */
+    void query(context &ctx,
+               std::array<uint64_t, N> keys,
                std::array<int, N> &num,
-               std::array<char*, N> &ptr);
+               std::array<char*, N> &ptr) const;
 
-    void query_perf(std::array<uint64_t, N> keys,
+    void query_perf(context &ctx,
+                    std::array<uint64_t, N> keys,
                     std::array<int, N> &num,
-                    std::array<char*, N> &ptr);
+                    std::array<char*, N> &ptr) const;
+
+    /* Query "n" keys (any number), set num[i] and ptr[i] as in "query".
+     * Keys are processed in groups of N, software-pipelined so that the
+     * model inference of one group overlaps the bucket accesses of the
+     * previous one. */
+    void query_many(context &ctx,
+                    const uint64_t *keys,
+                    size_t n,
+                    int *num,
+                    char **ptr) const;
+
+    /* Set "out" to the "num" values of a query result at "ptr" (see
+     * "query"), decoding them if the appendix is encoded. "out" must have
+     * room for "num" values of the value width of this. */
+    void get_values(const char *ptr, int num, uint64_t *out) const;
+    void get_values(const char *ptr, int num, uint32_t *out) const;
+
+    /* Returns an iterator over the values of a query result, that decodes
+     * a block of values at a time */
+    appendix::iterator<uint64_t> iterate_values64(const char *ptr,
+                                                  int num) const;
+    appendix::iterator<uint32_t> iterate_values32(const char *ptr,
+                                                  int num) const;
+
+    /* Returns the encoding of the value lists in the appendix (see
+     * "appendix") */
+    int get_appendix_encoding() const;
+
+    /* Returns the appendix offset unit, in bits (see "appendix") */
+    int get_appendix_shift() const;
 
     /* Returns a debug string for querying "key" */
     std::string debug(uint64_t key) const;
@@ -102,7 +301,7 @@ public:
     double get_prefix_bits_mean() const;
     double get_prefix_bits_stddev() const;
 
-    /* Returns a pointer to the ranges the the model is trained with */
+    /* Returns a pointer to the ranges the search engine uses */
     const uint64_t *get_ranges() const;
 
     /* Return a sorted list of all key occurrences */
@@ -111,11 +310,103 @@ public:
     /* Returns true iff this uses 64bit values */
     bool get_use_64bit() const;
 
-    /* Get average perf stats */
-    double get_stats_inference_ns() const;
-    double get_stats_search_ns() const;
-    double get_stats_validate_ns() const;
-    double get_stats_lookup_ns() const;
+    /* Returns the number of key filter bits per key (0 if none) */
+    int get_filter_bits() const;
+
+    /* Returns the number of verification bits per slot (0 if none) */
+    int get_verify_bits() const;
+
+    /* Returns the bucket geometry of this */
+    bucket_geometry get_bucket_geometry() const;
+
+    /* Returns the number of distinct keys in the stash of this, which
+     * collided in their buckets */
+    size_t get_stashed_key_num() const;
+
+    /* Returns the expected probability that a key that is not in this
+     * is reported as found */
+    double get_false_positive_rate() const;
+
+private:
+
+    /* Returns the encoding of the "num" values of a query result at "ptr".
+     * Single values and lists inlined in the buckets are raw. */
+    int get_encoding(const char *ptr, int num) const
+    {
+        return num > 1 && ptr >= apdx ? appendix_encoding : appendix::RAW;
+    }
+
+    /* Returns the bytes per value of a query result at "ptr" with "num"
+     * 64-bit values. Values in the buckets and stash may be narrow. */
+    int get_width(const char *ptr, int num) const
+    {
+        return value_bytes && (num == 1 || ptr < apdx) ? value_bytes :
+                                                         sizeof(uint64_t);
+    }
+
+    /* Read the db header and statistics. Sets "engine_type" to the stored
+     * search engine. Returns 0 on success. */
+    int read_info(binstream &s, int &engine_type);
+
+    /* Read the ranges, search engine and key filter, once "data" and
+     * "apdx" are set. Returns 0 on success. */
+    int read_search(binstream &s, int engine_type);
+
+    /* Allocate "data" for the buckets and appendix of "read_info", and
+     * set "apdx" */
+    void alloc_data();
+
+    /* Write the sections of the mapped format, of "size" bytes at
+     * "section", to "fp". Returns 0 on success. */
+    static int write_sections(const char *const *section,
+                              const size_t *size,
+                              FILE *fp);
+
+    /* Returns true iff "key" is definitely not in this */
+    bool is_absent(uint64_t key) const
+    {
+        return key < min || key > max || !filter.contains(key);
+    }
+
+    /* Sets num[i] and ptr[i] for each of "keys" that is cached or
+     * definitely not in this, and packs the other keys to the front of
+     * "keys", with idx[j] the original index of key j. The rest of "keys"
+     * is padded with the last unresolved key. Returns the number of
+     * unresolved keys. */
+    int resolve_batch(context &ctx,
+                      std::array<uint64_t, N> &keys,
+                      std::array<int, N> &idx,
+                      std::array<int, N> &num,
+                      std::array<char*, N> &ptr) const;
+
+    /* Sets num[idx[j]] and ptr[idx[j]] from lane_num[j] and lane_ptr[j] for
+     * the first "size" keys of a batch packed by "resolve_batch", and
+     * caches them */
+    void finish_batch(context &ctx,
+                      const std::array<uint64_t, N> &keys,
+                      const std::array<int, N> &idx,
+                      int size,
+                      const std::array<int, N> &lane_num,
+                      const std::array<char*, N> &lane_ptr,
+                      std::array<int, N> &num,
+                      std::array<char*, N> &ptr) const;
+
+    /* Load the next (up to) N unresolved keys from keys[cursor..n) into
+     * "st", and advance "cursor". Sets "num" and "ptr" of resolved keys.
+     * Returns the number of keys in "st". */
+    int load_group(context &ctx,
+                   context::stage &st,
+                   const uint64_t *keys,
+                   size_t n,
+                   size_t &cursor,
+                   int *num,
+                   char **ptr) const;
+
+    /* Search the bucket of each of "keys" with the search engine. Sets
+     * "buckets" to the bucket indices and "base_ranges" to their ranges. */
+    void search_batch(std::array<uint64_t, N> &keys,
+                      std::array<uint64_t, N> &base_ranges,
+                      std::array<int, N> &buckets) const;
 };
 
 #endif
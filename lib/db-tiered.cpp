@@ -0,0 +1,551 @@
+#include <cassert>
+#include <cstring>
+#include "db-tiered.h"
+#include "util.h"
+
+delta_tier::delta_tier(int value_size)
+: offsets(1, 0),
+  value_size(value_size),
+  seq(0)
+{
+    assert(value_size == sizeof(uint64_t) || value_size == sizeof(uint32_t));
+}
+
+void
+delta_tier::add(uint64_t key, uint64_t key_seq, const char *data, size_t num)
+{
+    assert(keys.empty() || keys.back() < key);
+    keys.push_back(key);
+    seqs.push_back(key_seq);
+    values.insert(values.end(), data, data + num * value_size);
+    offsets.push_back(offsets.back() + num);
+}
+
+void
+delta_tier::add(const delta_tier &other, size_t i)
+{
+    add(other.keys[i],
+        other.seqs[i],
+        &other.values[other.offsets[i] * value_size],
+        other.offsets[i+1] - other.offsets[i]);
+}
+
+delta_tier*
+delta_tier::overlay(const delta_tier &under, const delta_tier &over)
+{
+    delta_tier *out = new delta_tier(over.value_size);
+    size_t i, j;
+
+    assert(under.value_size == over.value_size);
+    i = j = 0;
+    while (i < under.keys.size() || j < over.keys.size()) {
+        if (j == over.keys.size() ||
+            (i < under.keys.size() && under.keys[i] < over.keys[j])) {
+            out->add(under, i++);
+        } else {
+            if (i < under.keys.size() && under.keys[i] == over.keys[j]) {
+                i++;
+            }
+            out->add(over, j++);
+        }
+    }
+    out->seq = over.seq;
+    return out;
+}
+
+delta_tier*
+delta_tier::make(int value_size,
+                 const std::map<uint64_t, std::vector<uint64_t>> &lists,
+                 uint64_t seq)
+{
+    delta_tier *out = new delta_tier(value_size);
+    std::vector<uint32_t> narrow;
+
+    for (auto &it : lists) {
+        if (value_size == sizeof(uint64_t)) {
+            out->add(it.first,
+                     seq,
+                     (const char*)it.second.data(),
+                     it.second.size());
+        } else {
+            narrow.assign(it.second.begin(), it.second.end());
+            out->add(it.first,
+                     seq,
+                     (const char*)narrow.data(),
+                     narrow.size());
+        }
+    }
+    out->seq = seq;
+    return out;
+}
+
+delta_tier*
+delta_tier::since(uint64_t seq) const
+{
+    delta_tier *out = new delta_tier(value_size);
+    for (size_t i=0; i<keys.size(); ++i) {
+        if (seqs[i] > seq) {
+            out->add(*this, i);
+        }
+    }
+    out->seq = this->seq;
+    return out;
+}
+
+void
+delta_tier::get_values(size_t i, std::vector<uint64_t> &out) const
+{
+    const char *ptr = values.data() + offsets[i] * value_size;
+    uint32_t narrow;
+
+    out.resize(offsets[i+1] - offsets[i]);
+    for (size_t j=0; j<out.size(); ++j) {
+        if (value_size == sizeof(uint64_t)) {
+            memcpy(&out[j], ptr + j * value_size, value_size);
+        } else {
+            memcpy(&narrow, ptr + j * value_size, value_size);
+            out[j] = narrow;
+        }
+    }
+}
+
+uint64_t
+delta_tier::get_seq() const
+{
+    return seq;
+}
+
+size_t
+delta_tier::get_key_num() const
+{
+    return keys.size();
+}
+
+size_t
+delta_tier::get_tombstone_num() const
+{
+    size_t num = 0;
+    for (size_t i=0; i<keys.size(); ++i) {
+        num += offsets[i+1] == offsets[i];
+    }
+    return num;
+}
+
+size_t
+delta_tier::get_value_num() const
+{
+    return offsets.back();
+}
+
+size_t
+delta_tier::get_size() const
+{
+    return keys.size() * (sizeof(uint64_t) * 2 + sizeof(size_t)) +
+           values.size();
+}
+
+void
+db_tiered::snapshot::query(db_reader::context &ctx,
+                           const std::array<uint64_t, db_reader::N> &keys,
+                           std::array<int, db_reader::N> &num,
+                           std::array<char*, db_reader::N> &ptr) const
+{
+    main->query(ctx, keys, num, ptr);
+    if (!delta->get_key_num()) {
+        return;
+    }
+    for (int i=0; i<db_reader::N; ++i) {
+        delta->find(keys[i], num[i], ptr[i]);
+    }
+}
+
+void
+db_tiered::snapshot::query_many(db_reader::context &ctx,
+                                const uint64_t *keys,
+                                size_t n,
+                                int *num,
+                                char **ptr) const
+{
+    main->query_many(ctx, keys, n, num, ptr);
+    if (!delta->get_key_num()) {
+        return;
+    }
+    for (size_t i=0; i<n; ++i) {
+        delta->find(keys[i], num[i], ptr[i]);
+    }
+}
+
+void
+db_tiered::snapshot::get_values(const char *ptr,
+                                int num,
+                                uint64_t *out) const
+{
+    if (delta->contains(ptr)) {
+        memcpy(out, ptr, num * sizeof(*out));
+    } else {
+        main->get_values(ptr, num, out);
+    }
+}
+
+void
+db_tiered::snapshot::get_values(const char *ptr,
+                                int num,
+                                uint32_t *out) const
+{
+    if (delta->contains(ptr)) {
+        memcpy(out, ptr, num * sizeof(*out));
+    } else {
+        main->get_values(ptr, num, out);
+    }
+}
+
+const db_reader&
+db_tiered::snapshot::get_main() const
+{
+    return *main;
+}
+
+const delta_tier&
+db_tiered::snapshot::get_delta() const
+{
+    return *delta;
+}
+
+class db_tiered::record_store {
+
+    FILE *fp;
+    size_t num;
+    uint64_t last_key;
+
+public:
+
+    record_store(const char *dir)
+    : fp(xtmpfile(dir)),
+      num(0),
+      last_key(0)
+    {}
+
+    record_store(const record_store&) = delete;
+
+    ~record_store()
+    {
+        fclose(fp);
+    }
+
+    /* Append "m". Records are added in key order. */
+    void add(const struct record &m)
+    {
+        assert(!num || last_key <= m.key);
+        xfwrite(&m, sizeof(m), fp);
+        last_key = m.key;
+        num++;
+    }
+
+    /* Read "n" records from record "i" on to "out" */
+    void read(size_t i, size_t n, struct record *out) const
+    {
+        xpread(fp, out, n * sizeof(*out), i * sizeof(*out));
+    }
+
+    /* Returns the first record whose key is not less than "key" */
+    size_t lower_bound(uint64_t key) const
+    {
+        struct record m;
+        size_t first = 0;
+        size_t count = num;
+        size_t step;
+
+        while (count) {
+            step = count / 2;
+            read(first + step, 1, &m);
+            if (m.key < key) {
+                first += step + 1;
+                count -= step + 1;
+            } else {
+                count = step;
+            }
+        }
+        return first;
+    }
+
+    /* Append the values of "key" to "values". Returns their number. */
+    size_t find(uint64_t key, std::vector<uint64_t> *values) const
+    {
+        const size_t first = lower_bound(key);
+        struct record m;
+        size_t i;
+
+        for (i=first; i<num; ++i) {
+            read(i, 1, &m);
+            if (m.key != key) {
+                break;
+            }
+            if (values) {
+                values->push_back(m.value);
+            }
+        }
+        return i - first;
+    }
+
+    size_t get_num() const
+    {
+        return num;
+    }
+};
+
+struct db_tiered::merge {
+    /* Base records are read in chunks of this many */
+    static constexpr size_t CHUNK = 4096;
+
+    const record_store *base;
+    const delta_tier *delta;
+    record_store *out;
+    std::vector<struct record> chunk;
+    size_t chunk_start;
+    size_t next_base;
+    size_t next_entry;
+    std::vector<uint64_t> values;
+    size_t cursor;
+    uint64_t key;
+
+    /* Returns true iff there is a next base record */
+    bool has_base() const
+    {
+        return next_base < base->get_num();
+    }
+
+    /* Returns the next base record */
+    const struct record &peek_base()
+    {
+        if (next_base - chunk_start >= chunk.size()) {
+            chunk_start = next_base;
+            chunk.resize(std::min((size_t)CHUNK,
+                                  base->get_num() - next_base));
+            base->read(chunk_start, chunk.size(), chunk.data());
+        }
+        return chunk[next_base - chunk_start];
+    }
+
+    int next(struct record *m)
+    {
+        while (cursor == values.size()) {
+            /* Base records of keys that are not in the tier */
+            if (has_base() &&
+                (next_entry == delta->get_key_num() ||
+                 peek_base().key < delta->get_key(next_entry))) {
+                *m = peek_base();
+                next_base++;
+                out->add(*m);
+                return 0;
+            }
+            if (next_entry == delta->get_key_num()) {
+                return 1;
+            }
+
+            /* The values of a key in the tier replace its base records */
+            key = delta->get_key(next_entry);
+            while (has_base() && peek_base().key == key) {
+                next_base++;
+            }
+            delta->get_values(next_entry++, values);
+            cursor = 0;
+        }
+        m->key = key;
+        m->value = values[cursor++];
+        out->add(*m);
+        return 0;
+    }
+
+    static int read_next(struct record *m, void *args)
+    {
+        return ((merge*)args)->next(m);
+    }
+};
+
+db_tiered::db_tiered(db_reader &&main,
+                     size_t record_num,
+                     next_record_func_t get_next,
+                     void *args,
+                     const char *dir)
+: dir(dir ? dir : ""),
+  value_size(main.get_use_64bit() ? sizeof(uint64_t) : sizeof(uint32_t))
+{
+    std::shared_ptr<const db_reader> db(new db_reader(std::move(main)));
+    record_store *records = new record_store(this->dir.c_str());
+    struct record m;
+
+    for (size_t i=0; i<record_num && !get_next(&m, args); ++i) {
+        records->add(m);
+    }
+    base.reset(records);
+    publish(db, std::make_shared<const delta_tier>(value_size));
+}
+
+void
+db_tiered::publish(std::shared_ptr<const db_reader> main,
+                   std::shared_ptr<const delta_tier> delta)
+{
+    snapshot *snap = new snapshot();
+    snap->main = main;
+    snap->delta = delta;
+    std::atomic_store(&current, std::shared_ptr<const snapshot>(snap));
+}
+
+std::shared_ptr<const db_tiered::snapshot>
+db_tiered::get_snapshot() const
+{
+    return std::atomic_load(&current);
+}
+
+void
+db_tiered::read_lists(const snapshot &snap,
+                      const record_store &base,
+                      std::map<uint64_t, std::vector<uint64_t>> &lists) const
+{
+    const delta_tier &delta = *snap.delta;
+    size_t i = 0;
+
+    /* Both the lists and the tier are sorted by key */
+    for (auto &it : lists) {
+        while (i < delta.get_key_num() && delta.get_key(i) < it.first) {
+            i++;
+        }
+        if (i < delta.get_key_num() && delta.get_key(i) == it.first) {
+            delta.get_values(i, it.second);
+        } else {
+            it.second.clear();
+            base.find(it.first, &it.second);
+            std::sort(it.second.begin(), it.second.end());
+        }
+    }
+}
+
+int
+db_tiered::apply(const struct update *updates, size_t n)
+{
+    std::lock_guard<std::mutex> lock(update_lock);
+    std::map<uint64_t, std::vector<uint64_t>> lists;
+    std::shared_ptr<const snapshot> snap;
+    std::shared_ptr<const delta_tier> updated;
+    uint64_t limit;
+
+    limit = value_size == sizeof(uint64_t) ? UINT64_MAX : UINT32_MAX;
+    for (size_t i=0; i<n; ++i) {
+        if (updates[i].op < INSERT || updates[i].op > ERASE_KEY ||
+            updates[i].value > limit) {
+            return 1;
+        }
+        lists[updates[i].key];
+    }
+
+    snap = get_snapshot();
+    read_lists(*snap, *base, lists);
+
+    /* Lists stay sorted, as in the db */
+    for (size_t i=0; i<n; ++i) {
+        const uint64_t value = updates[i].value;
+        std::vector<uint64_t> &list = lists[updates[i].key];
+        auto it = std::lower_bound(list.begin(), list.end(), value);
+
+        if (updates[i].op == INSERT) {
+            list.insert(it, value);
+        } else if (updates[i].op == ERASE) {
+            if (it != list.end() && *it == value) {
+                list.erase(it);
+            }
+        } else {
+            list.clear();
+        }
+    }
+
+    updated.reset(delta_tier::make(value_size,
+                                   lists,
+                                   snap->delta->get_seq() + 1));
+    publish(snap->main,
+            std::shared_ptr<const delta_tier>(
+                delta_tier::overlay(*snap->delta, *updated)));
+    return 0;
+}
+
+int
+db_tiered::insert(uint64_t key, uint64_t value)
+{
+    struct update u = { key, value, INSERT };
+    return apply(&u, 1);
+}
+
+int
+db_tiered::erase(uint64_t key, uint64_t value)
+{
+    struct update u = { key, value, ERASE };
+    return apply(&u, 1);
+}
+
+int
+db_tiered::erase_key(uint64_t key)
+{
+    struct update u = { key, 0, ERASE_KEY };
+    return apply(&u, 1);
+}
+
+int
+db_tiered::compact(db_builder &builder)
+{
+    std::lock_guard<std::mutex> lock(compact_lock);
+    std::shared_ptr<const snapshot> snap;
+    std::shared_ptr<const record_store> from;
+    std::shared_ptr<record_store> to;
+    std::shared_ptr<db_reader> main;
+    size_t record_num;
+
+    /* The base and the tier of the current snapshot */
+    {
+        std::lock_guard<std::mutex> copying(update_lock);
+        snap = get_snapshot();
+        from = base;
+    }
+    const delta_tier &delta = *snap->delta;
+
+    record_num = from->get_num() + delta.get_value_num();
+    for (size_t i=0; i<delta.get_key_num(); ++i) {
+        record_num -= from->find(delta.get_key(i), nullptr);
+    }
+
+    /* The merged records are the base of the new db */
+    to.reset(new record_store(dir.c_str()));
+    merge merged = { from.get(),
+                     &delta,
+                     to.get(),
+                     std::vector<struct record>(),
+                     0,
+                     0,
+                     0,
+                     std::vector<uint64_t>(),
+                     0,
+                     0 };
+    /* The build consumed all merged records iff "to" holds them */
+    builder.build(record_num, merge::read_next, &merged);
+    if (to->get_num() != record_num || builder.build_model()) {
+        return 1;
+    }
+    main.reset(new db_reader());
+    if (main->read(builder)) {
+        return 1;
+    }
+
+    /* The new db and base hold the updates up to the tier of "snap".
+     * Later ones stay in the tier. */
+    std::lock_guard<std::mutex> publishing(update_lock);
+    publish(main,
+            std::shared_ptr<const delta_tier>(
+                get_snapshot()->delta->since(delta.get_seq())));
+    base = to;
+    return 0;
+}
+
+size_t
+db_tiered::get_base_record_num()
+{
+    std::lock_guard<std::mutex> lock(update_lock);
+    return base->get_num();
+}
@@ -0,0 +1,237 @@
+#ifndef DB_TIERED_H
+#define DB_TIERED_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "db-builder.h"
+#include "db-reader.h"
+#include "record.h"
+
+/* A small sorted tier of keys whose values changed after a db was built.
+ * Each key has the full, sorted list of its current values, which
+ * overrides the values of the key in the db; an empty list is a tombstone
+ * of a deleted key. Each key also has the sequence number of the update
+ * that last changed it. Tiers are immutable once made, so any number of
+ * threads may search them. */
+class delta_tier {
+
+    std::vector<uint64_t> keys;
+    std::vector<uint64_t> seqs;
+    std::vector<size_t> offsets;
+    std::vector<char> values;
+    int value_size;
+    uint64_t seq;
+
+    /* Add "key" with the "num" values at "data" in the value size of
+     * this. Keys are added in order. */
+    void add(uint64_t key, uint64_t key_seq, const char *data, size_t num);
+
+    /* Add entry "i" of "other" */
+    void add(const delta_tier &other, size_t i);
+
+public:
+
+    /* Values of "value_size" bytes: 8 for 64-bit dbs, 4 for 32-bit */
+    delta_tier(int value_size);
+    delta_tier(const delta_tier&) = delete;
+
+    /* Returns true iff "key" is in this, and then sets "num" and "ptr" to
+     * its values, as "db_reader::query". Tombstones have no values. */
+    bool find(uint64_t key, int &num, char *&ptr) const
+    {
+        auto it = std::lower_bound(keys.begin(), keys.end(), key);
+        size_t i;
+
+        if (it == keys.end() || *it != key) {
+            return false;
+        }
+        i = it - keys.begin();
+        num = offsets[i+1] - offsets[i];
+        ptr = num ? (char*)&values[offsets[i] * value_size] : nullptr;
+        return true;
+    }
+
+    /* Returns the key of entry "i" of this. Entries are sorted by key. */
+    uint64_t get_key(size_t i) const
+    {
+        return keys[i];
+    }
+
+    /* Set "out" to the values of entry "i" of this */
+    void get_values(size_t i, std::vector<uint64_t> &out) const;
+
+    /* Returns true iff the values of a query result at "ptr" are in this.
+     * They are raw values of the value size of this. */
+    bool contains(const char *ptr) const
+    {
+        return !values.empty() &&
+               ptr >= values.data() &&
+               ptr < values.data() + values.size();
+    }
+
+    /* Returns a tier with the keys of "over", and the keys of "under"
+     * that are not in "over". The sequence number is that of "over". */
+    static delta_tier *overlay(const delta_tier &under,
+                               const delta_tier &over);
+
+    /* Returns a tier with "lists" (key to sorted values) as changed by
+     * update "seq" */
+    static delta_tier *make(int value_size,
+                            const std::map<uint64_t,
+                                           std::vector<uint64_t>> &lists,
+                            uint64_t seq);
+
+    /* Returns a tier with the keys of this that were changed after update
+     * "seq" */
+    delta_tier *since(uint64_t seq) const;
+
+    /* Returns the sequence number of the last update in this */
+    uint64_t get_seq() const;
+
+    /* Returns the number of keys in this, including tombstones */
+    size_t get_key_num() const;
+
+    /* Returns the number of tombstones in this */
+    size_t get_tombstone_num() const;
+
+    /* Returns the number of values in this */
+    size_t get_value_num() const;
+
+    /* Returns the number of bytes this takes */
+    size_t get_size() const;
+};
+
+/* A db that is updated in place: records are inserted and deleted in a
+ * delta tier that queries consult over the db, and compaction builds the
+ * updates into a new db in the background. Queries run on a snapshot of
+ * the db and its tier, so updates and compaction never block them: each
+ * publishes a new snapshot, and the memory of an old one is released once
+ * its last query drops it. Updates are serialized with each other, and so
+ * are compactions.
+ * The index cannot list its records, so this keeps the records that the db
+ * was built from (its base) in a temporary file. The tier starts the values
+ * of an updated key from the base, so the values of updated keys are exact,
+ * also for keys that are not in the db (which the db may report as false
+ * positives, see "db_reader::get_false_positive_rate"). Compaction merges
+ * the base with the tier to the records of the new db, which become the
+ * base of later updates. */
+class db_tiered {
+public:
+
+    /* Update operations */
+    enum { INSERT, ERASE, ERASE_KEY };
+
+    /* Insert or erase a record, or erase all records of a key */
+    struct update {
+        uint64_t key;
+        uint64_t value;
+        int op;
+    };
+
+    /* A db with the delta tier of its later updates. Query results point
+     * into the memory of the snapshot, so they stay valid as long as it
+     * does. */
+    class snapshot {
+        friend class db_tiered;
+
+        std::shared_ptr<const db_reader> main;
+        std::shared_ptr<const delta_tier> delta;
+
+    public:
+
+        /* As "db_reader::query", with the keys of the tier overriding the
+         * db */
+        void query(db_reader::context &ctx,
+                   const std::array<uint64_t, db_reader::N> &keys,
+                   std::array<int, db_reader::N> &num,
+                   std::array<char*, db_reader::N> &ptr) const;
+
+        /* As "db_reader::query_many", with the keys of the tier overriding
+         * the db */
+        void query_many(db_reader::context &ctx,
+                        const uint64_t *keys,
+                        size_t n,
+                        int *num,
+                        char **ptr) const;
+
+        /* As "db_reader::get_values", for results of this */
+        void get_values(const char *ptr, int num, uint64_t *out) const;
+        void get_values(const char *ptr, int num, uint32_t *out) const;
+
+        /* Returns the db of this */
+        const db_reader &get_main() const;
+
+        /* Returns the delta tier of this */
+        const delta_tier &get_delta() const;
+    };
+
+private:
+
+    /* Records sorted by key in a temporary file */
+    class record_store;
+
+    /* Merges the records of a base with a tier, as "next_record_func_t" */
+    struct merge;
+
+    std::shared_ptr<const snapshot> current;
+    std::shared_ptr<const record_store> base;
+    std::string dir;
+    std::mutex update_lock;
+    std::mutex compact_lock;
+    int value_size;
+
+    /* Publish a snapshot of "main" and "delta" */
+    void publish(std::shared_ptr<const db_reader> main,
+                 std::shared_ptr<const delta_tier> delta);
+
+    /* Set the lists of "lists" to the current values of their keys in
+     * "snap" and "base" */
+    void read_lists(const snapshot &snap,
+                    const record_store &base,
+                    std::map<uint64_t, std::vector<uint64_t>> &lists) const;
+
+public:
+
+    /* Updates "main", which was built from the "record_num" records that
+     * "get_next" and "args" read, sorted by key. Copies the records to a
+     * temporary file in "dir" (TMPDIR, or the system default, if NULL or
+     * empty). */
+    db_tiered(db_reader &&main,
+              size_t record_num,
+              next_record_func_t get_next,
+              void *args,
+              const char *dir = nullptr);
+    db_tiered(const db_tiered&) = delete;
+
+    /* Returns the current snapshot */
+    std::shared_ptr<const snapshot> get_snapshot() const;
+
+    /* Apply the "n" updates at "updates" in order, and publish them at
+     * once. Erasing values or keys that are absent does nothing. Returns
+     * 0 on success, or 1 (and applies none) if an update is invalid or
+     * has a value wider than the values of the db. */
+    int apply(const struct update *updates, size_t n);
+
+    /* Apply a single update */
+    int insert(uint64_t key, uint64_t value);
+    int erase(uint64_t key, uint64_t value);
+    int erase_key(uint64_t key);
+
+    /* Build the updates so far into a new db with "builder", which is
+     * configured by the caller, and replace the db and the part of the
+     * tier it holds with it. Queries and updates proceed meanwhile, so
+     * call from a background thread. Returns 0 on success. */
+    int compact(db_builder &builder);
+
+    /* Returns the number of records of the current base */
+    size_t get_base_record_num();
+};
+
+#endif
@@ -0,0 +1,144 @@
+#include <sstream>
+#include "eytzinger-engine.h"
+#include "simd.h"
+#include "util.h"
+
+eytzinger_engine::eytzinger_engine()
+: tree(nullptr),
+  depth(0),
+  kernels(bucket_kernels_get())
+{}
+
+eytzinger_engine::~eytzinger_engine()
+{
+    free_cacheline(tree);
+}
+
+int
+eytzinger_engine::get_type() const
+{
+    return EYTZINGER;
+}
+
+void
+eytzinger_engine::fill(uint64_t node, size_t *pos)
+{
+    if (node >> depth) {
+        return;
+    }
+    fill(2*node, pos);
+    /* Padding is greater than any key, so keys never descend into it */
+    tree[node] = *pos < ranges.size() ? ranges[*pos] : UINT64_MAX;
+    (*pos)++;
+    fill(2*node+1, pos);
+}
+
+int
+eytzinger_engine::build(const uint64_t *values,
+                        size_t size,
+                        const options &opts)
+{
+    size_t pos;
+
+    if (!size) {
+        return 1;
+    }
+
+    ranges.assign(values, values + size);
+    kernels = bucket_kernels_get();
+
+    /* The smallest full tree with at least "size" nodes. Node 0 is unused,
+     * so node 8k starts a cache line. */
+    depth = 0;
+    while (((1UL << depth) - 1) < size) {
+        depth++;
+    }
+    free_cacheline(tree);
+    tree = (uint64_t*)xmalloc_cacheline(sizeof(uint64_t) << depth);
+    tree[0] = 0;
+
+    pos = 0;
+    fill(1, &pos);
+    return 0;
+}
+
+binstream&
+eytzinger_engine::write(binstream &s) const
+{
+    return s;
+}
+
+int
+eytzinger_engine::read(binstream &s,
+                       const uint64_t *values,
+                       size_t size,
+                       const options &opts)
+{
+    return build(values, size, opts);
+}
+
+size_t
+eytzinger_engine::get_range_index(uint64_t node) const
+{
+    size_t pos;
+    int level;
+
+    /* Drop the right turns after the last left turn: the node of that left
+     * turn is the first one greater than the key (0 if there is none) */
+    node >>= __builtin_ffsll(~node);
+    if (!node) {
+        pos = ranges.size();
+    } else {
+        /* In-order position of the node in the full tree */
+        level = 63 - __builtin_clzll(node);
+        pos = ((2 * (node - (1UL << level)) + 1) << (depth - 1 - level)) - 1;
+        pos = pos < ranges.size() ? pos : ranges.size();
+    }
+
+    /* The last range that is not greater than the key */
+    return pos ? pos - 1 : 0;
+}
+
+void
+eytzinger_engine::search_batch(std::array<uint64_t, N> &keys,
+                               std::array<uint64_t, N> &base_ranges,
+                               std::array<int, N> &buckets) const
+{
+    std::array<uint64_t, N> nodes;
+
+    kernels->descend_batch(tree, depth, &keys[0], &nodes[0], N);
+    for (int i=0; i<N; ++i) {
+        buckets[i] = get_range_index(nodes[i]);
+        base_ranges[i] = ranges[buckets[i]];
+    }
+}
+
+std::string
+eytzinger_engine::debug(uint64_t key) const
+{
+    std::stringstream ss;
+    uint64_t node;
+
+    kernels->descend_batch(tree, depth, &key, &node, 1);
+    ss << "tree-depth: " << depth
+       << " tree-node: " << node;
+    return ss.str();
+}
+
+size_t
+eytzinger_engine::get_range_num() const
+{
+    return ranges.size();
+}
+
+const uint64_t *
+eytzinger_engine::get_ranges() const
+{
+    return &ranges[0];
+}
+
+size_t
+eytzinger_engine::get_size() const
+{
+    return (ranges.size() + (1UL << depth)) * sizeof(uint64_t);
+}
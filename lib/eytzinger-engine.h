@@ -0,0 +1,55 @@
+#ifndef EYTZINGER_ENGINE_H
+#define EYTZINGER_ENGINE_H
+
+#include "bucket-kernels.h"
+#include "search-engine.h"
+
+/* Exact search over the ranges in Eytzinger (BFS) order: node k has
+ * children 2k and 2k+1, so the top levels share a few cache lines and the
+ * nodes a few levels down can be prefetched. The tree is padded to a full
+ * binary tree, so all keys of a batch descend in lockstep without branches.
+ * Built from the ranges at load time; nothing but the ranges is stored. */
+class eytzinger_engine : public search_engine {
+
+    std::vector<uint64_t> ranges;
+    uint64_t *tree;
+    int depth;
+
+    /* SIMD kernels, selected at build */
+    const struct bucket_kernels *kernels;
+
+public:
+
+    eytzinger_engine();
+    eytzinger_engine(const eytzinger_engine&) = delete;
+    ~eytzinger_engine();
+
+    int get_type() const;
+
+    int build(const uint64_t *ranges, size_t size, const options &opts);
+
+    binstream& write(binstream&) const;
+    int read(binstream&,
+             const uint64_t *ranges,
+             size_t size,
+             const options &opts);
+
+    void search_batch(std::array<uint64_t, N> &keys,
+                      std::array<uint64_t, N> &base_ranges,
+                      std::array<int, N> &buckets) const;
+
+    std::string debug(uint64_t key) const;
+    size_t get_range_num() const;
+    const uint64_t *get_ranges() const;
+    size_t get_size() const;
+
+private:
+
+    /* Fill the subtree of "node" with ranges[*pos..] in order */
+    void fill(uint64_t node, size_t *pos);
+
+    /* Returns the range index of the tree leaf reached by "node" */
+    size_t get_range_index(uint64_t node) const;
+};
+
+#endif
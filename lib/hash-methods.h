@@ -2,6 +2,7 @@
 #define HASH_METHODS_H
 
 #include <cstdint>
+#include "bucket-kernels.h"
 #include "simd.h"
 
 static inline uint32_t
@@ -40,12 +41,24 @@ static inline uint32_t mhash_add(uint32_t hash, uint32_t data)
     return hash * 5 + 0xe6546b64;
 }
 
-static inline uint32_t hash_finish(uint64_t hash, uint64_t final)
+/* The hash of CRC32C "crc", see "hash_finish" */
+static inline uint32_t hash_finish_crc(uint32_t crc)
 {
     /* The finishing multiplier 0x805204f3 has been experimentally
      * derived to pass the testsuite hash tests. */
-    hash = _mm_crc32_u64(hash, final) * 0x805204f3;
-    return hash ^ (uint32_t)hash >> 16; /* Increase entropy in LSBs. */
+    uint32_t hash = crc * 0x805204f3;
+    return hash ^ hash >> 16; /* Increase entropy in LSBs. */
+}
+
+static inline uint32_t hash_finish(uint64_t hash, uint64_t final)
+{
+    /* Builds for CPUs without SSE4.2 take the CRC from the kernels that
+     * the CPU supports. Hot paths use "bucket_kernels::hash_batch". */
+#ifdef __SSE4_2__
+    return hash_finish_crc(_mm_crc32_u64(hash, final));
+#else
+    return hash_finish_crc(bucket_kernels_get()->crc32_u64(hash, final));
+#endif
 }
 
 static inline uint32_t hash_add(uint32_t hash, uint32_t data)
@@ -69,17 +82,114 @@ static inline uint32_t hash_uint64(const uint64_t x)
     return hash_uint64_basis(x, 0);
 }
 
+/* The hash basis of hash seed "seed". Seed 0 is "hash_uint64". */
+static inline uint32_t
+hash_seed_basis(uint32_t seed)
+{
+    return seed * 0x85ebca6b;
+}
+
+/* The hash basis of "hash_verify_key" */
+static constexpr uint32_t HASH_VERIFY_BASIS = 0x9e3779b9;
+
+/* The 15-bit key hash of key hash "hash", see "hash_15bit_key" */
 static inline uint16_t
-hash_15bit_key(uint64_t key, uint64_t base_range)
+hash_15bit_of(uint32_t hash)
+{
+    uint16_t out = (uint16_t)hash & 0xFFFE;
+    return out ? out : 2; /* Never return zero */
+}
+
+/* The 7-bit key hash of key hash "hash", see "hash_7bit_key" */
+static inline uint8_t
+hash_7bit_of(uint32_t hash)
 {
-    uint16_t out = (uint16_t)hash_uint64(key - base_range) & 0xFFFE;
+    uint8_t out = (uint8_t)hash & 0xFE;
     return out ? out : 2; /* Never return zero */
 }
 
+/* The verification bits of key hash "hash" with basis
+ * "HASH_VERIFY_BASIS", see "hash_verify_key" */
+static inline uint16_t
+hash_verify_of(uint32_t hash, uint16_t mask)
+{
+    return (uint16_t)(hash >> 16) & mask;
+}
+
+static inline uint16_t
+hash_15bit_key(uint64_t key, uint64_t base_range, uint32_t seed = 0)
+{
+    return hash_15bit_of(hash_uint64_basis(key - base_range,
+                                           hash_seed_basis(seed)));
+}
+
+/* Extra key bits for verifying a "hash_15bit_key" match. Independent of the
+ * 15-bit hash, and truncated to the bits in "mask". */
+static inline uint16_t
+hash_verify_key(uint64_t key, uint64_t base_range, uint16_t mask)
+{
+    return hash_verify_of(hash_uint64_basis(key - base_range,
+                                            HASH_VERIFY_BASIS),
+                          mask);
+}
+
 static inline uint16_t
 hash_15bit_read(void *ptr)
 {
     return *(uint16_t*)ptr & 0xFFFE;
 }
 
+static inline uint8_t
+hash_7bit_key(uint64_t key, uint64_t base_range, uint32_t seed = 0)
+{
+    return hash_7bit_of(hash_uint64_basis(key - base_range,
+                                          hash_seed_basis(seed)));
+}
+
+/* The key hash of a bucket hash slot of type "slot_t" with hash seed
+ * "seed": 15 bits in 16-bit slots, 7 bits in 8-bit slots. The LSbit is
+ * left for the slot flag. */
+template <typename slot_t>
+slot_t hash_slot_key(uint64_t key, uint64_t base_range, uint32_t seed);
+
+template <>
+inline uint16_t
+hash_slot_key<uint16_t>(uint64_t key, uint64_t base_range, uint32_t seed)
+{
+    return hash_15bit_key(key, base_range, seed);
+}
+
+template <>
+inline uint8_t
+hash_slot_key<uint8_t>(uint64_t key, uint64_t base_range, uint32_t seed)
+{
+    return hash_7bit_key(key, base_range, seed);
+}
+
+/* As "hash_slot_key", of key hash "hash" with the basis of the seed */
+template <typename slot_t>
+slot_t hash_slot_of(uint32_t hash);
+
+template <>
+inline uint16_t
+hash_slot_of<uint16_t>(uint32_t hash)
+{
+    return hash_15bit_of(hash);
+}
+
+template <>
+inline uint8_t
+hash_slot_of<uint8_t>(uint32_t hash)
+{
+    return hash_7bit_of(hash);
+}
+
+/* Returns the key hash in the slot at "ptr", without the flag */
+template <typename slot_t>
+static inline slot_t
+hash_slot_read(const slot_t *ptr)
+{
+    return *ptr & (slot_t)~1;
+}
+
 #endif
@@ -0,0 +1,169 @@
+#include <cstring>
+#include "bucket-kernels.h"
+#include "key-filter.h"
+#include "simd.h"
+#include "util.h"
+
+static constexpr int WORDS_PER_BLOCK = CACHE_LINE_SIZE / sizeof(uint64_t);
+
+/* Odd multipliers for selecting a bit per word, as in split block Bloom
+ * filters */
+static const uint32_t salt[WORDS_PER_BLOCK] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+/* Murmur3 64-bit finalizer */
+static inline uint64_t
+mix64(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+key_filter::key_filter()
+: blocks(nullptr),
+  block_num(0)
+{}
+
+key_filter::key_filter(key_filter &&other)
+: blocks(other.blocks),
+  block_num(other.block_num)
+{
+    other.blocks = nullptr;
+    other.block_num = 0;
+}
+
+key_filter::~key_filter()
+{
+    free_cacheline(blocks);
+}
+
+key_filter&
+key_filter::operator=(key_filter &&other)
+{
+    free_cacheline(blocks);
+    blocks = other.blocks;
+    block_num = other.block_num;
+    other.blocks = nullptr;
+    other.block_num = 0;
+    return *this;
+}
+
+void
+key_filter::init(size_t key_num, int bits_per_key)
+{
+    free_cacheline(blocks);
+    block_num = DIV_ROUND_UP(key_num * bits_per_key, CACHE_LINE_SIZE * 8);
+    block_num = block_num ? block_num : 1;
+    blocks = (uint64_t*)xmalloc_cacheline(get_size());
+    memset(blocks, 0, get_size());
+}
+
+uint64_t *
+key_filter::get_block(uint64_t hash) const
+{
+    /* Map the upper 32 bits of "hash" to [0, block_num) w/o division */
+    uint64_t idx = ((hash >> 32) * block_num) >> 32;
+    return blocks + idx * WORDS_PER_BLOCK;
+}
+
+void
+key_filter::add(uint64_t key)
+{
+    uint64_t hash = mix64(key);
+    uint64_t *block = get_block(hash);
+    for (int i=0; i<WORDS_PER_BLOCK; ++i) {
+        block[i] |= 1ULL << (((uint32_t)hash * salt[i]) >> 26);
+    }
+}
+
+bool
+key_filter::contains(uint64_t key) const
+{
+    uint64_t hash, miss;
+    uint64_t *block;
+
+    if (!blocks) {
+        return true;
+    }
+
+    hash = mix64(key);
+    block = get_block(hash);
+    miss = 0;
+    for (int i=0; i<WORDS_PER_BLOCK; ++i) {
+        miss |= ~block[i] & (1ULL << (((uint32_t)hash * salt[i]) >> 26));
+    }
+    return !miss;
+}
+
+void
+key_filter::prefetch(uint64_t key) const
+{
+    if (blocks) {
+        __builtin_prefetch(get_block(mix64(key)), 0, 1);
+    }
+}
+
+bool
+key_filter::is_empty() const
+{
+    return !blocks;
+}
+
+double
+key_filter::get_false_positive_rate() const
+{
+    const struct bucket_kernels *kernels;
+    double out, prob;
+    uint64_t *block;
+
+    if (!blocks) {
+        return 1;
+    }
+    kernels = bucket_kernels_get();
+
+    /* A missing key passes iff all its bits are set in its block */
+    out = 0;
+    for (size_t i=0; i<block_num; ++i) {
+        block = blocks + i * WORDS_PER_BLOCK;
+        prob = 1;
+        for (int j=0; j<WORDS_PER_BLOCK; ++j) {
+            prob *= kernels->popcount_batch(block + j, 1) / 64.0;
+        }
+        out += prob;
+    }
+    return out / block_num;
+}
+
+size_t
+key_filter::get_size() const
+{
+    return block_num * CACHE_LINE_SIZE;
+}
+
+binstream&
+key_filter::write(binstream &s) const
+{
+    s << block_num;
+    s.write((const char*)blocks, get_size());
+    return s;
+}
+
+int
+key_filter::read(binstream &s)
+{
+    free_cacheline(blocks);
+    blocks = nullptr;
+    s >> block_num;
+    if (!block_num) {
+        return 1;
+    }
+    blocks = (uint64_t*)xmalloc_cacheline(get_size());
+    s.read((char*)blocks, get_size());
+    return 0;
+}
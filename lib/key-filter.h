@@ -0,0 +1,58 @@
+#ifndef KEY_FILTER_H
+#define KEY_FILTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include "binstream.h"
+
+/* Blocked Bloom filter over 64-bit keys. Each key maps to a single 64B block
+ * and sets one bit in each of its eight 64-bit words, so a membership test
+ * costs one cache line access. */
+class key_filter {
+
+    uint64_t *blocks;
+    size_t block_num;
+
+public:
+
+    key_filter();
+    key_filter(const key_filter&) = delete;
+    key_filter(key_filter&&);
+    ~key_filter();
+    key_filter& operator=(key_filter&&);
+
+    /* Allocate an empty filter for "key_num" keys with "bits_per_key" bits
+     * per key (~10 bits per key give ~1% false positives) */
+    void init(size_t key_num, int bits_per_key);
+
+    /* Add "key" to this */
+    void add(uint64_t key);
+
+    /* Returns false iff "key" is definitely not in this. An empty filter
+     * contains all keys. */
+    bool contains(uint64_t key) const;
+
+    /* Prefetch the block of "key" */
+    void prefetch(uint64_t key) const;
+
+    /* Returns true iff this holds no blocks */
+    bool is_empty() const;
+
+    /* Returns the probability that "contains" is true for a key that was
+     * not added (1 for an empty filter) */
+    double get_false_positive_rate() const;
+
+    /* Returns the size of this in bytes */
+    size_t get_size() const;
+
+    /* Write/read this to/from a binstream. "read" returns 0 on success. */
+    binstream& write(binstream&) const;
+    int read(binstream&);
+
+private:
+
+    /* Returns the block of the key with hash "hash" */
+    uint64_t *get_block(uint64_t hash) const;
+};
+
+#endif
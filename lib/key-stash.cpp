@@ -0,0 +1,79 @@
+#include <cstring>
+#include "key-stash.h"
+
+key_stash::key_stash()
+: value_size(sizeof(uint64_t))
+{}
+
+void
+key_stash::init(int size)
+{
+    keys.clear();
+    counts.clear();
+    values.clear();
+    value_size = size;
+}
+
+void
+key_stash::add(uint64_t key, uint32_t count, const void *value)
+{
+    const char *ptr = (const char*)value;
+    keys.push_back(key);
+    counts.push_back(count);
+    values.insert(values.end(), ptr, ptr + value_size);
+}
+
+long
+key_stash::find(uint64_t key) const
+{
+    const uint64_t *base;
+    size_t len, half;
+
+    if (keys.empty()) {
+        return -1;
+    }
+
+    /* Branch-free search for the last key that is not greater than "key" */
+    base = &keys[0];
+    for (len=keys.size(); len>1; len-=half) {
+        half = len / 2;
+        base = base[half] <= key ? base + half : base;
+    }
+    return *base == key ? base - &keys[0] : -1;
+}
+
+size_t
+key_stash::get_key_num() const
+{
+    return keys.size();
+}
+
+size_t
+key_stash::get_size() const
+{
+    return keys.size() * (sizeof(uint64_t) + sizeof(uint32_t) + value_size);
+}
+
+binstream&
+key_stash::write(binstream &s) const
+{
+    s << value_size
+      << keys
+      << counts
+      << values;
+    return s;
+}
+
+int
+key_stash::read(binstream &s)
+{
+    s >> value_size
+      >> keys
+      >> counts
+      >> values;
+    if (counts.size() != keys.size() ||
+        values.size() != keys.size() * value_size) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef KEY_STASH_H
+#define KEY_STASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "binstream.h"
+
+/* Keys that were diverted from their buckets by hash collisions, so that
+ * the buckets could keep filling. Each key has a bucket value (see
+ * "bucket_geometry"): its single value, or the appendix value of its list
+ * of "count" values. Keys are sorted, and searched only by keys that miss
+ * their bucket, so the stash is rarely touched and stays small enough to
+ * be cache resident. */
+class key_stash {
+
+    std::vector<uint64_t> keys;
+    std::vector<uint32_t> counts;
+    std::vector<char> values;
+    int value_size;
+
+public:
+
+    key_stash();
+
+    /* Empty this, and store values of "size" bytes (4 or 8) */
+    void init(int size);
+
+    /* Add "key" with "count" values and bucket value "value". Keys must be
+     * added in ascending order. */
+    void add(uint64_t key, uint32_t count, const void *value);
+
+    /* Returns the index of "key" in this, or -1 if it is not in this */
+    long find(uint64_t key) const;
+
+    /* Returns the key at "idx" */
+    uint64_t get_key(long idx) const
+    {
+        return keys[idx];
+    }
+
+    /* Returns the number of values of the key at "idx" */
+    uint32_t get_count(long idx) const
+    {
+        return counts[idx];
+    }
+
+    /* Returns the bucket value of the key at "idx" */
+    char *get_value(long idx) const
+    {
+        return (char*)&values[idx * value_size];
+    }
+
+    /* Returns the number of keys in this */
+    size_t get_key_num() const;
+
+    /* Returns the size of this in bytes */
+    size_t get_size() const;
+
+    /* Write/read this to/from a binstream. "read" returns 0 on success. */
+    binstream& write(binstream&) const;
+    int read(binstream&);
+};
+
+#endif
@@ -2,12 +2,17 @@
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
+#include <mutex>
+#include <set>
 #include <vector>
 #include "binstream.h"
+#include "bucket-kernels.h"
 #include "db-builder.h"
 #include "db-reader.h"
 #include "libranger.h"
 #include "record.h"
+#include "record-sort.h"
+#include "util.h"
 
 /*  Export method to shared library */
 #define EXPORT extern "C" __attribute__((visibility("default")))
@@ -19,6 +24,33 @@ struct record_extract_args {
     void *args;
 };
 
+struct libranger_ctx {
+    struct libranger *idx;
+    db_reader::context context;
+};
+
+/* Query contexts of an index. Stats of destroyed contexts are merged into
+ * "retired", so "libranger_get_perf_string" never loses them. */
+struct context_list {
+    std::mutex lock;
+    std::set<struct libranger_ctx*> live;
+    db_reader::context retired;
+    db_reader::context shared;
+    size_t shared_cache_entries = 0;
+};
+
+/* Returns the context used by the non-thread-safe query methods */
+static inline db_reader::context &
+get_shared_context(struct libranger *idx)
+{
+    context_list *cl = (context_list *)idx->contexts;
+    if (cl->shared_cache_entries != idx->cache_entries) {
+        cl->shared_cache_entries = idx->cache_entries;
+        cl->shared.set_cache_size(idx->cache_entries);
+    }
+    return cl->shared;
+}
+
 static inline void
 logprint(struct libranger *idx, const char *fmt, ...)
 {
@@ -42,6 +74,7 @@ print_db_build_status(const db_builder &builder,
              "%d%% (utilization: %.3lf%% ranges: %lu "
              "singletons: %.1lf %% "
              "unique-keys: %lu "
+             "stashed: %lu "
              "buckets-size: %.3lf MB "
              "appendix-size: %.3lf MB)\n",
              status.build_percent,
@@ -49,6 +82,7 @@ print_db_build_status(const db_builder &builder,
              builder.get_ranges().size(),
              builder.get_singleton_percent()*100,
              builder.get_disctinct_key_num(),
+             builder.get_stashed_key_num(),
              builder.get_db_size()/1024.0/1024.0,
              builder.get_appendix().get_size()/1024.0/1024.0);
 }
@@ -73,10 +107,16 @@ print_db_status(const db_builder &builder,
     index = (struct libranger*)args;
     if (!index->logfile) {
         return;
+    } else if (status.status == db_builder::DB_LOAD) {
+        if (status.build_percent && !(status.build_percent % 25)) {
+            logprint(index, "Loaded %d%% of the records\n",
+                     status.build_percent);
+        }
     } else if (status.status == db_builder::DB_BUILD) {
         print_db_build_status(builder, status, index);
     } else if (status.status == db_builder::START_TRAINING) {
-        logprint(index, "Training RQ-RMI model... \n");
+        logprint(index, "Training %s search engine... \n",
+                 search_engine::get_name(builder.get_search_engine()));
     } else if (status.status == db_builder::DONE_TRAINING) {
         print_model_errors(status, index);
     }
@@ -104,17 +144,66 @@ libranger_init(FILE *logfile)
     memset(index, 0, sizeof(*index));
     index->logfile = logfile;
     index->db_reader = (void*) new db_reader();
+    index->contexts = (void*) new context_list();
+    logprint(index, "Using %s bucket kernels\n", bucket_kernels_get()->name);
     return index;
 }
 
 EXPORT void
 libranger_destroy(struct libranger *idx)
 {
+    context_list *cl = (context_list *)idx->contexts;
+    /* Free contexts the user did not destroy */
+    for (struct libranger_ctx *ctx : cl->live) {
+        ctx->~libranger_ctx();
+        free_cacheline(ctx);
+    }
+    delete cl;
     delete (db_reader*)idx->db_reader;
     free(idx->raw_data);
     delete idx;
 }
 
+/* Record and log the peak memory of the process, after a build */
+static void
+log_peak_memory(struct libranger *idx)
+{
+    idx->build_peak_bytes = get_peak_rss();
+    logprint(idx, "Peak memory: %.3lf MB\n",
+             idx->build_peak_bytes/1024.0/1024.0);
+}
+
+/* Set the build options of "idx" to "db_builder" */
+static void
+configure_builder(struct libranger *idx, db_builder &db_builder, int ratio)
+{
+    db_builder.on_update().add_listener(print_db_status, idx);
+    db_builder.set_compression(ratio);
+    db_builder.set_verify_bits(idx->verify_bits);
+    db_builder.set_filter_bits(idx->filter_bits);
+    db_builder.set_search_engine(idx->engine);
+    if (idx->error_bound) {
+        db_builder.set_error_bound(idx->error_bound);
+    }
+    if (idx->delta_values) {
+        db_builder.set_appendix_encoding(appendix::DELTA);
+    }
+    if (db_builder.set_bucket_geometry(idx->bucket_keys ?
+                                       idx->bucket_keys : 32,
+                                       idx->slot_bits ? idx->slot_bits : 16)) {
+        logprint(idx, "Unsupported bucket geometry, using the default\n");
+    }
+    db_builder.set_hash_seeds(idx->hash_seeds);
+    db_builder.set_inline_values(idx->inline_values);
+    db_builder.set_narrow_values(idx->narrow_values);
+    db_builder.set_stash_size(idx->stash_keys);
+    db_builder.set_build_threads(idx->build_threads);
+    db_builder.set_sort_records(idx->sort_records);
+    db_builder.set_sort_memory(idx->sort_memory);
+    db_builder.set_build_memory(idx->build_memory);
+    db_builder.set_spill_dir(idx->spill_dir);
+}
+
 EXPORT void
 libranger_build(struct libranger *idx,
                 size_t key_num,
@@ -126,42 +215,128 @@ libranger_build(struct libranger *idx,
     db_reader *dbr = (db_reader *)idx->db_reader;
     struct record_extract_args mea;
     db_builder db_builder(use_64bit);
-    mem_binstream memstream;
-    binstream s(memstream);
 
     mea.func = next_record_func;
     mea.args = next_record_func_args;
 
     idx->use_64bit = use_64bit;
 
-    db_builder.on_update().add_listener(print_db_status, idx);
-    db_builder.set_compression(ratio);
+    configure_builder(idx, db_builder, ratio);
     db_builder.build(key_num, get_next_record, &mea);
 
     db_builder.build_model();
 
-    logprint(idx, "Writing index as binary data...\n");
-    db_builder.write(s);
-    dbr->read(s);
-    idx->raw_data = memstream.detach_data(&idx->size);
+    /* The buckets and appendix move to the reader, and are serialized only
+     * when saved */
+    logprint(idx, "Moving index to the reader...\n");
+    dbr->set_huge_pages(idx->huge_pages);
+    dbr->read(db_builder);
+    idx->size = dbr->get_image_size();
+    log_peak_memory(idx);
 };
 
+EXPORT int
+libranger_build_file(struct libranger *idx,
+                     size_t key_num,
+                     bool use_64bit,
+                     int ratio,
+                     next_key_func_t next_record_func,
+                     void *next_record_func_args,
+                     FILE *fp)
+{
+    struct record_extract_args mea;
+    db_builder db_builder(use_64bit);
+    file_binstream base(fp);
+    binstream s(base);
+    long start, end;
+    size_t size;
+
+    mea.func = next_record_func;
+    mea.args = next_record_func_args;
+
+    idx->use_64bit = use_64bit;
+
+    configure_builder(idx, db_builder, ratio);
+    db_builder.build(key_num, get_next_record, &mea);
+
+    db_builder.build_model();
+
+    /* The size precedes the index, as in "libranger_save" */
+    logprint(idx, "Writing index to file...\n");
+    start = ftell(fp);
+    size = 0;
+    try {
+        s << size;
+        db_builder.write(s);
+    } catch (std::runtime_error&) {
+        return 1;
+    }
+    end = ftell(fp);
+    if (start < 0 || end < 0) {
+        return 1;
+    }
+    size = end - start - sizeof(size);
+    if (fseek(fp, start, SEEK_SET) ||
+        fwrite(&size, sizeof(size), 1, fp) != 1 ||
+        fseek(fp, end, SEEK_SET)) {
+        return 1;
+    }
+    log_peak_memory(idx);
+    return 0;
+}
+
 EXPORT void
+libranger_sort_records(uint64_t *records,
+                       size_t num,
+                       int threads,
+                       size_t memory)
+{
+    record_sort((struct record*)records, num, threads, memory);
+}
+
+EXPORT int
 libranger_save(struct libranger *idx, FILE *fp)
 {
-    fwrite((void*)&idx->size, sizeof(size_t), 1, fp);
-    fwrite(idx->raw_data, sizeof(char), idx->size, fp);
+    db_reader *dbr = (db_reader *)idx->db_reader;
+    file_binstream base(fp);
+    binstream s(base);
+
+    /* Only built indexes keep the sections to write */
+    if (!dbr->get_image_size()) {
+        logprint(idx, "Cannot save an index that was not built\n");
+        return 1;
+    }
+    if (fwrite((void*)&idx->size, sizeof(size_t), 1, fp) != 1) {
+        return 1;
+    }
+    try {
+        return dbr->write(s);
+    } catch (std::runtime_error&) {
+        return 1;
+    }
 }
 
 EXPORT struct libranger *
 libranger_load(FILE *fp)
+{
+    return libranger_load_ex(fp, 0);
+}
+
+EXPORT struct libranger *
+libranger_load_ex(FILE *fp, int huge_pages)
 {
     struct libranger *index;
     char *data;
     db_reader *dbr;
 
-    index = new libranger;
+    index = new libranger();
+    memset(index, 0, sizeof(*index));
+    index->contexts = (void*) new context_list();
+    index->huge_pages = huge_pages;
+    /* Select the bucket kernels before "dbr" creates its bucket reader */
+    bucket_kernels_get();
     dbr = new db_reader;
+    dbr->set_huge_pages(huge_pages);
 
     assert(fread(&index->size, sizeof(size_t), 1, fp) == 1);
 
@@ -180,6 +355,55 @@ libranger_load(FILE *fp)
     return index;
 }
 
+EXPORT int
+libranger_save_mmap(struct libranger *idx, const char *path)
+{
+    db_reader *dbr = (db_reader *)idx->db_reader;
+    FILE *fp;
+    int retval;
+
+    /* Only built indexes keep the sections to write */
+    if (!dbr->get_image_size()) {
+        return 1;
+    }
+    fp = fopen(path, "wb");
+    if (!fp) {
+        return 1;
+    }
+    retval = dbr->write_mapped(fp);
+    retval |= fclose(fp) ? 1 : 0;
+    return retval;
+}
+
+EXPORT struct libranger *
+libranger_open_mmap(const char *path)
+{
+    return libranger_open_mmap_ex(path, 0);
+}
+
+EXPORT struct libranger *
+libranger_open_mmap_ex(const char *path, int huge_pages)
+{
+    struct libranger *index;
+    db_reader *dbr;
+
+    index = new libranger();
+    memset(index, 0, sizeof(*index));
+    index->contexts = (void*) new context_list();
+    index->huge_pages = huge_pages;
+    /* Select the bucket kernels before "dbr" creates its bucket reader */
+    bucket_kernels_get();
+    dbr = new db_reader;
+    dbr->set_huge_pages(huge_pages);
+    index->db_reader = (void*)dbr;
+
+    if (dbr->open_mmap(path)) {
+        libranger_destroy(index);
+        return NULL;
+    }
+    return index;
+}
+
 EXPORT void
 libranger_get_stats(struct libranger *idx)
 {
@@ -193,6 +417,8 @@ libranger_get_stats(struct libranger *idx)
     idx->used_bytes = dbr->get_used_bytes();
     idx->prefix_bits_mean = dbr->get_prefix_bits_mean();
     idx->prefix_bits_stddev = dbr->get_prefix_bits_stddev();
+    idx->false_positive_rate = dbr->get_false_positive_rate();
+    idx->huge_page_bytes = dbr->get_huge_page_bytes();
 }
 
 EXPORT void
@@ -235,7 +461,7 @@ libranger_query(struct libranger *idx,
     key_arr = reinterpret_cast<decltype(key_arr)>(keys);
     num_arr = reinterpret_cast<decltype(num_arr)>(num);
     ptr_arr = reinterpret_cast<decltype(ptr_arr)>(ptr);
-    dbr->query(*key_arr, *num_arr, *ptr_arr);
+    dbr->query(get_shared_context(idx), *key_arr, *num_arr, *ptr_arr);
 }
 
 EXPORT void
@@ -251,27 +477,147 @@ libranger_query_perf(struct libranger *idx,
     key_arr = reinterpret_cast<decltype(key_arr)>(keys);
     num_arr = reinterpret_cast<decltype(num_arr)>(num);
     ptr_arr = reinterpret_cast<decltype(ptr_arr)>(ptr);
-    dbr->query_perf(*key_arr, *num_arr, *ptr_arr);
+    dbr->query_perf(get_shared_context(idx), *key_arr, *num_arr, *ptr_arr);
+}
+
+EXPORT void
+libranger_get_values(struct libranger *idx,
+                     const char *ptr,
+                     int num,
+                     void *out)
+{
+    db_reader *dbr = (db_reader *)idx->db_reader;
+    if (dbr->get_use_64bit()) {
+        dbr->get_values(ptr, num, (uint64_t*)out);
+    } else {
+        dbr->get_values(ptr, num, (uint32_t*)out);
+    }
+}
+
+EXPORT void
+libranger_query_many(struct libranger *idx,
+                     const uint64_t *keys,
+                     size_t n,
+                     int *num,
+                     char **ptr)
+{
+    db_reader *dbr = (db_reader *)idx->db_reader;
+    dbr->query_many(get_shared_context(idx), keys, n, num, ptr);
+}
+
+EXPORT struct libranger_ctx *
+libranger_ctx_init(struct libranger *idx)
+{
+    context_list *cl = (context_list *)idx->contexts;
+    struct libranger_ctx *ctx;
+
+    /* Contexts are written on every query; keep each in its own cache
+     * lines so threads do not share them */
+    ctx = (struct libranger_ctx*)xmalloc_cacheline(sizeof(*ctx));
+    new (ctx) libranger_ctx();
+    ctx->idx = idx;
+    ctx->context.set_cache_size(idx->cache_entries);
+
+    std::lock_guard<std::mutex> guard(cl->lock);
+    cl->live.insert(ctx);
+    return ctx;
+}
+
+EXPORT void
+libranger_ctx_destroy(struct libranger_ctx *ctx)
+{
+    context_list *cl = (context_list *)ctx->idx->contexts;
+    {
+        std::lock_guard<std::mutex> guard(cl->lock);
+        cl->retired.merge(ctx->context);
+        cl->live.erase(ctx);
+    }
+    ctx->~libranger_ctx();
+    free_cacheline(ctx);
+}
+
+EXPORT void
+libranger_ctx_query(struct libranger_ctx *ctx,
+                    uint64_t *keys,
+                    int *num,
+                    char **ptr)
+{
+    std::array<uint64_t, db_reader::N> *key_arr;
+    std::array<int, db_reader::N> *num_arr;
+    std::array<char*, db_reader::N> *ptr_arr;
+    db_reader *dbr = (db_reader *)ctx->idx->db_reader;
+    key_arr = reinterpret_cast<decltype(key_arr)>(keys);
+    num_arr = reinterpret_cast<decltype(num_arr)>(num);
+    ptr_arr = reinterpret_cast<decltype(ptr_arr)>(ptr);
+    dbr->query(ctx->context, *key_arr, *num_arr, *ptr_arr);
+}
+
+EXPORT void
+libranger_ctx_query_perf(struct libranger_ctx *ctx,
+                         uint64_t *keys,
+                         int *num,
+                         char **ptr)
+{
+    std::array<uint64_t, db_reader::N> *key_arr;
+    std::array<int, db_reader::N> *num_arr;
+    std::array<char*, db_reader::N> *ptr_arr;
+    db_reader *dbr = (db_reader *)ctx->idx->db_reader;
+    key_arr = reinterpret_cast<decltype(key_arr)>(keys);
+    num_arr = reinterpret_cast<decltype(num_arr)>(num);
+    ptr_arr = reinterpret_cast<decltype(ptr_arr)>(ptr);
+    dbr->query_perf(ctx->context, *key_arr, *num_arr, *ptr_arr);
+}
+
+EXPORT void
+libranger_ctx_query_many(struct libranger_ctx *ctx,
+                         const uint64_t *keys,
+                         size_t n,
+                         int *num,
+                         char **ptr)
+{
+    db_reader *dbr = (db_reader *)ctx->idx->db_reader;
+    dbr->query_many(ctx->context, keys, n, num, ptr);
 }
 
 EXPORT char*
 libranger_get_perf_string(struct libranger *idx)
 {
-    db_reader *dbr = (db_reader *)idx->db_reader;
+    context_list *cl = (context_list *)idx->contexts;
     const char *msg = "inference %.3lf ns search %.3lf ns "
-                      "validate %.3lf ns lookup %.3lf ns \n";
+                      "validate %.3lf ns lookup %.3lf ns "
+                      "verify-rejected %.4lf%% filtered %.3lf%% "
+                      "cache-hits %.3lf%% \n";
+    db_reader::context total;
     char *out = NULL;
-    size_t size = snprintf(out, 0, msg,
-                           dbr->get_stats_inference_ns(),
-                           dbr->get_stats_search_ns(),
-                           dbr->get_stats_validate_ns(),
-                           dbr->get_stats_lookup_ns());
+    size_t size;
+
+    /* Merge the stats of all contexts on demand */
+    {
+        std::lock_guard<std::mutex> guard(cl->lock);
+        total.merge(cl->shared);
+        total.merge(cl->retired);
+        for (struct libranger_ctx *ctx : cl->live) {
+            total.merge(ctx->context);
+        }
+    }
+
+    size = snprintf(out, 0, msg,
+                    total.get_stats_inference_ns(),
+                    total.get_stats_search_ns(),
+                    total.get_stats_validate_ns(),
+                    total.get_stats_lookup_ns(),
+                    total.get_stats_rejected()*100,
+                    total.get_stats_filtered()*100,
+                    total.get_stats_cache_hits()*100);
     out = (char*)malloc(sizeof(char)*size);
     snprintf(out, size, msg,
-             dbr->get_stats_inference_ns(),
-             dbr->get_stats_search_ns(),
-             dbr->get_stats_validate_ns(),
-             dbr->get_stats_lookup_ns());
+             total.get_stats_inference_ns(),
+             total.get_stats_search_ns(),
+             total.get_stats_validate_ns(),
+             total.get_stats_lookup_ns(),
+             total.get_stats_rejected()*100,
+             total.get_stats_filtered()*100,
+             total.get_stats_cache_hits()*100);
     return out;
 }
 
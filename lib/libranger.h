@@ -33,8 +33,37 @@ struct libranger {
     size_t total_key_num;
     double prefix_bits_mean;
     double prefix_bits_stddev;
+    /* New fields are appended below, so that the offsets of the fields
+     * above stay the same for existing callers */
+    void *contexts;
+    double false_positive_rate;
+    size_t huge_page_bytes;
+    size_t build_peak_bytes;
+    /* Build options, set before "libranger_build" */
+    int verify_bits;
+    int filter_bits;
+    int engine;
+    int error_bound;
+    int huge_pages;
+    int delta_values;
+    int bucket_keys;
+    int slot_bits;
+    int hash_seeds;
+    int inline_values;
+    int narrow_values;
+    size_t stash_keys;
+    int build_threads;
+    int sort_records;
+    size_t sort_memory;
+    size_t build_memory;
+    const char *spill_dir;
+    /* Query options, see "libranger_ctx_init" */
+    size_t cache_entries;
 };
 
+/* Per-thread query context, see "libranger_ctx_init" */
+struct libranger_ctx;
+
 /**
  * @brief A function pointer for a user defined function for reading records.
  * Upon any invocation of this, "*key" and "*value" should be set with the
@@ -58,7 +87,68 @@ struct libranger * libranger_init(FILE *logfile);
 void libranger_destroy(struct libranger *idx);
 
 /**
- * @brief Build a new Ranger database.
+ * @brief Build a new Ranger database. Build options are taken from the
+ * fields of "idx":
+ * - verify_bits: additional key bits per slot (in [0,16]). Each bit halves
+ *   the probability that a missing key is reported as found, at the cost of
+ *   a 64B verification line per bucket. 0 (default) disables verification.
+ * - filter_bits: bits per distinct key of a Bloom filter that answers most
+ *   absent keys before model inference (~10 bits give ~1% false positives).
+ *   0 (default) disables the filter. Keys outside the indexed key range
+ *   are always answered early.
+ * - engine: the range search engine. 0 (default) for the NuevoMatchUp RQ-RMI
+ *   model, 1 for an exact in-tree search over an Eytzinger tree, which
+ *   requires no training, 2 for an in-tree PGM-style learned model.
+ * - error_bound: maximal position error of the PGM model. Smaller bounds
+ *   search less per key and need more memory. 0 (default) selects 32.
+ * - huge_pages: back the buckets and appendix of the built index with 2MB
+ *   pages, which reduces TLB misses of lookups in large indexes. 0
+ *   (default) for none, 1 for transparent huge pages, 2 for the reserved
+ *   huge pages of the system (falls back to 1 if none are free). Loaded
+ *   and mapped indexes take the mode from "libranger_load_ex" and
+ *   "libranger_open_mmap_ex".
+ * - delta_values: store the value lists of keys with several values as
+ *   bit-packed deltas, which makes sorted positions several times smaller.
+ *   The query methods then point to encoded lists, which
+ *   "libranger_get_values" decodes. 0 (default) stores raw values.
+ * - bucket_keys, slot_bits: the bucket geometry. Up to 16, 32 or 64 keys
+ *   per bucket, with hash slots of 8 or 16 bits. Smaller buckets with
+ *   narrower slots probe fewer bytes per key, but fill less and need more
+ *   ranges (a larger model). 0 (default) selects 32 keys and 16 bits.
+ * - hash_seeds: try up to this many hash seeds (at most 256) per bucket
+ *   before closing it on a hash collision, so buckets fill more and there
+ *   are fewer ranges. Takes a hash slot per bucket. Most useful with 8-bit
+ *   slots. 0 (default) disables seeds.
+ * - inline_values: store value lists of up to this many values (at most
+ *   63) in the spare value slots of their bucket when they fit, which
+ *   saves the appendix access of their lookup. Such lists are never delta
+ *   encoded. 0 (default) stores all lists in the appendix.
+ * - narrow_values: store 64-bit values in 5 or 6 bytes when the largest
+ *   value and the longest list fit, which makes the buckets smaller. The
+ *   query methods may then point to narrow values, which
+ *   "libranger_get_values" widens. 0 (default) stores full values.
+ * - stash_keys: divert up to this many keys that collide in their buckets
+ *   to a global stash, instead of closing the buckets early. The stash is
+ *   searched only when a bucket misses. 0 (default) disables the stash.
+ * - build_threads: build the buckets with up to this many threads. The
+ *   records are then read into memory first. The index is the same with
+ *   any number of threads. 0 (default) builds on the calling thread.
+ * - sort_records: accept records in any order, and sort them by key and
+ *   value with the build threads (see "libranger_sort_records"). The
+ *   records are then read into memory first. 0 (default) requires records
+ *   that are sorted by key.
+ * - sort_memory: the memory budget of "sort_records", in bytes besides the
+ *   records. 0 (default) for no limit.
+ * - build_memory: build within about this many bytes, for inputs larger
+ *   than memory. The buckets and the appendix are then written to
+ *   temporary files as they are built, and records that do not fit in
+ *   half the budget are streamed to the buckets on the calling thread.
+ *   With "sort_records", they are sorted in runs that spill to temporary
+ *   files, and merged. The index is the same with any budget. Use with
+ *   "libranger_build_file", as "libranger_build" loads the whole index.
+ *   0 (default) builds in memory.
+ * - spill_dir: the directory of the temporary files of "build_memory".
+ *   NULL (default) for TMPDIR, or the system default.
  * @param idx An initiated Ranger data structure.
  * @param size How many records are going to be indexed
  * @param use_64bit Use 64-bit values (or 32-bit values)
@@ -73,25 +163,78 @@ void libranger_build(struct libranger *idx,
                      next_key_func_t next_record_func,
                      void *next_record_func_args);
 
+/**
+ * @brief Build a new Ranger database as "libranger_build", and write it to
+ * "fp" as "libranger_save" does, without loading it to "idx". With
+ * "build_memory", the index is streamed to "fp" and never held in memory
+ * as a whole. "libranger_load" loads it. "fp" must be seekable.
+ * @returns 0 on success
+ */
+int libranger_build_file(struct libranger *idx,
+                         size_t size,
+                         bool use_64bit,
+                         int ratio,
+                         next_key_func_t next_record_func,
+                         void *next_record_func_args,
+                         FILE *fp);
+
+/** @brief Sort "num" records, each a 64-bit key followed by its 64-bit
+ *  value, by key and then by value, with up to "threads" threads. A radix
+ *  sort over the bytes that are not the same in all records.
+ * @param memory At most this many bytes are used besides the records. 0
+ *  for no limit, which sorts fastest (with as many bytes as the records).
+ */
+void libranger_sort_records(uint64_t *records,
+                            size_t num,
+                            int threads,
+                            size_t memory);
+
 /** @brief Save/load the data-sturcute "idx" from the current cursor of file
- *  "fp". Updates "fp" cursor to point just after the data-structure. */
-void libranger_save(struct libranger *idx, FILE *fp);
+ *  "fp". Updates "fp" cursor to point just after the data-structure. Only
+ *  built indexes can be saved; they are serialized from their memory as
+ *  they are saved, so building keeps no serialized copy. Saving returns 0
+ *  on success, or 1 if "idx" was loaded or mapped rather than built, or on
+ *  a write error. */
+int libranger_save(struct libranger *idx, FILE *fp);
 struct libranger * libranger_load(FILE *fp);
 
+/** @brief Load as "libranger_load", with the buckets and appendix backed
+ *  by pages of "huge_pages" mode (see "huge_pages" in "libranger_build") */
+struct libranger * libranger_load_ex(FILE *fp, int huge_pages);
+
+/** @brief Save the built index "idx" to the file "path" in the mapped
+ *  format, where each section starts at a page. Returns 0 on success.
+ *  "libranger_open_mmap" maps such a file read-only and queries the buckets
+ *  in place: opening is fast regardless of the index size, and processes
+ *  that open the same file share its memory. Returns NULL on error. */
+int libranger_save_mmap(struct libranger *idx, const char *path);
+struct libranger * libranger_open_mmap(const char *path);
+
+/** @brief Map as "libranger_open_mmap", in "huge_pages" mode (see
+ *  "huge_pages" in "libranger_build"). Mapped files can only be advised to
+ *  use transparent huge pages, so modes 1 and 2 are the same here. */
+struct libranger * libranger_open_mmap_ex(const char *path,
+                                          int huge_pages);
+
 /** @brief Allocates "*out" to have "*size" elements (both set by this), each
  *  element is a range used by "idx". "*out" is sorted. */
 void libranger_extrat_ranges(struct libranger *idx,
                              const uint64_t **out,
                              size_t *size);
 
-/** @brief Populates "idx" with statistic information */
+/** @brief Populates "idx" with statistic information. "false_positive_rate"
+ *  is the expected probability that a missing key is reported as found.
+ *  "huge_page_bytes" is the amount of the index mapped by huge pages.
+ *  "build_peak_bytes", set by the build methods, is the peak resident
+ *  memory of the process when the build ends. */
 void libranger_get_stats(struct libranger *idx);
 
 /** @brief Returns a sorted list of the value count for each key in "idx" */
 uint32_t* libranger_get_occ_list(struct libranger *idx, size_t *count);
 
 /** @brief Allocates a string with various performance statistics. Should be
- *  freed by the user. */
+ *  freed by the user. The statistics are merged from all query contexts of
+ *  "idx", and should be collected while no queries are in flight. */
 char* libranger_get_perf_string(struct libranger *idx);
 
 /* Returns the size of the position list of "idx" in bytes, or -1 on error */
@@ -100,7 +243,9 @@ uint64_t libranger_get_appendix_size(struct libranger *idx);
 /** @brief Performs query on BATCH_SIZE "keys". Sets each element in "num" to
  *  hold the number of matched keys, and each element in "ptr" to hold pointers
  *  to the matched values. "libranger_query_perf" also saves performance
- *  statistics, thus is a bit slower. */
+ *  statistics, thus is a bit slower. These use a context that is shared by
+ *  all callers and are not thread-safe; threads should use "libranger_ctx_*"
+ *  methods instead. */
 void libranger_query(struct libranger *idx,
                      uint64_t *keys,
                      int *num,
@@ -110,6 +255,54 @@ void libranger_query_perf(struct libranger *idx,
                           int *num,
                           char **ptr);
 
+/** @brief Set "out" to the "num" values of a query result "ptr", decoding
+ *  them if "idx" stores delta-encoded lists or narrow values. "out" must
+ *  have room for "num" values of 64 or 32 bits, according to
+ *  "idx->use_64bit". Without "delta_values" and "narrow_values" this is a
+ *  copy of "ptr". */
+void libranger_get_values(struct libranger *idx,
+                          const char *ptr,
+                          int num,
+                          void *out);
+
+/** @brief Performs query on "n" "keys", where "n" is arbitrary. "num" and
+ *  "ptr" must have room for "n" elements and are set as in "libranger_query".
+ *  Consecutive batches are pipelined, so a single call with many keys is
+ *  faster than many calls to "libranger_query". No padding is required. */
+void libranger_query_many(struct libranger *idx,
+                          const uint64_t *keys,
+                          size_t n,
+                          int *num,
+                          char **ptr);
+
+/** @brief Create a query context for "idx". A context holds per-thread
+ *  statistics and scratch memory; each querying thread should own one.
+ *  Contexts that are not destroyed by the user are freed together
+ *  with "idx". If "idx->cache_entries" is set, the context caches the
+ *  results of that many keys (rounded down to a power of two), so
+ *  repeated keys skip the index. The context used by "libranger_query"
+ *  and friends follows "idx->cache_entries" as well. */
+struct libranger_ctx * libranger_ctx_init(struct libranger *idx);
+
+/** @brief Free "ctx". Its statistics are kept by the index. */
+void libranger_ctx_destroy(struct libranger_ctx *ctx);
+
+/** @brief Thread-safe versions of the query methods above. Any number of
+ *  threads may query the same index, each with its own "ctx". */
+void libranger_ctx_query(struct libranger_ctx *ctx,
+                         uint64_t *keys,
+                         int *num,
+                         char **ptr);
+void libranger_ctx_query_perf(struct libranger_ctx *ctx,
+                              uint64_t *keys,
+                              int *num,
+                              char **ptr);
+void libranger_ctx_query_many(struct libranger_ctx *ctx,
+                              const uint64_t *keys,
+                              size_t n,
+                              int *num,
+                              char **ptr);
+
 #ifdef __cplusplus
 };
 #endif
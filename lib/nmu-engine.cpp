@@ -0,0 +1,202 @@
+#include <cstdlib>
+#include <sstream>
+#include "nmu-engine.h"
+#include "perf.h"
+
+nmu_engine::nmu_engine()
+: ranges(nullptr),
+  model(nullptr),
+  range_bytes(0),
+  model_bytes(0)
+{}
+
+nmu_engine::~nmu_engine()
+{
+    clear();
+}
+
+void
+nmu_engine::clear()
+{
+    lnmu_range_array_destroy(ranges);
+    lnmu_rqrmi64_destroy(model);
+    ranges = nullptr;
+    model = nullptr;
+}
+
+int
+nmu_engine::get_type() const
+{
+    return NUEVOMATCHUP;
+}
+
+/* Select RQRMI size according to the number of ranges */
+static std::vector<int>
+model_size(size_t range_num)
+{
+    if (range_num < 1000) {
+        return {1};
+    } else if (range_num < 10000) {
+        return {1, 8};
+    } else if (range_num < 100000) {
+        return {1,8,55};
+    } else {
+        return {1,8,119};
+    }
+}
+
+int
+nmu_engine::build(const uint64_t *values, size_t size, const options &opts)
+{
+    struct lnmu_trainer_configuration pol;
+    std::vector<int> rqsize;
+    const uint64_t *cvalues;
+    size_t csize;
+    void *blob;
+    int retval;
+
+    clear();
+    ranges = lnmu_range_array_init(values, size, opts.compression, false);
+    csize = lnmu_range_array_get_size(ranges);
+    cvalues = lnmu_range_array_get_values(ranges);
+    range_bytes = size * sizeof(uint64_t);
+
+    rqsize = opts.model_size;
+    if (!rqsize.size()) {
+        rqsize = model_size(csize);
+    }
+
+    pol.error_threshold = 64;
+    pol.allow_failure = false;
+    pol.use_hybrid = true;
+    pol.use_batching = true;
+    pol.samples = 16e3;
+    pol.max_sessions = 20;
+
+    model = lnmu_rqrmi64_init(&pol, &rqsize[0], rqsize.size());
+    retval = lnmu_rqrmi64_train(model, cvalues, csize);
+
+    lnmu_rqrmi64_store(model, &blob, &model_bytes);
+    free(blob);
+    return retval;
+}
+
+binstream&
+nmu_engine::write(binstream &s) const
+{
+    size_t size;
+    void *blob;
+
+    lnmu_rqrmi64_store(model, &blob, &size);
+    s << size;
+    s.write(blob, size);
+    free(blob);
+    return s;
+}
+
+int
+nmu_engine::read(binstream &s,
+                 const uint64_t *values,
+                 size_t size,
+                 const options &opts)
+{
+    char *buffer;
+
+    clear();
+    ranges = lnmu_range_array_init(values, size, opts.compression, false);
+    range_bytes = size * sizeof(uint64_t);
+
+    model = lnmu_rqrmi64_init(NULL, NULL, 0);
+    s >> model_bytes;
+    buffer = new char[model_bytes];
+    s.read(buffer, model_bytes);
+    lnmu_rqrmi64_load(model, (void*)buffer, model_bytes);
+    delete[] buffer;
+    return 0;
+}
+
+void
+nmu_engine::search_batch(std::array<uint64_t, N> &keys,
+                         std::array<uint64_t, N> &base_ranges,
+                         std::array<int, N> &buckets) const
+{
+    std::array<double, N> model_out;
+    std::array<uint64_t, N> errors;
+    std::array<int, N> search_results;
+
+    lnmu_rqrmi64_inference_batch(model, &keys[0], &model_out[0], &errors[0]);
+    /* Access to secondary search array (should fit the cache) */
+    lnmu_range_array_search_batch(ranges, &keys[0], &model_out[0], &errors[0],
+                                  &base_ranges[0], &search_results[0]);
+    /* Access to validation array, 8*(compression-1) bytes per element */
+    lnmu_range_array_validate_batch(ranges, &keys[0], &search_results[0],
+                                    &base_ranges[0], &buckets[0]);
+}
+
+void
+nmu_engine::search_batch_perf(std::array<uint64_t, N> &keys,
+                              std::array<uint64_t, N> &base_ranges,
+                              std::array<int, N> &buckets,
+                              perf &stats) const
+{
+    std::array<double, N> model_out;
+    std::array<uint64_t, N> errors;
+    std::array<int, N> search_results;
+
+    PERF_START(inference);
+    lnmu_rqrmi64_inference_batch(model, &keys[0], &model_out[0], &errors[0]);
+    PERF_END(inference);
+
+    PERF_START(search);
+    lnmu_range_array_search_batch(ranges, &keys[0], &model_out[0], &errors[0],
+                                  &base_ranges[0], &search_results[0]);
+    PERF_END(search);
+
+    PERF_START(validate);
+    lnmu_range_array_validate_batch(ranges, &keys[0], &search_results[0],
+                                    &base_ranges[0], &buckets[0]);
+    PERF_END(validate);
+
+    stats.inference += inference;
+    stats.search += search;
+    stats.validate += validate;
+}
+
+const int *
+nmu_engine::get_errors(size_t *num) const
+{
+    return lnmu_rqrmi64_get_errors(model, num);
+}
+
+std::string
+nmu_engine::debug(uint64_t key) const
+{
+    std::array<uint64_t, N> keys;
+    std::array<double, N> model_out;
+    std::array<uint64_t, N> errors;
+    std::stringstream ss;
+
+    keys.fill(key);
+    lnmu_rqrmi64_inference_batch(model, &keys[0], &model_out[0], &errors[0]);
+    ss << "model-out: " << model_out[0]
+       << " error: " << errors[0];
+    return ss.str();
+}
+
+size_t
+nmu_engine::get_range_num() const
+{
+    return lnmu_range_array_get_size(ranges);
+}
+
+const uint64_t *
+nmu_engine::get_ranges() const
+{
+    return lnmu_range_array_get_values(ranges);
+}
+
+size_t
+nmu_engine::get_size() const
+{
+    return range_bytes + model_bytes;
+}
@@ -0,0 +1,54 @@
+#ifndef NMU_ENGINE_H
+#define NMU_ENGINE_H
+
+#include "libnuevomatchup.h"
+#include "search-engine.h"
+
+/* NuevoMatchUp search: RQ-RMI model inference over a compressed range
+ * array, a secondary search within the model error, and validation over
+ * the ranges that were dropped by the compression */
+class nmu_engine : public search_engine {
+
+    struct lnmu_rangearr *ranges;
+    struct lnmu_rqrmi64 *model;
+    size_t range_bytes;
+    size_t model_bytes;
+
+public:
+
+    nmu_engine();
+    nmu_engine(const nmu_engine&) = delete;
+    ~nmu_engine();
+
+    int get_type() const;
+
+    int build(const uint64_t *ranges, size_t size, const options &opts);
+
+    binstream& write(binstream&) const;
+    int read(binstream&,
+             const uint64_t *ranges,
+             size_t size,
+             const options &opts);
+
+    void search_batch(std::array<uint64_t, N> &keys,
+                      std::array<uint64_t, N> &base_ranges,
+                      std::array<int, N> &buckets) const;
+
+    void search_batch_perf(std::array<uint64_t, N> &keys,
+                           std::array<uint64_t, N> &base_ranges,
+                           std::array<int, N> &buckets,
+                           perf &stats) const;
+
+    const int *get_errors(size_t *num) const;
+    std::string debug(uint64_t key) const;
+    size_t get_range_num() const;
+    const uint64_t *get_ranges() const;
+    size_t get_size() const;
+
+private:
+
+    /* Release the range array and model of this */
+    void clear();
+};
+
+#endif
@@ -1,8 +1,12 @@
 #ifndef _PERF_H
 #define _PERF_H
 
+#include <linux/perf_event.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
 #include <time.h>
+#include <unistd.h>
 
 #define TIMESPAN_GET_NS(DEST, START, END)          \
         DEST=-(START.tv_sec * 1e9 + START.tv_nsec) \
@@ -35,4 +39,34 @@ get_time_ns()
     return clk.tv_sec * 1e9 + clk.tv_nsec;
 }
 
+/* Opens a hardware counter of the data TLB load misses of the calling
+ * thread; each miss starts a page walk. Returns a file descriptor, or -1
+ * if the counter is not available (e.g., in some VMs, or due to
+ * /proc/sys/kernel/perf_event_paranoid). */
+static inline int
+perf_page_walks_open()
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Returns the value of the counter "fd", or 0 if it is not available */
+static inline uint64_t
+perf_page_walks_read(int fd)
+{
+    uint64_t value;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+        return 0;
+    }
+    return value;
+}
+
 #endif
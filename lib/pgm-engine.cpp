@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include "pgm-engine.h"
+#include "perf.h"
+
+/* Positions within a segment stay exact in float32 */
+static constexpr size_t MAX_SEGMENT_SIZE = 1 << 24;
+
+/* Keys per call to the inference kernel when measuring errors */
+static constexpr int MEASURE_BATCH = 256;
+
+pgm_engine::pgm_engine()
+: error_bound(1),
+  kernels(bucket_kernels_get())
+{}
+
+int
+pgm_engine::get_type() const
+{
+    return PGM;
+}
+
+void
+pgm_engine::fit_level(const uint64_t *keys, size_t size, level &out) const
+{
+    std::array<uint32_t, MEASURE_BATCH> idx;
+    std::array<uint32_t, MEASURE_BATCH> pos;
+    struct pgm_segment seg;
+    double lo, hi, x, y;
+    int64_t error;
+    double slope;
+    size_t i, j;
+    int n;
+
+    out.segments.clear();
+    out.error = 0;
+
+    for (i=0; i<size; i=j) {
+        /* Shrinking cone of the slopes through the first key that keep all
+         * keys so far within the error bound */
+        lo = 0;
+        hi = HUGE_VAL;
+        for (j=i+1; j<size && j-i<MAX_SEGMENT_SIZE; ++j) {
+            x = keys[j] - keys[i];
+            y = j - i;
+            if (!x) {
+                if (y > error_bound) {
+                    break;
+                }
+                continue;
+            } else if (std::max(lo, (y - error_bound) / x) >
+                       std::min(hi, (y + error_bound) / x)) {
+                break;
+            }
+            lo = std::max(lo, (y - error_bound) / x);
+            hi = std::min(hi, (y + error_bound) / x);
+        }
+
+        seg.key = keys[i];
+        seg.start = i;
+        seg.last = j - i - 1;
+        seg.shift = 0;
+        while (((keys[j-1] - keys[i]) >> seg.shift) > INT32_MAX) {
+            seg.shift++;
+        }
+        slope = hi == HUGE_VAL ? lo : (lo + hi) / 2;
+        seg.slope = std::ldexp(slope, seg.shift);
+        seg.reserved = 0;
+        out.segments.push_back(seg);
+    }
+
+    /* The float32 inference adds rounding errors; measure the actual error
+     * with the kernel the queries use */
+    for (i=0, j=0; i<size; i+=n) {
+        n = std::min((size_t)MEASURE_BATCH, size - i);
+        for (int k=0; k<n; ++k) {
+            while (i + k > out.segments[j].start + out.segments[j].last) {
+                j++;
+            }
+            idx[k] = j;
+        }
+        kernels->predict_batch(&out.segments[0],
+                               &idx[0],
+                               keys + i,
+                               &pos[0],
+                               n);
+        for (int k=0; k<n; ++k) {
+            error = std::abs((int64_t)pos[k] - (int64_t)(i + k));
+            out.error = std::max(out.error, (int)error);
+        }
+    }
+}
+
+int
+pgm_engine::build(const uint64_t *values, size_t size, const options &opts)
+{
+    std::vector<uint64_t> keys;
+    level current;
+
+    if (!size) {
+        return 1;
+    }
+
+    ranges.assign(values, values + size);
+    error_bound = std::max(opts.error_bound, 1);
+    kernels = bucket_kernels_get();
+    levels.clear();
+
+    /* Each level indexes the first keys of the segments below it */
+    fit_level(&ranges[0], ranges.size(), current);
+    levels.push_back(current);
+    while (levels.back().segments.size() > 1) {
+        keys.clear();
+        for (const pgm_segment &seg : levels.back().segments) {
+            keys.push_back(seg.key);
+        }
+        fit_level(&keys[0], keys.size(), current);
+        levels.push_back(current);
+    }
+
+    update_errors();
+    return 0;
+}
+
+void
+pgm_engine::update_errors()
+{
+    errors.clear();
+    for (size_t l=levels.size(); l-- > 0; ) {
+        errors.push_back(levels[l].error);
+    }
+}
+
+binstream&
+pgm_engine::write(binstream &s) const
+{
+    size_t num = levels.size();
+    s << error_bound
+      << num;
+    for (const level &l : levels) {
+        s << l.error
+          << l.segments;
+    }
+    return s;
+}
+
+int
+pgm_engine::read(binstream &s,
+                 const uint64_t *values,
+                 size_t size,
+                 const options &opts)
+{
+    size_t num;
+
+    s >> error_bound
+      >> num;
+    levels.resize(num);
+    for (level &l : levels) {
+        s >> l.error
+          >> l.segments;
+    }
+
+    /* The top level must have a single segment */
+    if (!size || levels.empty() || levels.back().segments.size() != 1) {
+        return 1;
+    }
+
+    ranges.assign(values, values + size);
+    kernels = bucket_kernels_get();
+    update_errors();
+    return 0;
+}
+
+const uint64_t *
+pgm_engine::get_level_keys(size_t l, size_t *size, int *stride) const
+{
+    if (!l) {
+        *size = ranges.size();
+        *stride = 1;
+        return &ranges[0];
+    }
+    *size = levels[l-1].segments.size();
+    *stride = sizeof(pgm_segment) / sizeof(uint64_t);
+    return &levels[l-1].segments[0].key;
+}
+
+void
+pgm_engine::search(const uint64_t *input, uint32_t *idx, perf *stats) const
+{
+    std::array<uint64_t, N> keys;
+    std::array<uint32_t, N> pos;
+    const uint64_t *base;
+    uint64_t start_ns;
+    int64_t lo;
+    size_t size;
+    int window;
+    int stride;
+    int error;
+    int half;
+
+    /* Keys below the first range belong to the first bucket. Other keys
+     * are never smaller than the first key of their segment. */
+    for (int i=0; i<N; ++i) {
+        keys[i] = std::max(input[i], ranges[0]);
+        idx[i] = 0;
+    }
+
+    for (size_t l=levels.size(); l-- > 0; ) {
+        start_ns = stats ? get_time_ns() : 0;
+        kernels->predict_batch(&levels[l].segments[0],
+                               idx,
+                               &keys[0],
+                               &pos[0],
+                               N);
+        if (stats) {
+            stats->inference += get_time_ns() - start_ns;
+            start_ns = get_time_ns();
+        }
+
+        /* The key is within the error of the predictions of its two
+         * neighbours, hence within [pos-error-1, pos+error] */
+        base = get_level_keys(l, &size, &stride);
+        error = levels[l].error;
+        window = std::min((size_t)(2 * error + 2), size);
+        for (int i=0; i<N; ++i) {
+            lo = (int64_t)pos[i] - error - 1;
+            lo = std::max(lo, (int64_t)0);
+            lo = std::min(lo, (int64_t)(size - window));
+            idx[i] = lo;
+            __builtin_prefetch(base + (lo + window / 2) * stride);
+        }
+
+        /* Branch-free binary search, all keys in lockstep */
+        for (int len=window; len>1; len-=half) {
+            half = len / 2;
+            for (int i=0; i<N; ++i) {
+                lo = idx[i] + half;
+                idx[i] = base[lo * stride] <= keys[i] ? lo : idx[i];
+            }
+        }
+
+        if (stats) {
+            stats->search += get_time_ns() - start_ns;
+        }
+    }
+}
+
+void
+pgm_engine::search_batch(std::array<uint64_t, N> &keys,
+                         std::array<uint64_t, N> &base_ranges,
+                         std::array<int, N> &buckets) const
+{
+    std::array<uint32_t, N> idx;
+
+    search(&keys[0], &idx[0], nullptr);
+    for (int i=0; i<N; ++i) {
+        buckets[i] = idx[i];
+        base_ranges[i] = ranges[idx[i]];
+    }
+}
+
+void
+pgm_engine::search_batch_perf(std::array<uint64_t, N> &keys,
+                              std::array<uint64_t, N> &base_ranges,
+                              std::array<int, N> &buckets,
+                              perf &stats) const
+{
+    std::array<uint32_t, N> idx;
+
+    search(&keys[0], &idx[0], &stats);
+    for (int i=0; i<N; ++i) {
+        buckets[i] = idx[i];
+        base_ranges[i] = ranges[idx[i]];
+    }
+}
+
+const int *
+pgm_engine::get_errors(size_t *num) const
+{
+    *num = errors.size();
+    return &errors[0];
+}
+
+std::string
+pgm_engine::debug(uint64_t key) const
+{
+    std::stringstream ss;
+
+    ss << "levels: " << levels.size()
+       << " segments: " << levels[0].segments.size()
+       << " error-bound: " << error_bound
+       << " error: " << levels[0].error;
+    return ss.str();
+}
+
+size_t
+pgm_engine::get_range_num() const
+{
+    return ranges.size();
+}
+
+const uint64_t *
+pgm_engine::get_ranges() const
+{
+    return &ranges[0];
+}
+
+size_t
+pgm_engine::get_size() const
+{
+    size_t size = ranges.size() * sizeof(uint64_t);
+    for (const level &l : levels) {
+        size += l.segments.size() * sizeof(pgm_segment);
+    }
+    return size;
+}
@@ -0,0 +1,91 @@
+#ifndef PGM_ENGINE_H
+#define PGM_ENGINE_H
+
+#include "bucket-kernels.h"
+#include "search-engine.h"
+
+/* A linear model over the keys at positions [start, start+last] of a sorted
+ * array. The position of "key" (relative to "start") is predicted as
+ * slope * ((key - this->key) >> shift), in float32, clamped to [0, last].
+ * The shift keeps the model input within 31 bits, so the prediction is
+ * monotone in the key. */
+struct pgm_segment {
+    uint64_t key;
+    uint32_t start;
+    uint32_t last;
+    uint32_t shift;
+    float slope;
+    uint64_t reserved;
+};
+
+/* Learned search in the style of the PGM index: piecewise linear models
+ * with a maximal error, fitted greedily over the ranges in a single pass.
+ * The first key of each segment is indexed by the level above it, up to a
+ * level with a single segment. A query predicts its position at each level
+ * and binary-searches the error window around it. Training is exact and
+ * deterministic; the errors are measured with the float32 inference that
+ * the queries use. */
+class pgm_engine : public search_engine {
+
+    struct level {
+        std::vector<pgm_segment> segments;
+        int error;
+    };
+
+    std::vector<uint64_t> ranges;
+    /* Bottom (over the ranges) first */
+    std::vector<level> levels;
+    std::vector<int> errors;
+    int error_bound;
+
+    /* SIMD kernels, selected at build */
+    const struct bucket_kernels *kernels;
+
+public:
+
+    pgm_engine();
+
+    int get_type() const;
+
+    int build(const uint64_t *ranges, size_t size, const options &opts);
+
+    binstream& write(binstream&) const;
+    int read(binstream&,
+             const uint64_t *ranges,
+             size_t size,
+             const options &opts);
+
+    void search_batch(std::array<uint64_t, N> &keys,
+                      std::array<uint64_t, N> &base_ranges,
+                      std::array<int, N> &buckets) const;
+
+    void search_batch_perf(std::array<uint64_t, N> &keys,
+                           std::array<uint64_t, N> &base_ranges,
+                           std::array<int, N> &buckets,
+                           perf &stats) const;
+
+    const int *get_errors(size_t *num) const;
+    std::string debug(uint64_t key) const;
+    size_t get_range_num() const;
+    const uint64_t *get_ranges() const;
+    size_t get_size() const;
+
+private:
+
+    /* Fit segments with error "error_bound" over "size" sorted "keys" */
+    void fit_level(const uint64_t *keys, size_t size, level &out) const;
+
+    /* Returns the sorted keys that level "l" predicts positions in, and
+     * their stride in uint64_t units */
+    const uint64_t *get_level_keys(size_t l, size_t *size, int *stride) const;
+
+    /* For each of the N "keys": set idx[i] to the index of the last range
+     * that is not greater than keys[i] (0 if none). Adds the prediction and window search times to "stats",
+     * unless it is nullptr. */
+    void search(const uint64_t *keys, uint32_t *idx, perf *stats) const;
+
+    /* Set the error list from the levels */
+    void update_errors();
+};
+
+#endif
@@ -17,6 +17,7 @@ record_file::record_file()
 
 record_file::~record_file()
 {
+    reader.reset();
     gzclose(file);
     for (auto &it : map) {
         delete it.second;
@@ -42,9 +43,26 @@ record_file::open_write(const char *filename, int c)
     return !file;
 }
 
+int
+record_file::prefetch(size_t block_size, int depth)
+{
+    if (!file || mode != 'r' || block_size < 1 || depth < 1) {
+        return 1;
+    }
+    reader.reset(new gz_block_reader(file, block_size, depth));
+    return 0;
+}
+
+const gz_block_reader*
+record_file::get_reader() const
+{
+    return reader.get();
+}
+
 void
 record_file::close()
 {
+    reader.reset();
     gzclose(file);
     file = nullptr;
     mode = 0;
@@ -112,9 +130,12 @@ record_file::read_records()
     struct record m;
 
     last_key = -1;
+    mp = nullptr;
     for (size_t i=0; i<size; i++) {
-        record_read_from_file(&m, file);
-        if (m.key != last_key) {
+        if (read_next(&m, this)) {
+            break;
+        }
+        if (!mp || m.key != last_key) {
             map[m.key] = new map_values();
             mp = map[m.key];
         }
@@ -136,7 +157,7 @@ record_file::print(FILE *os)
     fprintf(os, "Total %lu records\n", size);
 
     while (1) {
-        if (record_read_from_file(&record, file)) {
+        if (read_next(&record, this)) {
             break;
         }
         fprintf(os, "%14lu %14lu\n", record.key, record.value);
@@ -147,5 +168,8 @@ int
 record_file::read_next(struct record *m, void *args)
 {
     record_file *me = (record_file *)args;
+    if (me->reader) {
+        return me->reader->read(m, sizeof(*m)) != sizeof(*m) ? EOF : 0;
+    }
     return record_read_from_file(m, me->file);
 }
@@ -3,8 +3,10 @@
 
 #include <cstdio>
 #include <map>
+#include <memory>
 #include <vector>
 #include <zlib.h>
+#include "block-pipeline.h"
 #include "record.h"
 
 /* Utilities for key dumpfiles */
@@ -15,6 +17,7 @@ public:
 
 private:
     std::map<uint64_t, map_values*> map;
+    std::unique_ptr<gz_block_reader> reader;
     size_t size;
     gzFile file;
     char mode;
@@ -28,6 +31,14 @@ public:
     /* Opens "filename" for reading. Returns 0 in success. */
     int open_read(const char *filename);
 
+    /* Decompress the records that "read_next" reads on a thread, up to
+     * "depth" blocks of "block_size" bytes ahead. Call after "open_read".
+     * Returns 0 on success. */
+    int prefetch(size_t block_size, int depth);
+
+    /* Returns the decompressing thread of "prefetch", or nullptr */
+    const gz_block_reader *get_reader() const;
+
     /* Adds record to this. Returns 1 iff key is unique */
     int add_record(struct record &m);
 
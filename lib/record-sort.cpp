@@ -0,0 +1,519 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "record-sort.h"
+#include "util.h"
+
+/* Bytes of a record, least significant first: 8 value bytes, then 8 key
+ * bytes */
+static constexpr int DIGITS = 16;
+static constexpr int RADIX = 256;
+
+/* Partitions smaller than this are insertion sorted */
+static constexpr size_t SMALL = 32;
+
+using histogram = std::array<size_t, RADIX>;
+
+static inline int
+get_digit(const struct record &r, int d)
+{
+    return ((d < 8 ? r.value : r.key) >> (8 * (d & 7))) & (RADIX - 1);
+}
+
+static inline bool
+record_less(const struct record &a, const struct record &b)
+{
+    return a.key < b.key || (a.key == b.key && a.value < b.value);
+}
+
+/* Runs f(t) for t in [0,threads), each on its own thread */
+template <class F>
+static void
+run_threads(int threads, F f)
+{
+    std::vector<std::thread> workers;
+
+    if (threads == 1) {
+        f(0);
+        return;
+    }
+    for (int t=0; t<threads; ++t) {
+        workers.push_back(std::thread(f, t));
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+}
+
+/* Returns a bit per digit that is not the same in all records */
+static uint32_t
+get_varying_digits(const struct record *records, size_t num, int threads)
+{
+    std::vector<std::array<uint64_t, 4>> masks(threads);
+    uint64_t key_diff, value_diff;
+    uint32_t out;
+
+    /* The OR and AND of the keys and values of each slice */
+    run_threads(threads, [&](int t) {
+        size_t first = num * t / threads;
+        size_t last = num * (t + 1) / threads;
+        std::array<uint64_t, 4> m = { 0, ~0UL, 0, ~0UL };
+        for (size_t i=first; i<last; ++i) {
+            m[0] |= records[i].key;
+            m[1] &= records[i].key;
+            m[2] |= records[i].value;
+            m[3] &= records[i].value;
+        }
+        masks[t] = m;
+    });
+
+    /* Bits that are set in some records but not in all */
+    for (int t=1; t<threads; ++t) {
+        masks[0][0] |= masks[t][0];
+        masks[0][1] &= masks[t][1];
+        masks[0][2] |= masks[t][2];
+        masks[0][3] &= masks[t][3];
+    }
+    key_diff = masks[0][0] & ~masks[0][1];
+    value_diff = masks[0][2] & ~masks[0][3];
+
+    out = 0;
+    for (int d=0; d<8; ++d) {
+        out |= (uint32_t)!!((value_diff >> (8 * d)) & 0xFF) << d;
+        out |= (uint32_t)!!((key_diff >> (8 * d)) & 0xFF) << (d + 8);
+    }
+    return out;
+}
+
+/* Each thread scatters its slice of "in" to "out" by digit "d", after the
+ * records of the same digit in the previous slices, so the pass is stable.
+ * "counts" holds the histogram of each slice. */
+static void
+scatter(const struct record *in,
+        struct record *out,
+        size_t num,
+        int threads,
+        int d,
+        std::vector<histogram> &counts)
+{
+    size_t sum, count;
+
+    sum = 0;
+    for (int b=0; b<RADIX; ++b) {
+        for (int t=0; t<threads; ++t) {
+            count = counts[t][b];
+            counts[t][b] = sum;
+            sum += count;
+        }
+    }
+
+    run_threads(threads, [&](int t) {
+        size_t first = num * t / threads;
+        size_t last = num * (t + 1) / threads;
+        for (size_t i=first; i<last; ++i) {
+            out[counts[t][get_digit(in[i], d)]++] = in[i];
+        }
+    });
+}
+
+/* Sets counts[t] to the histogram of digit "d" in the slice of thread t */
+static void
+count_digits(const struct record *records,
+             size_t num,
+             int threads,
+             int d,
+             std::vector<histogram> &counts)
+{
+    run_threads(threads, [&](int t) {
+        size_t first = num * t / threads;
+        size_t last = num * (t + 1) / threads;
+        counts[t].fill(0);
+        for (size_t i=first; i<last; ++i) {
+            counts[t][get_digit(records[i], d)]++;
+        }
+    });
+}
+
+/* Sorts by the "digits" from the least significant, a pass each, between
+ * "records" and "buffer" of "num" records. Returns the one that holds the
+ * sorted records. */
+static struct record *
+lsd_sort(struct record *records,
+         struct record *buffer,
+         size_t num,
+         int threads,
+         uint32_t digits)
+{
+    std::vector<histogram> counts(threads);
+    std::array<histogram, DIGITS> all;
+    struct record *in = records;
+    struct record *out = buffer;
+
+    /* A single slice has the same histograms in every pass, so they are
+     * counted in a single read */
+    if (threads == 1) {
+        for (auto &h : all) {
+            h.fill(0);
+        }
+        for (size_t i=0; i<num; ++i) {
+            for (int d=0; d<DIGITS; ++d) {
+                if (digits >> d & 1) {
+                    all[d][get_digit(records[i], d)]++;
+                }
+            }
+        }
+    }
+
+    for (int d=0; d<DIGITS; ++d) {
+        if (!(digits >> d & 1)) {
+            continue;
+        }
+        if (threads == 1) {
+            counts[0] = all[d];
+        } else {
+            count_digits(in, num, threads, d, counts);
+        }
+        scatter(in, out, num, threads, d, counts);
+        std::swap(in, out);
+    }
+    return in;
+}
+
+/* Moves the records to the partitions of digit "d" in place, given their
+ * "counts". Sets begin[b] to the first record of partition b, and
+ * begin[RADIX] to their number. */
+static void
+partition(struct record *records,
+          int d,
+          const histogram &counts,
+          size_t *begin)
+{
+    std::array<size_t, RADIX> next;
+    struct record r;
+    int k;
+
+    begin[0] = 0;
+    for (int b=0; b<RADIX; ++b) {
+        begin[b+1] = begin[b] + counts[b];
+        next[b] = begin[b];
+    }
+
+    /* Each record is swapped into the next free place of its partition */
+    for (int b=0; b<RADIX; ++b) {
+        while (next[b] < begin[b+1]) {
+            r = records[next[b]];
+            k = get_digit(r, d);
+            while (k != b) {
+                std::swap(r, records[next[k]++]);
+                k = get_digit(r, d);
+            }
+            records[next[b]++] = r;
+        }
+    }
+}
+
+/* Sorts by the "digits" from the most significant, in place, until
+ * partitions fit in "buffer" of "capacity" records */
+static void
+msd_sort(struct record *records,
+         size_t num,
+         uint32_t digits,
+         struct record *buffer,
+         size_t capacity)
+{
+    size_t begin[RADIX + 1];
+    histogram counts;
+    int d;
+
+    if (num < SMALL) {
+        for (size_t i=1; i<num; ++i) {
+            struct record r = records[i];
+            size_t j = i;
+            for (; j>0 && record_less(r, records[j-1]); --j) {
+                records[j] = records[j-1];
+            }
+            records[j] = r;
+        }
+        return;
+    }
+    if (num <= capacity) {
+        if (lsd_sort(records, buffer, num, 1, digits) != records) {
+            memcpy(records, buffer, num * sizeof(*records));
+        }
+        return;
+    }
+
+    /* Digits that are the same in all records of a partition are skipped */
+    for (d=DIGITS-1; d>=0; --d) {
+        if (!(digits >> d & 1)) {
+            continue;
+        }
+        digits &= ~(1U << d);
+        counts.fill(0);
+        for (size_t i=0; i<num; ++i) {
+            counts[get_digit(records[i], d)]++;
+        }
+        if (*std::max_element(counts.begin(), counts.end()) < num) {
+            break;
+        }
+    }
+    if (d < 0) {
+        return;
+    }
+
+    partition(records, d, counts, begin);
+    for (int b=0; b<RADIX; ++b) {
+        msd_sort(records + begin[b],
+                 begin[b+1] - begin[b],
+                 digits,
+                 buffer,
+                 capacity);
+    }
+}
+
+void
+record_sort(struct record *records, size_t num, int threads, size_t memory)
+{
+    std::unique_ptr<struct record[]> buffer;
+    std::vector<histogram> counts;
+    std::vector<int> order;
+    std::atomic<int> next;
+    size_t begin[RADIX + 1];
+    uint32_t digits;
+    bool buffered;
+    int d;
+
+    if (num < 2) {
+        return;
+    }
+    threads = std::max(threads, 1);
+    digits = get_varying_digits(records, num, threads);
+    if (!digits) {
+        return;
+    }
+
+    /* Partition by the most significant digit that varies */
+    d = DIGITS - 1;
+    while (!(digits >> d & 1)) {
+        d--;
+    }
+    digits &= ~(1U << d);
+    counts.resize(threads);
+    count_digits(records, num, threads, d, counts);
+    begin[0] = 0;
+    for (int b=0; b<RADIX; ++b) {
+        begin[b+1] = begin[b];
+        for (int t=0; t<threads; ++t) {
+            begin[b+1] += counts[t][b];
+        }
+    }
+
+    /* With a buffer, the partitions are scattered to it, and each is then
+     * sorted back from it by the rest of the digits, in cache if it fits */
+    buffered = !memory || num <= memory / sizeof(*records);
+    if (buffered) {
+        buffer.reset(new struct record[num]);
+        scatter(records, buffer.get(), num, threads, d, counts);
+    } else {
+        for (int b=0; b<RADIX; ++b) {
+            counts[0][b] = begin[b+1] - begin[b];
+        }
+        partition(records, d, counts[0], begin);
+    }
+
+    /* Threads take the largest partitions first */
+    for (int b=0; b<RADIX; ++b) {
+        order.push_back(b);
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return begin[a+1] - begin[a] > begin[b+1] - begin[b];
+    });
+    next = 0;
+    run_threads(threads, [&](int) {
+        std::unique_ptr<struct record[]> own;
+        struct record *in, *out;
+        size_t capacity;
+        size_t size;
+        int i, b;
+
+        capacity = buffered ? 0 : memory / threads / sizeof(*records);
+        if (capacity) {
+            own.reset(new struct record[capacity]);
+        }
+        while ((i = next++) < RADIX) {
+            b = order[i];
+            size = begin[b+1] - begin[b];
+            if (!buffered) {
+                msd_sort(records + begin[b],
+                         size,
+                         digits,
+                         own.get(),
+                         capacity);
+                continue;
+            }
+            in = buffer.get() + begin[b];
+            out = lsd_sort(in, records + begin[b], size, 1, digits);
+            if (out == in) {
+                memcpy(records + begin[b], in, size * sizeof(*records));
+            }
+        }
+    });
+}
+
+bool
+record_is_sorted(const struct record *records, size_t num)
+{
+    for (size_t i=1; i<num; ++i) {
+        if (record_less(records[i], records[i-1])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+external_sort::external_sort(size_t memory, int threads, const char *dir)
+: dir(dir ? dir : ""),
+  file(nullptr),
+  memory(memory),
+  spilled(0),
+  cursor(0),
+  threads(threads)
+{
+    /* Sorting a run takes a buffer as large as it. Runs are gathered
+     * without reallocation, and "clear" keeps the memory for the next. */
+    capacity = std::max(memory / 2 / sizeof(struct record), (size_t)1);
+    buffer.reserve(capacity);
+}
+
+external_sort::~external_sort()
+{
+    if (file) {
+        fclose(file);
+    }
+}
+
+void
+external_sort::add(const struct record &r)
+{
+    buffer.push_back(r);
+    if (buffer.size() == capacity) {
+        spill();
+    }
+}
+
+void
+external_sort::spill()
+{
+    struct run r;
+
+    if (!file) {
+        file = xtmpfile(dir.c_str());
+    }
+    record_sort(buffer.data(), buffer.size(), threads, memory / 2);
+    xfwrite(buffer.data(), buffer.size() * sizeof(struct record), file);
+    r.next = spilled;
+    r.end = spilled + buffer.size();
+    runs.push_back(r);
+    spilled = r.end;
+    buffer.clear();
+}
+
+void
+external_sort::finish()
+{
+    size_t window;
+
+    /* A single run is sorted in memory */
+    if (!file) {
+        record_sort(buffer.data(), buffer.size(), threads, memory / 2);
+        return;
+    }
+    if (!buffer.empty()) {
+        spill();
+    }
+
+    /* The memory is split between the windows of the runs */
+    window = std::max(capacity * 2 / runs.size(), (size_t)1);
+    std::vector<struct record>(window * runs.size()).swap(buffer);
+    for (int i=0; i<(int)runs.size(); ++i) {
+        runs[i].window = window * i;
+        if (refill(runs[i])) {
+            heap.push_back(i);
+        }
+    }
+    std::make_heap(heap.begin(), heap.end(), [&](int a, int b) {
+        return is_after(a, b);
+    });
+}
+
+bool
+external_sort::refill(struct run &r)
+{
+    size_t window = buffer.size() / runs.size();
+    size_t num = std::min(window, r.end - r.next);
+
+    if (!num) {
+        return false;
+    }
+    r.first = r.window;
+    xpread(file,
+           &buffer[r.first],
+           num * sizeof(struct record),
+           r.next * sizeof(struct record));
+    r.last = r.first + num;
+    r.next += num;
+    return true;
+}
+
+bool
+external_sort::is_after(int a, int b) const
+{
+    return record_less(buffer[runs[b].first], buffer[runs[a].first]);
+}
+
+int
+external_sort::next(struct record *m)
+{
+    auto after = [&](int a, int b) { return is_after(a, b); };
+    struct run *r;
+
+    if (!file) {
+        if (cursor >= buffer.size()) {
+            return 1;
+        }
+        *m = buffer[cursor++];
+        return 0;
+    }
+    if (heap.empty()) {
+        return 1;
+    }
+
+    /* The run of the smallest record moves to its next record */
+    std::pop_heap(heap.begin(), heap.end(), after);
+    r = &runs[heap.back()];
+    *m = buffer[r->first++];
+    if (r->first == r->last && !refill(*r)) {
+        heap.pop_back();
+    } else {
+        std::push_heap(heap.begin(), heap.end(), after);
+    }
+    return 0;
+}
+
+size_t
+external_sort::get_run_num() const
+{
+    return runs.size();
+}
+
+int
+external_sort::read_next(struct record *m, void *args)
+{
+    return ((external_sort*)args)->next(m);
+}
@@ -0,0 +1,89 @@
+#ifndef RECORD_SORT_H
+#define RECORD_SORT_H
+
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "record.h"
+
+/* Sorts "num" records by key, and the records of each key by value, with
+ * up to "threads" threads. A radix sort over the bytes of the keys and
+ * values that are not the same in all records. The records are
+ * partitioned by their most significant such byte, and threads sort the
+ * partitions by the rest, from the least significant byte (LSD), so small
+ * partitions are sorted in cache. The partitioning pass scatters the
+ * records to a buffer as large as them when it fits in "memory" bytes (0
+ * for no limit). Otherwise, it moves them in place, and the partitions are
+ * partitioned further in place (MSD) until they fit in the share of
+ * "memory" of their thread. */
+void record_sort(struct record *records,
+                 size_t num,
+                 int threads,
+                 size_t memory = 0);
+
+/* Returns true iff "records" are sorted as by "record_sort" */
+bool record_is_sorted(const struct record *records, size_t num);
+
+/* Sorts records that may not fit in memory, as "record_sort". Records are
+ * added in runs that fit in "memory" bytes, each sorted and spilled to a
+ * temporary file in "dir" once full. The runs are then merged as the
+ * records are read. Records that fit in a single run are never spilled. */
+class external_sort {
+
+    /* A spilled run: its records in [next,end) of the file are yet to be
+     * read, and [first,last) of its window in "buffer" to be merged */
+    struct run {
+        size_t next;
+        size_t end;
+        size_t window;
+        size_t first;
+        size_t last;
+    };
+
+    std::vector<struct record> buffer;
+    std::vector<struct run> runs;
+    std::vector<int> heap;
+    std::string dir;
+    FILE *file;
+    size_t memory;
+    size_t capacity;
+    size_t spilled;
+    size_t cursor;
+    int threads;
+
+    /* Sort the records of "buffer" and spill them as a run */
+    void spill();
+
+    /* Read the next records of "r" to its window. Returns false if it has
+     * none. */
+    bool refill(struct run &r);
+
+    /* Returns true iff the current record of run "a" is after that of
+     * run "b" (a min-heap order) */
+    bool is_after(int a, int b) const;
+
+public:
+
+    external_sort(size_t memory, int threads, const char *dir);
+    external_sort(const external_sort&) = delete;
+    ~external_sort();
+
+    /* Add "r" to the records */
+    void add(const struct record &r);
+
+    /* Done adding records. Call before "next". */
+    void finish();
+
+    /* Set "m" to the next record in order. Returns 0 on success, or 1 past
+     * the last record. */
+    int next(struct record *m);
+
+    /* Returns the number of runs that were spilled */
+    size_t get_run_num() const;
+
+    /* "next" as "next_record_func_t", with the external sort in "args" */
+    static int read_next(struct record *m, void *args);
+};
+
+#endif
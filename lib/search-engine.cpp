@@ -0,0 +1,71 @@
+#include <cstring>
+#include "eytzinger-engine.h"
+#include "nmu-engine.h"
+#include "perf.h"
+#include "pgm-engine.h"
+#include "search-engine.h"
+
+/* Indexed by engine type */
+static const char *engine_names[search_engine::ENGINE_NUM] = {
+    "nuevomatchup",
+    "eytzinger",
+    "pgm",
+};
+
+search_engine *
+search_engine::create(int type)
+{
+    switch (type) {
+    case NUEVOMATCHUP:
+        return new nmu_engine;
+    case EYTZINGER:
+        return new eytzinger_engine;
+    case PGM:
+        return new pgm_engine;
+    default:
+        return nullptr;
+    }
+}
+
+int
+search_engine::get_type(const char *name)
+{
+    for (int i=0; i<ENGINE_NUM; ++i) {
+        if (!strcmp(engine_names[i], name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *
+search_engine::get_name(int type)
+{
+    return type >= 0 && type < ENGINE_NUM ? engine_names[type] : "unknown";
+}
+
+void
+search_engine::search_batch_perf(std::array<uint64_t, N> &keys,
+                                 std::array<uint64_t, N> &base_ranges,
+                                 std::array<int, N> &buckets,
+                                 perf &stats) const
+{
+    PERF_START(search);
+    search_batch(keys, base_ranges, buckets);
+    PERF_END(search);
+    stats.search += search;
+}
+
+const int *
+search_engine::get_errors(size_t *num) const
+{
+    static const int exact[] = { 0 };
+    *num = 1;
+    return exact;
+}
+
+std::string
+search_engine::debug(uint64_t key) const
+{
+    return "";
+}
@@ -0,0 +1,103 @@
+#ifndef SEARCH_ENGINE_H
+#define SEARCH_ENGINE_H
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "binstream.h"
+#include "libnuevomatchup.h"
+
+/* Maps keys to buckets: for each key, finds the last range (the smallest key
+ * of a bucket) that is not greater than the key. The sorted ranges are
+ * stored by the db; each engine stores its own search structure next to
+ * them. */
+class search_engine {
+public:
+
+    /* Query batch size */
+    static constexpr int N = LNMU_BATCH_SIZE;
+
+    /* Engine types, as stored in the db header */
+    enum { NUEVOMATCHUP, EYTZINGER, PGM, ENGINE_NUM };
+
+    /* Maximal position error of learned engines, unless set */
+    static constexpr int DEFAULT_ERROR_BOUND = 32;
+
+    /* Build options. Engines ignore the options they do not use. */
+    struct options {
+        int compression;
+        std::vector<int> model_size;
+        int error_bound;
+        options() : compression(1), error_bound(DEFAULT_ERROR_BOUND) {}
+    };
+
+    /* Per-stage search times in ns, see "search_batch_perf" */
+    struct perf {
+        double inference;
+        double search;
+        double validate;
+    };
+
+    virtual ~search_engine() {}
+
+    /* Returns a new engine of type "type", or nullptr for an unknown type */
+    static search_engine *create(int type);
+
+    /* Returns the type named "name", or -1 if there is no such engine */
+    static int get_type(const char *name);
+
+    /* Returns the name of "type" */
+    static const char *get_name(int type);
+
+    /* Returns the type of this */
+    virtual int get_type() const = 0;
+
+    /* Build this over "size" sorted "ranges". Returns 0 on success. */
+    virtual int build(const uint64_t *ranges,
+                      size_t size,
+                      const options &opts) = 0;
+
+    /* Write the search structure of this to a binstream. The ranges are
+     * not written. */
+    virtual binstream& write(binstream&) const = 0;
+
+    /* Read a search structure written by "write" over "size" sorted
+     * "ranges", with the options this was built with. Returns 0 on
+     * success. */
+    virtual int read(binstream&,
+                     const uint64_t *ranges,
+                     size_t size,
+                     const options &opts) = 0;
+
+    /* For each i in [1..N]: set buckets[i] to the index of the range of
+     * keys[i], and base_ranges[i] to that range */
+    virtual void search_batch(std::array<uint64_t, N> &keys,
+                              std::array<uint64_t, N> &base_ranges,
+                              std::array<int, N> &buckets) const = 0;
+
+    /* Same as "search_batch", and adds the time of each stage to "stats".
+     * Engines without separate stages account everything as search. */
+    virtual void search_batch_perf(std::array<uint64_t, N> &keys,
+                                   std::array<uint64_t, N> &base_ranges,
+                                   std::array<int, N> &buckets,
+                                   perf &stats) const;
+
+    /* Returns the model error list (a single 0 for exact engines) */
+    virtual const int *get_errors(size_t *num) const;
+
+    /* Returns a debug string for searching "key" */
+    virtual std::string debug(uint64_t key) const;
+
+    /* Returns the number of ranges this searches over (after compression) */
+    virtual size_t get_range_num() const = 0;
+
+    /* Returns the ranges this searches over */
+    virtual const uint64_t *get_ranges() const = 0;
+
+    /* Returns the size of this in bytes, including its ranges */
+    virtual size_t get_size() const = 0;
+};
+
+#endif
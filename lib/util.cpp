@@ -1,3 +1,9 @@
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
 #include "util.h"
 #include "simd.h"
 
@@ -114,3 +120,162 @@ free_cacheline(void *p)
     free_size_align(p);
 }
 
+
+/* Allocates and returns at least 'size' bytes of memory, aligned to and
+ * backed by huge pages where possible. When 'hugetlb' is set, tries explicit
+ * huge pages first (those must be reserved by the admin, see
+ * /proc/sys/vm/nr_hugepages). Otherwise, or if none are free, asks for
+ * transparent huge pages. Sets '*out_size' to the size of the block.
+ *
+ * Use free_huge() to free the returned memory block. */
+void *
+xmalloc_huge(size_t size, bool hugetlb, size_t *out_size)
+{
+    void *p;
+    char *q;
+
+    size = ROUND_UP(size ? size : 1, HUGE_PAGE_SIZE);
+    if (hugetlb) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *out_size = size;
+            return p;
+        }
+    }
+
+    /* Over-allocate by a huge page, then trim to a huge page boundary, so
+     * that every 2MB of the block can be mapped by a single TLB entry */
+    p = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        abort_msg("Out of memory");
+    }
+    q = (char*)ROUND_UP((uintptr_t)p, HUGE_PAGE_SIZE);
+    if (q != (char*)p) {
+        munmap(p, q - (char*)p);
+    }
+    munmap(q + size, HUGE_PAGE_SIZE - (q - (char*)p));
+    madvise(q, size, MADV_HUGEPAGE);
+    *out_size = size;
+    return q;
+}
+
+/* Frees a memory block of 'size' bytes allocated with xmalloc_huge(). */
+void
+free_huge(void *p, size_t size)
+{
+    if (p) {
+        munmap(p, size);
+    }
+}
+
+/* Returns the number of bytes that are mapped with huge pages, in the
+ * mappings of this process that overlap [p, p+size). Returns 0 if unknown. */
+size_t
+get_huge_page_bytes(const void *p, size_t size)
+{
+    uintptr_t begin, end;
+    bool overlaps;
+    char line[256];
+    size_t total;
+    size_t kb;
+    FILE *fp;
+
+    fp = fopen("/proc/self/smaps", "r");
+    if (!fp) {
+        return 0;
+    }
+
+    total = 0;
+    overlaps = false;
+    while (fgets(line, sizeof(line), fp)) {
+        /* Mapping headers start with "begin-end", fields with a name */
+        if (sscanf(line, "%lx-%lx ", &begin, &end) == 2) {
+            overlaps = begin < (uintptr_t)p + size && end > (uintptr_t)p;
+        } else if (overlaps &&
+                   (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 ||
+                    sscanf(line, "ShmemPmdMapped: %lu kB", &kb) == 1 ||
+                    sscanf(line, "FilePmdMapped: %lu kB", &kb) == 1 ||
+                    sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1 ||
+                    sscanf(line, "Shared_Hugetlb: %lu kB", &kb) == 1)) {
+            total += kb << 10;
+        }
+    }
+    fclose(fp);
+    return total;
+}
+
+/* Returns the peak resident memory of this process so far, in bytes, or 0 if
+ * unknown. */
+size_t
+get_peak_rss()
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage)) {
+        return 0;
+    }
+    return (size_t)usage.ru_maxrss << 10;
+}
+
+/* Creates a temporary file in 'dir' (TMPDIR, or the system default, if NULL
+ * or empty), open for reading and writing. The file has no name, so it is
+ * removed once closed, or if the process dies. */
+FILE *
+xtmpfile(const char *dir)
+{
+    char path[PATH_MAX];
+    FILE *fp;
+    int fd;
+
+    if (!dir || !*dir) {
+        dir = getenv("TMPDIR");
+    }
+    if (!dir || !*dir) {
+        dir = P_tmpdir;
+    }
+    snprintf(path, sizeof(path), "%s/ranger-XXXXXX", dir);
+    fd = mkstemp(path);
+    if (fd < 0) {
+        abort_msg("Cannot create a temporary file");
+    }
+    unlink(path);
+    fp = fdopen(fd, "w+b");
+    if (!fp) {
+        abort_msg("Cannot open a temporary file");
+    }
+    return fp;
+}
+
+/* Writes 'size' bytes of 'data' to 'fp'. Aborts on failure (e.g., a full
+ * disk). */
+void
+xfwrite(const void *data, size_t size, FILE *fp)
+{
+    if (size && fwrite(data, 1, size, fp) != size) {
+        abort_msg("Cannot write to file");
+    }
+}
+
+/* Reads 'size' bytes at 'offset' of 'fp' to 'data', including the bytes
+ * that are written to 'fp' but not flushed yet. Does not move the position
+ * of 'fp'. Aborts on failure. */
+void
+xpread(FILE *fp, void *data, size_t size, uint64_t offset)
+{
+    ssize_t bytes;
+
+    if (fflush(fp)) {
+        abort_msg("Cannot write to file");
+    }
+    while (size) {
+        bytes = pread(fileno(fp), data, size, offset);
+        if (bytes <= 0) {
+            abort_msg("Cannot read from file");
+        }
+        data = (char*)data + bytes;
+        size -= bytes;
+        offset += bytes;
+    }
+}
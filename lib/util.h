@@ -1,6 +1,7 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <cstdio>
 #include <cstdlib>
 #include <cstdint>
 #include <cstddef>
@@ -16,11 +17,21 @@
 /* Returns the least number that, when added to X, yields a multiple of Y. */
 #define PAD_SIZE(X, Y) (ROUND_UP(X, Y) - (X))
 
+/* Size of a (PMD-level) huge page */
+#define HUGE_PAGE_SIZE (2UL << 20)
+
 void abort_msg(const char *msg);
 void * xmalloc(size_t size);
 void * xmalloc_size_align(size_t size, size_t alignment);
 void * xmalloc_cacheline(size_t size);
 void free_size_align(void *p);
 void free_cacheline(void *p);
+void * xmalloc_huge(size_t size, bool hugetlb, size_t *out_size);
+void free_huge(void *p, size_t size);
+size_t get_huge_page_bytes(const void *p, size_t size);
+size_t get_peak_rss();
+FILE * xtmpfile(const char *dir);
+void xfwrite(const void *data, size_t size, FILE *fp);
+void xpread(FILE *fp, void *data, size_t size, uint64_t offset);
 
 #endif
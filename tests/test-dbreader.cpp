@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdint>
 #include <cstdio>
@@ -6,15 +8,23 @@
 #include <cmath>
 #include <map>
 #include <set>
+#include <sstream>
+#include <string>
+#include <thread>
 #include <zlib.h>
 
 #include "lib/binstream.h"
+#include "lib/block-pipeline.h"
+#include "lib/bucket-kernels.h"
 #include "lib/db-builder.h"
 #include "lib/db-reader.h"
+#include "lib/db-tiered.h"
 #include "lib/record-file.h"
+#include "lib/record-sort.h"
 #include "lib/record.h"
 #include "lib/arguments.h"
 #include "lib/random.h"
+#include "lib/search-engine.h"
 #include "lib/util.h"
 
 /* Application arguments */
@@ -27,6 +37,7 @@ static arguments args[] = {
 {"export-ranges",       0, 0, NULL,     "Export db ranges to file."},
 {"seed",                0, 0, "print",  "Empty or 0 for random seed."},
 {"verbosity",           0, 0, "0",      "Test verbosity."},
+{"kernel",              0, 0, "",       "Bucket kernels. Empty for random."},
 {NULL,                  0, 0, NULL,     "Tests the correctness of db-reader."},
 };
 
@@ -38,9 +49,34 @@ static struct {
     uint32_t key_size;
     int key_num;
     int compression;
+    int verify_bits;
+    int filter_bits;
+    int cache_entries;
+    int engine;
+    int read_engine;
+    int error_bound;
+    int mapped;
+    int huge_pages;
+    int delta_values;
+    int appendix_shift;
+    int bucket_keys;
+    int slot_bits;
+    int hash_seeds;
+    int stash_keys;
+    int inline_values;
+    int narrow_values;
+    int value_bits;
+    int build_threads;
+    int sort_records;
+    int sort_memory;
+    int build_memory;
 } config;
 
+/* The db file in the mapped format, if "config.mapped" */
+static std::string mapfile;
+
 static record_file kdump;
+static db_reader::context ctx;
 static int verbosity;
 static size_t unique_keys = 0;
 
@@ -52,10 +88,16 @@ print_db_status(const db_builder &builder, struct db_builder::status status)
     }
 
     switch(status.status) {
+    case db_builder::DB_LOAD:
+        if (status.build_percent && !(status.build_percent % 25)) {
+            printf("Loaded %d%% of the records\n", status.build_percent);
+        }
+        break;
     case db_builder::DB_BUILD:
         printf("%d%% (utilization: %.3lf%% ranges: %lu "
                "singletons: %.1lf %% "
                "unique-keys: %lu "
+               "stashed: %lu "
                "buckets-size: %.3lf MB "
                "appendix-size: %.3lf MB)\n",
                status.build_percent,
@@ -63,6 +105,7 @@ print_db_status(const db_builder &builder, struct db_builder::status status)
                builder.get_ranges().size(),
                builder.get_singleton_percent()*100,
                builder.get_disctinct_key_num(),
+               builder.get_stashed_key_num(),
                builder.get_db_size()/1024.0/1024.0,
                builder.get_appendix().get_size()/1024.0/1024.0);
 
@@ -99,6 +142,33 @@ reset_seed()
     random_set_seed(seed);
 }
 
+static void
+select_kernels()
+{
+    std::vector<std::string> names;
+    std::stringstream ss;
+    const char *kernel;
+    std::string name;
+
+    kernel = ARG_STRING(args, "kernel", "");
+    if (strlen(kernel)) {
+        name = kernel;
+    } else {
+        ss << bucket_kernels_available();
+        while (ss >> name) {
+            names.push_back(name);
+        }
+        name = names[random_uint32() % names.size()];
+    }
+
+    if (bucket_kernels_select(name.c_str())) {
+        printf("Bucket kernels '%s' are not supported (available: %s)\n",
+               name.c_str(), bucket_kernels_available());
+        exit(EXIT_FAILURE);
+    }
+    printf("Using '%s' bucket kernels\n", bucket_kernels_get()->name);
+}
+
 static void
 test_init(int argc, char **argv)
 {
@@ -130,15 +200,85 @@ test_init(int argc, char **argv)
     config.key_mask = (1ULL<<(config.key_size*2)) - 1;
     config.key_num = 1<<(20 +(random_uint32() % 5));
     config.compression = 1<<(random_uint32()&3);
+    config.verify_bits = (random_uint32() % 3) * 8;
+    config.filter_bits = (random_uint32() % 2) * 10;
+    config.cache_entries = (random_uint32() % 2) << (8 + random_uint32() % 8);
+    config.engine = random_uint32() % search_engine::ENGINE_NUM;
+    /* Either the stored engine, or one that is built on read */
+    config.read_engine = random_uint32() % (search_engine::ENGINE_NUM + 1);
+    config.read_engine--;
+    config.error_bound = 1 << (random_uint32() % 8);
+    config.mapped = random_uint32() % 2;
+    config.huge_pages = random_uint32() % 3;
+    config.delta_values = random_uint32() % 2;
+    /* Either the smallest unit that fits, or a wider one */
+    config.appendix_shift = (int)(random_uint32() % 5) - 1;
+    config.bucket_keys = 16 << (random_uint32() % 3);
+    config.slot_bits = 8 << (random_uint32() % 2);
+    config.hash_seeds = (random_uint32() % 2) << (random_uint32() % 9);
+    config.stash_keys = (random_uint32() % 2) << (random_uint32() % 13);
+    config.inline_values = random_uint32() % 2 ? random_uint32() % 64 : 0;
+    config.narrow_values = random_uint32() % 2;
+    config.value_bits = 40 + 8 * (random_uint32() % 4);
+    config.build_threads = 1 << (random_uint32() % 4);
+    config.sort_records = random_uint32() % 2;
+    config.sort_memory = (random_uint32() % 2) << (random_uint32() % 28);
+    config.build_memory = (random_uint32() % 2) << (20 + random_uint32() % 6);
+    ctx.set_cache_size(config.cache_entries);
+
+    select_kernels();
 
     printf("Test configuration: "
            "key-size: %u key-mask: 0x%lX "
            "compression: %d "
-           "key-num: %d \n",
+           "key-num: %d "
+           "verify-bits: %d "
+           "filter-bits: %d "
+           "cache-entries: %d "
+           "engine: %s "
+           "read-engine: %s "
+           "error-bound: %d "
+           "mapped: %d "
+           "huge-pages: %d "
+           "delta-values: %d "
+           "appendix-shift: %d "
+           "bucket-keys: %d "
+           "slot-bits: %d "
+           "hash-seeds: %d "
+           "stash-keys: %d "
+           "inline-values: %d "
+           "narrow-values: %d "
+           "value-bits: %d "
+           "build-threads: %d "
+           "sort-records: %d "
+           "sort-memory: %d "
+           "build-memory: %d \n",
            config.key_size,
            config.key_mask,
            config.compression,
-           config.key_num);
+           config.key_num,
+           config.verify_bits,
+           config.filter_bits,
+           config.cache_entries,
+           search_engine::get_name(config.engine),
+           config.read_engine < 0 ? "stored" :
+           search_engine::get_name(config.read_engine),
+           config.error_bound,
+           config.mapped,
+           config.huge_pages,
+           config.delta_values,
+           config.appendix_shift,
+           config.bucket_keys,
+           config.slot_bits,
+           config.hash_seeds,
+           config.stash_keys,
+           config.inline_values,
+           config.narrow_values,
+           config.value_bits,
+           config.build_threads,
+           config.sort_records,
+           config.sort_memory,
+           config.build_memory);
 
     fflush(stdout);
 }
@@ -156,7 +296,7 @@ randomize_next_record(struct record *m, void *args)
     }
 
     counter++;
-    m->value = random_uint64();
+    m->value = random_uint64() >> (64 - config.value_bits);
 
     /* Generate the same key as before */
     if (remaining_key) {
@@ -233,6 +373,32 @@ populate_records(db_builder &db_builder)
     db_builder.build_model();
 }
 
+/* Set the build options of the configuration to "db_builder" */
+static void
+configure_builder(db_builder &db_builder)
+{
+    db_builder.set_compression(config.compression);
+    db_builder.set_verify_bits(config.verify_bits);
+    db_builder.set_filter_bits(config.filter_bits);
+    db_builder.set_search_engine(config.engine);
+    db_builder.set_error_bound(config.error_bound);
+    db_builder.set_appendix_encoding(config.delta_values ? appendix::DELTA :
+                                                           appendix::RAW);
+    db_builder.set_appendix_shift(config.appendix_shift);
+    if (db_builder.set_bucket_geometry(config.bucket_keys, config.slot_bits)) {
+        printf("Error: bucket geometry is not supported\n");
+        exit(EXIT_FAILURE);
+    }
+    db_builder.set_hash_seeds(config.hash_seeds);
+    db_builder.set_stash_size(config.stash_keys);
+    db_builder.set_inline_values(config.inline_values);
+    db_builder.set_narrow_values(config.narrow_values);
+    db_builder.set_build_threads(config.build_threads);
+    db_builder.set_sort_records(config.sort_records);
+    db_builder.set_sort_memory(config.sort_memory);
+    db_builder.set_build_memory(config.build_memory);
+}
+
 static void
 generate_database()
 {
@@ -246,7 +412,7 @@ generate_database()
     printf("Generating database... \n");
     fflush(stdout);
     db_builder.on_update().add_listener(print_db_status);
-    db_builder.set_compression(config.compression);
+    configure_builder(db_builder);
     populate_records(db_builder);
 
     printf("Saving db file to '%s'...\n", config.dbfile);
@@ -270,52 +436,85 @@ generate_database()
     }
 }
 
+static void
+check_values(uint64_t key, int num, char *ptr, db_reader &db)
+{
+    record_file::map_values *values;
+    std::vector<uint64_t> decoded;
+    uint64_t v;
+
+    values = kdump.get_map().at(key);
+    if (num != (int)values->size()) {
+        printf("\nError: value count mismatch for key %lu: "
+               "got %d expected %lu\n",
+               key,
+               num,
+               values->size());
+        printf("Debug string: %s\n", db.debug(key).c_str());
+        exit(EXIT_FAILURE);
+    }
+    decoded.resize(num);
+    db.get_values(ptr, num, &decoded[0]);
+    auto it = db.iterate_values64(ptr, num);
+    for (int j=0; j<num; j++) {
+        /* Both decoders return the same values */
+        if (!it.next(v) || v != decoded[j]) {
+            printf("\nError: value iterator mismatch for key %lu\n", key);
+            exit(EXIT_FAILURE);
+        }
+        if (v != values->at(j)) {
+            printf("\nError: value mismatch for key %lu: "
+                   "expected %lu, got %lu\n",
+                   key,
+                   values->at(j),
+                   v);
+            printf("%s\n", db.debug(key).c_str());
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (it.next(v)) {
+        printf("\nError: value iterator overrun for key %lu\n", key);
+        exit(EXIT_FAILURE);
+    }
+}
+
 static void
 test_exact_match(std::vector<uint64_t> &keys, db_reader &db)
 {
-    std::array<record_file::map_values*, db_reader::N> values_arr;
     std::array<uint64_t, db_reader::N> key_arr;
     std::array<int, db_reader::N> num;
     std::array<char*, db_reader::N> ptrs;
-    uint64_t v;
-    int idx;
-
-    auto &map = kdump.get_map();
 
     for (int i=0; i<db_reader::N; i++) {
-        idx = random_uint32() % keys.size();
-        key_arr[i] = keys[idx];
-        values_arr[i] = map.at(key_arr[i]);
+        key_arr[i] = keys[random_uint32() % keys.size()];
     }
 
-    db.query_perf(key_arr, num, ptrs);
+    db.query_perf(ctx, key_arr, num, ptrs);
 
     for (int i=0; i<db_reader::N; i++) {
-        /* Check that the number of values matches */
-        if (num[i] != (int)values_arr[i]->size()) {
-            printf("\nError: value count mismatch for key %lu: "
-                   "got %d expected %lu (batch idx: %d)\n",
-                   key_arr[i],
-                   num[i],
-                   map.at(key_arr[i])->size(),
-                   i);
-            printf("Debug string: %s\n", db.debug(key_arr[i]).c_str());
-            exit(EXIT_FAILURE);
-        }
-        /* Check that value is found */
-        for (int j=0; j<num[i]; j++) {
-            v = *((uint64_t*)ptrs[i] + j);
-            if (v != values_arr[i]->at(j)) {
-                printf("\nError: value mismatch for key %lu: "
-                       "expected %lu, got %lu (batch idx: %d)\n",
-                       key_arr[i],
-                       values_arr[i]->at(j),
-                       v,
-                       i);
-                printf("%s\n", db.debug(key_arr[i]).c_str());
-                exit(EXIT_FAILURE);
-            }
-        }
+        check_values(key_arr[i], num[i], ptrs[i], db);
+    }
+}
+
+static void
+test_query_many(std::vector<uint64_t> &keys, db_reader &db)
+{
+    const int MAX_KEYS = 67;
+    uint64_t key_arr[MAX_KEYS];
+    char *ptrs[MAX_KEYS];
+    int num[MAX_KEYS];
+    int n;
+
+    /* Any size, including a ragged tail */
+    n = 1 + random_uint32() % MAX_KEYS;
+    for (int i=0; i<n; i++) {
+        key_arr[i] = keys[random_uint32() % keys.size()];
+    }
+
+    db.query_many(ctx, key_arr, n, num, ptrs);
+
+    for (int i=0; i<n; i++) {
+        check_values(key_arr[i], num[i], ptrs[i], db);
     }
 }
 
@@ -330,6 +529,9 @@ perform_check(std::vector<uint64_t> &keys, db_reader &db)
 
     for (int i =0; i<TEST_NUM; ++i) {
         test_exact_match(keys, db);
+        if (!(i % 16)) {
+            test_query_many(keys, db);
+        }
         if (!(i %(TEST_NUM/10))) {
             printf(".");
             fflush(stdout);
@@ -338,27 +540,764 @@ perform_check(std::vector<uint64_t> &keys, db_reader &db)
 
     printf(" Done\n"
            "Stats: inference %.3lf ns search %.3lf ns "
-           "validate %.3lf ns lookup %.3lf ns\n",
-           db.get_stats_inference_ns(),
-           db.get_stats_search_ns(),
-           db.get_stats_validate_ns(),
-           db.get_stats_lookup_ns());
+           "validate %.3lf ns lookup %.3lf ns cache-hits %.3lf%%\n",
+           ctx.get_stats_inference_ns(),
+           ctx.get_stats_search_ns(),
+           ctx.get_stats_validate_ns(),
+           ctx.get_stats_lookup_ns(),
+           ctx.get_stats_cache_hits()*100);
+    printf("Huge pages: %.3lf MB\n", db.get_huge_page_bytes()/1024.0/1024.0);
+}
+
+static void
+test_concurrent_queries(std::vector<uint64_t> &keys, db_reader &db)
+{
+    const int THREAD_NUM = 4;
+    const int KEY_NUM = 1e5;
+    std::vector<std::vector<uint64_t>> thread_keys(THREAD_NUM);
+    std::vector<std::thread> threads;
 
+    printf("Performing concurrent queries with %d threads...", THREAD_NUM);
+    fflush(stdout);
+
+    /* The random generator is not thread-safe */
+    for (auto &vec : thread_keys) {
+        for (int i=0; i<KEY_NUM; i++) {
+            vec.push_back(keys[random_uint32() % keys.size()]);
+        }
+    }
+
+    /* Each thread owns a context; "db" is shared */
+    for (auto &vec : thread_keys) {
+        threads.push_back(std::thread([&db, &vec]() {
+            db_reader::context thread_ctx;
+            thread_ctx.set_cache_size(config.cache_entries);
+            std::vector<char*> ptrs(vec.size());
+            std::vector<int> num(vec.size());
+            db.query_many(thread_ctx, &vec[0], vec.size(), &num[0], &ptrs[0]);
+            for (size_t i=0; i<vec.size(); i++) {
+                check_values(vec[i], num[i], ptrs[i], db);
+            }
+        }));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    printf(" Done\n");
 }
 
 static void
-read_database(std::vector<uint64_t> &keys, db_reader &db)
+test_missing_keys(std::vector<uint64_t> &keys, db_reader &db)
+{
+    const int KEY_NUM = 1e5;
+    std::array<uint64_t, db_reader::N> key_arr;
+    std::array<int, db_reader::N> num_arr;
+    std::array<char*, db_reader::N> ptr_arr;
+    std::vector<uint64_t> missing;
+    std::vector<char*> ptrs;
+    std::vector<int> num;
+    db_reader::context missing_ctx;
+    uint64_t min, max, key;
+    double expected;
+    int found;
+
+    printf("Querying missing keys...");
+    fflush(stdout);
+
+    min = *std::min_element(keys.begin(), keys.end());
+    max = *std::max_element(keys.begin(), keys.end());
+    while ((int)missing.size() < KEY_NUM) {
+        key = min + random_uint64() % (max - min + 1);
+        if (!kdump.get_map().count(key)) {
+            missing.push_back(key);
+        }
+    }
+
+    num.resize(KEY_NUM);
+    ptrs.resize(KEY_NUM);
+    db.query_many(missing_ctx, &missing[0], KEY_NUM, &num[0], &ptrs[0]);
+
+    found = 0;
+    for (int i=0; i<KEY_NUM; i++) {
+        found += (num[i] != 0);
+    }
+
+    /* Allow for variance around the expected number of false positives */
+    expected = db.get_false_positive_rate() * KEY_NUM;
+    printf(" Done (verify-bits: %d filter-bits: %d false-positives: %d "
+           "expected: %.2lf filtered: %.2lf%%)\n",
+           db.get_verify_bits(),
+           db.get_filter_bits(),
+           found,
+           expected,
+           missing_ctx.get_stats_filtered()*100);
+    if (found > 3 * expected + 20) {
+        printf("Error: too many false positives\n");
+        exit(EXIT_FAILURE);
+    }
+    if (db.get_filter_bits() && missing_ctx.get_stats_filtered() < 0.9) {
+        printf("Error: too few keys were filtered\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Keys above the largest key are never found, also when mixed with
+     * present keys in the same batch */
+    for (int i=0; i<KEY_NUM/db_reader::N; i++) {
+        for (int j=0; j<db_reader::N; j++) {
+            key_arr[j] = random_coin(0.5) ?
+                         max + 1 + random_uint32() :
+                         keys[random_uint32() % keys.size()];
+        }
+        db.query(missing_ctx, key_arr, num_arr, ptr_arr);
+        for (int j=0; j<db_reader::N; j++) {
+            if (key_arr[j] <= max) {
+                check_values(key_arr[j], num_arr[j], ptr_arr[j], db);
+            } else if (num_arr[j]) {
+                printf("Error: key %lu above the largest key was found\n",
+                       key_arr[j]);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+
+/* Convert the db file to the mapped format, and map it to "db" */
+static int
+map_database(db_reader &db)
 {
+    std::vector<char> image;
+    char buffer[1<<16];
     gzFile fp;
+    FILE *out;
+    int error;
+    int size;
 
     fp = gzopen(config.dbfile, "rb");
+    while ((size = gzread(fp, buffer, sizeof(buffer))) > 0) {
+        image.insert(image.end(), buffer, buffer + size);
+    }
+    gzclose(fp);
 
-    zlib_binstream base = zlib_binstream(nullptr, fp);
-    binstream stream = binstream(base);
+    mapfile = std::string(config.dbfile) + ".map";
+    printf("Mapping db file '%s'...\n", mapfile.c_str());
+    fflush(stdout);
+    out = fopen(mapfile.c_str(), "wb");
+    if (!out) {
+        return 1;
+    }
+    error = db_reader::write_mapped(&image[0], image.size(), out);
+    error |= fclose(out);
+    return error || db.open_mmap(mapfile.c_str());
+}
+
+/* Iterates a vector of records, as "next_record_func_t" */
+struct record_iterator {
+    const std::vector<struct record> *records;
+    size_t next;
+};
+
+static int
+next_vector_record(struct record *m, void *args)
+{
+    record_iterator *it = (record_iterator*)args;
+
+    if (it->next >= it->records->size()) {
+        return 1;
+    }
+    *m = (*it->records)[it->next++];
+    return 0;
+}
+
+/* Returns the db that "threads" threads build from "records" within
+ * "memory" bytes, sorting them iff "sort", with an exact search engine so
+ * that it has no training noise */
+static std::string
+build_from_records(const std::vector<struct record> &records,
+                   int threads,
+                   bool sort,
+                   size_t memory)
+{
+    db_builder db_builder(true);
+    mem_binstream memstream;
+    binstream stream(memstream);
+    record_iterator it = { &records, 0 };
+    char *data;
+    size_t size;
+
+    configure_builder(db_builder);
+    db_builder.set_search_engine(search_engine::EYTZINGER);
+    db_builder.set_build_threads(threads);
+    db_builder.set_sort_records(sort);
+    db_builder.set_build_memory(memory);
+    db_builder.build(records.size(), next_vector_record, &it);
+    db_builder.build_model();
+    db_builder.write(stream);
+
+    data = (char*)memstream.detach_data(&size);
+    std::string out(data, size);
+    free(data);
+    return out;
+}
+
+/* Set "records" to the records of "kdump", sorted */
+static void
+get_records(std::vector<struct record> &records)
+{
+    /* The values of "kdump" are sorted once it is written */
+    for (auto &it : kdump.get_map()) {
+        for (uint64_t value : *it.second) {
+            records.push_back({ it.first, value });
+        }
+    }
+}
+
+/* A threaded build, a build of shuffled records, and a build within the
+ * memory budget, are the same as the serial build of sorted records */
+static void
+test_parallel_build()
+{
+    std::vector<struct record> records;
+    std::string serial;
+
+    if (config.build_threads <= 1 &&
+        !config.sort_records &&
+        !config.build_memory) {
+        return;
+    }
+
+    printf("Comparing serial and %d-thread builds%s%s...",
+           config.build_threads,
+           config.sort_records ? " of shuffled records" : "",
+           config.build_memory ? " in limited memory" : "");
+    fflush(stdout);
+
+    get_records(records);
+    serial = build_from_records(records, 1, false, 0);
+
+    if (config.build_threads > 1 &&
+        build_from_records(records, config.build_threads, false, 0) !=
+        serial) {
+        printf("\nError: the %d-thread build differs from the serial "
+               "build\n", config.build_threads);
+        exit(EXIT_FAILURE);
+    }
+    if (config.build_memory &&
+        build_from_records(records,
+                           config.build_threads,
+                           false,
+                           config.build_memory) != serial) {
+        printf("\nError: the build within %d bytes differs from the "
+               "serial build\n", config.build_memory);
+        exit(EXIT_FAILURE);
+    }
+    if (config.sort_records) {
+        for (size_t i=records.size()-1; i>0; --i) {
+            std::swap(records[i], records[random_uint64() % (i + 1)]);
+        }
+        if (build_from_records(records,
+                               config.build_threads,
+                               true,
+                               config.build_memory) != serial) {
+            printf("\nError: the build of shuffled records differs from "
+                   "the build of sorted records\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf(" Done\n");
+}
+
+/* A db that is read from its builder answers queries, and writes the db
+ * that its builder would write */
+static void
+test_read_builder(std::vector<uint64_t> &keys)
+{
+    std::vector<struct record> records;
+    db_builder db_builder(true);
+    mem_binstream memstream;
+    binstream stream(memstream);
+    record_iterator it = { &records, 0 };
+    db_reader db;
+    char *data;
+    size_t size;
+
+    printf("Reading the db from its builder...");
+    fflush(stdout);
+
+    get_records(records);
+    configure_builder(db_builder);
+    db_builder.set_search_engine(search_engine::EYTZINGER);
+    db_builder.set_build_threads(1);
+    db_builder.set_build_memory(0);
+    db_builder.build(records.size(), next_vector_record, &it);
+    db_builder.build_model();
+    if (db.read(db_builder)) {
+        printf("\nError: cannot read the db from its builder\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i=0; i<1000; ++i) {
+        test_exact_match(keys, db);
+    }
+
+    if (db.write(stream)) {
+        printf("\nError: cannot write the db read from its builder\n");
+        exit(EXIT_FAILURE);
+    }
+    data = (char*)memstream.detach_data(&size);
+    std::string image(data, size);
+    free(data);
+    if (size != db.get_image_size() ||
+        image != build_from_records(records, 1, false, 0)) {
+        printf("\nError: the db read from its builder is written "
+               "differently\n");
+        exit(EXIT_FAILURE);
+    }
+    printf(" Done\n");
+}
+
+/* Returns the values of "key" in "snap", as "values" expects them */
+static std::vector<uint64_t>
+get_tiered_values(const db_tiered::snapshot &snap,
+                  db_reader::context &ctx,
+                  uint64_t key)
+{
+    std::array<uint64_t, db_reader::N> keys;
+    std::array<int, db_reader::N> num;
+    std::array<char*, db_reader::N> ptr;
+    std::vector<uint64_t> values;
+
+    keys.fill(key);
+    snap.query(ctx, keys, num, ptr);
+    values.resize(num[0]);
+    snap.get_values(ptr[0], num[0], values.data());
+    return values;
+}
+
+/* A db that is updated in a delta tier answers queries with the updated
+ * values, before and after compactions that run while it is queried and
+ * updated */
+static void
+test_tiered_updates(std::vector<uint64_t> &keys)
+{
+    std::map<uint64_t, std::vector<uint64_t>> truth;
+    std::vector<struct record> records;
+    std::vector<db_tiered::update> updates;
+    std::atomic<bool> querying;
+    std::atomic<int> errors;
+    db_builder builder(true);
+    db_reader::context ctx;
+    record_iterator it = { &records, 0 };
+    db_reader db;
+    size_t tier_keys;
+    int compact_error;
+
+    printf("Updating the db in a delta tier...");
+    fflush(stdout);
+
+    get_records(records);
+    configure_builder(builder);
+    builder.set_build_memory(0);
+    builder.build(records.size(), next_vector_record, &it);
+    builder.build_model();
+    if (db.read(builder)) {
+        printf("\nError: cannot read the db to update\n");
+        exit(EXIT_FAILURE);
+    }
+    it.next = 0;
+    db_tiered tiered(std::move(db), records.size(), next_vector_record, &it);
+
+    /* Odd keys of the db, and new keys in its key range, are updated. Even
+     * keys of the db are queried meanwhile and must not change. */
+    auto update = [&](int batch) {
+        updates.clear();
+        for (int i=0; i<batch; ++i) {
+            db_tiered::update u;
+            if (random_coin(0.2)) {
+                do {
+                    u.key = random_uint64() & config.key_mask;
+                } while (kdump.get_map().count(u.key));
+            } else {
+                do {
+                    u.key = keys[random_range(keys.size())];
+                } while (!(u.key & 1));
+            }
+            u.value = random_uint64() >> (64 - config.value_bits);
+            u.op = random_range(10) < 6 ? db_tiered::INSERT :
+                   random_range(4) ? db_tiered::ERASE :
+                                     db_tiered::ERASE_KEY;
+            if (!truth.count(u.key)) {
+                auto found = kdump.get_map().find(u.key);
+                truth[u.key] = found == kdump.get_map().end() ?
+                               std::vector<uint64_t>() : *found->second;
+            }
+            std::vector<uint64_t> &list = truth[u.key];
+            if (u.op == db_tiered::ERASE &&
+                !list.empty() &&
+                random_coin(0.8)) {
+                u.value = list[random_range(list.size())];
+            }
+            auto pos = std::lower_bound(list.begin(), list.end(), u.value);
+            if (u.op == db_tiered::INSERT) {
+                list.insert(pos, u.value);
+            } else if (u.op == db_tiered::ERASE) {
+                if (pos != list.end() && *pos == u.value) {
+                    list.erase(pos);
+                }
+            } else {
+                list.clear();
+            }
+            updates.push_back(u);
+        }
+        return tiered.apply(updates.data(), updates.size());
+    };
+    /* Keys without values that are not in the tier are not in the db
+     * either, which may report false positives for them */
+    auto check = [&]() {
+        auto snap = tiered.get_snapshot();
+        int num;
+        char *ptr;
+        for (auto &t : truth) {
+            if (t.second.empty() &&
+                !snap->get_delta().find(t.first, num, ptr)) {
+                continue;
+            }
+            if (get_tiered_values(*snap, ctx, t.first) != t.second) {
+                return 1;
+            }
+        }
+        return 0;
+    };
+
+    errors = 0;
+    for (int round=0; round<3; ++round) {
+        for (int i=0; i<10; ++i) {
+            errors += update(1 + random_range(200));
+        }
+        errors += check();
+
+        querying = true;
+        std::thread reader([&]() {
+            db_reader::context reader_ctx;
+            size_t i = 0;
+            while (querying) {
+                uint64_t k = keys[i];
+                i = (i + 7919) % keys.size();
+                if (k & 1) {
+                    continue;
+                }
+                auto snap = tiered.get_snapshot();
+                if (get_tiered_values(*snap, reader_ctx, k) !=
+                    *kdump.get_map().at(k)) {
+                    errors++;
+                }
+            }
+        });
+        db_builder compactor(true);
+        configure_builder(compactor);
+        compactor.set_build_memory(0);
+        std::thread background([&]() {
+            compact_error = tiered.compact(compactor);
+        });
+        for (int i=0; i<10; ++i) {
+            errors += update(1 + random_range(20));
+        }
+        background.join();
+        errors += compact_error;
+        errors += check();
+        querying = false;
+        reader.join();
+    }
+    tier_keys = tiered.get_snapshot()->get_delta().get_key_num();
+
+    if (errors) {
+        printf("\nError: the updated db answers differently\n");
+        exit(EXIT_FAILURE);
+    }
+    printf(" Done (%lu keys updated, %lu in the tier, %lu base records)\n",
+           truth.size(),
+           tier_keys,
+           tiered.get_base_record_num());
+}
+
+/* Records that a compressing thread writes in blocks of any size are read
+ * back by a decompressing thread, also when the reader stops early */
+static void
+test_block_pipeline()
+{
+    std::string filename = std::string(config.dbfile) + ".pipe";
+    std::vector<struct record> records;
+    struct record m;
+    record_file dmp;
+    size_t block_size;
+    size_t num;
+    int depth;
+    gzFile fp;
+    int error;
+
+    get_records(records);
+    block_size = 1 + random_range(4096);
+    depth = 1 + random_range(4);
+    printf("Piping %lu records in %d blocks of %lu bytes...",
+           records.size(),
+           depth,
+           block_size);
+    fflush(stdout);
+
+    fp = gzopen(filename.c_str(), "w1h");
+    {
+        gz_block_writer writer(fp, block_size, depth);
+        gz_block_writer::stream base(writer);
+        binstream stream(base);
+        num = records.size();
+        stream << num;
+        for (auto &r : records) {
+            stream.write(&r, sizeof(r));
+        }
+        error = writer.finish();
+    }
+    error |= gzclose(fp);
+
+    error |= dmp.open_read(filename.c_str());
+    error |= dmp.prefetch(block_size, depth);
+    error |= dmp.get_size() != records.size();
+    for (size_t i=0; !error && i<records.size(); ++i) {
+        error = record_file::read_next(&m, &dmp) ||
+                m.key != records[i].key ||
+                m.value != records[i].value;
+    }
+    error |= !record_file::read_next(&m, &dmp);
+    error |= dmp.get_reader()->get_error();
+    /* The header was read before the thread started */
+    error |= dmp.get_reader()->get_stats().bytes !=
+             records.size() * sizeof(struct record);
+    dmp.close();
+
+    /* Destroying the reader stops its thread mid-file */
+    error |= dmp.open_read(filename.c_str());
+    error |= dmp.prefetch(block_size, depth);
+    for (size_t i=0; !error && i<records.size()/2; ++i) {
+        error = record_file::read_next(&m, &dmp);
+    }
+    dmp.close();
+    remove(filename.c_str());
+
+    if (error) {
+        printf("\nError: the records read through the pipeline differ "
+               "from those written\n");
+        exit(EXIT_FAILURE);
+    }
+    printf(" Done\n");
+}
+
+/* Sort random records with all sort strategies, and compare to std::sort */
+static void
+test_record_sort()
+{
+    std::vector<struct record> records, expected;
+    struct record m;
+    size_t num, memory;
+    uint64_t key_mask;
+    int threads;
+
+    printf("Testing record sort...");
+    fflush(stdout);
+
+    for (int i=0; i<20; ++i) {
+        num = random_uint32() % (1 << (random_uint32() % 20));
+        key_mask = random_uint64() >> (random_uint32() % 64);
+        threads = 1 + random_uint32() % 8;
+
+        /* No limit (LSD), or a part of the records' size (MSD) */
+        memory = random_uint32() % 2 ?
+                 0 : random_uint32() % (num * sizeof(struct record) + 1);
+
+        records.resize(num);
+        for (auto &r : records) {
+            r.key = random_uint64() & key_mask;
+            r.value = random_uint32() % 2 ? random_uint32() % 4 :
+                                            random_uint64();
+        }
+        expected = records;
+        std::sort(expected.begin(), expected.end(),
+                  [](const struct record &a, const struct record &b) {
+                      return a.key < b.key ||
+                             (a.key == b.key && a.value < b.value);
+                  });
+
+        /* Spilled in up to 128 runs */
+        external_sort sorter(num * sizeof(struct record) /
+                             (1 + random_uint32() % 64) + 32,
+                             threads,
+                             nullptr);
+        for (auto &r : records) {
+            sorter.add(r);
+        }
+        sorter.finish();
+        for (size_t j=0; j<=num; ++j) {
+            if (sorter.next(&m) != (j == num) ||
+                (j < num && (m.key != expected[j].key ||
+                             m.value != expected[j].value))) {
+                printf("\nError: record %lu of %lu is out of order in %lu "
+                       "runs\n", j, num, sorter.get_run_num());
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        record_sort(records.data(), num, threads, memory);
+        for (size_t j=0; j<num; ++j) {
+            if (records[j].key != expected[j].key ||
+                records[j].value != expected[j].value) {
+                printf("\nError: record %lu of %lu is out of order with "
+                       "%d threads and %lu bytes\n",
+                       j, num, threads, memory);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (!record_is_sorted(records.data(), num)) {
+            printf("\nError: sorted records are not reported sorted\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf(" Done\n");
+}
+
+/* The hash CRC of every kernel must match, as the dbs depend on it */
+static void
+test_crc_kernels()
+{
+    const int NUM = 100000;
+    const struct bucket_kernels *first = nullptr;
+    const struct bucket_kernels *k;
+    const char *selected;
+    uint64_t crc, data;
+    std::stringstream ss;
+    std::string name;
+
+    printf("Testing the CRC of all kernels...");
+    fflush(stdout);
+    selected = bucket_kernels_get()->name;
+    ss << bucket_kernels_available();
+    while (ss >> name) {
+        bucket_kernels_select(name.c_str());
+        k = bucket_kernels_get();
+        if (!first) {
+            first = k;
+            continue;
+        }
+        for (int i=0; i<NUM; ++i) {
+            crc = random_uint64();
+            data = random_uint64();
+            if (k->crc32_u64(crc, data) != first->crc32_u64(crc, data)) {
+                printf("\nError: CRC mismatch of '%s' and '%s' kernels\n",
+                       k->name, first->name);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    bucket_kernels_select(selected);
+    printf(" Done\n");
+}
+
+/* Round-trip value lists of all delta widths through every kernel */
+static void
+test_appendix_encoding()
+{
+    const int LIST_NUM = 1000;
+    std::vector<std::vector<uint64_t>> lists64(LIST_NUM);
+    std::vector<std::vector<uint32_t>> lists32(LIST_NUM);
+    std::vector<uint64_t> offsets64, offsets32;
+    std::vector<uint64_t> out64;
+    std::vector<uint32_t> out32;
+    const char *selected;
+    std::stringstream ss;
+    std::string name;
+    appendix apdx64;
+    appendix apdx32;
+    uint64_t offset;
+    uint64_t mask;
+    int width;
+    int shift;
+
+    printf("Testing appendix encoding...");
+    fflush(stdout);
+
+    shift = random_uint32() % 4;
+    apdx64.set_encoding(appendix::DELTA);
+    apdx32.set_encoding(appendix::DELTA);
+    apdx64.set_shift(shift);
+    apdx32.set_shift(shift);
+    for (int i=0; i<LIST_NUM; ++i) {
+        width = random_uint32() % 65;
+        mask = width == 64 ? UINT64_MAX : (1ULL << width) - 1;
+        lists64[i].push_back(random_uint64() & mask);
+        lists32[i].push_back(random_uint32() & mask);
+        for (int j=1 + random_uint32() % 100; j>0; --j) {
+            lists64[i].push_back(random_uint64() & mask);
+            lists32[i].push_back(random_uint32() & mask);
+        }
+        offset = apdx64.add_element64(lists64[i]) >> 32;
+        offsets64.push_back(offset << shift);
+        /* 32-bit lists start with their value count */
+        offset = apdx32.add_element32(lists32[i]);
+        offsets32.push_back((offset << shift) + sizeof(uint32_t));
+    }
+
+    selected = bucket_kernels_get()->name;
+    ss << bucket_kernels_available();
+    while (ss >> name) {
+        bucket_kernels_select(name.c_str());
+        for (int i=0; i<LIST_NUM; ++i) {
+            out64.resize(lists64[i].size());
+            out32.resize(lists32[i].size());
+            appendix::decode64(appendix::DELTA,
+                               apdx64.get_data() + offsets64[i],
+                               out64.size(),
+                               &out64[0]);
+            appendix::decode32(appendix::DELTA,
+                               apdx32.get_data() + offsets32[i],
+                               out32.size(),
+                               &out32[0]);
+            /* "add_element" sorts the lists */
+            if (out64 != lists64[i] || out32 != lists32[i]) {
+                printf("\nError: appendix list %d mismatch with '%s' "
+                       "kernels\n", i, name.c_str());
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    bucket_kernels_select(selected);
+    printf(" Done\n");
+}
+
+static void
+read_database(std::vector<uint64_t> &keys, db_reader &db)
+{
+    gzFile fp;
+    int error;
 
     printf("Reading db file from '%s'...\n", config.dbfile);
     fflush(stdout);
-    db.read(stream);
+    db.set_search_engine(config.read_engine);
+    db.set_huge_pages(config.huge_pages);
+    if (config.mapped) {
+        error = map_database(db);
+    } else {
+        fp = gzopen(config.dbfile, "rb");
+        zlib_binstream base = zlib_binstream(nullptr, fp);
+        binstream stream = binstream(base);
+        error = db.read(stream);
+        gzclose(fp);
+    }
+    if (error) {
+        printf("Error: cannot read db file\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("Using '%s' search engine, %d-key buckets with %d-bit slots "
+           "and %d-byte values, %lu stashed keys\n",
+           search_engine::get_name(db.get_search_engine()),
+           db.get_bucket_geometry().keys,
+           db.get_bucket_geometry().slot_bits,
+           db.get_bucket_geometry().get_value_bytes(),
+           db.get_stashed_key_num());
 
     if (!kdump.get_mode()) {
         printf("Reading key dump file from '%s'...\n", config.dumpfile);
@@ -389,6 +1328,19 @@ main(int argc, char **argv)
     read_database(keys, db);
     generate_key_list(keys);
     perform_check(keys, db);
+    test_missing_keys(keys, db);
+    test_concurrent_queries(keys, db);
+    test_crc_kernels();
+    test_appendix_encoding();
+    test_record_sort();
+    test_parallel_build();
+    test_read_builder(keys);
+    test_block_pipeline();
+    test_tiered_updates(keys);
+
+    if (config.mapped) {
+        remove(mapfile.c_str());
+    }
 
     if (!ARG_BOOL(args, "keep", 0) && config.randomize) {
         printf("Deleting \"%s\" and \"%s\"\n", config.dbfile, config.dumpfile);
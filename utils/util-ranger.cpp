@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
@@ -10,6 +11,8 @@
 
 #include "lib/appendix.h"
 #include "lib/binstream.h"
+#include "lib/block-pipeline.h"
+#include "lib/bucket-kernels.h"
 #include "lib/db-builder.h"
 #include "lib/db-reader.h"
 #include "lib/record.h"
@@ -19,6 +22,8 @@
 #include "lib/perf.h"
 #include "lib/print-utils.h"
 #include "lib/random.h"
+#include "lib/search-engine.h"
+#include "lib/util.h"
 
 /* Application arguments */
 static arguments args[] = {
@@ -36,6 +41,40 @@ static arguments args[] = {
                                "record-file. Create index db file. \n"
                                "Knobs: \n"
                                "-n1: ranges compression factor (default: 16)\n"
+                               "-verify: key verification bits per slot "
+                               "(default: 0)\n"
+                               "-filter: key filter bits per key "
+                               "(default: 0)\n"
+                               "-engine: range search engine, "
+                               "'nuevomatchup', 'eytzinger' or 'pgm' "
+                               "(default: nuevomatchup)\n"
+                               "-error: PGM model error bound "
+                               "(default: 32)\n"
+                               "-delta: delta-encode the value lists of "
+                               "keys with several values\n"
+                               "-keys: keys per bucket, 16, 32 or 64 "
+                               "(default: 32)\n"
+                               "-slot: hash slot bits, 8 or 16 "
+                               "(default: 16)\n"
+                               "-seeds: hash seeds to try per bucket "
+                               "(default: 0)\n"
+                               "-stash: colliding keys to stash "
+                               "(default: 0)\n"
+                               "-inline: inline lists of up to this "
+                               "many values in buckets (default: 0)\n"
+                               "-narrow: store 64-bit values in 5 or 6 "
+                               "bytes when they fit\n"
+                               "-threads: build threads (default: 1)\n"
+                               "-memory: build memory budget in MB, "
+                               "beyond which the db is built in "
+                               "temporary files (default: 0, no limit)\n"
+                               "-spill: directory of the temporary files "
+                               "(default: TMPDIR or /tmp)\n"
+                               "-pipe: blocks that the decompressing and "
+                               "the compressing threads run ahead of the "
+                               "build, 0 to read and write on the build "
+                               "thread (default: 4)\n"
+                               "-mapped: write the memory-mapped format\n"
                                "-out: the output database filename."
                                "\n\n"
 
@@ -44,12 +83,28 @@ static arguments args[] = {
                                "accesses to the index and print "
                                "performance statistics to stdout. \n"
                                "Knobs: \n"
-                               "-n1: number of accesses (default: 1000000)"
+                               "-n1: number of accesses (default: 1000000)\n"
+                               "-kernel: bucket kernels to use "
+                               "(default: best available)\n"
+                               "-cache: query result cache entries "
+                               "(default: 0)\n"
+                               "-engine: range search engine, built from "
+                               "the ranges on load, or 'all' to compare "
+                               "all engines on the same keys "
+                               "(default: the engine stored in the db)\n"
+                               "-huge: back the buckets and appendix with "
+                               "huge pages: 0 none, 1 transparent, "
+                               "2 explicit (default: 0)\n"
+                               "-mapped: 'input' is in the memory-mapped "
+                               "format"
                                "\n\n"
 
                                "* 'extract-ranges' treat 'input' "
                                "as an index db file. Print ranges "
-                               "to stdout in human readable format."
+                               "to stdout in human readable format.\n"
+                               "Knobs: \n"
+                               "-mapped: 'input' is in the memory-mapped "
+                               "format"
                                "\n\n"
 },
 {"seed",   0, 0, "print",      "Random seed. Default is random seed."},
@@ -57,10 +112,32 @@ static arguments args[] = {
 {"factor", 0, 0, "0",          "Output file gzip compression factor "
                                "(in [0,9]). 0 Stands for no compression."},
 {"n1",     0, 0, "0",          "General purpose numeric knob."},
+{"kernel", 0, 0, "",           "Bucket kernels (e.g., 'avx2')."},
+{"verify", 0, 0, "0",          "Key verification bits per slot, in [0,16]."},
+{"filter", 0, 0, "0",          "Key filter bits per key."},
+{"cache",  0, 0, "0",          "Query result cache entries."},
+{"engine", 0, 0, "",           "Range search engine (e.g., 'eytzinger')."},
+{"error",  0, 0, "32",         "PGM model error bound."},
+{"mapped", 0, 1, 0,            "Use the memory-mapped db format."},
+{"huge",   0, 0, "0",          "Huge pages mode, in [0,2]."},
+{"delta",  0, 1, 0,            "Delta-encode appendix value lists."},
+{"keys",   0, 0, "32",         "Keys per bucket: 16, 32 or 64."},
+{"slot",   0, 0, "16",         "Hash slot bits: 8 or 16."},
+{"seeds",  0, 0, "0",          "Hash seeds per bucket, in [0,256]."},
+{"stash",  0, 0, "0",          "Stash size, in colliding keys."},
+{"inline", 0, 0, "0",          "Inlined list values, in [0,63]."},
+{"narrow", 0, 1, 0,            "Store values in the fewest bytes."},
+{"threads", 0, 0, "1",         "Build threads."},
+{"memory", 0, 0, "0",          "Build memory budget, in MB."},
+{"spill",  0, 0, "",           "Directory of temporary build files."},
+{"pipe",   0, 0, "4",          "Build pipeline depth, in blocks."},
 {NULL,     0, 0, NULL,         "Various utils for inspecing libranger index "
                                "db files."},
 };
 
+/* The block size of the build pipeline */
+static constexpr size_t PIPE_BLOCK = 1<<20;
+
 static struct print_utils *print_utls;
 static int seed = 0;
 static int verbosity = 0;
@@ -85,6 +162,7 @@ print_db_build_status(const db_builder &builder,
                        "%d%% (utilization: %.3lf%% ranges: %lu "
                        "singletons: %.1lf %% "
                        "unique-keys: %lu "
+                       "stashed: %lu "
                        "buckets-size: %.3lf MB "
                        "appendix-size: %.3lf MB)\n",
                        status.build_percent,
@@ -92,6 +170,7 @@ print_db_build_status(const db_builder &builder,
                        builder.get_ranges().size(),
                        builder.get_singleton_percent()*100,
                        builder.get_disctinct_key_num(),
+                       builder.get_stashed_key_num(),
                        builder.get_db_size()/1024.0/1024.0,
                        builder.get_appendix().get_size()/1024.0/1024.0);
     print_utils_flush(print_utls);
@@ -112,7 +191,13 @@ static void
 print_db_status(const db_builder &builder,
                 struct db_builder::status status)
 {
-    if (status.status == db_builder::DB_BUILD) {
+    if (status.status == db_builder::DB_LOAD) {
+        if (status.build_percent && !(status.build_percent % 25)) {
+            print_utils_printf(print_utls,
+                               "Loaded %d%% of the records\n",
+                               status.build_percent);
+        }
+    } else if (status.status == db_builder::DB_BUILD) {
         print_db_build_status(builder, status);
     } else if (status.status == db_builder::DONE_TRAINING) {
         print_model_errors(status);
@@ -131,6 +216,33 @@ open_input_as_dumpfile(record_file &dmpfile)
     }
 }
 
+/* Read the db file "filename" into "db", in the memory-mapped format if
+ * requested. Exits on error. */
+static void
+read_db_file(const char *filename, db_reader &db)
+{
+    gzFile fp;
+    int error;
+
+    printf("Reading db file from '%s'...\n", filename);
+    fflush(stdout);
+
+    if (ARG_BOOL(args, "mapped", 0)) {
+        error = db.open_mmap(filename);
+    } else {
+        fp = gzopen(filename, "rb");
+        zlib_binstream base = zlib_binstream(nullptr, fp);
+        binstream stream = binstream(base);
+        error = db.read(stream);
+        gzclose(fp);
+    }
+
+    if (error) {
+        printf("Cannot read db file\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
 static void
 mode_print()
 {
@@ -139,14 +251,112 @@ mode_print()
     dmp.print(stdout);
 }
 
+/* Write the db of "builder" to "out" in the memory-mapped format.
+ * Exits on error. */
+static void
+write_mapped(db_builder &builder, const char *out)
+{
+    mem_binstream memstream;
+    binstream stream(memstream);
+    char *image;
+    size_t size;
+    FILE *fp;
+    int error;
+
+    builder.write(stream);
+    image = (char*)memstream.detach_data(&size);
+
+    fp = fopen(out, "wb");
+    error = !fp || db_reader::write_mapped(image, size, fp);
+    if (fp) {
+        error |= fclose(fp);
+    }
+    free(image);
+
+    if (error) {
+        printf("Cannot write db file '%s'\n", out);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Print the throughput of the pipeline stage "name", which passed on
+ * "bytes" in "busy_ns", and waited for the other stages "wait_ns" */
+static void
+print_stage(const char *name,
+            uint64_t bytes,
+            uint64_t busy_ns,
+            uint64_t wait_ns)
+{
+    printf("  %-15s %10.3lf MB busy: %8.3lf sec (%9.3lf MB/s) "
+           "stalled: %8.3lf sec\n",
+           name,
+           bytes/1024.0/1024.0,
+           busy_ns/1e9,
+           busy_ns ? bytes/1024.0/1024.0/(busy_ns/1e9) : 0,
+           wait_ns/1e9);
+}
+
+/* Print the input stages of the build pipeline, in which the records of
+ * "dmpfile" were built in "build_ns" */
+static void
+print_input_stages(const record_file &dmpfile, uint64_t build_ns)
+{
+    const gz_block_reader *reader = dmpfile.get_reader();
+
+    if (!reader) {
+        return;
+    }
+    print_stage("decompress",
+                reader->get_stats().bytes,
+                reader->get_stats().busy_ns,
+                reader->get_stats().wait_ns);
+    print_stage("pack",
+                dmpfile.get_size() * sizeof(struct record),
+                build_ns - reader->get_wait_ns(),
+                reader->get_wait_ns());
+}
+
+/* Write the db of "builder" to "fp" with a compressing thread that runs
+ * up to "depth" blocks behind. Prints the output stages of the build
+ * pipeline. Returns 0 on success. */
+static int
+write_pipelined(db_builder &builder, gzFile fp, int depth)
+{
+    gz_block_writer writer(fp, PIPE_BLOCK, depth);
+    gz_block_writer::stream base(writer);
+    binstream stream(base);
+    uint64_t serialize_ns;
+    int error;
+
+    serialize_ns = get_time_ns();
+    builder.write(stream);
+    error = writer.finish();
+    serialize_ns = get_time_ns() - serialize_ns;
+
+    printf("\n");
+    print_stage("serialize",
+                writer.get_stats().bytes,
+                serialize_ns - writer.get_wait_ns(),
+                writer.get_wait_ns());
+    print_stage("compress/write",
+                writer.get_stats().bytes,
+                writer.get_stats().busy_ns,
+                writer.get_stats().wait_ns);
+    return error;
+}
+
 static void
 mode_build_db_from_dump()
 {
     record_file dmpfile;
     db_builder db_builder(true);
+    const char *engine;
     const char *out;
     int compression;
+    int engine_type;
     int factor;
+    int depth;
+    int error;
     gzFile fp;
     char mode[4];
 
@@ -155,38 +365,81 @@ mode_build_db_from_dump()
 
     out = ARG_STRING(args, "out", NULL);
     factor = ARG_INTEGER(args, "factor", 0);
+    depth = ARG_INTEGER(args, "pipe", 4);
+    engine = ARG_STRING(args, "engine", "");
+    engine_type = strlen(engine) ? search_engine::get_type(engine) :
+                                   search_engine::NUEVOMATCHUP;
 
-    if (!out) {
+    if (!out || engine_type < 0 || depth < 0) {
         printf("Invalid configuration arguments\n");
         exit(EXIT_FAILURE);
     }
 
     open_input_as_dumpfile(dmpfile);
+    if (depth) {
+        dmpfile.prefetch(PIPE_BLOCK, depth);
+    }
 
     printf("Building database...\n");
     fflush(stdout);
     PERF_START(build);
     db_builder.on_update().add_listener(print_db_status);
     db_builder.set_compression(compression);
+    db_builder.set_verify_bits(ARG_INTEGER(args, "verify", 0));
+    db_builder.set_filter_bits(ARG_INTEGER(args, "filter", 0));
+    db_builder.set_search_engine(engine_type);
+    db_builder.set_error_bound(ARG_INTEGER(args, "error", 32));
+    db_builder.set_appendix_encoding(ARG_BOOL(args, "delta", 0) ?
+                                     appendix::DELTA : appendix::RAW);
+    if (db_builder.set_bucket_geometry(ARG_INTEGER(args, "keys", 32),
+                                       ARG_INTEGER(args, "slot", 16))) {
+        printf("Invalid bucket geometry\n");
+        exit(EXIT_FAILURE);
+    }
+    db_builder.set_hash_seeds(ARG_INTEGER(args, "seeds", 0));
+    db_builder.set_stash_size(ARG_INTEGER(args, "stash", 0));
+    db_builder.set_inline_values(ARG_INTEGER(args, "inline", 0));
+    db_builder.set_narrow_values(ARG_BOOL(args, "narrow", 0));
+    db_builder.set_build_threads(ARG_INTEGER(args, "threads", 1));
+    db_builder.set_build_memory((size_t)ARG_INTEGER(args, "memory", 0) << 20);
+    db_builder.set_spill_dir(ARG_STRING(args, "spill", ""));
     db_builder.build(dmpfile.get_size(), record_file::read_next, &dmpfile);
     PERF_END(build);
-    printf("total time: %.3lf sec\n", build/1e9);
+    printf("total time: %.3lf sec peak memory: %.3lf MB\n",
+           build/1e9,
+           get_peak_rss()/1024.0/1024.0);
+    print_input_stages(dmpfile, build);
 
-    printf("Training model... \n");
+    printf("Training %s search engine... \n",
+           search_engine::get_name(engine_type));
     db_builder.build_model();
     fflush(stdout);
 
     printf("Saving to '%s' (gzip compression factor: %d)...", out, factor);
     fflush(stdout);
     PERF_START(dump);
-    snprintf(mode, sizeof(mode), "w%1dh", factor);
-    fp = gzopen(out, mode);
-    zlib_binstream base = zlib_binstream(fp, nullptr);
-    binstream stream = binstream(base);
-    db_builder.write(stream);
-    gzclose(fp);
+    if (ARG_BOOL(args, "mapped", 0)) {
+        write_mapped(db_builder, out);
+    } else {
+        snprintf(mode, sizeof(mode), "w%1dh", factor);
+        fp = gzopen(out, mode);
+        if (depth) {
+            error = write_pipelined(db_builder, fp, depth);
+        } else {
+            zlib_binstream base = zlib_binstream(fp, nullptr);
+            binstream stream = binstream(base);
+            db_builder.write(stream);
+            error = 0;
+        }
+        if (error | gzclose(fp)) {
+            printf("Cannot write db file '%s'\n", out);
+            exit(EXIT_FAILURE);
+        }
+    }
     PERF_END(dump);
-    printf(" total time: %.3lf ms\n", dump/1e6);
+    printf(" total time: %.3lf ms peak memory: %.3lf MB\n",
+           dump/1e6,
+           get_peak_rss()/1024.0/1024.0);
 }
 
 static void
@@ -195,20 +448,12 @@ mode_extract_ranges()
     const char *filename, *out;
     db_reader db;
     size_t size;
-    gzFile fp;
     FILE *fp2;
 
     filename = ARG_STRING(args, "file", "");
     out = ARG_STRING(args, "out", NULL);
 
-    fp = gzopen(filename, "rb");
-    zlib_binstream base = zlib_binstream(nullptr, fp);
-    binstream stream = binstream(base);
-
-    printf("Reading db file from '%s'...\n", filename);
-    fflush(stdout);
-    db.read(stream);
-    gzclose(fp);
+    read_db_file(filename, db);
 
     printf("Writing ranges to file '%s'...\n", out);
     fp2 = fopen(out, "w");
@@ -219,50 +464,145 @@ mode_extract_ranges()
     fclose(fp2);
 }
 
+/* Perform "count" random queries on "filename" with search engine
+ * "engine_type" (-1 for the engine stored in the db) */
 static void
-mode_perf_test()
+perf_test_engine(const char *filename, int count, int engine_type)
 {
     std::array<uint64_t, db_reader::N> inputs;
     std::array<char*, db_reader::N> ptr;
     std::array<int, db_reader::N> num;
+    std::vector<uint64_t> values;
+    db_reader::context ctx;
     uint64_t min, max, diff;
-    const char *filename;
-    int count;
+    uint64_t page_walks;
+    uint64_t decode_ns;
+    uint64_t start_ns;
+    size_t decoded;
     db_reader db;
-    gzFile fp;
+    int fd;
 
+    ctx.set_cache_size(ARG_INTEGER(args, "cache", 0));
+    db.set_search_engine(engine_type);
+    db.set_huge_pages(ARG_INTEGER(args, "huge", 0));
 
-    filename = ARG_STRING(args, "file", "");
-    count = ARG_INTEGER(args, "n1", 0);
-    count = count != 0 ? count : 1000000;
+    PERF_START(read);
+    read_db_file(filename, db);
+    PERF_END(read);
+    printf("Using '%s' search engine (load time: %.3lf ms, size: %.3lf MB)\n",
+           search_engine::get_name(db.get_search_engine()),
+           read/1e6,
+           db.get_total_bytes()/1024.0/1024.0);
 
-    fp = gzopen(filename, "rb");
-    zlib_binstream base = zlib_binstream(nullptr, fp);
-    binstream stream = binstream(base);
-
-    printf("Reading db file from '%s'...\n", filename);
-    fflush(stdout);
-    db.read(stream);
-    gzclose(fp);
+    /* The same keys for every engine */
+    reset_seed();
 
     printf("Performing test...\n");
     fflush(stdout);
     min = db.get_ranges()[0];
     max = db.get_ranges()[db.get_range_num()-1];
     diff = max-min;
+    fd = perf_page_walks_open();
+    page_walks = perf_page_walks_read(fd);
+    decode_ns = 0;
+    decoded = 0;
     for (int i=0; i<count; i++) {
         for (int j=0; j<db_reader::N; ++j) {
             inputs[j] = min + (random_uint32() % diff);
         }
-        db.query_perf(inputs, num, ptr);
+        db.query_perf(ctx, inputs, num, ptr);
+
+        /* Value lists are decoded by the caller, on demand */
+        start_ns = get_time_ns();
+        for (int j=0; j<db_reader::N; ++j) {
+            if (num[j] > 1) {
+                values.resize(std::max(values.size(), (size_t)num[j]));
+                db.get_values(ptr[j], num[j], &values[0]);
+                decoded += num[j];
+            }
+        }
+        decode_ns += get_time_ns() - start_ns;
     }
+    page_walks = perf_page_walks_read(fd) - page_walks;
 
     printf("Stats: inference %.3lf ns search %.3lf ns "
            "validate %.3lf ns lookup %.3lf ns\n",
-           db.get_stats_inference_ns(),
-           db.get_stats_search_ns(),
-           db.get_stats_validate_ns(),
-           db.get_stats_lookup_ns());
+           ctx.get_stats_inference_ns(),
+           ctx.get_stats_search_ns(),
+           ctx.get_stats_validate_ns(),
+           ctx.get_stats_lookup_ns());
+    printf("Bucket geometry: %d keys, %d-bit slots, %d hash seeds, "
+           "%d inline values, %d-byte values, %lu bytes\n",
+           db.get_bucket_geometry().keys,
+           db.get_bucket_geometry().slot_bits,
+           db.get_bucket_geometry().hash_seeds,
+           db.get_bucket_geometry().inline_values,
+           db.get_bucket_geometry().get_value_bytes(),
+           db.get_bucket_geometry().get_size_bytes());
+    printf("Stashed keys: %lu\n", db.get_stashed_key_num());
+    printf("Verification bits: %d expected false-positive rate: %.3le "
+           "rejected by verification: %.4lf%%\n",
+           db.get_verify_bits(),
+           db.get_false_positive_rate(),
+           ctx.get_stats_rejected()*100);
+    printf("Filter bits: %d filtered before inference: %.3lf%%\n",
+           db.get_filter_bits(),
+           ctx.get_stats_filtered()*100);
+    printf("Cache entries: %lu cache hits: %.3lf%%\n",
+           ctx.get_cache_size(),
+           ctx.get_stats_cache_hits()*100);
+    printf("Appendix encoding: %s offset unit: %d bytes "
+           "decode: %.3lf ns per value\n",
+           db.get_appendix_encoding() == appendix::DELTA ? "delta" : "raw",
+           1 << db.get_appendix_shift(),
+           decoded ? (double)decode_ns / decoded : 0.0);
+    printf("Huge pages: %.3lf MB (%.1lf%% of the index) ",
+           db.get_huge_page_bytes()/1024.0/1024.0,
+           100.0 * db.get_huge_page_bytes() / db.get_total_bytes());
+    if (fd >= 0) {
+        printf("page walks per query: %.3lf\n",
+               (double)page_walks / count / db_reader::N);
+        close(fd);
+    } else {
+        printf("page walks per query: n/a\n");
+    }
+}
+
+static void
+mode_perf_test()
+{
+    const char *filename;
+    const char *kernel;
+    const char *engine;
+    int engine_type;
+    int count;
+
+    filename = ARG_STRING(args, "file", "");
+    count = ARG_INTEGER(args, "n1", 0);
+    count = count != 0 ? count : 1000000;
+    kernel = ARG_STRING(args, "kernel", "");
+    engine = ARG_STRING(args, "engine", "");
+
+    if (strlen(kernel) && bucket_kernels_select(kernel)) {
+        printf("Bucket kernels '%s' are not supported (available: %s)\n",
+               kernel, bucket_kernels_available());
+        return;
+    }
+    printf("Using '%s' bucket kernels\n", bucket_kernels_get()->name);
+
+    if (!strcmp(engine, "all")) {
+        for (int i=0; i<search_engine::ENGINE_NUM; ++i) {
+            perf_test_engine(filename, count, i);
+        }
+        return;
+    }
+
+    engine_type = strlen(engine) ? search_engine::get_type(engine) : -1;
+    if (strlen(engine) && engine_type < 0) {
+        printf("Search engine '%s' is not supported\n", engine);
+        return;
+    }
+    perf_test_engine(filename, count, engine_type);
 }
 
 int